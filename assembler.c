@@ -2,29 +2,40 @@
 // Created by Thirumal Venkat on 02/08/16.
 //
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "assembler.h"
 #include "tokenize.h"
 #include "binary_code.h"
+#include "layout.h"
+#include "debuginfo.h"
+#include "diag.h"
+#include "expr.h"
+#include "floppy.h"
+#include "listing.h"
+#include "merge.h"
+#include "output.h"
+#include "pipeline.h"
+#include "prelude.h"
+#include "segment.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
 
-int asm_init(struct assembler *a, char *file) {
+// Mapped input that streaming is done with is handed back in steps of this
+#define INPUT_DROP_STEP (1 << 20)
+
+// Read file into a->input, reusing the buffer when it is big enough
+static int read_input(struct assembler *a, char *file) {
     FILE *fp;
     ssize_t ftsize;
     uint64_t size;
-
-    /* See if the assembler structure is valid ? */
-    if (!a) {
-        LOGERROR("Assembler structure is NULL");
-        return -1;
-    }
-
-    /* Sanity check on file name */
-    if (!file) {
-        LOGERROR("Input file is NULL");
-        return -1;
-    }
+    char *grown;
 
     /* Try to open the file */
     fp = fopen(file, "r");
@@ -53,20 +64,21 @@ int asm_init(struct assembler *a, char *file) {
     /* Go back to the beginning of the file */
     rewind(fp);
 
-    /* Zero out the assembler structure */
-    memset(a, 0, sizeof(*a));
-
     /* Allocate memory for the input */
-    a->input = malloc(sizeof(char) * (size + 1));
-    if (!a->input) {
-        fclose(fp);
-        LOGERROR("Cannot allocate memory to store input file");
-        return -1;
+    if (size + 1 > a->inp_cap) {
+        grown = realloc(a->input, sizeof(char) * (size + 1));
+        if (!grown) {
+            fclose(fp);
+            LOGERROR("Cannot allocate memory to store input file");
+            return -1;
+        }
+        ASM_STAT(a, ac_bytes, size + 1 - a->inp_cap);
+        a->input = grown;
+        a->inp_cap = size + 1;
     }
 
     /* Read the file into input */
     if (fread(a->input, sizeof(char), size, fp) != size) {
-        free(a->input);
         fclose(fp);
         LOGERROR("Could not read the file successfully");
         return -1;
@@ -77,10 +89,146 @@ int asm_init(struct assembler *a, char *file) {
 
     /* Close the file */
     fclose(fp);
+    return 0;
+}
+
+// Map file as a->input instead, read-only and followed by a '\0' like the
+// buffer read_input() fills: the file goes over an anonymous mapping one
+// page longer, whose zeroes are past its end. Streaming drops the pages
+// it is done with, see asm_drop_input().
+static int map_input(struct assembler *a, char *file) {
+    struct stat st;
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE), len;
+    void *base;
+    int fd;
 
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        LOGERROR("Unable to open file: %s", file);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        LOGERROR("fstat() failed");
+        return -1;
+    }
+    len = ((uint64_t) st.st_size / page + 1) * page;
+    base = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        LOGERROR("Cannot map the input file");
+        return -1;
+    }
+    if (st.st_size && mmap(base, (size_t) st.st_size, PROT_READ,
+                           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, len);
+        close(fd);
+        LOGERROR("Cannot map the input file");
+        return -1;
+    }
+    close(fd);
+    madvise(base, len, MADV_SEQUENTIAL);
+    a->input = base;
+    a->inp_size = (uint64_t) st.st_size;
+    a->inp_cap = len;
+    a->inp_mapped = 1;
+    a->inp_dropped = 0;
+    a->input_file = file;
     return 0;
 }
 
+static void unmap_input(struct assembler *a) {
+    munmap(a->input, a->inp_cap);
+    a->input = NULL;
+    a->inp_cap = 0;
+}
+
+void asm_drop_input(struct assembler *a, uint64_t offset) {
+    uint64_t page, end;
+    if (!a->inp_mapped || offset < a->inp_dropped + INPUT_DROP_STEP) {
+        return;
+    }
+    page = (uint64_t) sysconf(_SC_PAGESIZE);
+    end = offset / page * page;
+    madvise(a->input + a->inp_dropped, end - a->inp_dropped, MADV_DONTNEED);
+    a->inp_dropped = end;
+}
+
+static int init(struct assembler *a, char *file, int mapped) {
+    int rc;
+    TRACE_START(t0);
+
+    /* See if the assembler structure is valid ? */
+    if (!a) {
+        LOGERROR("Assembler structure is NULL");
+        return -1;
+    }
+
+    /* Sanity check on file name */
+    if (!file) {
+        LOGERROR("Input file is NULL");
+        return -1;
+    }
+
+    /* Zero out the assembler structure */
+    memset(a, 0, sizeof(*a));
+    a->max_errors = ASM_MAX_ERRORS;
+
+    rc = mapped ? map_input(a, file) : read_input(a, file);
+    if (rc < 0 && !mapped) {
+        free(a->input);
+        a->input = NULL;
+    }
+    TRACE_SPAN(t0, "read", file);
+    return rc;
+}
+
+int asm_init(struct assembler *a, char *file) {
+    return init(a, file, 0);
+}
+
+int asm_init_mapped(struct assembler *a, char *file) {
+    return init(a, file, 1);
+}
+
+int asm_reload(struct assembler *a) {
+    struct token *t;
+    int rc;
+    TRACE_START(t0);
+
+    // tokens and binary code nodes go back to their pools
+    for (t = a->tok_list.head; t; t = t->next) {
+        tok_release(t);
+    }
+    if (a->tok_list.tail) {
+        a->tok_list.tail->next = a->tok_pool;
+        a->tok_pool = a->tok_list.head;
+    }
+    if (a->bcd_list.tail) {
+        a->bcd_list.tail->next = a->bcd_pool;
+        a->bcd_pool = a->bcd_list.head;
+    }
+    memset(&a->tok_list, 0, sizeof(a->tok_list));
+    memset(&a->bcd_list, 0, sizeof(a->bcd_list));
+    // the symbols of a streaming run are its own, the others are tokens
+    stream_reset(a);
+    memset(&a->label_pts, 0, sizeof(a->label_pts));
+    memset(&a->label_ops, 0, sizeof(a->label_ops));
+    seg_reset(a);
+    expr_reset(a);
+    diag_reset(a);
+    a->inp_row = a->inp_col = a->inp_offset = 0;
+
+    if (a->inp_mapped) {
+        unmap_input(a);
+        rc = map_input(a, a->input_file);
+    } else {
+        rc = read_input(a, a->input_file);
+    }
+    TRACE_SPAN(t0, "read", a->input_file);
+    return rc;
+}
+
 void asm_free(struct assembler *a) {
     if (!a) {
         // Silently fail if no assembler structure is found
@@ -92,6 +240,7 @@ void asm_free(struct assembler *a) {
         t1 = a->tok_list.head;
         while (t1 != NULL) {
             t2 = t1->next;
+            tok_release(t1);
             free(t1);
             t1 = t2;
         }
@@ -106,31 +255,205 @@ void asm_free(struct assembler *a) {
             b1 = b2;
         }
     }
+    {
+        // Free what asm_reload() kept for the next run
+        struct token *t1, *t2;
+        struct bcode_node *b1, *b2;
+        for (t1 = a->tok_pool; t1; t1 = t2) {
+            t2 = t1->next;
+            free(t1);
+        }
+        for (b1 = a->bcd_pool; b1; b1 = b2) {
+            b2 = b1->next;
+            free(b1);
+        }
+    }
+    // Free what a streaming run kept
+    stream_free(a);
+    prelude_free(a->prelude);
+    free(a->prelude);
+    seg_free(a);
+    expr_free(a);
+    diag_free(a);
     // Free the input storage
-    if (a->input) {
+    if (a->input && a->inp_mapped) {
+        unmap_input(a);
+    } else if (a->input) {
         free(a->input);
     }
 }
 
+void asm_set_stats(struct assembler *a, struct asm_stats *s) {
+    a->stats = s;
+    // the input buffer was allocated before anyone could count it
+    ASM_STAT(a, ac_bytes, a->inp_size + 1);
+}
+
+// Run one phase, timing it when statistics are wanted
+static inline int run_phase(struct assembler *a, enum asm_phase p,
+                            const char *name,
+                            int (*phase)(struct assembler *)) {
+    int rc;
+    TRACE_START(t0);
+    if (a->stats) {
+        stats_begin(a->stats, p);
+    }
+    rc = phase(a);
+    if (a->stats) {
+        stats_end(a->stats, p);
+    }
+    TRACE_SPAN(t0, name, a->input_file);
+    (void) name;
+    return rc;
+}
+
+static int load_prelude(struct assembler *a) {
+    return prelude_load(a->prelude);
+}
+
+int asm_prelude(struct assembler *a, char *file) {
+    if (!a->prelude) {
+        a->prelude = calloc(1, sizeof(struct prelude));
+        if (!a->prelude) {
+            LOGERROR("No memory for the prelude");
+            return -1;
+        }
+    }
+    a->prelude->pr_file = file;
+    return run_phase(a, asp_prelude, "prelude", load_prelude);
+}
+
 int asm_parse(struct assembler *a) {
-    // tokenize
-    if (construct_tokens(a) < 0) {
+    // the prelude's labels and words go first
+    if (a->prelude && prelude_apply(a, a->prelude) < 0) {
+        return -1;
+    }
+    // tokenize, carrying on past the errors in the source
+    if (run_phase(a, asp_tokenize, "tokenize", construct_tokens) < 0) {
+        return -1;
+    }
+    // optionally merge DATs that are the same as, or end, others
+    if (a->merge && !a->nerrors &&
+        run_phase(a, asp_merge, "merge", merge_data) < 0) {
+        return -1;
+    }
+    // optionally move hot blocks into the short literal range
+    if (a->layout && !a->nerrors &&
+        run_phase(a, asp_layout, "layout", layout_optimize) < 0) {
         return -1;
     }
     // pass #1: Build binary code.
-    if (pass1(a) < 0) {
+    if (run_phase(a, asp_pass1, "pass1", pass1) < 0) {
         return -1;
     }
     // pass #2: Resolve any unresolved label operands.
-    if (pass2(a) < 0) {
+    if (run_phase(a, asp_pass2, "pass2", pass2) < 0) {
         return -1;
     }
-    return 0;
+    // every label has been looked up, the errors so far are all there are
+    return a->nerrors ? -1 : 0;
+}
+
+int asm_stream(struct assembler *a) {
+    return run_phase(a, asp_stream, "stream", stream_assemble);
+}
+
+int asm_pipeline(struct assembler *a) {
+    return run_phase(a, asp_stream, "stream", pipeline_assemble);
 }
 
 int asm_write(struct assembler *a) {
     // For now we just print debug output.. no hassle of printing the output
     // to a file. If ever this goes into production (highly unlikely), I'll
     // cook up a routine that writes to a file.
-    return bcode_debug(a);
-}
\ No newline at end of file
+    return run_phase(a, asp_output, "output", bcode_debug);
+}
+
+uint16_t *asm_image(struct assembler *a, uint64_t *words) {
+    struct bcode_node *cur;
+    uint16_t *image;
+    uint64_t n = 0;
+    if (a->segs.st_count) {
+        n = seg_end(a);
+    } else {
+        for (cur = a->bcd_list.head; cur; cur = cur->next) {
+            n += cur->size / 2;
+        }
+    }
+    image = malloc(sizeof(uint16_t) * (n ? n : 1));
+    if (!image) {
+        LOGERROR("No memory to lay out the image");
+        return NULL;
+    }
+    if (bcode_image(a, image, n) < 0) {
+        free(image);
+        return NULL;
+    }
+    *words = n;
+    return image;
+}
+
+// Lay the image out at its addresses, once for all the outputs
+static int write_image(struct assembler *a) {
+    uint16_t *image;
+    uint64_t n;
+    int rc;
+    if (a->image) {
+        return out_write(a, a->image, a->img_words, a->outputs, a->noutputs);
+    }
+    image = asm_image(a, &n);
+    if (!image) {
+        return -1;
+    }
+    rc = out_write(a, image, n, a->outputs, a->noutputs);
+    free(image);
+    return rc;
+}
+
+static int write_floppy(struct assembler *a) {
+    uint16_t *image;
+    uint64_t n;
+    int rc;
+    if (a->image) {
+        return floppy_write(a, a->image, a->img_words, a->parts, a->nparts);
+    }
+    image = asm_image(a, &n);
+    if (!image) {
+        return -1;
+    }
+    rc = floppy_write(a, image, n, a->parts, a->nparts);
+    free(image);
+    return rc;
+}
+
+int asm_write_floppy(struct assembler *a, char *disk,
+                     struct disk_part *parts, int n) {
+    a->floppy = disk;
+    a->parts = parts;
+    a->nparts = n;
+    return run_phase(a, asp_floppy, "floppy", write_floppy);
+}
+
+static int write_listing(struct assembler *a) {
+    return listing_write(a, a->listing);
+}
+
+int asm_write_listing(struct assembler *a, char *file) {
+    a->listing = file;
+    return run_phase(a, asp_listing, "listing", write_listing);
+}
+
+static int write_debuginfo(struct assembler *a) {
+    return dsym_write(a, a->debuginfo);
+}
+
+int asm_write_debuginfo(struct assembler *a, char *file) {
+    a->debuginfo = file;
+    return run_phase(a, asp_debuginfo, "debuginfo", write_debuginfo);
+}
+
+int asm_write_images(struct assembler *a, struct out_sink *outputs, int n) {
+    a->outputs = outputs;
+    a->noutputs = n;
+    return run_phase(a, asp_output, "output", write_image);
+}
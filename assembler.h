@@ -8,8 +8,42 @@
 #include "common.h"
 
 int  asm_init(struct assembler *a, char *file);
+/* Like asm_init, but the input is mapped rather than read, so that
+ * asm_stream() and asm_pipeline() can let go of what they are done with */
+int  asm_init_mapped(struct assembler *a, char *file);
+/* The mapped input before offset is no longer needed, its pages may go */
+void asm_drop_input(struct assembler *a, uint64_t offset);
 void asm_free(struct assembler *a);
+/* Read the input file again and forget the last run, keeping the tokens,
+ * binary code nodes and buffers it allocated for the next one */
+int  asm_reload(struct assembler *a);
+/* Lay file out ahead of the input, its labels visible to it. Mapped from
+ * its cache, which is built first if it is missing or stale. Again before
+ * every asm_parse() that should see changes to it. */
+int  asm_prelude(struct assembler *a, char *file);
 int  asm_parse(struct assembler *a);
+/* Like asm_parse, one statement at a time straight into the image, keeping
+ * neither tokens nor binary code nodes. Only asm_write_images works after. */
+int  asm_stream(struct assembler *a);
+/* asm_stream with the tokenizer and the encoder on two threads */
+int  asm_pipeline(struct assembler *a);
 int  asm_write(struct assembler *a);
+/* Write the image to each of the n outputs, in its format */
+int  asm_write_images(struct assembler *a, struct out_sink *outputs, int n);
+/* Write the image to sector 0 of the M35FD disk image disk, and the n
+ * parts at their sectors, see floppy.h */
+int  asm_write_floppy(struct assembler *a, char *disk,
+                      struct disk_part *parts, int n);
+/* The image laid out at its addresses in a new buffer, after asm_parse().
+ * NULL if there is no memory. */
+uint16_t *asm_image(struct assembler *a, uint64_t *words);
+/* Write every source line with its address and words, then the labels,
+ * to file ("-" for stdout). After asm_parse() only. */
+int  asm_write_listing(struct assembler *a, char *file);
+/* Write the labels and source lines to file for debuggers to map, see
+ * debuginfo.h. After asm_parse() only. */
+int  asm_write_debuginfo(struct assembler *a, char *file);
+/* Count statistics into s from here on, NULL turns them off */
+void asm_set_stats(struct assembler *a, struct asm_stats *s);
 
 #endif //ASSEMBLER_ASSEMBLER_H
@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCH_AVX2 1
+#include <immintrin.h>
+#endif
+
+/* Basic opcodes the vector path knows about */
+#define OP_SET 0x01
+#define OP_ADD 0x02
+#define OP_SUB 0x03
+#define OP_MUL 0x04
+#define OP_MLI 0x05
+#define OP_AND 0x0a
+#define OP_BOR 0x0b
+#define OP_XOR 0x0c
+#define OP_SHR 0x0d
+#define OP_ASR 0x0e
+#define OP_SHL 0x0f
+#define OP_IFB 0x10
+#define OP_IFU 0x17
+
+static inline int is_conditional(uint16_t op) {
+    return op >= OP_IFB && op <= OP_IFU;
+}
+
+static inline int is_shift(uint16_t op) {
+    return op >= OP_SHR && op <= OP_SHL;
+}
+
+static inline int sets_ex(uint16_t op) {
+    return (op >= OP_ADD && op <= OP_MLI) || is_shift(op);
+}
+
+// Base cycles of the opcodes above, 0 for the ones left to the scalar path
+static const uint8_t vector_cycles[0x20] = {
+        0, 1, 2, 2, 2, 2, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// Does this operand value code consume a "next word"?
+static inline int operand_has_word(uint16_t code) {
+    return (code >= 0x10 && code <= 0x17) || code == 0x1a ||
+           code == 0x1e || code == 0x1f;
+}
+
+static inline int page_clean(struct batch *bt, uint16_t from, uint16_t to) {
+    uint32_t p = from >> DCPU_PAGE_SHIFT, last = to >> DCPU_PAGE_SHIFT;
+    for (;;) {
+        if (bt->dirty[p / 64] >> (p % 64) & 1) {
+            return 0;
+        }
+        if (p == last) {
+            return 1;
+        }
+        p = (p + 1) % DCPU_PAGES;
+    }
+}
+
+int batch_init(struct batch *bt, uint32_t lanes, struct dcpu *proto) {
+    uint32_t i;
+    size_t row;
+    memset(bt, 0, sizeof(*bt));
+    if (!lanes) {
+        LOGERROR("A batch needs at least one lane");
+        return -1;
+    }
+    bt->lanes = lanes;
+    bt->stride = (lanes + BATCH_LANE_ALIGN - 1) / BATCH_LANE_ALIGN *
+                 BATCH_LANE_ALIGN;
+    row = sizeof(uint16_t) * bt->stride;
+    bt->cpu = calloc(lanes, sizeof(struct dcpu *));
+    bt->reg = aligned_alloc(32, row * BATCH_REGS);
+    bt->active = aligned_alloc(32, row);
+    bt->cond = aligned_alloc(32, row);
+    bt->cycles = calloc(bt->stride, sizeof(uint64_t));
+    bt->status = calloc(bt->stride, sizeof(uint8_t));
+    if (!bt->cpu || !bt->reg || !bt->active || !bt->cond ||
+        !bt->cycles || !bt->status) {
+        LOGERROR("Cannot allocate memory for %u lanes", lanes);
+        batch_free(bt);
+        return -1;
+    }
+    memset(bt->reg, 0, row * BATCH_REGS);
+    memset(bt->cond, 0, row);
+    for (i = 0; i < bt->stride; ++i) {
+        bt->active[i] = (uint16_t) (i < lanes ? 0xffff : 0);
+    }
+    for (i = 0; i < lanes; ++i) {
+        bt->cpu[i] = malloc(sizeof(struct dcpu));
+        if (!bt->cpu[i] || dcpu_init(bt->cpu[i]) < 0) {
+            free(bt->cpu[i]);
+            bt->cpu[i] = NULL;
+            LOGERROR("Cannot allocate lane %u", i);
+            batch_free(bt);
+            return -1;
+        }
+        memcpy(bt->cpu[i]->ram, proto->ram, sizeof(proto->ram));
+    }
+    for (i = 0; i < BATCH_REGS; ++i) {
+        uint32_t l;
+        for (l = 0; l < lanes; ++l) {
+            batch_row(bt, i)[l] = proto->reg[i];
+        }
+    }
+    bt->running = lanes;
+    bt->converged = 1;
+    bt->pc = proto->reg[DR_PC];
+#ifdef BATCH_AVX2
+    bt->avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return 0;
+}
+
+void batch_free(struct batch *bt) {
+    uint32_t i;
+    if (bt->cpu) {
+        for (i = 0; i < bt->lanes; ++i) {
+            if (bt->cpu[i]) {
+                dcpu_free(bt->cpu[i]);
+                free(bt->cpu[i]);
+            }
+        }
+        free(bt->cpu);
+    }
+    free(bt->reg);
+    free(bt->active);
+    free(bt->cond);
+    free(bt->cycles);
+    free(bt->status);
+    memset(bt, 0, sizeof(*bt));
+}
+
+// Place a lane's own input in its RAM. The pages written no longer hold
+// the same words in every lane, so code on them runs scalar.
+int batch_input(struct batch *bt, uint32_t lane, uint16_t addr,
+                uint16_t *words, uint64_t n) {
+    uint64_t i;
+    uint32_t p;
+    if (lane >= bt->lanes) {
+        LOGERROR("No lane %u in a batch of %u", lane, bt->lanes);
+        return -1;
+    }
+    if (n > DCPU_RAM_WORDS) {
+        LOGERROR("Input of %llu words does not fit in RAM",
+                 (unsigned long long) n);
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        dcpu_write(bt->cpu[lane], (uint16_t) (addr + i), words[i]);
+    }
+    for (p = 0; p < DCPU_PAGES / 64; ++p) {
+        bt->dirty[p] |= bt->cpu[lane]->dirty[p];
+    }
+    return 0;
+}
+
+static inline void lane_done(struct batch *bt, uint32_t lane, uint8_t why) {
+    bt->status[lane] = why;
+    bt->active[lane] = 0;
+    bt->running--;
+}
+
+// Leave converged mode: hand every running lane its PC and cycles
+static void batch_sync(struct batch *bt) {
+    uint16_t *pc = batch_row(bt, DR_PC);
+    uint32_t i;
+    if (!bt->converged) {
+        return;
+    }
+    for (i = 0; i < bt->lanes; ++i) {
+        if (!bt->active[i]) {
+            continue;
+        }
+        pc[i] = bt->pc;
+        bt->cycles[i] += bt->pending;
+        if (bt->cycles[i] >= bt->limit) {
+            lane_done(bt, i, bls_budget);
+        }
+    }
+    bt->pending = 0;
+    bt->converged = 0;
+}
+
+// Enter converged mode if every running lane is at the same PC
+static void batch_converge(struct batch *bt) {
+    uint16_t *pc = batch_row(bt, DR_PC);
+    uint64_t budget = UINT64_MAX;
+    uint32_t i;
+    int first = -1;
+    for (i = 0; i < bt->lanes; ++i) {
+        if (!bt->active[i]) {
+            continue;
+        }
+        if (first < 0) {
+            first = (int) i;
+        } else if (pc[i] != pc[first]) {
+            return;
+        }
+        if (bt->limit - bt->cycles[i] < budget) {
+            budget = bt->limit - bt->cycles[i];
+        }
+    }
+    if (first < 0) {
+        return;
+    }
+    bt->converged = 1;
+    bt->pc = pc[first];
+    bt->pending = 0;
+    bt->budget = budget;
+}
+
+// Run one instruction of one lane through the plain interpreter
+static void batch_scalar_step(struct batch *bt, uint32_t lane) {
+    struct dcpu *d = bt->cpu[lane];
+    int r, p, rc;
+    for (r = 0; r < BATCH_REGS; ++r) {
+        d->reg[r] = batch_row(bt, r)[lane];
+    }
+    d->cycles = bt->cycles[lane];
+    rc = dcpu_step(d);
+    for (r = 0; r < BATCH_REGS; ++r) {
+        batch_row(bt, r)[lane] = d->reg[r];
+    }
+    bt->cycles[lane] = d->cycles;
+    for (p = 0; p < DCPU_PAGES / 64; ++p) {
+        bt->dirty[p] |= d->dirty[p];
+    }
+    bt->instructions++;
+    bt->scalar_steps++;
+    if (rc < 0) {
+        lane_done(bt, lane, bls_fire);
+    } else if (d->halted && (!d->intq_count || d->int_queueing)) {
+        // there are no devices in a batch, nothing can wake it up
+        lane_done(bt, lane, bls_halted);
+    } else if (d->cycles >= bt->limit) {
+        lane_done(bt, lane, bls_budget);
+    }
+}
+
+// Scalar reference of one vector lane. Returns the new b, sets *ex for
+// the opcodes that change EX and *cond for the conditionals.
+static inline uint16_t alu(uint16_t op, uint16_t b, uint16_t a,
+                           uint16_t *ex, uint16_t *cond) {
+    int32_t res;
+    switch (op) {
+        case OP_SET:
+            return a;
+        case OP_ADD:
+            res = b + a;
+            *ex = (uint16_t) (res > 0xffff);
+            return (uint16_t) res;
+        case OP_SUB:
+            res = b - a;
+            *ex = (uint16_t) (res < 0 ? 0xffff : 0);
+            return (uint16_t) res;
+        case OP_MUL:
+            *ex = (uint16_t) (((uint32_t) b * a) >> 16);
+            return (uint16_t) (b * a);
+        case OP_MLI:
+            res = (int16_t) b * (int16_t) a;
+            *ex = (uint16_t) (res >> 16);
+            return (uint16_t) res;
+        case OP_AND:
+            return b & a;
+        case OP_BOR:
+            return b | a;
+        case OP_XOR:
+            return b ^ a;
+        // shift counts are literals of at most 16 here
+        case OP_SHR:
+            *ex = (uint16_t) (((uint32_t) b << 16) >> a);
+            return (uint16_t) (b >> a);
+        case OP_ASR:
+            *ex = (uint16_t) (((uint32_t) b << 16) >> a);
+            return (uint16_t) ((int16_t) b >> (a < 16 ? a : 15));
+        case OP_SHL:
+            *ex = (uint16_t) (((uint32_t) b << a) >> 16);
+            return (uint16_t) ((uint32_t) b << a);
+        case 0x10: *cond = (b & a) != 0; return b;
+        case 0x11: *cond = (b & a) == 0; return b;
+        case 0x12: *cond = b == a; return b;
+        case 0x13: *cond = b != a; return b;
+        case 0x14: *cond = b > a; return b;
+        case 0x15: *cond = (int16_t) b > (int16_t) a; return b;
+        case 0x16: *cond = b < a; return b;
+        default:   *cond = (int16_t) b < (int16_t) a; return b;
+    }
+}
+
+// Portable kernel: the same instruction on every running lane.
+// Returns the number of running lanes whose condition held.
+static uint32_t kernel_generic(struct batch *bt, uint16_t op, uint16_t *ar,
+                               uint16_t lit, uint16_t *br) {
+    uint16_t *exr = batch_row(bt, DR_EX), ex, cond, r;
+    uint32_t i, taken = 0;
+    for (i = 0; i < bt->lanes; ++i) {
+        if (!bt->active[i]) {
+            continue;
+        }
+        ex = exr[i];
+        cond = 0;
+        r = alu(op, br[i], ar ? ar[i] : lit, &ex, &cond);
+        if (is_conditional(op)) {
+            bt->cond[i] = (uint16_t) (cond ? 0xffff : 0);
+            taken += cond;
+        } else {
+            br[i] = r;
+            if (sets_ex(op)) {
+                exr[i] = ex;
+            }
+        }
+    }
+    return taken;
+}
+
+#ifdef BATCH_AVX2
+// The same as kernel_generic(), 16 lanes at a time
+__attribute__((target("avx2")))
+static uint32_t kernel_avx2(struct batch *bt, uint16_t op, uint16_t *ar,
+                            uint16_t lit, uint16_t *br) {
+    uint16_t *exr = batch_row(bt, DR_EX);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(-1);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i la = _mm256_set1_epi16((short) lit);
+    const __m128i cnt = _mm_cvtsi32_si128(lit);
+    const __m128i rcnt = _mm_cvtsi32_si128(16 - (lit & 0x1f));
+    __m256i m, va, vb, r, e = zero, t;
+    uint32_t i, taken = 0;
+    for (i = 0; i < bt->stride; i += 16) {
+        m = _mm256_load_si256((__m256i *) (bt->active + i));
+        if (_mm256_testz_si256(m, m)) {
+            continue;
+        }
+        va = ar ? _mm256_load_si256((__m256i *) (ar + i)) : la;
+        vb = _mm256_load_si256((__m256i *) (br + i));
+        switch (op) {
+            case OP_SET:
+                r = va;
+                break;
+            case OP_ADD:
+                r = _mm256_add_epi16(vb, va);
+                // carry when the sum wrapped below b
+                t = _mm256_cmpeq_epi16(_mm256_max_epu16(r, vb), r);
+                e = _mm256_andnot_si256(t, one);
+                break;
+            case OP_SUB:
+                r = _mm256_sub_epi16(vb, va);
+                // borrow when b < a
+                t = _mm256_cmpeq_epi16(_mm256_max_epu16(vb, va), vb);
+                e = _mm256_xor_si256(t, ones);
+                break;
+            case OP_MUL:
+                r = _mm256_mullo_epi16(vb, va);
+                e = _mm256_mulhi_epu16(vb, va);
+                break;
+            case OP_MLI:
+                r = _mm256_mullo_epi16(vb, va);
+                e = _mm256_mulhi_epi16(vb, va);
+                break;
+            case OP_AND:
+                r = _mm256_and_si256(vb, va);
+                break;
+            case OP_BOR:
+                r = _mm256_or_si256(vb, va);
+                break;
+            case OP_XOR:
+                r = _mm256_xor_si256(vb, va);
+                break;
+            case OP_SHR:
+                r = _mm256_srl_epi16(vb, cnt);
+                e = _mm256_sll_epi16(vb, rcnt);
+                break;
+            case OP_ASR:
+                r = _mm256_sra_epi16(vb, cnt);
+                e = _mm256_sll_epi16(vb, rcnt);
+                break;
+            case OP_SHL:
+                r = _mm256_sll_epi16(vb, cnt);
+                e = _mm256_srl_epi16(vb, rcnt);
+                break;
+            case 0x10: // IFB
+                r = _mm256_xor_si256(
+                        _mm256_cmpeq_epi16(_mm256_and_si256(vb, va), zero), ones);
+                break;
+            case 0x11: // IFC
+                r = _mm256_cmpeq_epi16(_mm256_and_si256(vb, va), zero);
+                break;
+            case 0x12: // IFE
+                r = _mm256_cmpeq_epi16(vb, va);
+                break;
+            case 0x13: // IFN
+                r = _mm256_xor_si256(_mm256_cmpeq_epi16(vb, va), ones);
+                break;
+            case 0x14: // IFG, not a >= b
+                r = _mm256_xor_si256(
+                        _mm256_cmpeq_epi16(_mm256_max_epu16(va, vb), va), ones);
+                break;
+            case 0x15: // IFA
+                r = _mm256_cmpgt_epi16(vb, va);
+                break;
+            case 0x16: // IFL, not b >= a
+                r = _mm256_xor_si256(
+                        _mm256_cmpeq_epi16(_mm256_max_epu16(vb, va), vb), ones);
+                break;
+            default:   // IFU
+                r = _mm256_cmpgt_epi16(va, vb);
+                break;
+        }
+        if (is_conditional(op)) {
+            r = _mm256_and_si256(r, m);
+            _mm256_store_si256((__m256i *) (bt->cond + i), r);
+            taken += (uint32_t) __builtin_popcount(
+                    (unsigned) _mm256_movemask_epi8(r)) / 2;
+            continue;
+        }
+        _mm256_store_si256((__m256i *) (br + i), _mm256_blendv_epi8(vb, r, m));
+        if (sets_ex(op)) {
+            // loaded after b is stored, so EX as a target ends up as the flag
+            t = _mm256_load_si256((__m256i *) (exr + i));
+            _mm256_store_si256((__m256i *) (exr + i), _mm256_blendv_epi8(t, e, m));
+        }
+    }
+    return taken;
+}
+#endif
+
+// Find where a skip starting at pc ends, as dcpu_skip() would
+static uint16_t skip_span(uint16_t *ram, uint16_t pc, int *skipped) {
+    uint16_t w, op;
+    *skipped = 0;
+    do {
+        w = ram[pc++];
+        op = (uint16_t) (w & 0x1f);
+        pc += operand_has_word((uint16_t) (w >> 10));
+        if (op) {
+            pc += operand_has_word((uint16_t) ((w >> 5) & 0x1f));
+        }
+        ++*skipped;
+    } while (op >= 0x10 && op <= 0x17);
+    return pc;
+}
+
+// Resolve an operand for the vector path: a register row, or a literal
+// (row left NULL). 0 if the operand needs the scalar path.
+static int vector_operand(struct batch *bt, uint16_t code, int is_a,
+                          uint16_t *ram, uint16_t *next,
+                          uint16_t **row, uint16_t *lit, uint64_t *cost) {
+    *row = NULL;
+    if (code < 0x08) {
+        *row = batch_row(bt, code);
+    } else if (code == 0x1b) {
+        *row = batch_row(bt, DR_SP);
+    } else if (code == 0x1d) {
+        *row = batch_row(bt, DR_EX);
+    } else if (is_a && code == 0x1f) {
+        *lit = ram[(*next)++];
+        ++*cost;
+    } else if (is_a && code >= 0x20) {
+        *lit = (uint16_t) (code - 0x21);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Run the instruction at bt->pc on every running lane at once.
+// 1 if it ran, 0 if it has to go through the scalar path.
+static int batch_vector_step(struct batch *bt) {
+    // a page nobody wrote holds the same words in every lane
+    uint16_t *ram = bt->cpu[0]->ram;
+    uint16_t pc = bt->pc, next = (uint16_t) (pc + 1), lit = 0, dummy, end;
+    uint16_t w = ram[pc], op = (uint16_t) (w & 0x1f);
+    uint16_t *ar, *br, *pcr;
+    uint64_t cost = vector_cycles[op];
+    uint32_t taken, i;
+    int skipped;
+
+    if (!cost || !page_clean(bt, pc, pc)) {
+        return 0;
+    }
+    if (!vector_operand(bt, (uint16_t) (w >> 10), 1, ram, &next,
+                        &ar, &lit, &cost)) {
+        return 0;
+    }
+    if (!page_clean(bt, pc, (uint16_t) (next - 1))) {
+        return 0;
+    }
+    if (((w >> 5) & 0x1f) == 0x1c && op == OP_SET && !ar) {
+        // SET PC, literal: the same jump everywhere
+        bt->instructions += bt->running;
+        bt->vector_steps++;
+        bt->pending += cost;
+        if (lit == pc) {
+            // jumped onto itself, every lane halts here
+            bt->pc = pc;
+            batch_sync(bt);
+            for (i = 0; i < bt->lanes; ++i) {
+                if (bt->active[i]) {
+                    lane_done(bt, i, bls_halted);
+                }
+            }
+            return 1;
+        }
+        bt->pc = lit;
+        return 1;
+    }
+    if (!vector_operand(bt, (uint16_t) ((w >> 5) & 0x1f), 0, ram, &next,
+                        &br, &dummy, &cost)) {
+        return 0;
+    }
+    if (is_shift(op) && (ar || lit > 16)) {
+        return 0;
+    }
+#ifdef BATCH_AVX2
+    taken = bt->avx2 ? kernel_avx2(bt, op, ar, lit, br)
+                     : kernel_generic(bt, op, ar, lit, br);
+#else
+    taken = kernel_generic(bt, op, ar, lit, br);
+#endif
+    bt->instructions += bt->running;
+    bt->vector_steps++;
+    if (!is_conditional(op) || taken == bt->running) {
+        bt->pending += cost;
+        bt->pc = next;
+        return 1;
+    }
+    end = skip_span(ram, next, &skipped);
+    if (!page_clean(bt, next, (uint16_t) (end - 1))) {
+        // cannot tell the skip length from lane 0, let each lane skip
+        // on its own by running the test again in scalar
+        bt->instructions -= bt->running;
+        bt->vector_steps--;
+        return 0;
+    }
+    if (!taken) {
+        bt->pending += cost + (uint64_t) skipped;
+        bt->pc = end;
+        return 1;
+    }
+    // the lanes disagree, from here on they go their own ways
+    bt->pc = next;
+    bt->pending += cost;
+    batch_sync(bt);
+    pcr = batch_row(bt, DR_PC);
+    for (i = 0; i < bt->lanes; ++i) {
+        if (bt->active[i] && !bt->cond[i]) {
+            pcr[i] = end;
+            bt->cycles[i] += (uint64_t) skipped;
+            if (bt->cycles[i] >= bt->limit) {
+                lane_done(bt, i, bls_budget);
+            }
+        }
+    }
+    return 1;
+}
+
+// Scalar step every running lane sitting at the lowest PC, so lanes that
+// fell behind catch up with the others
+static void batch_diverged_step(struct batch *bt) {
+    uint16_t *pc = batch_row(bt, DR_PC), min = 0xffff;
+    uint32_t i;
+    for (i = 0; i < bt->lanes; ++i) {
+        if (bt->active[i] && pc[i] < min) {
+            min = pc[i];
+        }
+    }
+    for (i = 0; i < bt->lanes; ++i) {
+        if (bt->active[i] && pc[i] == min) {
+            batch_scalar_step(bt, i);
+        }
+    }
+}
+
+// Run every lane until it halts or has used max_cycles.
+// Returns the number of lanes that caught fire.
+int batch_run(struct batch *bt, uint64_t max_cycles) {
+    uint32_t i;
+    int fires = 0;
+    bt->limit = max_cycles;
+    if (bt->converged) {
+        batch_sync(bt);
+        batch_converge(bt);
+    }
+    while (bt->running) {
+        if (bt->converged) {
+            if (batch_vector_step(bt)) {
+                if (bt->converged && bt->pending >= bt->budget) {
+                    batch_sync(bt);
+                    batch_converge(bt);
+                }
+                continue;
+            }
+            batch_sync(bt);
+            for (i = 0; i < bt->lanes; ++i) {
+                if (bt->active[i]) {
+                    batch_scalar_step(bt, i);
+                }
+            }
+        } else {
+            batch_diverged_step(bt);
+        }
+        batch_converge(bt);
+    }
+    batch_sync(bt);
+    for (i = 0; i < bt->lanes; ++i) {
+        fires += bt->status[i] == bls_fire;
+    }
+    return fires;
+}
+
+void batch_debug(struct batch *bt) {
+    static const char *status[] = {"running", "halted", "budget", "fire"};
+    uint32_t i;
+    for (i = 0; i < bt->lanes; ++i) {
+        printf("%u: A=%04x B=%04x C=%04x X=%04x Y=%04x Z=%04x I=%04x J=%04x "
+               "PC=%04x SP=%04x EX=%04x cycles=%llu %s\n", i,
+               batch_row(bt, DR_A)[i], batch_row(bt, DR_B)[i],
+               batch_row(bt, DR_C)[i], batch_row(bt, DR_X)[i],
+               batch_row(bt, DR_Y)[i], batch_row(bt, DR_Z)[i],
+               batch_row(bt, DR_I)[i], batch_row(bt, DR_J)[i],
+               batch_row(bt, DR_PC)[i], batch_row(bt, DR_SP)[i],
+               batch_row(bt, DR_EX)[i],
+               (unsigned long long) bt->cycles[i], status[bt->status[i]]);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef ASSEMBLER_BATCH_H
+#define ASSEMBLER_BATCH_H
+
+#include "dcpu.h"
+
+/* Lanes are padded to a whole number of 256 bit vectors of words */
+#define BATCH_LANE_ALIGN 16
+
+/* Registers kept in the struct-of-arrays file, one row each */
+#define BATCH_REGS (DR_IA + 1)
+
+enum batch_lane_status {
+    bls_running,
+    bls_halted,     /* Jumped onto itself */
+    bls_budget,     /* Ran out of cycles */
+    bls_fire,       /* Interrupt queue overflowed */
+};
+
+// N instances of one image run in lockstep. While every running lane sits
+// at the same PC (converged) register and literal ALU instructions run
+// on all lanes at once, with AVX2 when the CPU has it. Everything else,
+// and lanes that went their own way, step through dcpu_step() one lane at
+// a time until their PCs meet again.
+struct batch {
+    uint32_t lanes;
+    uint32_t stride;         /* lanes rounded up to BATCH_LANE_ALIGN */
+    uint32_t running;        /* Lanes still running */
+    struct dcpu **cpu;       /* Per lane RAM and interrupt queue */
+    uint16_t *reg;           /* reg[r * stride + lane], r < BATCH_REGS */
+    uint16_t *active;        /* 0xffff for a running lane, 0 otherwise */
+    uint16_t *cond;          /* Scratch row for conditionals */
+    uint64_t *cycles;
+    uint8_t  *status;        /* enum batch_lane_status */
+    uint64_t limit;          /* Cycle budget of every lane */
+    /* Converged state: every running lane is at 'pc', and has run
+     * 'pending' cycles not yet added to its counter. 'budget' is the
+     * least number of cycles any of them may still run. */
+    uint8_t  converged;
+    uint16_t pc;
+    uint64_t pending;
+    uint64_t budget;
+    /* Pages written by any lane, code on the other pages is the same in
+     * every lane and can be decoded once */
+    uint64_t dirty[DCPU_PAGES / 64];
+    uint64_t instructions;   /* Summed over all lanes */
+    uint64_t vector_steps;
+    uint64_t scalar_steps;
+    int      avx2;
+};
+
+static inline uint16_t *batch_row(struct batch *bt, int r) {
+    return bt->reg + (uint64_t) r * bt->stride;
+}
+
+int  batch_init(struct batch *bt, uint32_t lanes, struct dcpu *proto);
+void batch_free(struct batch *bt);
+int  batch_input(struct batch *bt, uint32_t lane, uint16_t addr,
+                 uint16_t *words, uint64_t n);
+int  batch_run(struct batch *bt, uint64_t max_cycles);
+void batch_debug(struct batch *bt);
+
+#endif //ASSEMBLER_BATCH_H
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "binary_code.h"
+#include "tokenize.h"
+
+// Times each assembler phase over a set of sources. Every source is
+// assembled -r times and the fastest time of each phase is kept, or the
+// median with -m. One line per phase, as key=value pairs:
+//   file=<path> phase=<name> bytes=.. lines=.. seconds=.. mb_per_s=..
+//   lines_per_s=.. peak_rss_kb=..
+// peak_rss_kb is the peak of the whole process by the end of that phase.
+
+enum bench_phase {
+    bp_read,
+    bp_tokenize,
+    bp_pass1,
+    bp_pass2,
+    bp_output,
+    bp_total,
+    bp_stream,      /* asm_stream(), with -p */
+    bp_pipeline,    /* asm_pipeline(), with -p */
+    bp_max
+};
+
+static const char *phase_names[] = {
+        "read", "tokenize", "pass1", "pass2", "output", "total", "stream",
+        "pipeline"
+};
+
+// Also time the single pass modes
+static int time_streams;
+
+struct bench_result {
+    double seconds[bp_max];
+    long peak_rss_kb[bp_max];
+};
+
+static inline double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline long peak_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// Write the listing as dasm would, but into /dev/null
+static int output_to_null(struct assembler *a) {
+    int saved, null, rc;
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null < 0) {
+        LOGERROR("Cannot redirect the output");
+        return -1;
+    }
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    rc = asm_write(a);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return rc;
+}
+
+// Time one of the single pass modes, reading excluded
+static int bench_stream(char *file, int (*assemble)(struct assembler *),
+                        double *seconds, long *peak) {
+    struct assembler a[1];
+    double t;
+    int rc;
+    if (asm_init(a, file) < 0) {
+        return -1;
+    }
+    t = now();
+    rc = assemble(a);
+    *seconds = now() - t;
+    *peak = peak_rss_kb();
+    asm_free(a);
+    return rc;
+}
+
+// One run over a file, times in r->seconds. 0 on success, -1 on error.
+static int bench_once(char *file, struct bench_result *r) {
+    struct assembler a[1];
+    double t[bp_max + 1];
+    int rc = -1;
+
+    t[bp_read] = now();
+    if (asm_init(a, file) < 0) {
+        return -1;
+    }
+    t[bp_tokenize] = now();
+    r->peak_rss_kb[bp_read] = peak_rss_kb();
+    if (construct_tokens(a) < 0) {
+        goto out;
+    }
+    t[bp_pass1] = now();
+    r->peak_rss_kb[bp_tokenize] = peak_rss_kb();
+    if (pass1(a) < 0) {
+        goto out;
+    }
+    t[bp_pass2] = now();
+    r->peak_rss_kb[bp_pass1] = peak_rss_kb();
+    if (pass2(a) < 0) {
+        goto out;
+    }
+    t[bp_output] = now();
+    r->peak_rss_kb[bp_pass2] = peak_rss_kb();
+    if (output_to_null(a) < 0) {
+        goto out;
+    }
+    t[bp_total] = now();
+    r->peak_rss_kb[bp_output] = peak_rss_kb();
+    r->peak_rss_kb[bp_total] = r->peak_rss_kb[bp_output];
+    r->seconds[bp_read] = t[bp_tokenize] - t[bp_read];
+    r->seconds[bp_tokenize] = t[bp_pass1] - t[bp_tokenize];
+    r->seconds[bp_pass1] = t[bp_pass2] - t[bp_pass1];
+    r->seconds[bp_pass2] = t[bp_output] - t[bp_pass2];
+    r->seconds[bp_output] = t[bp_total] - t[bp_output];
+    r->seconds[bp_total] = t[bp_total] - t[bp_read];
+    rc = 0;
+out:
+    asm_free(a);
+    if (rc == 0 && time_streams) {
+        if (bench_stream(file, asm_stream, &r->seconds[bp_stream],
+                         &r->peak_rss_kb[bp_stream]) < 0 ||
+                bench_stream(file, asm_pipeline, &r->seconds[bp_pipeline],
+                             &r->peak_rss_kb[bp_pipeline]) < 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+static int count_lines(char *file, uint64_t *bytes, uint64_t *lines) {
+    char buf[65536];
+    size_t n, i;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open file: %s", file);
+        return -1;
+    }
+    *bytes = *lines = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        *bytes += n;
+        for (i = 0; i < n; ++i) {
+            *lines += buf[i] == '\n';
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int cmp_double(const void *x, const void *y) {
+    double a = *(const double *) x, b = *(const double *) y;
+    return (a > b) - (a < b);
+}
+
+static int bench_file(char *file, int runs, int median, int warmup) {
+    struct bench_result best, *r;
+    uint64_t bytes, lines;
+    double s, *times;
+    int i, p;
+
+    if (count_lines(file, &bytes, &lines) < 0) {
+        return -1;
+    }
+    r = malloc(sizeof(*r) * (size_t) runs);
+    times = malloc(sizeof(double) * (size_t) runs);
+    if (!r || !times) {
+        LOGERROR("Cannot allocate memory for %d runs", runs);
+        free(r);
+        free(times);
+        return -1;
+    }
+    for (i = -warmup; i < runs; ++i) {
+        // warm-up runs land in r[0] and are overwritten
+        if (bench_once(file, &r[i < 0 ? 0 : i]) < 0) {
+            fprintf(stderr, "%s does not assemble\n", file);
+            free(r);
+            free(times);
+            return -1;
+        }
+    }
+    for (p = 0; p < (time_streams ? bp_max : bp_stream); ++p) {
+        for (i = 0; i < runs; ++i) {
+            times[i] = r[i].seconds[p];
+        }
+        qsort(times, (size_t) runs, sizeof(double), cmp_double);
+        best.seconds[p] = median ? times[runs / 2] : times[0];
+        best.peak_rss_kb[p] = r[runs - 1].peak_rss_kb[p];
+    }
+    free(r);
+    free(times);
+    for (p = 0; p < (time_streams ? bp_max : bp_stream); ++p) {
+        s = best.seconds[p] > 0 ? best.seconds[p] : 1e-9;
+        printf("file=%s phase=%s bytes=%llu lines=%llu seconds=%.6f "
+               "mb_per_s=%.2f lines_per_s=%.0f peak_rss_kb=%ld\n",
+               file, phase_names[p], (unsigned long long) bytes,
+               (unsigned long long) lines, best.seconds[p],
+               (double) bytes / s / 1e6, (double) lines / s,
+               best.peak_rss_kb[p]);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-r runs] [-m] [-w runs] [-c cpu] [-p] <source>...\n"
+                    "  -r runs    assemble each source this many times and\n"
+                    "             keep the fastest time per phase (default 3)\n"
+                    "  -m         keep the median time instead\n"
+                    "  -w runs    untimed warm-up runs first (default 0)\n"
+                    "  -c cpu     run pinned to this CPU, where supported\n"
+                    "  -p         also time --stream and --pipeline (as the\n"
+                    "             stream and pipeline phases, without read)\n",
+            basename(prog));
+}
+
+// Keep the scheduler from moving us between cores mid-run
+static void pin_to_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Cannot pin to CPU %d, running unpinned\n", cpu);
+    }
+#else
+    (void) cpu;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 3, median = 0, warmup = 0, opt, i, rc = 0;
+
+    while ((opt = getopt(argc, argv, "c:mpr:w:")) != -1) {
+        switch (opt) {
+            case 'c':
+                pin_to_cpu(atoi(optarg));
+                break;
+            case 'm':
+                median = 1;
+                break;
+            case 'p':
+                time_streams = 1;
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind == argc || runs < 1 || warmup < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    for (i = optind; i < argc; ++i) {
+        if (bench_file(argv[i], runs, median, warmup) < 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
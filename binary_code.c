@@ -5,8 +5,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include "binary_code.h"
+#include "diag.h"
+#include "expr.h"
+#include "segment.h"
+#include "stats.h"
 
-static inline struct bcode_node *get_bcode() {
+static inline struct bcode_node *get_bcode(struct assembler *a) {
+    struct bcode_node *node = a->bcd_pool;
+    ASM_STAT(a, ac_bcode_nodes, 1);
+    if (node) {
+        a->bcd_pool = node->next;
+        memset(node, 0, sizeof(*node));
+        return node;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct bcode_node));
     return calloc(1, sizeof(struct bcode_node));
 }
 
@@ -31,11 +43,11 @@ static inline void append_to_bcode_list(struct assembler *a,
     }
 }
 
-static inline struct label *get_label_pointer(struct assembler *a,
-                                              char *lbl_name,
-                                              uint64_t lbl_len) {
+struct label *get_label_pointer(struct assembler *a, char *lbl_name,
+                                uint64_t lbl_len) {
     struct label *cur;
     for (cur = a->label_pts.head; cur; cur = cur->next) {
+        ASM_STAT(a, ac_probes, 1);
         // easy check on label lengths
         if (lbl_len != cur->lbl_len) {
             continue;
@@ -49,6 +61,52 @@ static inline struct label *get_label_pointer(struct assembler *a,
     return cur;
 }
 
+// Words an operand other than a label takes after the opcode word,
+// as build_operand() encodes it. An expression with labels is counted as
+// a word, which it keeps unless its labels are placed before it.
+uint64_t operand_words(struct token *op, int is_a) {
+    struct operand *opd = &op->ttu_opd;
+    switch (opd->opd_type) {
+        case ot_literal:
+            return is_a && !opd->opd_expr && opd->opd_literal_val >= -1 &&
+                   opd->opd_literal_val <= 30 ? 0 : 1;
+        case ot_reg:
+        case ot_ind_reg:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// Every label of an expression has to be defined. One that is not is
+// reported, and the expression dropped for a word of 0. 0 or -1.
+static int check_labels(struct assembler *a, struct operand *opd) {
+    struct expr_item *it, *end;
+    char err_str[256];
+    int missing = 0;
+    end = opd->opd_expr->ex_item + opd->opd_expr->ex_count;
+    for (it = opd->opd_expr->ex_item; it < end; ++it) {
+        if (it->ei_op != eo_label ||
+            get_label_pointer(a, it->ei_name, it->ei_len)) {
+            continue;
+        }
+        err_str[0] = '\0';
+        strcat(err_str, "Label '");
+        label_concat(err_str, it->ei_name, it->ei_len < 64 ? it->ei_len : 64);
+        strcat(err_str, "' is not associated with any label pointer");
+        asm_error(a, it->ei_row, it->ei_col, err_str);
+        if (!diag_more(a)) {
+            return -1;
+        }
+        missing = 1;
+    }
+    if (missing) {
+        free(opd->opd_expr);
+        opd->opd_expr = NULL;
+    }
+    return 0;
+}
+
 // String representation: op b, a.
 // Notice operand 'a' has no right token
 // NOTE: lbl_off is in bytes, while placing it convert it into words (/ by 2)
@@ -70,13 +128,22 @@ int build_operand(struct assembler *a, struct token *t, uint16_t *opcode,
             label_concat(err_str, t->ttu_lab.lbl_name, t->ttu_lab.lbl_len);
             strcat(err_str, "' is not associated with any label pointer");
             ASMTOKERROR(a, t, err_str);
-            return -1;
+            if (!diag_more(a)) {
+                return -1;
+            }
+            // carry on with it as a far label at 0, pass 2 leaves it
+            t->ttu_lab.lbl_state = ls_op_resolved;
+            *opcode |= (OPERAND_OP_MAX << shift);
+            *operand = 0;
+            *has_opd = 1;
+            return 2;
         }
         if (lptr->lbl_state == ls_pt_resolved) {
             // Mark this label as resolved :-)
             t->ttu_lab.lbl_state = ls_op_resolved;
             t->ttu_lab.lbl_off = lptr->lbl_off;
-            if (lptr->lbl_off / 2 <= 0x1E) {
+            // only operand a has room for an inline literal
+            if (is_a && lptr->lbl_off / 2 <= 0x1E) {
                 // NOTE: As offset can't be negative we did not
                 // check for lptr->lbl_off >= -1
                 // Place the label's offset in the opcode itself
@@ -110,6 +177,25 @@ int build_operand(struct assembler *a, struct token *t, uint16_t *opcode,
         // we have a proper operand..
         struct operand *opd = &t->ttu_opd;
         int lit_not_needed = 0; // is op_literal_val needed or not?
+        int64_t value;
+        if (opd->opd_expr) {
+            if (check_labels(a, opd) < 0) {
+                return -1;
+            }
+            // its labels placed before it, it is a number like any other
+            if (opd->opd_expr && expr_placed(a, opd->opd_expr, &value) == 0) {
+                free(opd->opd_expr);
+                opd->opd_expr = NULL;
+                opd->opd_literal_val = (long) value;
+            } else {
+                // a label still to come, it takes a word either way
+                *opcode |= (opd->opd_opcode_val << shift);
+                *operand = 0;
+                opd->opd_bcp = operand;
+                *has_opd = 1;
+                return 2;
+            }
+        }
         switch (opd->opd_type) {
             case ot_literal:
                 // literal, just put it there
@@ -164,8 +250,9 @@ int build_operand(struct assembler *a, struct token *t, uint16_t *opcode,
 // Just to avoid some confusion..
 // opcode string in assembly looks like:  <opcode> <b>,<a>
 // opcode binary is [0xOPCODE] [0xOPA] [0xOPB]
-int build_opcode(struct assembler *a, struct token *t) {
-    struct bcode_node *node;
+// Fills node, which the caller provides. Returns its size in bytes, or -1.
+int encode_opcode(struct assembler *a, struct token *t,
+                  struct bcode_node *node) {
     uint16_t *opcode, *opd_a, *opd_b, *operand;
     uint8_t *has_a, *has_b, *has_opd;
     int len;
@@ -188,13 +275,8 @@ int build_opcode(struct assembler *a, struct token *t) {
         LOGERROR("Token type passed is not an opcode");
         return -1;
     }
-    // get a bcode_node
-    node = get_bcode();
-    if (!node) {
-        LOGERROR("No memory to allocate binary code node");
-        return -1;
-    }
     // initialize the node
+    memset(node, 0, sizeof(*node));
     node->type = bt_code;
     node->next = NULL;
     opcode = &node->btu_code[0];
@@ -219,7 +301,6 @@ int build_opcode(struct assembler *a, struct token *t) {
     }
     len = build_operand(a, t->right, opcode, operand, has_opd);
     if (len < 0) {
-        free(node);
         return -1;
     }
     node->size += len;
@@ -229,35 +310,95 @@ int build_opcode(struct assembler *a, struct token *t) {
         has_opd = has_a;
         len = build_operand(a, t->right->right, opcode, operand, has_opd);
         if (len < 0) {
-            free(node);
             return -1;
         }
         node->size += len;
     }
-    // Append the binary code node to the list
-    append_to_bcode_list(a, node);
     // Return the node's size in bytes
     return (int) node->size;
 }
 
-int build_data(struct assembler *a, struct token *t) {
+int build_opcode(struct assembler *a, struct token *t) {
     struct bcode_node *node;
-    if (t->type != tt_data) {
+    struct token *op;
+    int len;
+    // get a bcode_node
+    node = get_bcode(a);
+    if (!node) {
+        LOGERROR("No memory to allocate binary code node");
+        return -1;
+    }
+    len = encode_opcode(a, t, node);
+    if (len < 0) {
+        free(node);
+        return -1;
+    }
+    // Append the binary code node to the list
+    append_to_bcode_list(a, node);
+    // expressions wait in the node for pass 2, which takes them over
+    for (op = t->right; op; op = op->right) {
+        if (op->type != tt_operand || !op->ttu_opd.opd_expr) {
+            continue;
+        }
+        if (expr_defer(a, op->ttu_opd.opd_bcp, 0,
+                       op->ttu_opd.opd_expr) < 0) {
+            return -1;
+        }
+        op->ttu_opd.opd_expr = NULL;
+    }
+    return len;
+}
+
+int build_data(struct assembler *a, struct token *t) {
+    struct label *lptr, *ref;
+    uint64_t i, index;
+    if (t->type != tt_words) {
         LOGERROR("Invalid token passed");
         return -1;
     }
-    node = get_bcode();
+    // fill in the words of labels known by now, the rest wait for pass 2
+    for (i = 0; i < t->ttu_nrefs; ++i) {
+        ref = &t->ttu_refs[i].ttu_lab;
+        lptr = get_label_pointer(a, ref->lbl_name, ref->lbl_len);
+        if (!lptr) {
+            char err_str[256];
+            err_str[0] = '\0';
+            strcat(err_str, "Label '");
+            label_concat(err_str, ref->lbl_name, ref->lbl_len);
+            strcat(err_str, "' is not associated with any label pointer");
+            ASMTOKERROR(a, (&t->ttu_refs[i]), err_str);
+            if (!diag_more(a)) {
+                return -1;
+            }
+            // its word stays 0
+            ref->lbl_state = ls_op_resolved;
+            continue;
+        }
+        index = ref->lbl_off;
+        if (lptr->lbl_state == ls_pt_resolved) {
+            ref->lbl_state = ls_op_resolved;
+            ref->lbl_off = lptr->lbl_off;
+            t->ttu_wrd[index] = (uint16_t) (lptr->lbl_off / 2);
+        } else {
+            ref->lbl_bcp = &t->ttu_wrd[index];
+        }
+    }
+    return build_words(a, t->ttu_wrd, t->tok_len);
+}
+
+int build_words(struct assembler *a, uint16_t *words, uint64_t n) {
+    struct bcode_node *node = get_bcode(a);
     if (!node) {
         LOGERROR("Could not allocate memory for binary code node");
         return -1;
     }
-    node->type = bt_data;
     node->next = NULL;
-    node->size = t->tok_len * 2;
-    node->btu_data = t->ttu_dat;
+    node->size = n * 2;
+    node->type = bt_words;
+    node->btu_words = words;
     // Append the binary code node to the list
     append_to_bcode_list(a, node);
-    // Return the node's size in words (finally when put in code)
+    // Return the node's size in bytes
     return (int) node->size;
 }
 
@@ -271,9 +412,17 @@ int build_data(struct assembler *a, struct token *t) {
 //     * If the label pointer is not found, raise an error
 int pass1(struct assembler *a) {
     uint64_t tot_off = 0; // current offset in code
+    uint64_t emitted = 0; // words so far, wherever they went
+    uint64_t addr;
     int cur_off;
     struct token *t;
     struct label *l;
+    struct bcode_node *cur;
+    // Words laid out before the tokens, a prelude, come first
+    for (cur = a->bcd_list.head; cur; cur = cur->next) {
+        emitted += cur->size / 2;
+    }
+    tot_off = emitted * 2;
     // For the top level it can either be a label, opcode or data.
     // Operands come only after opcode.
     for (t = a->tok_list.head; t; t = t->next) {
@@ -303,14 +452,31 @@ int pass1(struct assembler *a) {
                     return -1;
                 }
                 tot_off += cur_off;
+                emitted += cur_off / 2;
                 break;
-            case tt_data:
+            case tt_words:
                 // build the data's bcode_node and append it to its list
                 cur_off = build_data(a, t);
                 if (cur_off < 0) {
                     return -1;
                 }
                 tot_off += cur_off;
+                emitted += cur_off / 2;
+                break;
+            case tt_pin:
+                // only the layout pass cares
+                break;
+            case tt_org:
+            case tt_reserve:
+                // carry on from another address, a new segment
+                addr = t->ttu_num;
+                if (t->type == tt_reserve) {
+                    addr += tot_off / 2;
+                }
+                if (seg_org(a, t, addr, emitted) < 0) {
+                    return -1;
+                }
+                tot_off = addr * 2;
                 break;
             case tt_operand:
                 ASMTOKERROR(a, t, "PASS1: Operand at where it should not be");
@@ -335,10 +501,10 @@ int pass1(struct assembler *a) {
             return -1;
         }
     }
-    return 0;
+    return seg_finish(a, emitted);
 }
 
-// pass #2: Resolve any unresolved label operands.
+// pass #2: Resolve any unresolved label operands, and expressions.
 int pass2(struct assembler *a) {
     struct label *cur, *ptr;
     // for every label operand present in the list
@@ -357,7 +523,10 @@ int pass2(struct assembler *a) {
                     strcat(err_str, "' does not match any label pointer.");
                     struct token *tok = label_to_token(cur);
                     ASMTOKERROR(a, tok, err_str);
-                    return -1;
+                    if (!diag_more(a)) {
+                        return -1;
+                    }
+                    break;
                 }
                 // verify sanity of label pointer
                 if (ptr->lbl_state != ls_pt_resolved) {
@@ -369,6 +538,7 @@ int pass2(struct assembler *a) {
                 // this label's bcode_node after converting offset
                 // in bytes into words (dividing by 2)
                 *cur->lbl_bcp = (uint16_t ) (ptr->lbl_off / 2);
+                ASM_STAT(a, ac_fixups, 1);
                 break;
             case ls_op_resolved:
                 // already resolved, do nothing
@@ -378,13 +548,42 @@ int pass2(struct assembler *a) {
                 return -1;
         }
     }
-    return 0;
+    // and the words of expressions, now that every label is placed
+    return expr_fixups(a);
+}
+
+// " %04x" for every word and a newline, formatted a line buffer at a time
+static void print_words(const uint16_t *w, uint64_t n) {
+    static const char hex[] = "0123456789abcdef";
+    char buf[4096], *p = buf;
+    uint64_t i;
+    for (i = 0; i < n; ++i) {
+        if (p + 6 > buf + sizeof(buf)) {
+            fwrite(buf, 1, (size_t) (p - buf), stdout);
+            p = buf;
+        }
+        *p++ = ' ';
+        *p++ = hex[w[i] >> 12];
+        *p++ = hex[(w[i] >> 8) & 0xf];
+        *p++ = hex[(w[i] >> 4) & 0xf];
+        *p++ = hex[w[i] & 0xf];
+    }
+    *p++ = '\n';
+    fwrite(buf, 1, (size_t) (p - buf), stdout);
 }
 
 int bcode_debug(struct assembler *a) {
     struct bcode_node *cur;
-    int i, offset = 0;
-    for (cur = a->bcd_list.head; cur; cur = cur->next) {
+    struct segment *sg = a->segs.st_seg, *sg_end = sg + a->segs.st_count;
+    uint64_t emitted = 0;
+    int offset = 0;
+    for (cur = a->bcd_list.head; cur; emitted += cur->size / 2,
+                                      cur = cur->next) {
+        // Jump to where the next segment starts
+        if (sg < sg_end && sg->sg_index == emitted) {
+            offset = (int) sg->sg_addr;
+            ++sg;
+        }
         // Print the current address
         printf("%04x:", offset);
         // Depending on the binary code type, print it
@@ -403,14 +602,9 @@ int bcode_debug(struct assembler *a) {
                 }
                 putchar('\n');
                 break;
-            case bt_data:
-                // Data
-                for (i = 0; i < cur->size / 2; ++i) {
-                    // NOTE: This force converts ASCII to 16-bit data.
-                    printf(" %04x", cur->btu_data[i]);
-                    ++offset;
-                }
-                putchar('\n');
+            case bt_words:
+                print_words(cur->btu_words, cur->size / 2);
+                offset += cur->size / 2;
                 break;
             default:
                 LOGERROR("Unknown binary code type: %p", cur);
@@ -419,3 +613,53 @@ int bcode_debug(struct assembler *a) {
     }
     return 0;
 }
+
+// Flatten the binary code list into words, as they would sit in memory.
+// Returns one past the highest address written, -1 if the image does not
+// fit.
+int64_t bcode_image(struct assembler *a, uint16_t *image, uint64_t max_words) {
+    struct bcode_node *cur;
+    struct segment *sg = a->segs.st_seg, *sg_end = sg + a->segs.st_count;
+    uint64_t offset = 0, emitted = 0, end = 0;
+    if (sg < sg_end) {
+        end = seg_end(a);
+        if (end > max_words) {
+            LOGERROR("Binary code does not fit in %llu words",
+                     (unsigned long long) max_words);
+            return -1;
+        }
+        // gaps between the segments read as zero
+        memset(image, 0, sizeof(uint16_t) * end);
+    }
+    for (cur = a->bcd_list.head; cur; emitted += cur->size / 2,
+                                      cur = cur->next) {
+        if (sg < sg_end && sg->sg_index == emitted) {
+            offset = sg->sg_addr;
+            ++sg;
+        }
+        if (offset + cur->size / 2 > max_words) {
+            LOGERROR("Binary code does not fit in %llu words",
+                     (unsigned long long) max_words);
+            return -1;
+        }
+        switch (cur->type) {
+            case bt_code:
+                image[offset++] = cur->btu_code[0];
+                if (cur->btu_c_has_a) {
+                    image[offset++] = cur->btu_code[1];
+                }
+                if (cur->btu_c_has_b) {
+                    image[offset++] = cur->btu_code[2];
+                }
+                break;
+            case bt_words:
+                memcpy(image + offset, cur->btu_words, cur->size);
+                offset += cur->size / 2;
+                break;
+            default:
+                LOGERROR("Unknown binary code type: %p", cur);
+                return -1;
+        }
+    }
+    return (int64_t) (end > offset ? end : offset);
+}
@@ -7,8 +7,18 @@
 
 #include "common.h"
 
+struct label *get_label_pointer(struct assembler *a, char *lbl_name,
+                                uint64_t lbl_len);
+/* Words an operand other than a label takes after the opcode word */
+uint64_t operand_words(struct token *op, int is_a);
+int encode_opcode(struct assembler *a, struct token *t,
+                  struct bcode_node *node);
+/* Append n words, already encoded, that the node keeps pointing at.
+ * Returns their size in bytes, or -1. */
+int build_words(struct assembler *a, uint16_t *words, uint64_t n);
 int pass1(struct assembler *a);
 int pass2(struct assembler *a);
 int bcode_debug(struct assembler *a);
+int64_t bcode_image(struct assembler *a, uint16_t *image, uint64_t max_words);
 
 #endif //ASSEMBLER_BINARY_CODE_H
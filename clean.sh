@@ -1,8 +1,14 @@
 # Target
 rm -f ./dasm
+rm -f ./demu
+rm -f ./ddis
+rm -f ./dasm_bench ./dasm_corpus
 
 # CMake files
 rm -f  ./CMakeCache.txt
 rm -fr ./CMakeFiles/
 rm -f  ./cmake_install.cmake
 rm -f  ./Makefile
+rm -fr ./Testing/
+rm -f  ./CTestTestfile.cmake
+rm -f  ./golden_*.bin ./ddis_*.dasm
@@ -18,19 +18,12 @@
                 errno, ##__VA_ARGS__); \
     } while (0)
 
+/* Report an error in the source, and keep it, see diag.h */
 #define ASMERROR(a, message) \
-    do { \
-        fprintf(stderr, "%s:%llu:%llu %s\n", \
-                basename(a->input_file), a->inp_row + 1, \
-                a->inp_col + 1, message); \
-    } while (0)
+    asm_error(a, a->inp_row, a->inp_col, message)
 
 #define ASMTOKERROR(a, t, message) \
-    do { \
-        fprintf(stderr, "%s:%llu:%llu %s\n", \
-            basename(a->input_file), t->tok_row + 1, \
-            t->tok_col + 1, message); \
-    } while (0)
+    asm_error(a, t->tok_row, t->tok_col, message)
 
 enum operand_type {
     ot_invalid,
@@ -49,14 +42,17 @@ enum token_type {
     tt_basic_opcode,
     tt_special_opcode,
     tt_operand,
-    tt_data,
+    tt_words,           // DAT, its items laid out as words
+    tt_org,             // .org <address>
+    tt_reserve,         // .reserve <words>
+    tt_pin,             // .pin, the next block keeps its place
 };
 
 /* Binary code type enumeration */
 enum bincode_type {
     bt_invalid,
     bt_code,       /* Opcode type */
-    bt_data        /* Data type */
+    bt_words       /* Data words of a DAT */
 };
 
 /* Label state */
@@ -81,10 +77,14 @@ struct operand_tokens {
     enum operand_type type;
 };
 
+struct expr;
+
 struct operand {
     enum  operand_type opd_type;
     int   opd_opcode_val;
     long  opd_literal_val;
+    struct expr *opd_expr;  /* Its value once labels are placed, or NULL */
+    uint16_t    *opd_bcp;   /* The word it takes, from build_operand() */
 };
 
 struct label {
@@ -113,8 +113,13 @@ struct token {
     uint64_t tok_len;
     enum token_type type;
     union {
-        char *data;
+        struct {
+            uint16_t     *words;  /* tok_len of them */
+            struct token *refs;   /* Label references among the words */
+            uint64_t      nrefs;
+        } dat;
         int opcode;
+        uint64_t number;
         struct label label;
         struct operand operand;
     } u;
@@ -123,8 +128,11 @@ struct token {
 };
 #define ttu_lab u.label
 #define ttu_opc u.opcode
+#define ttu_num u.number
 #define ttu_opd u.operand
-#define ttu_dat u.data
+#define ttu_wrd u.dat.words
+#define ttu_refs u.dat.refs
+#define ttu_nrefs u.dat.nrefs
 
 struct token *label_to_token(struct label *l);
 
@@ -146,7 +154,7 @@ struct bcode_node {
             uint8_t has_b;     /* Are we using register B */
             uint16_t bcode[3]; /* Upto 3 words of binary data */
         } s;
-        char     *bdata;    /* Pointer to binary data */
+        uint16_t *bwords;   /* Data words, owned by the token */
     } u;
     /* Next binary list code entry */
     struct bcode_node *next;
@@ -154,7 +162,7 @@ struct bcode_node {
 #define btu_c_has_a u.s.has_a
 #define btu_c_has_b u.s.has_b
 #define btu_code u.s.bcode
-#define btu_data u.bdata
+#define btu_words u.bwords
 
 /* Binary code structure */
 struct bcode_list {
@@ -162,20 +170,96 @@ struct bcode_list {
     struct bcode_node *tail;
 };
 
+/* A run of words laid out from one address, opened by .org or .reserve */
+struct segment {
+    uint64_t sg_addr;    /* First address, in words */
+    uint64_t sg_index;   /* Its first word among all the words emitted */
+    uint64_t sg_words;   /* Filled in by seg_finish() */
+    uint64_t sg_row;     /* The directive that opened it */
+    uint64_t sg_col;
+};
+
+/* Empty until the first .org or .reserve, everything is at 0 then */
+struct segment_table {
+    struct segment  *st_seg;     /* In source order */
+    struct segment **st_sorted;  /* By address, from seg_finish() */
+    uint64_t         st_count;
+    uint64_t         st_cap;
+};
+
+/* Layout of the image file */
+enum image_format {
+    if_flat,      /* Big endian words from address 0, gaps zeroed */
+    if_sparse,    /* Header and segment table, then only the segments */
+    if_hex,       /* Intel HEX records of the segments, at byte addresses */
+    if_carray     /* A C header, the words from address 0 as an array */
+};
+
+/* One of the images to write, -o [format:]path */
+struct out_sink {
+    enum image_format os_format;
+    char             *os_path;
+};
+
+/* A file placed on a floppy image, --place */
+struct disk_part {
+    uint64_t dp_sector;
+    char    *dp_path;       /* Assembled first when it ends in .dasm */
+};
+
+struct asm_stats;
+struct diagnostic;
+struct expr_fixup;
+struct prelude;
+
 /* The main assembler structure */
 struct assembler {
     uint64_t inp_row;
     uint64_t inp_col;
     uint64_t inp_offset;
     uint64_t inp_size;
+    uint64_t inp_cap;
+    uint64_t inp_dropped;          // Mapped input handed back up to here
+    int inp_mapped;                // From asm_init_mapped(), not read
     char *input;
     char *input_file;
+    struct out_sink *outputs;      // Images to write, -o
+    char *listing;                 // Listing file, --listing
+    char *debuginfo;               // Debug info file, --debug-info
+    char *floppy;                  // M35FD disk image, --floppy
+    struct disk_part *parts;       // Files placed on it, --place
+    int nparts;
+    int noutputs;
+    int output_atomic;             // Write <output>.tmp, rename it over
     struct label_list label_pts;   // labels whose offsets have been determined
     struct label_list label_ops;   // unresolved labels which are operands
     struct token_list tok_list;
     struct bcode_list bcd_list;
+    struct token *tok_pool;        // Recycled by asm_reload(), on next
+    struct bcode_node *bcd_pool;
+    struct segment_table segs;
+    uint16_t *image;               // Streaming mode: the image, no bcode list
+    uint64_t img_words;
+    uint64_t img_cap;
+    struct asm_stats *stats;       // NULL unless statistics are wanted
+    int merge;                     // Merge constant DATs before pass 1
+    int layout;                    // Reorder blocks before pass 1
+    char *layout_profile;          // Reference counts per label, or NULL
+    struct prelude *prelude;       // Laid out ahead of the input, or NULL
+    struct diagnostic *diags;      // Errors so far, in the order found
+    uint64_t ndiags;
+    uint64_t diag_cap;
+    uint64_t nerrors;              // Errors reported, kept or not
+    uint64_t max_errors;           // Stop after this many, 0 for no limit
+    int diag_quiet;                // Keep errors without printing them
+    struct expr_fixup *fixups;     // Words waiting for an expression
+    uint64_t nfixups;
+    uint64_t fixup_cap;
 };
 
+void asm_error(struct assembler *a, uint64_t row, uint64_t col,
+               const char *message);
+
 #define OPERAND_A_LSHIFT 0xA
 #define OPERAND_B_LSHIFT 0x5
 #define OPERAND_OP_MAX   0x1F
@@ -0,0 +1,309 @@
+#include <getopt.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+// Synthetic assembly sources for the benchmarks. Every shape assembles
+// with dasm; they differ in what the assembler spends its time on.
+
+enum corpus_shape {
+    cs_mixed,
+    cs_labels,      /* A label on every line, short backward jumps */
+    cs_comments,    /* Mostly comment lines and trailing comments */
+    cs_data,        /* DAT strings and number lists */
+    cs_forward,     /* Far forward references, resolved in pass 2 */
+    cs_long,        /* Very long lines */
+};
+
+static const char *shape_names[] = {
+        "mixed", "labels", "comments", "data", "forward", "long"
+};
+
+static const char *basic_ops[] = {
+        "SET", "ADD", "SUB", "MUL", "MLI", "DIV", "DVI", "MOD", "MDI",
+        "AND", "BOR", "XOR", "SHR", "ASR", "SHL", "IFB", "IFC", "IFE",
+        "IFN", "IFG", "IFA", "IFL", "IFU", "ADX", "SBX", "STI", "STD"
+};
+
+static const char *regs[] = {"A", "B", "C", "X", "Y", "Z", "I", "J"};
+
+struct corpus {
+    FILE *out;
+    uint64_t state;         /* xorshift64 */
+    uint64_t written;
+    uint64_t lines;
+    uint64_t next_label;    /* Labels l0 .. next_label-1 are defined */
+    uint64_t max_ref;       /* Highest label referenced so far, plus one */
+};
+
+static inline uint32_t rnd(struct corpus *c, uint32_t n) {
+    c->state ^= c->state << 13;
+    c->state ^= c->state >> 7;
+    c->state ^= c->state << 17;
+    return (uint32_t) (c->state % n);
+}
+
+static void emit(struct corpus *c, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void emit(struct corpus *c, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vfprintf(c->out, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        c->written += (uint64_t) n;
+    }
+}
+
+static void end_line(struct corpus *c) {
+    emit(c, "\n");
+    c->lines++;
+}
+
+static void operand(struct corpus *c, int is_a) {
+    switch (rnd(c, 6)) {
+        case 0:
+            emit(c, "%s", regs[rnd(c, 8)]);
+            break;
+        case 1:
+            emit(c, "[%s]", regs[rnd(c, 8)]);
+            break;
+        case 2:
+            emit(c, "[%s + 0x%x]", regs[rnd(c, 8)], rnd(c, 0x10000));
+            break;
+        case 3:
+            emit(c, "[0x%x]", rnd(c, 0x10000));
+            break;
+        case 4:
+            emit(c, "%s", is_a ? "POP" : "PUSH");
+            break;
+        default:
+            emit(c, "%u", rnd(c, is_a ? 64 : 0x10000));
+            break;
+    }
+}
+
+static void label_ref(struct corpus *c, uint64_t id) {
+    emit(c, "l%llu", (unsigned long long) id);
+    if (id + 1 > c->max_ref) {
+        c->max_ref = id + 1;
+    }
+}
+
+static void define_label(struct corpus *c) {
+    emit(c, ":l%llu ", (unsigned long long) c->next_label++);
+}
+
+static void instruction(struct corpus *c) {
+    if (rnd(c, 8) == 0) {
+        emit(c, "JSR ");
+        operand(c, 1);
+        return;
+    }
+    emit(c, "%s ", basic_ops[rnd(c, sizeof(basic_ops) / sizeof(char *))]);
+    operand(c, 0);
+    emit(c, ", ");
+    operand(c, 1);
+}
+
+static void jump_back(struct corpus *c) {
+    uint64_t back = c->next_label ? rnd(c, 16) : 0;
+    if (!c->next_label) {
+        instruction(c);
+        return;
+    }
+    emit(c, "SET PC, ");
+    label_ref(c, c->next_label - 1 - (back < c->next_label ? back : 0));
+}
+
+static void jump_forward(struct corpus *c, uint32_t distance) {
+    emit(c, "IFE A, %u\n", rnd(c, 30));
+    c->lines++;
+    emit(c, "SET PC, ");
+    label_ref(c, c->next_label + 1 + rnd(c, distance));
+}
+
+static void string_data(struct corpus *c, uint32_t len) {
+    static const char printable[] =
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,:-_";
+    uint32_t i;
+    emit(c, "DAT \"");
+    for (i = 0; i < len; ++i) {
+        fputc(printable[rnd(c, sizeof(printable) - 1)], c->out);
+    }
+    c->written += len;
+    emit(c, "\"");
+}
+
+static void number_data(struct corpus *c, uint32_t count) {
+    uint32_t i;
+    emit(c, "DAT 0x%x", rnd(c, 0x10000));
+    for (i = 1; i < count; ++i) {
+        emit(c, ", 0x%x", rnd(c, 0x10000));
+    }
+}
+
+static void comment(struct corpus *c, uint32_t len) {
+    static const char words[][8] = {
+            "load", "the", "next", "word", "into", "a", "loop", "over",
+            "table", "entry", "check", "carry", "and", "skip", "done"
+    };
+    uint32_t n = 0;
+    emit(c, "; ");
+    while (n < len) {
+        const char *w = words[rnd(c, sizeof(words) / sizeof(words[0]))];
+        emit(c, "%s ", w);
+        n += (uint32_t) strlen(w) + 1;
+    }
+}
+
+static void line(struct corpus *c, enum corpus_shape shape) {
+    uint32_t r = rnd(c, 100);
+    switch (shape) {
+        case cs_labels:
+            define_label(c);
+            if (r < 30) {
+                jump_back(c);
+            } else {
+                instruction(c);
+            }
+            break;
+        case cs_comments:
+            if (r < 70) {
+                comment(c, 20 + rnd(c, 60));
+            } else {
+                instruction(c);
+                emit(c, " ");
+                comment(c, 10 + rnd(c, 30));
+            }
+            break;
+        case cs_data:
+            if (r < 50) {
+                string_data(c, 4 + rnd(c, 60));
+            } else {
+                number_data(c, 1 + rnd(c, 16));
+            }
+            break;
+        case cs_forward:
+            if (r < 10) {
+                define_label(c);
+            }
+            if (r < 60) {
+                jump_forward(c, 4096);
+            } else {
+                instruction(c);
+            }
+            break;
+        case cs_long:
+            if (r < 50) {
+                number_data(c, 200 + rnd(c, 400));
+            } else {
+                string_data(c, 1000 + rnd(c, 3000));
+            }
+            break;
+        default:
+            if (r < 10) {
+                define_label(c);
+            }
+            if (r < 15) {
+                comment(c, 10 + rnd(c, 40));
+            } else if (r < 25) {
+                jump_back(c);
+            } else if (r < 30) {
+                jump_forward(c, 64);
+            } else if (r < 35) {
+                string_data(c, 4 + rnd(c, 30));
+            } else if (r < 40) {
+                number_data(c, 1 + rnd(c, 8));
+            } else {
+                instruction(c);
+            }
+            break;
+    }
+    end_line(c);
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-k shape] [-s bytes] [-S seed] [-o outfile]\n"
+                    "  -k shape   mixed (default), labels, comments, data,\n"
+                    "             forward or long\n"
+                    "  -s bytes   approximate size of the source (default 1 MiB)\n"
+                    "  -S seed    random seed (default 1)\n",
+            basename(prog));
+}
+
+int main(int argc, char *argv[]) {
+    struct corpus c;
+    enum corpus_shape shape = cs_mixed;
+    uint64_t size = 1 << 20, seed = 1;
+    char *outfile = NULL;
+    int opt, i, found;
+
+    while ((opt = getopt(argc, argv, "k:o:s:S:")) != -1) {
+        switch (opt) {
+            case 'k':
+                found = 0;
+                for (i = 0; i < (int) (sizeof(shape_names) / sizeof(char *)); ++i) {
+                    if (!strcmp(optarg, shape_names[i])) {
+                        shape = (enum corpus_shape) i;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 's':
+                size = strtoull(optarg, NULL, 0);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.state = seed ? seed : 1;
+    c.out = stdout;
+    if (outfile) {
+        c.out = fopen(outfile, "w");
+        if (!c.out) {
+            LOGERROR("Unable to open %s for writing", outfile);
+            return -1;
+        }
+    }
+    emit(&c, "; %s corpus, seed %llu\n", shape_names[shape],
+         (unsigned long long) seed);
+    c.lines++;
+    while (c.written < size) {
+        line(&c, shape);
+    }
+    // define whatever was referenced but not reached
+    while (c.next_label < c.max_ref) {
+        define_label(&c);
+        emit(&c, "SET PC, POP");
+        end_line(&c);
+    }
+    if (c.out != stdout && fclose(c.out) != 0) {
+        LOGERROR("Could not write %s", outfile);
+        return -1;
+    }
+    return 0;
+}
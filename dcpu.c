@@ -0,0 +1,564 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcpu.h"
+#include "hardware.h"
+
+int dcpu_init(struct dcpu *d) {
+    if (!d) {
+        LOGERROR("DCPU structure is NULL");
+        return -1;
+    }
+    memset(d, 0, sizeof(*d));
+    if (sched_init(&d->sched) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void dcpu_free(struct dcpu *d) {
+    uint16_t i;
+    if (!d) {
+        return;
+    }
+    for (i = 0; i < d->hw_count; ++i) {
+        d->hw[i]->hw_ops->hwo_free(d->hw[i]);
+    }
+    if (d->hw) {
+        free(d->hw);
+    }
+    sched_free(&d->sched);
+}
+
+// Connect a device, devices are numbered in the order they are attached
+int dcpu_attach(struct dcpu *d, struct hw_device *hw) {
+    struct hw_device **list;
+    if (!hw) {
+        LOGERROR("Hardware device is NULL");
+        return -1;
+    }
+    if (d->hw_count == DCPU_HW_MAX) {
+        LOGERROR("Cannot connect more than %d devices", DCPU_HW_MAX);
+        return -1;
+    }
+    list = realloc(d->hw, sizeof(struct hw_device *) * (d->hw_count + 1));
+    if (!list) {
+        LOGERROR("Cannot allocate memory for the device list");
+        return -1;
+    }
+    list[d->hw_count++] = hw;
+    d->hw = list;
+    return 0;
+}
+
+// Place the segments of a sparse image ("DSEG", see output.c)
+static int load_sparse(struct dcpu *d, FILE *fp) {
+    uint8_t buf[8], *table;
+    uint32_t n, i, addr, len, k;
+    int rc = 0;
+    if (fread(buf, 1, 4, fp) != 4) {
+        return -1;
+    }
+    n = (uint32_t) buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    table = malloc((size_t) n * 8 + 1);
+    if (!table || fread(table, 8, n, fp) != n) {
+        free(table);
+        return -1;
+    }
+    for (i = 0; i < n && !rc; ++i) {
+        addr = (uint32_t) table[8 * i] << 24 | table[8 * i + 1] << 16 |
+               table[8 * i + 2] << 8 | table[8 * i + 3];
+        len = (uint32_t) table[8 * i + 4] << 24 | table[8 * i + 5] << 16 |
+              table[8 * i + 6] << 8 | table[8 * i + 7];
+        if (addr > DCPU_RAM_WORDS || len > DCPU_RAM_WORDS - addr) {
+            LOGERROR("Segment at 0x%x does not fit in memory", addr);
+            rc = -1;
+            break;
+        }
+        for (k = 0; k < len; ++k) {
+            if (fread(buf, 1, 2, fp) != 2) {
+                rc = -1;
+                break;
+            }
+            d->ram[addr + k] = (uint16_t) (buf[0] << 8 | buf[1]);
+        }
+    }
+    free(table);
+    return rc;
+}
+
+// Load a raw image (big endian words) at address 0, or a sparse one
+int dcpu_load_image(struct dcpu *d, char *file) {
+    uint8_t buf[2], magic[4];
+    uint32_t addr = 0;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open image: %s", file);
+        return -1;
+    }
+    if (fread(magic, 1, 4, fp) == 4 && !memcmp(magic, "DSEG", 4)) {
+        if (load_sparse(d, fp) < 0) {
+            fclose(fp);
+            LOGERROR("Could not read the sparse image %s", file);
+            return -1;
+        }
+    } else {
+        rewind(fp);
+        while (addr < DCPU_RAM_WORDS && fread(buf, 1, 2, fp) == 2) {
+            d->ram[addr++] = (uint16_t) (buf[0] << 8 | buf[1]);
+        }
+    }
+    // bypassed dcpu_write(), the dirty pages mean nothing now
+    d->snap_id = 0;
+    if (ferror(fp)) {
+        fclose(fp);
+        LOGERROR("Could not read the image successfully");
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Queue an interrupt, software and hardware alike.
+// 0 on success, -1 if the queue overflowed and the DCPU caught fire.
+int dcpu_interrupt(struct dcpu *d, uint16_t message) {
+    if (d->intq_count >= DCPU_INTQ_MAX) {
+        d->on_fire = 1;
+        return -1;
+    }
+    d->intq[(d->intq_head + d->intq_count) % DCPU_INTQ_MAX] = message;
+    d->intq_count++;
+    return 0;
+}
+
+// Report writes to [start, start + len) to the device, the range may wrap
+// around the end of RAM. 0 on success, -1 if there are too many watches.
+int dcpu_watch(struct dcpu *d, struct hw_device *hw,
+               uint16_t start, uint16_t len) {
+    uint32_t g, first, last;
+    struct dcpu_watch *w;
+    if (!len) {
+        return 0;
+    }
+    if (d->watch_count == DCPU_WATCH_MAX) {
+        LOGERROR("Cannot watch more than %d RAM ranges", DCPU_WATCH_MAX);
+        return -1;
+    }
+    w = &d->watches[d->watch_count++];
+    w->dw_start = start;
+    w->dw_len = len;
+    w->dw_dev = hw;
+    first = start >> DCPU_WATCH_SHIFT;
+    last = (uint32_t) (start + len - 1) >> DCPU_WATCH_SHIFT;
+    for (g = first; g <= last; ++g) {
+        d->watched[g % (DCPU_RAM_WORDS >> DCPU_WATCH_SHIFT)]++;
+    }
+    return 0;
+}
+
+// Drop every watch of the device
+void dcpu_unwatch(struct dcpu *d, struct hw_device *hw) {
+    struct dcpu_watch keep[DCPU_WATCH_MAX];
+    uint8_t i, n = 0, count = d->watch_count;
+    for (i = 0; i < count; ++i) {
+        if (d->watches[i].dw_dev != hw) {
+            keep[n++] = d->watches[i];
+        }
+    }
+    // rebuild the granule counts from what is left
+    memset(d->watched, 0, sizeof(d->watched));
+    d->watch_count = 0;
+    for (i = 0; i < n; ++i) {
+        dcpu_watch(d, keep[i].dw_dev, keep[i].dw_start, keep[i].dw_len);
+    }
+}
+
+// Slow path of dcpu_write(), the granule is watched by someone
+void dcpu_watch_hit(struct dcpu *d, uint16_t addr) {
+    uint8_t i;
+    struct dcpu_watch *w;
+    for (i = 0; i < d->watch_count; ++i) {
+        w = &d->watches[i];
+        if ((uint16_t) (addr - w->dw_start) < w->dw_len) {
+            w->dw_dev->hw_ops->hwo_write(d, w->dw_dev, addr);
+        }
+    }
+}
+
+static inline uint16_t dcpu_get(struct dcpu *d, uint32_t loc) {
+    return loc < DCPU_RAM_WORDS ? d->ram[loc] : d->reg[loc - DCPU_RAM_WORDS];
+}
+
+static inline void dcpu_set(struct dcpu *d, uint32_t loc, uint16_t val) {
+    if (loc < DCPU_RAM_WORDS) {
+        dcpu_write(d, (uint16_t) loc, val);
+    } else {
+        d->reg[loc - DCPU_RAM_WORDS] = val;
+    }
+}
+
+static inline void dcpu_push(struct dcpu *d, uint16_t val) {
+    dcpu_write(d, --d->reg[DR_SP], val);
+}
+
+static inline uint16_t dcpu_pop(struct dcpu *d) {
+    return d->ram[d->reg[DR_SP]++];
+}
+
+static inline uint16_t next_word(struct dcpu *d) {
+    return d->ram[d->reg[DR_PC]++];
+}
+
+// Does this operand value code consume a "next word"?
+static inline int operand_has_word(uint16_t code) {
+    return (code >= 0x10 && code <= 0x17) || code == 0x1a ||
+           code == 0x1e || code == 0x1f;
+}
+
+// Resolve an operand value code into a location, charging the cycles for
+// any "next word" lookups. 'is_a' distinguishes POP from PUSH and allows
+// the inline literals.
+static inline uint32_t dcpu_operand(struct dcpu *d, uint16_t code, int is_a) {
+    uint16_t *r = d->reg;
+    if (code < 0x08) {
+        return DCPU_LOC_REG(code);
+    } else if (code < 0x10) {
+        return r[code - 0x08];
+    } else if (code < 0x18) {
+        d->cycles++;
+        return (uint16_t) (r[code - 0x10] + next_word(d));
+    }
+    switch (code) {
+        case 0x18:
+            return is_a ? r[DR_SP]++ : --r[DR_SP];
+        case 0x19:
+            return r[DR_SP];
+        case 0x1a:
+            d->cycles++;
+            return (uint16_t) (r[DR_SP] + next_word(d));
+        case 0x1b:
+            return DCPU_LOC_REG(DR_SP);
+        case 0x1c:
+            return DCPU_LOC_REG(DR_PC);
+        case 0x1d:
+            return DCPU_LOC_REG(DR_EX);
+        case 0x1e:
+            d->cycles++;
+            return next_word(d);
+        case 0x1f:
+            d->cycles++;
+            r[is_a ? DR_LIT_A : DR_LIT_B] = next_word(d);
+            return DCPU_LOC_REG(is_a ? DR_LIT_A : DR_LIT_B);
+        default:
+            // 0x20-0x3f: inline literal -1..30
+            r[DR_LIT_A] = (uint16_t) (code - 0x21);
+            return DCPU_LOC_REG(DR_LIT_A);
+    }
+}
+
+// Skip the next instruction, and keep skipping while the skipped ones
+// are conditionals. Costs one cycle per skipped instruction.
+static inline void dcpu_skip(struct dcpu *d) {
+    uint16_t w, op;
+    do {
+        w = next_word(d);
+        op = (uint16_t) (w & 0x1f);
+        d->reg[DR_PC] += operand_has_word((uint16_t) (w >> 10));
+        if (op) {
+            d->reg[DR_PC] += operand_has_word((uint16_t) ((w >> 5) & 0x1f));
+        }
+        d->cycles++;
+    } while (op >= 0x10 && op <= 0x17);
+}
+
+// Start the interrupt at the head of the queue
+static inline void dcpu_trigger(struct dcpu *d) {
+    uint16_t message = d->intq[d->intq_head];
+    d->intq_head = (uint16_t) ((d->intq_head + 1) % DCPU_INTQ_MAX);
+    d->intq_count--;
+    if (!d->reg[DR_IA]) {
+        // interrupts are dropped when IA is 0
+        return;
+    }
+    d->int_queueing = 1;
+    dcpu_push(d, d->reg[DR_PC]);
+    dcpu_push(d, d->reg[DR_A]);
+    d->reg[DR_PC] = d->reg[DR_IA];
+    d->reg[DR_A] = message;
+    d->halted = 0;
+}
+
+static void dcpu_special(struct dcpu *d, uint16_t op, uint16_t code) {
+    uint32_t a = dcpu_operand(d, code, 1);
+    uint16_t val = dcpu_get(d, a);
+    struct hw_device *hw;
+    switch (op) {
+        case 0x01: // JSR
+            dcpu_push(d, d->reg[DR_PC]);
+            d->reg[DR_PC] = val;
+            d->cycles += 3;
+            break;
+        case 0x08: // INT
+            dcpu_interrupt(d, val);
+            d->cycles += 4;
+            break;
+        case 0x09: // IAG
+            dcpu_set(d, a, d->reg[DR_IA]);
+            d->cycles += 1;
+            break;
+        case 0x0a: // IAS
+            d->reg[DR_IA] = val;
+            d->cycles += 1;
+            break;
+        case 0x0b: // RFI
+            d->int_queueing = 0;
+            d->reg[DR_A] = dcpu_pop(d);
+            d->reg[DR_PC] = dcpu_pop(d);
+            d->cycles += 3;
+            break;
+        case 0x0c: // IAQ
+            d->int_queueing = (uint8_t) (val != 0);
+            d->cycles += 2;
+            break;
+        case 0x10: // HWN
+            dcpu_set(d, a, d->hw_count);
+            d->cycles += 2;
+            break;
+        case 0x11: // HWQ
+            if (val < d->hw_count) {
+                hw = d->hw[val];
+                d->reg[DR_A] = (uint16_t) hw->hw_id;
+                d->reg[DR_B] = (uint16_t) (hw->hw_id >> 16);
+                d->reg[DR_C] = hw->hw_version;
+                d->reg[DR_X] = (uint16_t) hw->hw_manufacturer;
+                d->reg[DR_Y] = (uint16_t) (hw->hw_manufacturer >> 16);
+            } else {
+                d->reg[DR_A] = d->reg[DR_B] = d->reg[DR_C] = 0;
+                d->reg[DR_X] = d->reg[DR_Y] = 0;
+            }
+            d->cycles += 4;
+            break;
+        case 0x12: // HWI
+            d->cycles += 4;
+            if (val < d->hw_count) {
+                hw = d->hw[val];
+                d->cycles += hw->hw_ops->hwo_interrupt(d, hw);
+            }
+            break;
+        default:
+            // reserved, behaves as a one cycle no-op
+            d->cycles += 1;
+            break;
+    }
+}
+
+static void dcpu_basic(struct dcpu *d, uint16_t op, uint16_t code_b,
+                       uint16_t code_a) {
+    // a is always handled by the processor before b
+    uint32_t a = dcpu_operand(d, code_a, 1);
+    uint16_t av = dcpu_get(d, a);
+    uint32_t b = dcpu_operand(d, code_b, 0);
+    uint16_t bv = dcpu_get(d, b);
+    int32_t res;
+    int cond = 1;
+    switch (op) {
+        case 0x01: // SET
+            dcpu_set(d, b, av);
+            d->cycles += 1;
+            return;
+        case 0x02: // ADD
+            res = bv + av;
+            dcpu_set(d, b, (uint16_t) res);
+            d->reg[DR_EX] = (uint16_t) (res > 0xffff);
+            d->cycles += 2;
+            return;
+        case 0x03: // SUB
+            res = bv - av;
+            dcpu_set(d, b, (uint16_t) res);
+            d->reg[DR_EX] = (uint16_t) (res < 0 ? 0xffff : 0);
+            d->cycles += 2;
+            return;
+        case 0x04: { // MUL
+            uint32_t m = (uint32_t) bv * av;
+            dcpu_set(d, b, (uint16_t) m);
+            d->reg[DR_EX] = (uint16_t) (m >> 16);
+            d->cycles += 2;
+            return;
+        }
+        case 0x05: // MLI
+            res = (int16_t) bv * (int16_t) av;
+            dcpu_set(d, b, (uint16_t) res);
+            d->reg[DR_EX] = (uint16_t) (res >> 16);
+            d->cycles += 2;
+            return;
+        case 0x06: // DIV
+            if (!av) {
+                dcpu_set(d, b, 0);
+                d->reg[DR_EX] = 0;
+            } else {
+                dcpu_set(d, b, (uint16_t) (bv / av));
+                d->reg[DR_EX] = (uint16_t) (((uint32_t) bv << 16) / av);
+            }
+            d->cycles += 3;
+            return;
+        case 0x07: // DVI
+            if (!av) {
+                dcpu_set(d, b, 0);
+                d->reg[DR_EX] = 0;
+            } else {
+                dcpu_set(d, b, (uint16_t) ((int16_t) bv / (int16_t) av));
+                d->reg[DR_EX] = (uint16_t) (((int64_t) (int16_t) bv * 65536) /
+                                            (int16_t) av);
+            }
+            d->cycles += 3;
+            return;
+        case 0x08: // MOD
+            dcpu_set(d, b, (uint16_t) (av ? bv % av : 0));
+            d->cycles += 3;
+            return;
+        case 0x09: // MDI
+            dcpu_set(d, b, (uint16_t) (av ? (int16_t) bv % (int16_t) av : 0));
+            d->cycles += 3;
+            return;
+        case 0x0a: // AND
+            dcpu_set(d, b, bv & av);
+            d->cycles += 1;
+            return;
+        case 0x0b: // BOR
+            dcpu_set(d, b, bv | av);
+            d->cycles += 1;
+            return;
+        case 0x0c: // XOR
+            dcpu_set(d, b, bv ^ av);
+            d->cycles += 1;
+            return;
+        case 0x0d: // SHR
+            dcpu_set(d, b, (uint16_t) (av < 16 ? bv >> av : 0));
+            d->reg[DR_EX] = (uint16_t) (av < 32 ? ((uint32_t) bv << 16) >> av : 0);
+            d->cycles += 1;
+            return;
+        case 0x0e: // ASR
+            dcpu_set(d, b, (uint16_t) ((int16_t) bv >> (av < 16 ? av : 15)));
+            d->reg[DR_EX] = (uint16_t) (av < 32 ? ((uint32_t) bv << 16) >> av : 0);
+            d->cycles += 1;
+            return;
+        case 0x0f: // SHL
+            dcpu_set(d, b, (uint16_t) (av < 16 ? bv << av : 0));
+            d->reg[DR_EX] = (uint16_t) (av < 32 ? ((uint64_t) bv << av) >> 16 : 0);
+            d->cycles += 1;
+            return;
+        case 0x10: cond = (bv & av) != 0; break;                    // IFB
+        case 0x11: cond = (bv & av) == 0; break;                    // IFC
+        case 0x12: cond = bv == av; break;                          // IFE
+        case 0x13: cond = bv != av; break;                          // IFN
+        case 0x14: cond = bv > av; break;                           // IFG
+        case 0x15: cond = (int16_t) bv > (int16_t) av; break;       // IFA
+        case 0x16: cond = bv < av; break;                           // IFL
+        case 0x17: cond = (int16_t) bv < (int16_t) av; break;       // IFU
+        case 0x1a: // ADX
+            res = bv + av + d->reg[DR_EX];
+            dcpu_set(d, b, (uint16_t) res);
+            d->reg[DR_EX] = (uint16_t) (res > 0xffff);
+            d->cycles += 3;
+            return;
+        case 0x1b: // SBX
+            res = bv - av + d->reg[DR_EX];
+            dcpu_set(d, b, (uint16_t) res);
+            d->reg[DR_EX] = (uint16_t) (res < 0 ? 0xffff : res > 0xffff);
+            d->cycles += 3;
+            return;
+        case 0x1e: // STI
+        case 0x1f: // STD
+            dcpu_set(d, b, av);
+            d->reg[DR_I] += op == 0x1e ? 1 : -1;
+            d->reg[DR_J] += op == 0x1e ? 1 : -1;
+            d->cycles += 2;
+            return;
+        default:
+            // reserved, behaves as a one cycle no-op
+            d->cycles += 1;
+            return;
+    }
+    // conditionals: 2 cycles, and a skip if the test fails
+    d->cycles += 2;
+    if (!cond) {
+        dcpu_skip(d);
+    }
+}
+
+// Execute one instruction and then at most one interrupt.
+// 0 on success, -1 if the DCPU is on fire.
+int dcpu_step(struct dcpu *d) {
+    uint16_t pc = d->reg[DR_PC];
+    uint16_t w = next_word(d);
+    uint16_t op = (uint16_t) (w & 0x1f);
+    if (op) {
+        dcpu_basic(d, op, (uint16_t) ((w >> 5) & 0x1f), (uint16_t) (w >> 10));
+    } else {
+        dcpu_special(d, (uint16_t) ((w >> 5) & 0x1f), (uint16_t) (w >> 10));
+    }
+    d->instructions++;
+    // SET, ADD or SUB of a literal to PC that lands on itself (SET PC, self
+    // or SUB PC, 1) does the same every time, only an interrupt or a device
+    // writing RAM can get it out. Anything else may change state each round.
+    d->halted = (uint8_t) (d->reg[DR_PC] == pc && op >= 0x01 && op <= 0x03 &&
+                           ((w >> 5) & 0x1f) == 0x1c && (w >> 10) >= 0x1f);
+    if (!d->int_queueing && d->intq_count) {
+        dcpu_trigger(d);
+    }
+    return d->on_fire ? -1 : 0;
+}
+
+// Fire every event that is due by now
+static inline void dcpu_dispatch(struct dcpu *d) {
+    struct sched_event ev;
+    while (sched_next(&d->sched) <= d->cycles) {
+        sched_pop(&d->sched, &ev);
+        ev.se_dev->hw_ops->hwo_event(d, ev.se_dev, ev.se_kind);
+    }
+}
+
+// Run for (at least) max_cycles. Devices cost nothing between their
+// events, and a halted CPU jumps straight to the next due event.
+// Returns a dcpu_run_status, or -1 if the DCPU caught fire.
+int dcpu_run(struct dcpu *d, uint64_t max_cycles) {
+    uint64_t limit = d->cycles + max_cycles, due;
+    if (limit < d->cycles) {
+        limit = UINT64_MAX;
+    }
+    while (d->cycles < limit) {
+        due = sched_next(&d->sched);
+        while (d->cycles < due && d->cycles < limit) {
+            if (d->halted && (!d->intq_count || d->int_queueing)) {
+                // nothing but a device event can change the state now
+                if (due == SCHED_NEVER) {
+                    return drs_halted;
+                }
+                d->cycles = due < limit ? due : limit;
+                break;
+            }
+            if (dcpu_step(d) < 0) {
+                return -1;
+            }
+            // a HWI may have scheduled something sooner
+            due = sched_next(&d->sched);
+        }
+        dcpu_dispatch(d);
+        if (d->on_fire) {
+            return -1;
+        }
+    }
+    return drs_budget;
+}
+
+void dcpu_debug(struct dcpu *d) {
+    uint16_t *r = d->reg;
+    printf("A=%04x B=%04x C=%04x X=%04x Y=%04x Z=%04x I=%04x J=%04x\n",
+           r[DR_A], r[DR_B], r[DR_C], r[DR_X],
+           r[DR_Y], r[DR_Z], r[DR_I], r[DR_J]);
+    printf("PC=%04x SP=%04x EX=%04x IA=%04x\n",
+           r[DR_PC], r[DR_SP], r[DR_EX], r[DR_IA]);
+    printf("cycles=%llu instructions=%llu\n",
+           (unsigned long long) d->cycles,
+           (unsigned long long) d->instructions);
+}
@@ -0,0 +1,99 @@
+#ifndef ASSEMBLER_DCPU_H
+#define ASSEMBLER_DCPU_H
+
+#include "common.h"
+#include "scheduler.h"
+
+#define DCPU_RAM_WORDS  0x10000
+#define DCPU_CLOCK_HZ   100000   /* Cycles per emulated second */
+#define DCPU_INTQ_MAX   256      /* Catch fire beyond this */
+#define DCPU_HW_MAX     0xFFFF
+#define DCPU_WATCH_SHIFT 4       /* Writes are watched in 16 word granules */
+#define DCPU_WATCH_MAX  16
+#define DCPU_PAGE_SHIFT 9        /* Dirty tracking in 512 word pages */
+#define DCPU_PAGES      (DCPU_RAM_WORDS >> DCPU_PAGE_SHIFT)
+
+/* Register file, including the two scratch slots for literal operands */
+enum dcpu_register {
+    DR_A, DR_B, DR_C, DR_X, DR_Y, DR_Z, DR_I, DR_J,
+    DR_SP, DR_PC, DR_EX, DR_IA,
+    DR_LIT_A,   /* Literal operand a, writes are discarded */
+    DR_LIT_B,   /* Literal operand b, writes are discarded */
+    DR_MAX
+};
+
+/* Operand locations: 0x0000-0xFFFF are RAM, registers follow after that */
+#define DCPU_LOC_REG(r) ((uint32_t) DCPU_RAM_WORDS + (r))
+
+/* Return codes of dcpu_run() */
+enum dcpu_run_status {
+    drs_budget = 0,   /* Cycle budget used up */
+    drs_halted = 1,   /* Spinning on itself with no event left to wake it */
+};
+
+struct hw_device;
+
+/* A RAM range whose writes are reported to a device */
+struct dcpu_watch {
+    uint16_t dw_start;
+    uint16_t dw_len;
+    struct hw_device *dw_dev;
+};
+
+struct dcpu {
+    uint16_t ram[DCPU_RAM_WORDS];
+    uint16_t reg[DR_MAX];
+    uint64_t cycles;
+    uint64_t instructions;
+    uint8_t  int_queueing;  /* IAQ or an interrupt handler is running */
+    uint8_t  halted;        /* Last instruction was a literal jump onto
+                             * itself, cleared by a write to RAM */
+    uint8_t  on_fire;       /* Interrupt queue overflowed */
+    uint16_t intq[DCPU_INTQ_MAX];
+    uint16_t intq_head;
+    uint16_t intq_count;
+    struct hw_device **hw;
+    uint16_t hw_count;
+    struct scheduler sched;
+    /* Number of watches covering each granule, checked on every write */
+    uint8_t  watched[DCPU_RAM_WORDS >> DCPU_WATCH_SHIFT];
+    struct dcpu_watch watches[DCPU_WATCH_MAX];
+    uint8_t  watch_count;
+    /* Pages written since the bits were last cleared */
+    uint64_t dirty[DCPU_PAGES / 64];
+    /* Snapshot the RAM was last taken from or restored to, and which the
+     * dirty pages differ from. 0 after RAM was loaded behind its back. */
+    uint64_t snap_id;
+};
+
+int  dcpu_init(struct dcpu *d);
+void dcpu_free(struct dcpu *d);
+int  dcpu_attach(struct dcpu *d, struct hw_device *hw);
+int  dcpu_load_image(struct dcpu *d, char *file);
+int  dcpu_interrupt(struct dcpu *d, uint16_t message);
+int  dcpu_watch(struct dcpu *d, struct hw_device *hw,
+                uint16_t start, uint16_t len);
+void dcpu_unwatch(struct dcpu *d, struct hw_device *hw);
+void dcpu_watch_hit(struct dcpu *d, uint16_t addr);
+int  dcpu_step(struct dcpu *d);
+int  dcpu_run(struct dcpu *d, uint64_t max_cycles);
+void dcpu_debug(struct dcpu *d);
+
+// All RAM stores from the CPU and from devices funnel through here. A
+// device may rewrite the loop a halted CPU spins in, so it runs again.
+static inline void dcpu_write(struct dcpu *d, uint16_t addr, uint16_t val) {
+    d->ram[addr] = val;
+    d->halted = 0;
+    d->dirty[addr >> (DCPU_PAGE_SHIFT + 6)] |= 1ULL << (addr >> DCPU_PAGE_SHIFT & 63);
+    if (d->watched[addr >> DCPU_WATCH_SHIFT]) {
+        dcpu_watch_hit(d, addr);
+    }
+}
+
+// Schedule an event for a device 'delay' cycles from now
+static inline int dcpu_schedule(struct dcpu *d, struct hw_device *hw,
+                                uint64_t delay, int kind) {
+    return sched_add(&d->sched, d->cycles + delay, hw, kind);
+}
+
+#endif //ASSEMBLER_DCPU_H
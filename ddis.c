@@ -0,0 +1,184 @@
+#include <getopt.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "binary_code.h"
+#include "disasm.h"
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-a] [-o outfile] [--verify] <image>\n"
+                    "  -a         note the address of each line\n"
+                    "  -o file    write the assembly to file, not stdout\n"
+                    "  --verify   assemble the output again and compare it\n"
+                    "             with the image word for word\n",
+            basename(prog));
+}
+
+// Read a raw image of big endian words
+static uint16_t *load_image(char *file, uint64_t *n) {
+    uint8_t *bytes;
+    uint16_t *words;
+    long size;
+    uint64_t i;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open image: %s", file);
+        return NULL;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+        LOGERROR("Cannot tell the size of %s", file);
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    if (size % 2) {
+        fprintf(stderr, "%s: odd size, the last byte is ignored\n", file);
+    }
+    *n = (uint64_t) size / 2;
+    bytes = malloc((size_t) size + 1);
+    words = malloc(sizeof(uint16_t) * (*n + 1));
+    if (!bytes || !words) {
+        LOGERROR("Cannot allocate memory for the image");
+        free(bytes);
+        free(words);
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(bytes, 1, (size_t) size, fp) != (size_t) size) {
+        LOGERROR("Could not read the image successfully");
+        free(bytes);
+        free(words);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    for (i = 0; i < *n; ++i) {
+        words[i] = (uint16_t) (bytes[2 * i] << 8 | bytes[2 * i + 1]);
+    }
+    free(bytes);
+    return words;
+}
+
+// Assemble the disassembly again and compare it with the image.
+// 0 if they match, -1 otherwise.
+static int verify(char *asm_file, uint16_t *image, uint64_t n) {
+    struct assembler a[1];
+    uint16_t *again;
+    int64_t got;
+    uint64_t i;
+    int rc = -1;
+
+    again = malloc(sizeof(uint16_t) * (n + 1));
+    if (!again) {
+        LOGERROR("Cannot allocate memory to verify");
+        return -1;
+    }
+    if (asm_init(a, asm_file) < 0) {
+        free(again);
+        return -1;
+    }
+    if (asm_parse(a) < 0 || (got = bcode_image(a, again, n + 1)) < 0) {
+        fprintf(stderr, "verify: the disassembly does not assemble\n");
+    } else if ((uint64_t) got != n) {
+        fprintf(stderr, "verify: %llu words assembled, the image has %llu\n",
+                (unsigned long long) got, (unsigned long long) n);
+    } else {
+        for (i = 0; i < n && again[i] == image[i]; ++i);
+        if (i < n) {
+            fprintf(stderr, "verify: word %llx is %04x, the image has %04x\n",
+                    (unsigned long long) i, again[i], image[i]);
+        } else {
+            fprintf(stderr, "verify: %llu words match\n",
+                    (unsigned long long) n);
+            rc = 0;
+        }
+    }
+    asm_free(a);
+    free(again);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_opts[] = {
+            {"verify", no_argument, NULL, 'v'},
+            {NULL, 0, NULL, 0}
+    };
+    char tmp[] = "/tmp/ddisXXXXXX";
+    char *outfile = NULL, *check = NULL;
+    uint16_t *image;
+    uint64_t n;
+    FILE *out = stdout, *fp;
+    int flags = 0, do_verify = 0, opt, fd, rc = 0;
+
+    while ((opt = getopt_long(argc, argv, "ao:v", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                flags |= DIS_ADDRESSES;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'v':
+                do_verify = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    image = load_image(argv[optind], &n);
+    if (!image) {
+        return -1;
+    }
+    if (outfile) {
+        out = fopen(outfile, "w");
+        if (!out) {
+            LOGERROR("Unable to open %s for writing", outfile);
+            free(image);
+            return -1;
+        }
+    }
+    if (disasm_image(out, image, n, flags) < 0) {
+        rc = -1;
+    }
+    if (out != stdout && fclose(out) != 0) {
+        LOGERROR("Could not write %s", outfile);
+        rc = -1;
+    }
+
+    if (do_verify && rc == 0) {
+        check = outfile;
+        if (!check) {
+            // stdout cannot be read back, disassemble once more into a file
+            fd = mkstemp(tmp);
+            fp = fd < 0 ? NULL : fdopen(fd, "w");
+            if (!fp) {
+                LOGERROR("Cannot create a temporary file");
+                free(image);
+                return -1;
+            }
+            if (disasm_image(fp, image, n, flags) < 0) {
+                rc = -1;
+            }
+            fclose(fp);
+            check = tmp;
+        }
+        if (rc == 0) {
+            rc = verify(check, image, n);
+        }
+        if (check == tmp) {
+            unlink(tmp);
+        }
+    }
+    free(image);
+    return rc;
+}
@@ -0,0 +1,359 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debuginfo.h"
+#include "listing.h"
+#include "prelude.h"
+
+static inline uint32_t fnv1a32(const char *p, uint64_t n) {
+    uint32_t h = 2166136261u;
+    uint64_t i;
+    for (i = 0; i < n; ++i) {
+        h = (h ^ (unsigned char) p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static inline uint64_t align4(uint64_t n) {
+    return (n + 3) & ~(uint64_t) 3;
+}
+
+// Labels by address, then by name
+static int cmp_label(const void *x, const void *y) {
+    const struct label *p = *(struct label * const *) x;
+    const struct label *q = *(struct label * const *) y;
+    uint64_t n = p->lbl_len < q->lbl_len ? p->lbl_len : q->lbl_len;
+    int c;
+    if (p->lbl_off != q->lbl_off) {
+        return p->lbl_off < q->lbl_off ? -1 : 1;
+    }
+    c = memcmp(p->lbl_name, q->lbl_name, n);
+    return c ? c : (p->lbl_len > q->lbl_len) - (p->lbl_len < q->lbl_len);
+}
+
+static int cmp_line(const void *x, const void *y) {
+    const struct dsym_line *p = x, *q = y;
+    return (p->dn_addr > q->dn_addr) - (p->dn_addr < q->dn_addr);
+}
+
+// Write next to path and rename it over, so a debugger that maps it never
+// sees half of one
+static int write_file(const void *buf, size_t size, const char *path) {
+    char tmp[4096];
+    FILE *fp;
+    int rc = 0;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        LOGERROR("Debug info file name too long: %s", path);
+        return -1;
+    }
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", tmp);
+        return -1;
+    }
+    if (fwrite(buf, 1, size, fp) != size) {
+        rc = -1;
+    }
+    if (fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp, path) != 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        LOGERROR("Could not write the debug info %s", path);
+        remove(tmp);
+    }
+    return rc;
+}
+
+// The file a label was defined in: the prelude's come from its cache
+static uint32_t label_file(struct assembler *a, struct token *t) {
+    struct prelude *p = a->prelude;
+    return p && t >= p->pr_labels &&
+           t < p->pr_labels + p->pr_head->ph_labels ? 1 : 0;
+}
+
+int dsym_write(struct assembler *a, const char *path) {
+    struct dsym_header *h = NULL;
+    struct dsym_label *dl;
+    struct dsym_line *dn;
+    struct dsym_file *df;
+    struct list_row *rows = NULL;
+    struct label *l, **sorted = NULL;
+    struct token *t;
+    const char *files[2];
+    uint32_t *buckets;
+    uint64_t tokens = 0, labels = 0, lines = 0, names = 0, nfiles, nbuckets;
+    uint64_t size, end = 0, i, k;
+    int64_t nrows, r;
+    char *name;
+    int rc = -1;
+
+    files[0] = a->input_file;
+    files[1] = a->prelude ? a->prelude->pr_file : NULL;
+    nfiles = a->prelude ? 2 : 1;
+    for (i = 0; i < nfiles; ++i) {
+        names += strlen(files[i]);
+    }
+    for (t = a->tok_list.head; t; t = t->next) {
+        ++tokens;
+    }
+    for (l = a->label_pts.head; l; l = l->next) {
+        ++labels;
+        names += l->lbl_len;
+    }
+    for (nbuckets = 1; nbuckets < 2 * labels; nbuckets *= 2);
+    rows = malloc(sizeof(*rows) * (tokens ? tokens : 1));
+    sorted = malloc(sizeof(*sorted) * (labels ? labels : 1));
+    if (!rows || !sorted) {
+        LOGERROR("No memory for the debug info");
+        goto out;
+    }
+    nrows = listing_rows(a, rows);
+    if (nrows < 0) {
+        goto out;
+    }
+    for (r = 0; r < nrows; ++r) {
+        if (rows[r].lr_node && rows[r].lr_node->size) {
+            ++lines;
+            k = rows[r].lr_addr + rows[r].lr_node->size / 2;
+            end = k > end ? k : end;
+        }
+    }
+
+    size = sizeof(*h) + sizeof(*dl) * labels + sizeof(*buckets) * nbuckets +
+           sizeof(*dn) * lines + sizeof(*df) * nfiles + align4(names);
+    if (size > UINT32_MAX || end > UINT32_MAX) {
+        LOGERROR("The program is too large for a debug info file");
+        goto out;
+    }
+    h = calloc(1, size);
+    if (!h) {
+        LOGERROR("No memory for the debug info");
+        goto out;
+    }
+    h->dh_magic = DSYM_MAGIC;
+    h->dh_version = DSYM_VERSION;
+    h->dh_size = (uint32_t) size;
+    h->dh_labels = (uint32_t) labels;
+    h->dh_label_off = sizeof(*h);
+    h->dh_buckets = (uint32_t) nbuckets;
+    h->dh_bucket_off = h->dh_label_off + (uint32_t) (sizeof(*dl) * labels);
+    h->dh_lines = (uint32_t) lines;
+    h->dh_line_off = h->dh_bucket_off +
+                     (uint32_t) (sizeof(*buckets) * nbuckets);
+    h->dh_files = (uint32_t) nfiles;
+    h->dh_file_off = h->dh_line_off + (uint32_t) (sizeof(*dn) * lines);
+    h->dh_names = (uint32_t) names;
+    h->dh_name_off = h->dh_file_off + (uint32_t) (sizeof(*df) * nfiles);
+
+    name = (char *) h + h->dh_name_off;
+    df = (struct dsym_file *) ((char *) h + h->dh_file_off);
+    for (i = 0; i < nfiles; ++i) {
+        df[i].df_name = (uint32_t) (name - ((char *) h + h->dh_name_off));
+        df[i].df_len = (uint32_t) strlen(files[i]);
+        memcpy(name, files[i], df[i].df_len);
+        name += df[i].df_len;
+    }
+
+    // the labels by address, each one in the first free bucket from its hash
+    for (l = a->label_pts.head, i = 0; l; l = l->next) {
+        sorted[i++] = l;
+    }
+    qsort(sorted, labels, sizeof(*sorted), cmp_label);
+    dl = (struct dsym_label *) ((char *) h + h->dh_label_off);
+    buckets = (uint32_t *) ((char *) h + h->dh_bucket_off);
+    for (i = 0; i < labels; ++i) {
+        l = sorted[i];
+        t = label_to_token(l);
+        dl[i].dl_addr = (uint32_t) (l->lbl_off / 2);
+        dl[i].dl_hash = fnv1a32(l->lbl_name, l->lbl_len);
+        dl[i].dl_name = (uint32_t) (name - ((char *) h + h->dh_name_off));
+        dl[i].dl_len = (uint32_t) l->lbl_len;
+        dl[i].dl_file = label_file(a, t);
+        dl[i].dl_line = (uint32_t) t->tok_row + 1;
+        memcpy(name, l->lbl_name, l->lbl_len);
+        name += l->lbl_len;
+        for (k = dl[i].dl_hash & (nbuckets - 1); buckets[k];
+             k = (k + 1) & (nbuckets - 1));
+        buckets[k] = (uint32_t) i + 1;
+    }
+
+    // the lines that made words, by address once --layout or .org moved
+    // some of them
+    dn = (struct dsym_line *) ((char *) h + h->dh_line_off);
+    for (r = 0, k = 0; r < nrows; ++r) {
+        if (!rows[r].lr_node || !rows[r].lr_node->size) {
+            continue;
+        }
+        dn[k].dn_addr = (uint32_t) rows[r].lr_addr;
+        dn[k].dn_words = (uint32_t) (rows[r].lr_node->size / 2);
+        dn[k].dn_file = 0;
+        dn[k].dn_line = (uint32_t) rows[r].lr_row + 1;
+        ++k;
+    }
+    for (i = 1; i < lines && dn[i - 1].dn_addr < dn[i].dn_addr; ++i);
+    if (i < lines) {
+        qsort(dn, lines, sizeof(*dn), cmp_line);
+    }
+    rc = write_file(h, size, path);
+out:
+    free(h);
+    free(sorted);
+    free(rows);
+    return rc;
+}
+
+// A section of n entries of the given size at off lies within the file
+static int section_ok(const struct dsym_header *h, uint32_t off, uint64_t n,
+                      size_t entry) {
+    return off % 4 == 0 && off >= sizeof(*h) && off <= h->dh_size &&
+           n * entry <= h->dh_size - off;
+}
+
+// Whole, and every index in it stays inside the file
+static int dsym_valid(const struct dsym *s) {
+    const struct dsym_header *h = s->ds_head;
+    const struct dsym_label *dl;
+    const struct dsym_line *dn;
+    const struct dsym_file *df;
+    const uint32_t *buckets;
+    uint32_t i;
+    if (s->ds_size < sizeof(*h) || h->dh_magic != DSYM_MAGIC ||
+        h->dh_version != DSYM_VERSION || h->dh_size != s->ds_size ||
+        !h->dh_buckets || (h->dh_buckets & (h->dh_buckets - 1)) ||
+        !section_ok(h, h->dh_label_off, h->dh_labels, sizeof(*dl)) ||
+        !section_ok(h, h->dh_bucket_off, h->dh_buckets, sizeof(*buckets)) ||
+        !section_ok(h, h->dh_line_off, h->dh_lines, sizeof(*dn)) ||
+        !section_ok(h, h->dh_file_off, h->dh_files, sizeof(*df)) ||
+        h->dh_name_off > h->dh_size ||
+        h->dh_names > h->dh_size - h->dh_name_off) {
+        return 0;
+    }
+    dl = dsym_labels(s);
+    for (i = 0; i < h->dh_labels; ++i) {
+        if (dl[i].dl_name > h->dh_names ||
+            dl[i].dl_len > h->dh_names - dl[i].dl_name ||
+            dl[i].dl_file >= h->dh_files) {
+            return 0;
+        }
+    }
+    buckets = (const uint32_t *) ((const char *) h + h->dh_bucket_off);
+    for (i = 0; i < h->dh_buckets; ++i) {
+        if (buckets[i] > h->dh_labels) {
+            return 0;
+        }
+    }
+    dn = dsym_lines(s);
+    for (i = 0; i < h->dh_lines; ++i) {
+        if (dn[i].dn_file >= h->dh_files) {
+            return 0;
+        }
+    }
+    df = dsym_files(s);
+    for (i = 0; i < h->dh_files; ++i) {
+        if (df[i].df_name > h->dh_names ||
+            df[i].df_len > h->dh_names - df[i].df_name) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int dsym_open(struct dsym *s, const char *path) {
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY);
+    memset(s, 0, sizeof(*s));
+    if (fd < 0) {
+        LOGERROR("Unable to open file: %s", path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*s->ds_head)) {
+        close(fd);
+        LOGERROR("%s is not a debug info file", path);
+        return -1;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGERROR("Unable to map %s", path);
+        return -1;
+    }
+    s->ds_head = map;
+    s->ds_size = (size_t) st.st_size;
+    if (!dsym_valid(s)) {
+        LOGERROR("%s is not a debug info file of this version", path);
+        dsym_close(s);
+        return -1;
+    }
+    return 0;
+}
+
+void dsym_close(struct dsym *s) {
+    if (s->ds_head) {
+        munmap((void *) s->ds_head, s->ds_size);
+    }
+    s->ds_head = NULL;
+    s->ds_size = 0;
+}
+
+const struct dsym_label *dsym_label_at(const struct dsym *s, uint32_t addr) {
+    const struct dsym_label *dl = dsym_labels(s);
+    uint32_t lo = 0, hi = s->ds_head->dh_labels, mid;
+    // the first label past addr
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (dl[mid].dl_addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo) {
+        return NULL;
+    }
+    // the first by name of those at the same address
+    for (--lo; lo && dl[lo - 1].dl_addr == dl[lo].dl_addr; --lo);
+    return &dl[lo];
+}
+
+const struct dsym_label *dsym_find(const struct dsym *s, const char *name,
+                                   uint32_t len) {
+    const struct dsym_header *h = s->ds_head;
+    const struct dsym_label *dl = dsym_labels(s), *l;
+    const uint32_t *buckets = (const uint32_t *)
+            ((const char *) h + h->dh_bucket_off);
+    uint32_t hash = fnv1a32(name, len), mask = h->dh_buckets - 1, k, n;
+    for (k = hash & mask, n = 0; buckets[k] && n < h->dh_buckets;
+         k = (k + 1) & mask, ++n) {
+        l = &dl[buckets[k] - 1];
+        if (l->dl_hash == hash && l->dl_len == len &&
+            !memcmp(dsym_name(s, l->dl_name), name, len)) {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+const struct dsym_line *dsym_line_at(const struct dsym *s, uint32_t addr) {
+    const struct dsym_line *dn = dsym_lines(s);
+    uint32_t lo = 0, hi = s->ds_head->dh_lines, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (dn[mid].dn_addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo || addr - dn[lo - 1].dn_addr >= dn[lo - 1].dn_words) {
+        return NULL;
+    }
+    return &dn[lo - 1];
+}
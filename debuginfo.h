@@ -0,0 +1,96 @@
+#ifndef ASSEMBLER_DEBUGINFO_H
+#define ASSEMBLER_DEBUGINFO_H
+
+#include "common.h"
+
+// Labels and source lines of an assembled program for debuggers and the
+// emulator, in a file they map and query where it lies: every section is
+// found from an offset in the header, nothing points into memory, and no
+// table has to be built before the first lookup. The labels are sorted by
+// address for "which label is this address in", hashed by name for "where
+// is this label", and the lines sorted by address for "which line made
+// this word". Host byte order, like the prelude cache.
+
+#define DSYM_MAGIC   0x4d595344u    /* "DSYM" in host byte order */
+#define DSYM_VERSION 1
+
+/* Offsets are from the start of the file, each section 4 byte aligned */
+struct dsym_header {
+    uint32_t dh_magic;
+    uint32_t dh_version;
+    uint32_t dh_size;           /* Bytes of the whole file */
+    uint32_t dh_labels;
+    uint32_t dh_label_off;      /* struct dsym_label, by address and name */
+    uint32_t dh_buckets;        /* A power of two */
+    uint32_t dh_bucket_off;     /* Label index + 1, 0 when empty */
+    uint32_t dh_lines;
+    uint32_t dh_line_off;       /* struct dsym_line, by address */
+    uint32_t dh_files;
+    uint32_t dh_file_off;       /* struct dsym_file, 0 is the input */
+    uint32_t dh_names;          /* Bytes of label and file names */
+    uint32_t dh_name_off;
+    uint32_t dh_pad;
+};
+
+struct dsym_label {
+    uint32_t dl_addr;           /* In words */
+    uint32_t dl_hash;           /* FNV-1a of the name, probes from it */
+    uint32_t dl_name;           /* Into the names */
+    uint32_t dl_len;
+    uint32_t dl_file;           /* Where it is defined */
+    uint32_t dl_line;           /* From 1 */
+};
+
+/* The words of one source line, [dn_addr, dn_addr + dn_words) */
+struct dsym_line {
+    uint32_t dn_addr;
+    uint32_t dn_words;
+    uint32_t dn_file;
+    uint32_t dn_line;           /* From 1 */
+};
+
+struct dsym_file {
+    uint32_t df_name;           /* Into the names */
+    uint32_t df_len;
+};
+
+/* A mapped debug info file */
+struct dsym {
+    const struct dsym_header *ds_head;
+    size_t                    ds_size;
+};
+
+static inline const struct dsym_label *dsym_labels(const struct dsym *s) {
+    return (const struct dsym_label *)
+            ((const char *) s->ds_head + s->ds_head->dh_label_off);
+}
+
+static inline const struct dsym_line *dsym_lines(const struct dsym *s) {
+    return (const struct dsym_line *)
+            ((const char *) s->ds_head + s->ds_head->dh_line_off);
+}
+
+static inline const struct dsym_file *dsym_files(const struct dsym *s) {
+    return (const struct dsym_file *)
+            ((const char *) s->ds_head + s->ds_head->dh_file_off);
+}
+
+static inline const char *dsym_name(const struct dsym *s, uint32_t off) {
+    return (const char *) s->ds_head + s->ds_head->dh_name_off + off;
+}
+
+/* Write the labels and lines of a, after asm_parse(), to path. 0 or -1 */
+int dsym_write(struct assembler *a, const char *path);
+
+/* Map path and check that it is whole. 0 or -1 */
+int  dsym_open(struct dsym *s, const char *path);
+void dsym_close(struct dsym *s);
+/* The last label at or before addr, NULL if there is none */
+const struct dsym_label *dsym_label_at(const struct dsym *s, uint32_t addr);
+/* The label called name, NULL if there is none */
+const struct dsym_label *dsym_find(const struct dsym *s, const char *name,
+                                   uint32_t len);
+/* The line whose words cover addr, NULL if none does */
+const struct dsym_line *dsym_line_at(const struct dsym *s, uint32_t addr);
+
+#endif //ASSEMBLER_DEBUGINFO_H
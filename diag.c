@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+#include "json.h"
+
+static int keep(struct assembler *a, uint64_t row, uint64_t col,
+                const char *message) {
+    struct diagnostic *grown, *d;
+    uint64_t cap;
+    if (a->ndiags == a->diag_cap) {
+        cap = a->diag_cap ? a->diag_cap * 2 : 16;
+        grown = realloc(a->diags, sizeof(struct diagnostic) * cap);
+        if (!grown) {
+            return -1;
+        }
+        a->diags = grown;
+        a->diag_cap = cap;
+    }
+    d = &a->diags[a->ndiags];
+    d->dg_row = row;
+    d->dg_col = col;
+    d->dg_msg = strdup(message);
+    if (!d->dg_msg) {
+        return -1;
+    }
+    a->ndiags++;
+    return 0;
+}
+
+static void print(struct assembler *a, uint64_t row, uint64_t col,
+                  const char *message) {
+    fprintf(stderr, "%s:%llu:%llu %s\n", basename(a->input_file),
+            (unsigned long long) row + 1, (unsigned long long) col + 1,
+            message);
+}
+
+static void print_stop(struct assembler *a) {
+    fprintf(stderr, "%s: stopping after %llu errors\n",
+            basename(a->input_file), (unsigned long long) a->nerrors);
+}
+
+void asm_error(struct assembler *a, uint64_t row, uint64_t col,
+               const char *message) {
+    if (!a->diag_quiet) {
+        print(a, row, col, message);
+    }
+    // counted even when it cannot be kept, the run fails either way
+    if (keep(a, row, col, message) < 0) {
+        LOGERROR("No memory to keep the error");
+    }
+    if (++a->nerrors == a->max_errors && !a->diag_quiet) {
+        print_stop(a);
+    }
+}
+
+void diag_print(struct assembler *a) {
+    uint64_t i;
+    for (i = 0; i < a->ndiags; ++i) {
+        print(a, a->diags[i].dg_row, a->diags[i].dg_col, a->diags[i].dg_msg);
+    }
+    if (!diag_more(a)) {
+        print_stop(a);
+    }
+}
+
+int diag_more(struct assembler *a) {
+    return !a->max_errors || a->nerrors < a->max_errors;
+}
+
+static inline int before(const struct diagnostic *p,
+                         const struct diagnostic *q) {
+    return p->dg_row < q->dg_row ||
+           (p->dg_row == q->dg_row && p->dg_col < q->dg_col);
+}
+
+// Both found theirs in source order, so are the two together
+int diag_merge(struct assembler *a, struct assembler *from) {
+    struct diagnostic *all, *p, *q, *end_p, *end_q, *d;
+    uint64_t n = a->ndiags + from->ndiags;
+    if (!from->nerrors) {
+        return 0;
+    }
+    all = malloc(sizeof(struct diagnostic) * (n ? n : 1));
+    if (!all) {
+        LOGERROR("No memory to keep the errors");
+        a->nerrors += from->nerrors;
+        diag_free(from);
+        return -1;
+    }
+    p = a->diags;
+    end_p = p + a->ndiags;
+    q = from->diags;
+    end_q = q + from->ndiags;
+    for (d = all; p < end_p || q < end_q; ++d) {
+        *d = q == end_q || (p < end_p && !before(q, p)) ? *p++ : *q++;
+    }
+    free(a->diags);
+    a->diags = all;
+    a->ndiags = a->diag_cap = n;
+    a->nerrors += from->nerrors;
+    // each stopped at the limit on its own, together they stop there too
+    if (a->max_errors && a->nerrors > a->max_errors) {
+        for (; a->ndiags > a->max_errors; --a->ndiags) {
+            free(a->diags[a->ndiags - 1].dg_msg);
+        }
+        a->nerrors = a->max_errors;
+    }
+    // the messages moved over
+    free(from->diags);
+    from->diags = NULL;
+    from->ndiags = from->diag_cap = from->nerrors = 0;
+    return 0;
+}
+
+void diag_reset(struct assembler *a) {
+    uint64_t i;
+    for (i = 0; i < a->ndiags && a->diags; ++i) {
+        free(a->diags[i].dg_msg);
+    }
+    a->ndiags = a->nerrors = 0;
+}
+
+void diag_free(struct assembler *a) {
+    diag_reset(a);
+    free(a->diags);
+    a->diags = NULL;
+    a->diag_cap = 0;
+}
+
+int diag_write(struct assembler *a, const char *file) {
+    struct json_out o;
+    struct diagnostic *d;
+    FILE *fp;
+    uint64_t i;
+    int rc = 0;
+
+    memset(&o, 0, sizeof(o));
+    json_raw(&o, "{\"file\":", 8);
+    json_quote(&o, a->input_file, strlen(a->input_file));
+    json_printf(&o, ",\"errors\":%llu,\"stopped\":%s,\"diagnostics\":[",
+                (unsigned long long) a->nerrors,
+                diag_more(a) ? "false" : "true");
+    for (i = 0; i < a->ndiags; ++i) {
+        d = &a->diags[i];
+        json_printf(&o, "%s\n{\"line\":%llu,\"column\":%llu,"
+                        "\"severity\":\"error\",\"message\":",
+                    i ? "," : "", (unsigned long long) d->dg_row + 1,
+                    (unsigned long long) d->dg_col + 1);
+        json_quote(&o, d->dg_msg, strlen(d->dg_msg));
+        json_raw(&o, "}", 1);
+    }
+    json_raw(&o, "]}\n", 3);
+    if (o.jo_err) {
+        LOGERROR("No memory for the diagnostics");
+        free(o.jo_buf);
+        return -1;
+    }
+
+    fp = strcmp(file, "-") ? fopen(file, "wb") : stdout;
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", file);
+        free(o.jo_buf);
+        return -1;
+    }
+    if (fwrite(o.jo_buf, 1, o.jo_len, fp) != o.jo_len) {
+        rc = -1;
+    }
+    if (fp == stdout ? fflush(fp) != 0 : fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        LOGERROR("Could not write the diagnostics to %s", file);
+    }
+    free(o.jo_buf);
+    return rc;
+}
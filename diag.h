@@ -0,0 +1,37 @@
+#ifndef ASSEMBLER_DIAG_H
+#define ASSEMBLER_DIAG_H
+
+#include "common.h"
+
+// Errors in the source are kept as they are reported, so a run can carry
+// on past them. The tokenizer starts again at the next line, pass 1 takes
+// a missing label for a far one, and every label is still looked up, by
+// pass 2 or at the end of a stream. A run that had any fails at its end,
+// or as soon as there are a->max_errors.
+
+/* Errors to stop at unless --max-errors says otherwise */
+#define ASM_MAX_ERRORS 20
+
+/* An error at a 0 based row and column of the input */
+struct diagnostic {
+    uint64_t dg_row;
+    uint64_t dg_col;
+    char    *dg_msg;
+};
+
+/* 1 while the run may carry on after an error, 0 at the limit */
+int  diag_more(struct assembler *a);
+/* Take the errors of from, a copy of a that went its own way, over, in
+ * source order along with those of a, and keep the first a->max_errors
+ * of them. 0 or -1. */
+int  diag_merge(struct assembler *a, struct assembler *from);
+/* Print the errors kept so far to stderr as asm_error() does, for a run
+ * that kept them quiet to print them in source order */
+void diag_print(struct assembler *a);
+/* Forget the errors of the last run */
+void diag_reset(struct assembler *a);
+void diag_free(struct assembler *a);
+/* Write the errors as a JSON object to file ("-" for stdout). 0 or -1. */
+int  diag_write(struct assembler *a, const char *file);
+
+#endif //ASSEMBLER_DIAG_H
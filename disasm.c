@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "disasm.h"
+#include "tokenize.h"
+
+// Disassembler. The mnemonic tables of the tokenizer are turned around
+// into arrays indexed directly by opcode and operand value, so decoding a
+// word is a handful of loads. Text is built in a large buffer by hand.
+//
+// The output is meant to assemble back into the very same words, so
+// whatever dasm would encode differently (a short literal in a long
+// operand word, reserved opcodes) is written as DAT with the instruction
+// in a comment.
+
+#define DIS_BUF_SIZE (1 << 20)
+#define DIS_LINE_MAX 128    /* Longest line we can produce, with margin */
+
+struct dis_operand {
+    const char *name;
+    enum operand_type type;
+};
+
+struct dis_out {
+    FILE *fp;
+    char *buf;
+    size_t len;
+    int error;
+};
+
+static const char *basic_names[32];
+static const char *special_names[32];
+static struct dis_operand opd_b[32];
+static struct dis_operand opd_a[64];
+static int tables_ready;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void fill_operand(struct dis_operand *slot, struct operand_tokens *ot,
+                         int replace) {
+    if (!slot->type || replace) {
+        slot->name = ot->caps;
+        slot->type = ot->type;
+    }
+}
+
+static void build_tables(void) {
+    int i, v;
+    for (i = 0; i < basic_opcodes_count; ++i) {
+        basic_names[basic_opcodes[i].opct_value] = basic_opcodes[i].opct_caps;
+    }
+    for (i = 0; i < special_opcodes_count; ++i) {
+        special_names[special_opcodes[i].opct_value] =
+                special_opcodes[i].opct_caps;
+    }
+    for (i = 0; i < operands_count; ++i) {
+        v = operands[i].value;
+        // the first spelling wins, except that the stack register reads
+        // as POP in operand a and PUSH in operand b
+        fill_operand(&opd_b[v], &operands[i], 0);
+        fill_operand(&opd_a[v], &operands[i],
+                     operands[i].type == ot_reg && opd_a[v].type == ot_reg);
+    }
+    for (v = 0x20; v < 0x40; ++v) {
+        opd_a[v].type = ot_literal;
+    }
+    tables_ready = 1;
+}
+
+static void dis_flush(struct dis_out *o) {
+    if (o->len && fwrite(o->buf, 1, o->len, o->fp) != o->len) {
+        o->error = 1;
+    }
+    o->len = 0;
+}
+
+static inline void put_str(char **p, const char *s) {
+    while (*s) {
+        *(*p)++ = *s++;
+    }
+}
+
+static inline void put_hex(char **p, uint16_t w) {
+    char *q = *p;
+    q[0] = '0';
+    q[1] = 'x';
+    q[2] = hex_digits[w >> 12];
+    q[3] = hex_digits[w >> 8 & 0xf];
+    q[4] = hex_digits[w >> 4 & 0xf];
+    q[5] = hex_digits[w & 0xf];
+    *p = q + 6;
+}
+
+static inline void put_addr(char **p, uint64_t addr) {
+    char *q = *p;
+    int shift = addr > 0xffff ? 28 : 12;
+    for (; shift >= 0; shift -= 4) {
+        *q++ = hex_digits[addr >> shift & 0xf];
+    }
+    *p = q;
+}
+
+static inline int operand_has_word(uint16_t code) {
+    return (code >= 0x10 && code <= 0x17) || code == 0x1a ||
+           code == 0x1e || code == 0x1f;
+}
+
+// Write an operand, 0 if dasm would not encode it the same way
+static int put_operand(char **p, struct dis_operand *d, uint16_t code,
+                       uint16_t word, int is_a) {
+    switch (d->type) {
+        case ot_reg:
+            put_str(p, d->name);
+            return 1;
+        case ot_ind_reg:
+            *(*p)++ = '[';
+            put_str(p, d->name);
+            *(*p)++ = ']';
+            return 1;
+        case ot_ind_reg_literal:
+            *(*p)++ = '[';
+            put_str(p, d->name);
+            put_str(p, " + ");
+            put_hex(p, word);
+            *(*p)++ = ']';
+            return 1;
+        case ot_ind_literal:
+            *(*p)++ = '[';
+            put_hex(p, word);
+            *(*p)++ = ']';
+            return 1;
+        case ot_literal:
+            if (code >= 0x20) {
+                // dasm puts -1 inline too, 0xffff it does not
+                if (code == 0x20) {
+                    put_str(p, "-1");
+                    return 1;
+                }
+                put_hex(p, (uint16_t) (code - 0x21));
+                return 1;
+            }
+            put_hex(p, word);
+            // dasm puts small literals in operand a inline
+            return !is_a || word > 30;
+        default:
+            return 0;
+    }
+}
+
+// Disassemble the instruction at words[0], 'avail' words are left.
+// Returns the number of words it takes.
+static uint64_t dis_one(struct dis_out *o, const uint16_t *words,
+                        uint64_t avail, uint64_t addr, int flags) {
+    char text[DIS_LINE_MAX], *p = text, *q;
+    uint16_t w = words[0], op = (uint16_t) (w & 0x1f);
+    uint16_t b = (uint16_t) (w >> 5 & 0x1f), a = (uint16_t) (w >> 10);
+    uint16_t aw = 0, bw = 0;
+    uint64_t n = 1, i;
+    int ok;
+
+    // operand a is fetched first, its word comes before the one of b
+    if (operand_has_word(a)) {
+        aw = n < avail ? words[n] : 0;
+        ++n;
+    }
+    if (op && operand_has_word(b)) {
+        bw = n < avail ? words[n] : 0;
+        ++n;
+    }
+    if (n > avail) {
+        // cut short by the end of the image
+        n = 1;
+        ok = 0;
+        put_str(&p, "truncated");
+    } else if (op) {
+        ok = basic_names[op] != NULL;
+        put_str(&p, ok ? basic_names[op] : "reserved");
+        *p++ = ' ';
+        ok &= put_operand(&p, &opd_b[b], b, bw, 0);
+        put_str(&p, ", ");
+        ok &= put_operand(&p, &opd_a[a], a, aw, 1);
+    } else {
+        ok = special_names[b] != NULL;
+        put_str(&p, ok ? special_names[b] : "reserved");
+        *p++ = ' ';
+        ok &= put_operand(&p, &opd_a[a], a, aw, 1);
+    }
+
+    if (o->len + 2 * DIS_LINE_MAX > DIS_BUF_SIZE) {
+        dis_flush(o);
+    }
+    q = o->buf + o->len;
+    if (ok) {
+        memcpy(q, text, (size_t) (p - text));
+        q += p - text;
+        if (flags & DIS_ADDRESSES) {
+            put_str(&q, " ; ");
+            put_addr(&q, addr);
+        }
+    } else {
+        put_str(&q, "DAT ");
+        for (i = 0; i < n; ++i) {
+            if (i) {
+                put_str(&q, ", ");
+            }
+            put_hex(&q, words[i]);
+        }
+        put_str(&q, " ; ");
+        if (flags & DIS_ADDRESSES) {
+            put_addr(&q, addr);
+            *q++ = ' ';
+        }
+        memcpy(q, text, (size_t) (p - text));
+        q += p - text;
+    }
+    *q++ = '\n';
+    o->len = (size_t) (q - o->buf);
+    return n;
+}
+
+// Write assembly for n words of an image to 'out'. 0 on success, -1 on
+// a write error.
+int disasm_image(FILE *out, const uint16_t *words, uint64_t n, int flags) {
+    struct dis_out o;
+    uint64_t pc = 0;
+
+    if (!tables_ready) {
+        build_tables();
+    }
+    o.fp = out;
+    o.len = 0;
+    o.error = 0;
+    o.buf = malloc(DIS_BUF_SIZE);
+    if (!o.buf) {
+        LOGERROR("Cannot allocate the output buffer");
+        return -1;
+    }
+    while (pc < n) {
+        pc += dis_one(&o, words + pc, n - pc, pc, flags);
+    }
+    dis_flush(&o);
+    free(o.buf);
+    if (o.error || fflush(out) != 0) {
+        LOGERROR("Could not write the disassembly");
+        return -1;
+    }
+    return 0;
+}
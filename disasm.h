@@ -0,0 +1,11 @@
+#ifndef ASSEMBLER_DISASM_H
+#define ASSEMBLER_DISASM_H
+
+#include "common.h"
+
+/* disasm_image() flags */
+#define DIS_ADDRESSES 0x1   /* Note the address of each line in a comment */
+
+int disasm_image(FILE *out, const uint16_t *words, uint64_t n, int flags);
+
+#endif //ASSEMBLER_DISASM_H
@@ -0,0 +1,70 @@
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lsp.h"
+
+// Language server for DCPU-16 assembly on stdin and stdout, framed by
+// Content-Length headers as the protocol wants.
+
+// The length of the next message, 0 at the end of the input, -1 if the
+// headers are broken
+static long read_headers(FILE *in) {
+    char line[256];
+    long length = -1;
+    size_t n;
+    while (fgets(line, sizeof(line), in)) {
+        n = strlen(line);
+        while (n && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if (!n) {
+            return length;
+        }
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            length = strtol(line + 15, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct lsp_server s;
+    char *msg = NULL, *grown;
+    size_t cap = 0;
+    long len;
+
+    if (argc > 1 && strcmp(argv[1], "--stdio")) {
+        fprintf(stderr, "Usage: %s [--stdio]\n"
+                        "  Language server for DCPU-16 assembly on stdin "
+                        "and stdout\n", basename(argv[0]));
+        return -1;
+    }
+    lsp_init(&s);
+    while (!s.ls_exit && (len = read_headers(stdin)) > 0) {
+        if ((size_t) len > cap) {
+            grown = realloc(msg, (size_t) len);
+            if (!grown) {
+                LOGERROR("No memory for a message of %ld bytes", len);
+                break;
+            }
+            msg = grown;
+            cap = (size_t) len;
+        }
+        if (fread(msg, 1, (size_t) len, stdin) != (size_t) len) {
+            break;
+        }
+        lsp_handle(&s, msg, (size_t) len);
+        if (s.ls_out.jo_len) {
+            printf("Content-Length: %zu\r\n\r\n", s.ls_out.jo_len);
+            fwrite(s.ls_out.jo_buf, 1, s.ls_out.jo_len, stdout);
+            fflush(stdout);
+        }
+    }
+    len = s.ls_exit ? s.ls_exit - 1 : 1;
+    free(msg);
+    lsp_free(&s);
+    return (int) len;
+}
@@ -0,0 +1,463 @@
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "batch.h"
+#include "binary_code.h"
+#include "debuginfo.h"
+#include "hardware.h"
+#include "image.h"
+#include "snapshot.h"
+
+#define DEFAULT_MAX_CYCLES 10000000ULL
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-b] [-c cycles] [-f disk [-p]] "
+                    "[-s screen [-r cycles]] [-S] [-w snapshot]\n"
+                    "       %*s [-g symbols]\n"
+                    "       %*s <infile | -l snapshot [-V]>\n"
+                    "       %s [-b] [-c cycles] -N lanes [-i inputs@addr] "
+                    "[-V] <infile>\n"
+                    "  -b         infile is a raw image, not assembly\n"
+                    "  -c cycles  stop after this many cycles (default %llu)\n"
+                    "  -f disk    insert a floppy image into the M35FD\n"
+                    "  -p         write protect the floppy\n"
+                    "  -s screen  save the LEM1802 screen (.ppm or .png)\n"
+                    "  -r cycles  save a frame every so many cycles, the\n"
+                    "             screen name is a printf pattern (%%d)\n"
+                    "  -S         print a hash of the final screen\n"
+                    "  -g symbols print the label and source line PC ended\n"
+                    "             at, from dasm --debug-info\n"
+                    "  -l snapshot\n"
+                    "             resume from a snapshot instead of infile\n"
+                    "  -w snapshot\n"
+                    "             save a snapshot of the machine at the end\n"
+                    "  -N lanes   run that many instances in lockstep, without\n"
+                    "             devices\n"
+                    "  -i inputs@addr\n"
+                    "             split the raw image inputs evenly over the\n"
+                    "             lanes, each lane gets its part at addr\n"
+                    "  -V         check every lane against a run of its own\n"
+                    "             through the plain interpreter; with -l,\n"
+                    "             restore the snapshot again and check a\n"
+                    "             second run ends the same\n",
+            basename(prog), (int) strlen(basename(prog)), "",
+            (int) strlen(basename(prog)), "", basename(prog),
+            DEFAULT_MAX_CYCLES);
+}
+
+// Assemble the source and place it at address 0
+static int load_source(struct dcpu *d, char *file) {
+    struct assembler a[1];
+    int rc = -1;
+    if (asm_init(a, file) < 0) {
+        return -1;
+    }
+    if (asm_parse(a) == 0 && bcode_image(a, d->ram, DCPU_RAM_WORDS) >= 0) {
+        rc = 0;
+    }
+    asm_free(a);
+    return rc;
+}
+
+// Read a raw image (big endian words) into a new buffer
+static uint16_t *load_words(char *file, uint64_t *n) {
+    uint8_t buf[2];
+    uint16_t *words = NULL, *grown;
+    uint64_t cap = 0;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open inputs: %s", file);
+        return NULL;
+    }
+    *n = 0;
+    while (fread(buf, 1, 2, fp) == 2) {
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            grown = realloc(words, cap * sizeof(uint16_t));
+            if (!grown) {
+                LOGERROR("Cannot allocate memory for the inputs");
+                free(words);
+                fclose(fp);
+                return NULL;
+            }
+            words = grown;
+        }
+        words[(*n)++] = (uint16_t) (buf[0] << 8 | buf[1]);
+    }
+    if (ferror(fp) || !*n) {
+        LOGERROR("Could not read any inputs from %s", file);
+        free(words);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    return words;
+}
+
+// Run every lane of a finished batch again on its own, one instruction at
+// a time with dcpu_run(), and check it ends with the same registers,
+// cycles, status and RAM
+static int verify_batch(struct batch *bt, struct dcpu *proto, uint16_t addr,
+                        uint16_t *words, uint64_t each) {
+    struct dcpu *d = malloc(sizeof(struct dcpu));
+    uint64_t k;
+    uint32_t i;
+    int r, rc, bad = 0;
+    uint8_t status;
+    if (!d) {
+        LOGERROR("Cannot allocate memory for the DCPU");
+        return -1;
+    }
+    for (i = 0; i < bt->lanes; ++i) {
+        if (dcpu_init(d) < 0) {
+            free(d);
+            return -1;
+        }
+        memcpy(d->ram, proto->ram, sizeof(d->ram));
+        memcpy(d->reg, proto->reg, sizeof(d->reg));
+        for (k = 0; words && k < each; ++k) {
+            dcpu_write(d, (uint16_t) (addr + k), words[i * each + k]);
+        }
+        rc = dcpu_run(d, bt->limit);
+        status = rc < 0 ? bls_fire
+                        : rc == drs_halted ? bls_halted : bls_budget;
+        for (r = 0; r < BATCH_REGS; ++r) {
+            if (batch_row(bt, r)[i] != d->reg[r]) {
+                break;
+            }
+        }
+        if (r < BATCH_REGS || bt->cycles[i] != d->cycles ||
+            bt->status[i] != status ||
+            memcmp(bt->cpu[i]->ram, d->ram, sizeof(d->ram))) {
+            fprintf(stderr, "Lane %u differs from a run on its own:\n", i);
+            dcpu_debug(d);
+            bad = 1;
+        }
+        dcpu_free(d);
+    }
+    free(d);
+    return bad ? -1 : 0;
+}
+
+// Run the loaded image on many lanes at once, each with its slice of the
+// inputs, and report the aggregate throughput
+static int run_batch(struct dcpu *proto, uint32_t lanes, uint64_t cycles,
+                     char *inputs, int verify) {
+    struct batch bt[1];
+    struct timespec t0, t1;
+    uint16_t *words = NULL, addr = 0;
+    uint64_t n = 0, each;
+    uint32_t i;
+    char *at;
+    double secs;
+    int fires, rc;
+
+    if (inputs) {
+        at = strrchr(inputs, '@');
+        if (at) {
+            *at = '\0';
+            addr = (uint16_t) strtoul(at + 1, NULL, 0);
+        }
+        words = load_words(inputs, &n);
+        if (!words) {
+            return -1;
+        }
+        if (n < lanes) {
+            LOGERROR("%llu input words cannot be split over %u lanes",
+                     (unsigned long long) n, lanes);
+            free(words);
+            return -1;
+        }
+    }
+    if (batch_init(bt, lanes, proto) < 0) {
+        free(words);
+        return -1;
+    }
+    each = n / lanes;
+    for (i = 0; words && i < lanes; ++i) {
+        if (batch_input(bt, i, addr, words + i * each, each) < 0) {
+            batch_free(bt);
+            free(words);
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fires = batch_run(bt, cycles);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (double) (t1.tv_sec - t0.tv_sec) +
+           (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    batch_debug(bt);
+    printf("lanes=%u instructions=%llu seconds=%.6f instructions/s=%.0f\n",
+           lanes, (unsigned long long) bt->instructions, secs,
+           secs > 0 ? (double) bt->instructions / secs : 0.0);
+    printf("vector_steps=%llu scalar_steps=%llu simd=%s\n",
+           (unsigned long long) bt->vector_steps,
+           (unsigned long long) bt->scalar_steps,
+           bt->avx2 ? "avx2" : "generic");
+    if (fires) {
+        fprintf(stderr, "%d lane(s) caught fire: interrupt queue overflow\n",
+                fires);
+    }
+    rc = verify ? verify_batch(bt, proto, addr, words, each) : 0;
+    free(words);
+    batch_free(bt);
+    return fires || rc < 0 ? -1 : 0;
+}
+
+// Pick up where a saved run left off, the devices must match. The
+// snapshot stays mapped in sn for a rerun.
+static int load_snapshot(struct dcpu *d, char *file,
+                         struct dcpu_snapshot *sn) {
+    if (snapshot_map(sn, file) < 0) {
+        return -1;
+    }
+    if (snapshot_restore(d, sn) < 0) {
+        snapshot_free(sn);
+        return -1;
+    }
+    return 0;
+}
+
+// Restore the snapshot the run started from, which copies back only the
+// pages it wrote, run as long again and check RAM and registers end up
+// the same as after the first run. rc is what the first run returned.
+static int rerun_snapshot(struct dcpu *d, struct dcpu_snapshot *sn,
+                          uint64_t cycles, int rc) {
+    uint16_t *ram, reg[DR_MAX];
+    uint64_t end = d->cycles;
+    int copied, same;
+
+    ram = malloc(sizeof(d->ram));
+    if (!ram) {
+        LOGERROR("Cannot allocate memory for the RAM of the first run");
+        return -1;
+    }
+    memcpy(ram, d->ram, sizeof(d->ram));
+    memcpy(reg, d->reg, sizeof(d->reg));
+    copied = snapshot_restore(d, sn);
+    if (copied < 0) {
+        free(ram);
+        return -1;
+    }
+    fprintf(stderr, "rerun: %d of %d pages restored\n", copied, DCPU_PAGES);
+    same = dcpu_run(d, cycles) == rc && d->cycles == end &&
+           memcmp(reg, d->reg, sizeof(reg)) == 0 &&
+           memcmp(ram, d->ram, sizeof(d->ram)) == 0;
+    free(ram);
+    if (!same) {
+        LOGERROR("The rerun from the snapshot ended elsewhere");
+        return -1;
+    }
+    return 0;
+}
+
+static int save_snapshot(struct dcpu *d, char *file) {
+    struct dcpu_snapshot sn[1];
+    int rc;
+    if (snapshot_take(d, sn) < 0) {
+        return -1;
+    }
+    rc = snapshot_save(sn, file);
+    snapshot_free(sn);
+    return rc;
+}
+
+// Connect the documented devices, in the order HWN enumerates them
+static int attach_devices(struct dcpu *d, char *disk, int write_protect,
+                          struct hw_device **lem) {
+    if (dcpu_attach(d, clock_new()) < 0 ||
+        dcpu_attach(d, *lem = lem1802_new()) < 0 ||
+        dcpu_attach(d, m35fd_new(disk, write_protect)) < 0 ||
+        dcpu_attach(d, spc2000_new()) < 0 ||
+        dcpu_attach(d, sped3_new()) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Run, saving a frame whenever the screen changed at the end of a period
+static int run_frames(struct dcpu *d, struct hw_device *lem, uint64_t cycles,
+                      uint64_t period, char *pattern) {
+    char file[4096];
+    uint64_t last = 0, hash, frame = 0;
+    int rc = drs_budget;
+    while (cycles && rc == drs_budget) {
+        rc = dcpu_run(d, period < cycles ? period : cycles);
+        cycles -= period < cycles ? period : cycles;
+        if (rc < 0 || !lem1802_render(d, lem)) {
+            continue;
+        }
+        hash = image_hash(lem1802_frame(lem), LEM1802_FRAME_W, LEM1802_FRAME_H);
+        if (hash == last) {
+            continue;
+        }
+        last = hash;
+        snprintf(file, sizeof(file), pattern, (int) frame++);
+        if (image_write(file, lem1802_frame(lem),
+                        LEM1802_FRAME_W, LEM1802_FRAME_H) < 0) {
+            return -1;
+        }
+    }
+    return rc;
+}
+
+// The label and source line of addr, from the debug info of the program
+static void print_where(const char *symbols, uint16_t addr) {
+    const struct dsym_label *l;
+    const struct dsym_line *n;
+    const struct dsym_file *f;
+    struct dsym s;
+    if (dsym_open(&s, symbols) < 0) {
+        return;
+    }
+    l = dsym_label_at(&s, addr);
+    n = dsym_line_at(&s, addr);
+    if (l) {
+        printf("at=%.*s+%u", (int) l->dl_len, dsym_name(&s, l->dl_name),
+               addr - l->dl_addr);
+    } else {
+        printf("at=%04x", addr);
+    }
+    if (n) {
+        f = &dsym_files(&s)[n->dn_file];
+        printf(" line=%.*s:%u", (int) f->df_len, dsym_name(&s, f->df_name),
+               n->dn_line);
+    }
+    printf("\n");
+    dsym_close(&s);
+}
+
+int main(int argc, char *argv[]) {
+    struct dcpu *d;
+    struct hw_device *lem = NULL;
+    struct dcpu_snapshot sn[1];
+    uint64_t max_cycles = DEFAULT_MAX_CYCLES, period = 0;
+    char *disk = NULL, *screen = NULL, *inputs = NULL;
+    char *resume = NULL, *suspend = NULL, *symbols = NULL, *infile;
+    uint32_t lanes = 0;
+    int binary = 0, write_protect = 0, hash = 0, verify = 0, opt, rc;
+
+    while ((opt = getopt(argc, argv, "bc:f:g:i:l:N:pr:s:SVw:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = 1;
+                break;
+            case 'c':
+                max_cycles = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                disk = optarg;
+                break;
+            case 'g':
+                symbols = optarg;
+                break;
+            case 'i':
+                inputs = optarg;
+                break;
+            case 'l':
+                resume = optarg;
+                break;
+            case 'N':
+                lanes = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                write_protect = 1;
+                break;
+            case 'r':
+                period = strtoull(optarg, NULL, 0);
+                break;
+            case 's':
+                screen = optarg;
+                break;
+            case 'S':
+                hash = 1;
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'w':
+                suspend = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind != argc - (resume ? 0 : 1) || (period && !screen) ||
+        (inputs && !lanes) || (verify && !lanes && (!resume || period)) ||
+        (lanes && (disk || screen || hash || suspend || symbols))) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    memset(sn, 0, sizeof(sn));
+    // 128 KiB of RAM, keep it off the stack
+    d = malloc(sizeof(struct dcpu));
+    if (!d) {
+        LOGERROR("Cannot allocate memory for the DCPU");
+        return -1;
+    }
+    if (dcpu_init(d) < 0) {
+        free(d);
+        return -1;
+    }
+    infile = argv[optind];
+    if ((!lanes && attach_devices(d, disk, write_protect, &lem) < 0) ||
+        (resume ? load_snapshot(d, resume, sn)
+                : binary ? dcpu_load_image(d, infile)
+                         : load_source(d, infile)) < 0) {
+        dcpu_free(d);
+        free(d);
+        return -1;
+    }
+
+    if (lanes) {
+        rc = run_batch(d, lanes, max_cycles, inputs, verify);
+        snapshot_free(sn);
+        dcpu_free(d);
+        free(d);
+        return rc;
+    }
+    if (period) {
+        rc = run_frames(d, lem, max_cycles, period, screen);
+    } else {
+        rc = dcpu_run(d, max_cycles);
+    }
+    if (rc >= 0 && verify && rerun_snapshot(d, sn, max_cycles, rc) < 0) {
+        rc = -1;
+    }
+    snapshot_free(sn);
+    if (rc < 0 && d->on_fire) {
+        fprintf(stderr, "DCPU-16 caught fire: interrupt queue overflow\n");
+    }
+    dcpu_debug(d);
+    if (symbols) {
+        print_where(symbols, d->reg[DR_PC]);
+    }
+    if (suspend && save_snapshot(d, suspend) < 0) {
+        rc = -1;
+    }
+    if (rc >= 0 && (hash || (screen && !period))) {
+        lem1802_render(d, lem);
+        if (hash) {
+            printf("screen=%016llx\n", (unsigned long long)
+                   image_hash(lem1802_frame(lem), LEM1802_FRAME_W, LEM1802_FRAME_H));
+        }
+        if (screen && !period &&
+            image_write(screen, lem1802_frame(lem),
+                        LEM1802_FRAME_W, LEM1802_FRAME_H) < 0) {
+            rc = -1;
+        }
+    }
+
+    dcpu_free(d);
+    free(d);
+    return rc < 0 ? -1 : 0;
+}
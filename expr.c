@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_code.h"
+#include "diag.h"
+#include "expr.h"
+#include "stats.h"
+
+int expr_apply(enum expr_op op, int64_t x, int64_t y, int64_t *r,
+               const char **err) {
+    switch (op) {
+        case eo_neg: *r = -x;    break;
+        case eo_not: *r = ~x;    break;
+        case eo_mul: *r = x * y; break;
+        case eo_add: *r = x + y; break;
+        case eo_sub: *r = x - y; break;
+        case eo_and: *r = x & y; break;
+        case eo_xor: *r = x ^ y; break;
+        case eo_or:  *r = x | y; break;
+        case eo_div:
+        case eo_mod:
+            if (!y) {
+                *err = "Division by zero in an expression";
+                return -1;
+            }
+            // truncated, as in C
+            *r = op == eo_div ? x / y : x % y;
+            break;
+        case eo_shl:
+        case eo_shr:
+            if (y < 0 || y > 31) {
+                *err = "Shift count out of range in an expression";
+                return -1;
+            }
+            // arithmetic, without leaning on how C shifts a negative
+            *r = op == eo_shl ? x * ((int64_t) 1 << y) :
+                 x >= 0 ? x >> y : ~(~x >> y);
+            break;
+        default:
+            *err = "Invalid operator in an expression";
+            return -1;
+    }
+    if (*r < INT32_MIN || *r > INT32_MAX) {
+        *err = "Expression does not fit in 32 bits";
+        return -1;
+    }
+    return 0;
+}
+
+int expr_spans(struct token *t) {
+    struct token *op;
+    for (op = t->right; op; op = op->right) {
+        if (op->type == tt_operand && op->ttu_opd.opd_expr &&
+            op->ttu_opd.opd_expr->ex_labels > 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The value of e, its labels from label(). 0, or -1 when one of them has
+// none or the value does not fit, which is reported where it went wrong
+// unless a is NULL.
+static int compute(struct assembler *a, const struct expr *e,
+                   int (*label)(void *arg, const struct expr_item *it,
+                                int64_t *value),
+                   void *arg, int64_t *value) {
+    const struct expr_item *it, *end = e->ex_item + e->ex_count;
+    int64_t stack[EXPR_MAX_ITEMS];
+    uint32_t n = 0;
+    const char *err = NULL;
+
+    for (it = e->ex_item; it < end; ++it) {
+        switch (it->ei_op) {
+            case eo_num:
+                stack[n++] = it->ei_num;
+                break;
+            case eo_label:
+                if (label(arg, it, &stack[n++]) < 0) {
+                    return -1;
+                }
+                break;
+            default:
+                if (expr_unary(it->ei_op)) {
+                    if (expr_apply(it->ei_op, stack[n - 1], 0,
+                                   &stack[n - 1], &err) < 0) {
+                        goto fail;
+                    }
+                } else if (expr_apply(it->ei_op, stack[n - 2], stack[n - 1],
+                                      &stack[n - 2], &err) < 0) {
+                    goto fail;
+                } else {
+                    --n;
+                }
+                break;
+        }
+    }
+    if (stack[0] < -0x8000 || stack[0] > 0xffff) {
+        if (a) {
+            asm_error(a, e->ex_row, e->ex_col,
+                      "Expression does not fit in 16 bits");
+        }
+        return -1;
+    }
+    *value = stack[0];
+    return 0;
+fail:
+    if (a) {
+        asm_error(a, it->ei_row, it->ei_col, err);
+    }
+    return -1;
+}
+
+int expr_value(const struct expr *e,
+               int (*label)(void *arg, const struct expr_item *it,
+                            int64_t *value),
+               void *arg, int64_t *value) {
+    return compute(NULL, e, label, arg, value);
+}
+
+// Where the label is now, if it is placed
+static int label_placed(void *arg, const struct expr_item *it,
+                        int64_t *value) {
+    struct label *l = get_label_pointer(arg, it->ei_name, it->ei_len);
+    if (!l || l->lbl_state != ls_pt_resolved) {
+        return -1;
+    }
+    *value = (int64_t) (l->lbl_off / 2);
+    return 0;
+}
+
+int expr_placed(struct assembler *a, const struct expr *e, int64_t *value) {
+    return compute(NULL, e, label_placed, a, value);
+}
+
+// Like label_placed(), but a label that is not there at all is reported
+static int label_reported(void *arg, const struct expr_item *it,
+                          int64_t *value) {
+    struct assembler *a = arg;
+    struct label *l = get_label_pointer(a, it->ei_name, it->ei_len);
+    char err_str[256];
+    if (!l) {
+        snprintf(err_str, 256, "Label '%.*s' is not associated "
+                               "with any label pointer",
+                 (int) (it->ei_len < 64 ? it->ei_len : 64), it->ei_name);
+        asm_error(a, it->ei_row, it->ei_col, err_str);
+        return -1;
+    }
+    // a stream reports the labels it never saw defined
+    if (l->lbl_state != ls_pt_resolved) {
+        return -1;
+    }
+    *value = (int64_t) (l->lbl_off / 2);
+    return 0;
+}
+
+int expr_defer(struct assembler *a, uint16_t *word, uint64_t index,
+               struct expr *e) {
+    struct expr_fixup *grown, *f;
+    uint64_t cap;
+    if (a->nfixups == a->fixup_cap) {
+        cap = a->fixup_cap ? a->fixup_cap * 2 : 64;
+        grown = realloc(a->fixups, sizeof(struct expr_fixup) * cap);
+        if (!grown) {
+            LOGERROR("No more memory for the expressions");
+            return -1;
+        }
+        ASM_STAT(a, ac_bytes,
+                 sizeof(struct expr_fixup) * (cap - a->fixup_cap));
+        a->fixups = grown;
+        a->fixup_cap = cap;
+    }
+    f = &a->fixups[a->nfixups++];
+    f->ef_word = word;
+    f->ef_index = index;
+    f->ef_expr = e;
+    return 0;
+}
+
+int expr_fixups(struct assembler *a) {
+    struct expr_fixup *f, *end = a->fixups + a->nfixups;
+    int64_t value;
+    for (f = a->fixups; f < end; ++f) {
+        if (compute(a, f->ef_expr, label_reported, a, &value) < 0) {
+            if (!diag_more(a)) {
+                return -1;
+            }
+            continue;
+        }
+        if (f->ef_word) {
+            *f->ef_word = (uint16_t) value;
+        } else {
+            a->image[f->ef_index] = (uint16_t) value;
+        }
+        ASM_STAT(a, ac_fixups, 1);
+    }
+    return 0;
+}
+
+void expr_reset(struct assembler *a) {
+    uint64_t i;
+    for (i = 0; i < a->nfixups; ++i) {
+        free(a->fixups[i].ef_expr);
+    }
+    a->nfixups = 0;
+}
+
+void expr_free(struct assembler *a) {
+    expr_reset(a);
+    free(a->fixups);
+    a->fixups = NULL;
+    a->fixup_cap = 0;
+}
@@ -0,0 +1,97 @@
+#ifndef ASSEMBLER_EXPR_H
+#define ASSEMBLER_EXPR_H
+
+#include "common.h"
+
+// Operand expressions, like end - start, [A + table + 3] or PICK 2 * 3.
+// The tokenizer reads them in postfix order and folds every part made of
+// numbers only as it goes, so an expression of numbers is a number by the
+// end and is encoded as one, inline in operand a when it is -1 to 30. One
+// that names labels only placed before it is folded by pass 1, or by a
+// stream, the same way. One that names a label still to come keeps a word
+// of its own: pass 1 files it here, and pass 2, or the end of a stream,
+// fills the word in once the labels are placed.
+//
+// The operators are C's, with its precedence: unary - ~ +, then * / %,
+// + -, << >>, & ^ and |. Every value along the way fits in 32 bits and
+// the result in 16, from -0x8000 to 0xffff.
+
+#define EXPR_MAX_ITEMS  64     /* Numbers, labels and operators */
+#define EXPR_MAX_DEPTH  32     /* Parentheses and unary operators */
+
+enum expr_op {
+    eo_num,
+    eo_label,
+    eo_neg,
+    eo_not,
+    eo_mul,
+    eo_div,
+    eo_mod,
+    eo_add,
+    eo_sub,
+    eo_shl,
+    eo_shr,
+    eo_and,
+    eo_xor,
+    eo_or,
+};
+
+struct expr_item {
+    enum expr_op ei_op;
+    uint32_t     ei_len;       /* Of a label's name */
+    uint64_t     ei_row;       /* Where it is, errors are reported there */
+    uint64_t     ei_col;
+    union {
+        int64_t     num;
+        char       *name;      /* Into the input */
+    } u;
+};
+#define ei_num  u.num
+#define ei_name u.name
+
+struct expr {
+    uint64_t         ex_row;   /* Where it starts */
+    uint64_t         ex_col;
+    uint32_t         ex_count;
+    uint32_t         ex_labels;
+    struct expr_item ex_item[]; /* In postfix order */
+};
+
+static inline int expr_unary(enum expr_op op) {
+    return op == eo_neg || op == eo_not;
+}
+
+/* A word that waits for an expression, owned from expr_defer() on */
+struct expr_fixup {
+    uint16_t    *ef_word;      /* Into a bcode_node, or NULL ... */
+    uint64_t     ef_index;     /* ... for a stream, into a->image */
+    struct expr *ef_expr;
+};
+
+/* *r = x op y, y unused for a unary op. 0, or -1 with the reason in *err
+ * when it does not fit in 32 bits or divides by zero. */
+int  expr_apply(enum expr_op op, int64_t x, int64_t y, int64_t *r,
+                const char **err);
+/* 1 when an operand of the opcode t depends on where two labels are from
+ * each other, which moving code or data around would change */
+int  expr_spans(struct token *t);
+/* The value of e, reporting nothing. Its labels are asked for in the
+ * order they come, label(arg, it, value) gives 0, or -1 when it has no
+ * value. 0, or -1 when a label has none or e does not fit. */
+int  expr_value(const struct expr *e,
+                int (*label)(void *arg, const struct expr_item *it,
+                             int64_t *value),
+                void *arg, int64_t *value);
+/* expr_value() with the labels placed so far, as pass 1 places them */
+int  expr_placed(struct assembler *a, const struct expr *e, int64_t *value);
+/* Fill a word in with e once its labels are placed. 0 or -1. */
+int  expr_defer(struct assembler *a, uint16_t *word, uint64_t index,
+                struct expr *e);
+/* Evaluate every deferred expression into its word, reporting what does
+ * not. -1 when the run has to stop, 0 otherwise. */
+int  expr_fixups(struct assembler *a);
+/* Forget the deferred expressions, keeping the room for the next run */
+void expr_reset(struct assembler *a);
+void expr_free(struct assembler *a);
+
+#endif //ASSEMBLER_EXPR_H
@@ -0,0 +1,254 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "floppy.h"
+
+// Sectors that follow on from each other are written with one call, up
+// to this many at a time
+#define FLOPPY_RUN 32
+
+/* What goes at a sector: laid out words, or the bytes of a file */
+struct piece {
+    uint64_t        pc_sector;
+    uint64_t        pc_bytes;
+    const char     *pc_name;
+    const uint16_t *pc_words;   /* NULL for a file */
+    uint16_t       *pc_owned;   /* Laid out here, from a .dasm part */
+    int             pc_fd;      /* Of the file, or -1 */
+};
+
+/* The disk being written and the run of sectors not written out yet */
+struct disk {
+    int      dk_fd;
+    uint64_t dk_first;
+    uint64_t dk_count;
+    int      dk_err;
+    uint8_t  dk_buf[FLOPPY_RUN * FLOPPY_SECTOR_BYTES];
+};
+
+int floppy_parse(char *arg, struct disk_part *p) {
+    char *end;
+    unsigned long long sector = strtoull(arg, &end, 0);
+    if (end == arg || *end != ':' || !end[1]) {
+        return -1;
+    }
+    p->dp_sector = sector;
+    p->dp_path = end + 1;
+    return 0;
+}
+
+static void flush(struct disk *d) {
+    size_t n = d->dk_count * FLOPPY_SECTOR_BYTES;
+    if (d->dk_count && !d->dk_err &&
+        pwrite(d->dk_fd, d->dk_buf, n,
+               (off_t) (d->dk_first * FLOPPY_SECTOR_BYTES)) != (ssize_t) n) {
+        d->dk_err = 1;
+    }
+    d->dk_count = 0;
+}
+
+// Where the bytes of sector go: after the run so far when it follows on
+static uint8_t *slot(struct disk *d, uint64_t sector) {
+    if (d->dk_count && (d->dk_first + d->dk_count != sector ||
+                        d->dk_count == FLOPPY_RUN)) {
+        flush(d);
+    }
+    if (!d->dk_count) {
+        d->dk_first = sector;
+    }
+    return d->dk_buf + d->dk_count * FLOPPY_SECTOR_BYTES;
+}
+
+// Keep the sector just filled in, unless all of it is zero: that one is
+// left a hole
+static void keep(struct disk *d) {
+    const uint8_t *p = d->dk_buf + d->dk_count * FLOPPY_SECTOR_BYTES;
+    size_t i;
+    for (i = 0; i < FLOPPY_SECTOR_BYTES && !p[i]; ++i);
+    if (i < FLOPPY_SECTOR_BYTES) {
+        ++d->dk_count;
+    }
+}
+
+static int put_piece(struct disk *d, const struct piece *pc) {
+    uint64_t sector = pc->pc_sector, done, i, k;
+    ssize_t got;
+    uint8_t *p;
+    for (done = 0; done < pc->pc_bytes; done += k, ++sector) {
+        p = slot(d, sector);
+        k = pc->pc_bytes - done;
+        k = k < FLOPPY_SECTOR_BYTES ? k : FLOPPY_SECTOR_BYTES;
+        if (pc->pc_words) {
+            for (i = 0; i < k / 2; ++i) {
+                p[2 * i] = (uint8_t) (pc->pc_words[done / 2 + i] >> 8);
+                p[2 * i + 1] = (uint8_t) pc->pc_words[done / 2 + i];
+            }
+        } else {
+            for (i = 0; i < k; i += (uint64_t) got) {
+                got = read(pc->pc_fd, p + i, (size_t) (k - i));
+                if (got < 0 && errno == EINTR) {
+                    got = 0;
+                } else if (got <= 0) {
+                    LOGERROR("Could not read %s", pc->pc_name);
+                    return -1;
+                }
+            }
+        }
+        memset(p + k, 0, FLOPPY_SECTOR_BYTES - k);
+        keep(d);
+    }
+    return 0;
+}
+
+// Sectors a piece takes
+static inline uint64_t sectors(const struct piece *pc) {
+    return (pc->pc_bytes + FLOPPY_SECTOR_BYTES - 1) / FLOPPY_SECTOR_BYTES;
+}
+
+static int cmp_piece(const void *x, const void *y) {
+    const struct piece *p = x, *q = y;
+    return (p->pc_sector > q->pc_sector) - (p->pc_sector < q->pc_sector);
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), k = strlen(suffix);
+    return n >= k && !strcmp(s + n - k, suffix);
+}
+
+// A part as a piece: a source assembled and laid out, or a file opened
+static int open_piece(struct piece *pc, const struct disk_part *part) {
+    struct assembler pa[1];
+    struct stat st;
+    uint64_t words;
+    pc->pc_sector = part->dp_sector;
+    pc->pc_name = part->dp_path;
+    if (has_suffix(part->dp_path, ".dasm")) {
+        if (asm_init(pa, part->dp_path) < 0) {
+            return -1;
+        }
+        if (asm_parse(pa) == 0) {
+            pc->pc_owned = asm_image(pa, &words);
+        }
+        asm_free(pa);
+        if (!pc->pc_owned) {
+            return -1;
+        }
+        pc->pc_words = pc->pc_owned;
+        pc->pc_bytes = words * 2;
+        return 0;
+    }
+    pc->pc_fd = open(part->dp_path, O_RDONLY);
+    if (pc->pc_fd < 0 || fstat(pc->pc_fd, &st) < 0) {
+        LOGERROR("Unable to open file: %s", part->dp_path);
+        return -1;
+    }
+    pc->pc_bytes = (uint64_t) st.st_size;
+    return 0;
+}
+
+// Every piece on the disk, none of them over another
+static int check_pieces(const struct piece *pcs, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (pcs[i].pc_sector + sectors(&pcs[i]) > FLOPPY_SECTORS) {
+            LOGERROR("%s at sector %llu does not fit on the disk, it needs "
+                     "%llu sectors", pcs[i].pc_name,
+                     (unsigned long long) pcs[i].pc_sector,
+                     (unsigned long long) sectors(&pcs[i]));
+            return -1;
+        }
+        if (i && pcs[i - 1].pc_sector + sectors(&pcs[i - 1]) >
+                 pcs[i].pc_sector) {
+            LOGERROR("%s at sector %llu overlaps %s", pcs[i].pc_name,
+                     (unsigned long long) pcs[i].pc_sector,
+                     pcs[i - 1].pc_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int floppy_write(struct assembler *a, const uint16_t *image, uint64_t words,
+                 const struct disk_part *parts, int n) {
+    struct piece *pcs;
+    struct disk *d = NULL;
+    char tmp[4096];
+    const char *path = a->floppy;
+    int i, rc = -1;
+
+    pcs = calloc((size_t) n + 1, sizeof(*pcs));
+    if (!pcs) {
+        LOGERROR("No memory for the floppy");
+        return -1;
+    }
+    for (i = 0; i <= n; ++i) {
+        pcs[i].pc_fd = -1;
+    }
+    pcs[0].pc_name = a->input_file;
+    pcs[0].pc_words = image;
+    pcs[0].pc_bytes = words * 2;
+    for (i = 0; i < n; ++i) {
+        if (open_piece(&pcs[i + 1], &parts[i]) < 0) {
+            goto out;
+        }
+    }
+    qsort(pcs, (size_t) n + 1, sizeof(*pcs), cmp_piece);
+    if (check_pieces(pcs, n + 1) < 0) {
+        goto out;
+    }
+
+    // next to its name when readers should never see half of it
+    if (snprintf(tmp, sizeof(tmp), a->output_atomic ? "%s.tmp" : "%s",
+                 path) >= (int) sizeof(tmp)) {
+        LOGERROR("Floppy image name too long: %s", path);
+        goto out;
+    }
+    d = malloc(sizeof(*d));
+    if (!d) {
+        LOGERROR("No memory for the floppy");
+        goto out;
+    }
+    d->dk_count = 0;
+    d->dk_err = 0;
+    d->dk_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (d->dk_fd < 0) {
+        LOGERROR("Unable to open %s for writing", tmp);
+        goto out;
+    }
+    for (i = 0; i <= n && !d->dk_err; ++i) {
+        if (put_piece(d, &pcs[i]) < 0) {
+            d->dk_err = 1;
+        }
+    }
+    flush(d);
+    // the sectors after the last one written read as zero
+    if (ftruncate(d->dk_fd,
+                  (off_t) FLOPPY_SECTORS * FLOPPY_SECTOR_BYTES) != 0) {
+        d->dk_err = 1;
+    }
+    if (close(d->dk_fd) != 0 || d->dk_err) {
+        LOGERROR("Could not write %s", tmp);
+    } else if (a->output_atomic && rename(tmp, path) != 0) {
+        LOGERROR("Could not rename %s to %s", tmp, path);
+    } else {
+        rc = 0;
+    }
+    if (rc < 0 && a->output_atomic) {
+        remove(tmp);
+    }
+out:
+    for (i = 0; i <= n; ++i) {
+        if (pcs[i].pc_fd >= 0) {
+            close(pcs[i].pc_fd);
+        }
+        free(pcs[i].pc_owned);
+    }
+    free(pcs);
+    free(d);
+    return rc;
+}
@@ -0,0 +1,24 @@
+#ifndef ASSEMBLER_FLOPPY_H
+#define ASSEMBLER_FLOPPY_H
+
+#include "common.h"
+
+// A disk image for the Mackapar M35FD (docs/floppy-drive.txt): 1440
+// sectors of 512 words, big endian like the binary image. The program goes
+// at sector 0 and every --place at its own sector, each written straight
+// from where it lies in one pass over the disk in sector order. Sectors
+// that are all zero are never written, so they stay holes in a sparse file.
+
+#define FLOPPY_SECTORS      1440
+#define FLOPPY_SECTOR_WORDS 512
+#define FLOPPY_SECTOR_BYTES (FLOPPY_SECTOR_WORDS * 2)
+
+/* "sector:path", 0 or -1 */
+int floppy_parse(char *arg, struct disk_part *p);
+/* Write the image of words at sector 0 and the n parts to a->floppy. A
+ * part ending in .dasm is assembled first, anything else is copied as it
+ * is. 0, or -1 when a part is missing, does not fit or overlaps another. */
+int floppy_write(struct assembler *a, const uint16_t *image, uint64_t words,
+                 const struct disk_part *parts, int n);
+
+#endif //ASSEMBLER_FLOPPY_H
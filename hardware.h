@@ -0,0 +1,75 @@
+#ifndef ASSEMBLER_HARDWARE_H
+#define ASSEMBLER_HARDWARE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "dcpu.h"
+
+struct hw_device;
+
+/* Per device behaviour, see docs/ for what each device does on HWI */
+struct hw_ops {
+    /* HWI handler, returns the extra cycles the CPU is halted for */
+    int  (*hwo_interrupt)(struct dcpu *d, struct hw_device *hw);
+    /* A scheduled event of the given kind is due */
+    void (*hwo_event)(struct dcpu *d, struct hw_device *hw, int kind);
+    /* Release the device */
+    void (*hwo_free)(struct hw_device *hw);
+    /* A watched RAM word was written, see dcpu_watch() */
+    void (*hwo_write)(struct dcpu *d, struct hw_device *hw, uint16_t addr);
+    /* Copy the device state into buf (NULL to only ask) and return its
+     * size in bytes, see snapshot.h */
+    size_t (*hwo_save)(struct hw_device *hw, void *buf);
+    /* Put back a state saved by hwo_save */
+    void (*hwo_restore)(struct dcpu *d, struct hw_device *hw, const void *buf);
+};
+
+/* Every device embeds this as its first member */
+struct hw_device {
+    uint32_t hw_id;
+    uint16_t hw_version;
+    uint32_t hw_manufacturer;
+    const struct hw_ops *hw_ops;
+};
+
+// Save or restore the plain data members that follow the hw_device
+// header, up to the given offset into the device structure
+static inline size_t hw_state_save(struct hw_device *hw, size_t end, void *buf) {
+    if (buf) {
+        memcpy(buf, hw + 1, end - sizeof(*hw));
+    }
+    return end - sizeof(*hw);
+}
+
+static inline size_t hw_state_restore(struct hw_device *hw, size_t end,
+                                      const void *buf) {
+    memcpy(hw + 1, buf, end - sizeof(*hw));
+    return end - sizeof(*hw);
+}
+
+#define MANUFACTURER_NYA_ELEKTRISKA 0x1c6c8b36
+#define MANUFACTURER_MACKAPAR       0x1eb37e91
+
+/* Floppy geometry, see docs/floppy-drive.txt */
+#define M35FD_TRACKS            80
+#define M35FD_SECTORS_PER_TRACK 18
+#define M35FD_SECTORS           (M35FD_TRACKS * M35FD_SECTORS_PER_TRACK)
+#define M35FD_SECTOR_WORDS      512
+#define M35FD_DISK_WORDS        (M35FD_SECTORS * M35FD_SECTOR_WORDS)
+
+/* LEM1802 frame: 128x96 pixels plus the border, 8 bit RGB */
+#define LEM1802_BORDER  4
+#define LEM1802_FRAME_W (128 + 2 * LEM1802_BORDER)
+#define LEM1802_FRAME_H (96 + 2 * LEM1802_BORDER)
+
+struct hw_device *clock_new(void);
+struct hw_device *lem1802_new(void);
+struct hw_device *m35fd_new(char *disk, int write_protect);
+struct hw_device *spc2000_new(void);
+struct hw_device *sped3_new(void);
+
+int      lem1802_render(struct dcpu *d, struct hw_device *hw);
+uint8_t *lem1802_frame(struct hw_device *hw);
+
+#endif //ASSEMBLER_HARDWARE_H
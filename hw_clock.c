@@ -0,0 +1,100 @@
+#include <stdlib.h>
+
+#include "hardware.h"
+
+// Generic clock, see docs/clock.txt
+
+#define CLOCK_ID      0x12d0b402
+#define CLOCK_VERSION 1
+
+enum clock_event {
+    ce_tick,
+};
+
+struct clock {
+    struct hw_device hw;
+    uint16_t divider;    /* Ticks 60/divider times a second, 0 when off */
+    uint16_t ticks;      /* Ticks since the clock was last set */
+    uint16_t message;    /* Interrupt message, 0 when disabled */
+    uint64_t start;      /* Cycle at which the clock was last set */
+    uint64_t tick_no;    /* Index of the next tick since start */
+};
+
+// Cycle at which tick n happens. Computed from the start instead of
+// accumulated so the 100000/60 rounding error does not drift.
+static inline uint64_t clock_tick_at(struct clock *c, uint64_t n) {
+    return c->start + n * c->divider * DCPU_CLOCK_HZ / 60;
+}
+
+static int clock_interrupt(struct dcpu *d, struct hw_device *hw) {
+    struct clock *c = (struct clock *) hw;
+    switch (d->reg[DR_A]) {
+        case 0:
+            sched_cancel(&d->sched, hw, ce_tick);
+            c->divider = d->reg[DR_B];
+            c->ticks = 0;
+            c->start = d->cycles;
+            c->tick_no = 1;
+            if (c->divider) {
+                sched_add(&d->sched, clock_tick_at(c, c->tick_no), hw, ce_tick);
+            }
+            break;
+        case 1:
+            d->reg[DR_C] = c->ticks;
+            break;
+        case 2:
+            c->message = d->reg[DR_B];
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void clock_event(struct dcpu *d, struct hw_device *hw, int kind) {
+    struct clock *c = (struct clock *) hw;
+    if (kind != ce_tick) {
+        LOGERROR("Unknown clock event: %d", kind);
+        return;
+    }
+    c->ticks++;
+    if (c->message) {
+        dcpu_interrupt(d, c->message);
+    }
+    sched_add(&d->sched, clock_tick_at(c, ++c->tick_no), hw, ce_tick);
+}
+
+static void clock_free(struct hw_device *hw) {
+    free(hw);
+}
+
+static size_t clock_save(struct hw_device *hw, void *buf) {
+    return hw_state_save(hw, sizeof(struct clock), buf);
+}
+
+static void clock_restore(struct dcpu *d, struct hw_device *hw, const void *buf) {
+    (void) d;
+    hw_state_restore(hw, sizeof(struct clock), buf);
+}
+
+static const struct hw_ops clock_ops = {
+        clock_interrupt,
+        clock_event,
+        clock_free,
+        NULL,
+        clock_save,
+        clock_restore
+};
+
+struct hw_device *clock_new(void) {
+    struct clock *c = calloc(1, sizeof(struct clock));
+    if (!c) {
+        LOGERROR("Cannot allocate memory for the clock");
+        return NULL;
+    }
+    c->hw.hw_id = CLOCK_ID;
+    c->hw.hw_version = CLOCK_VERSION;
+    c->hw.hw_manufacturer = 0;
+    c->hw.hw_ops = &clock_ops;
+    return &c->hw;
+}
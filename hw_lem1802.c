@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware.h"
+
+// LEM1802 low energy monitor, see docs/monitor.txt
+
+#define LEM1802_ID       0x7349f615
+#define LEM1802_VERSION  0x1802
+
+#define LEM1802_SCREEN_WORDS  384
+#define LEM1802_FONT_WORDS    256
+#define LEM1802_PALETTE_WORDS 16
+#define LEM1802_COLS          32
+#define LEM1802_ROWS          12
+#define LEM1802_GLYPHS        128
+
+/* Blinking cells are shown for half of each second */
+#define LEM1802_BLINK_CYCLES  (DCPU_CLOCK_HZ / 2)
+
+enum lem1802_event {
+    le_started,         /* The one second start up has passed */
+};
+
+struct lem1802 {
+    struct hw_device hw;
+    uint16_t screen;     /* Video RAM address, 0 when disconnected */
+    uint16_t font;       /* Font RAM address, 0 for the default font */
+    uint16_t palette;    /* Palette RAM address, 0 for the default one */
+    uint16_t border;     /* Border palette index */
+    uint8_t  started;    /* Finished starting up after being connected */
+    /* Renderer state, only what changed since the last frame is redrawn */
+    uint64_t dirty_cells[LEM1802_SCREEN_WORDS / 64];
+    uint64_t dirty_glyphs[LEM1802_GLYPHS / 64];
+    uint8_t  dirty_all;
+    uint8_t  shown;      /* Connected and started at the last frame */
+    uint8_t  blink;      /* Blink phase at the last frame */
+    uint8_t  frame[LEM1802_FRAME_H][LEM1802_FRAME_W][3];
+};
+
+static const uint16_t default_font[LEM1802_FONT_WORDS] = {
+        0xb79e, 0x388e, 0x722c, 0x75f4, 0x19bb, 0x7f8f, 0x85f9, 0xb158,
+        0x242e, 0x2400, 0x082a, 0x0800, 0x0008, 0x0000, 0x0808, 0x0808,
+        0x00ff, 0x0000, 0x00f8, 0x0808, 0x08f8, 0x0000, 0x080f, 0x0000,
+        0x000f, 0x0808, 0x00ff, 0x0808, 0x08f8, 0x0808, 0x08ff, 0x0000,
+        0x080f, 0x0808, 0x08ff, 0x0808, 0x6633, 0x99cc, 0x9933, 0x66cc,
+        0xfef8, 0xe080, 0x7f1f, 0x0701, 0x0107, 0x1f7f, 0x80e0, 0xf8fe,
+        0x5500, 0xaa00, 0x55aa, 0x55aa, 0xffaa, 0xff55, 0x0f0f, 0x0f0f,
+        0xf0f0, 0xf0f0, 0x0000, 0xffff, 0xffff, 0x0000, 0xffff, 0xffff,
+        0x0000, 0x0000, 0x005f, 0x0000, 0x0300, 0x0300, 0x3e14, 0x3e00,
+        0x266b, 0x3200, 0x611c, 0x4300, 0x3629, 0x7650, 0x0002, 0x0100,
+        0x1c22, 0x4100, 0x4122, 0x1c00, 0x1408, 0x1400, 0x081c, 0x0800,
+        0x4020, 0x0000, 0x0808, 0x0800, 0x0040, 0x0000, 0x601c, 0x0300,
+        0x3e49, 0x3e00, 0x427f, 0x4000, 0x6259, 0x4600, 0x2249, 0x3600,
+        0x0f08, 0x7f00, 0x2745, 0x3900, 0x3e49, 0x3200, 0x6119, 0x0700,
+        0x3649, 0x3600, 0x2649, 0x3e00, 0x0024, 0x0000, 0x4024, 0x0000,
+        0x0814, 0x2200, 0x1414, 0x1400, 0x2214, 0x0800, 0x0259, 0x0600,
+        0x3e59, 0x5e00, 0x7e09, 0x7e00, 0x7f49, 0x3600, 0x3e41, 0x2200,
+        0x7f41, 0x3e00, 0x7f49, 0x4100, 0x7f09, 0x0100, 0x3e41, 0x7a00,
+        0x7f08, 0x7f00, 0x417f, 0x4100, 0x2040, 0x3f00, 0x7f08, 0x7700,
+        0x7f40, 0x4000, 0x7f06, 0x7f00, 0x7f01, 0x7e00, 0x3e41, 0x3e00,
+        0x7f09, 0x0600, 0x3e61, 0x7e00, 0x7f09, 0x7600, 0x2649, 0x3200,
+        0x017f, 0x0100, 0x3f40, 0x7f00, 0x1f60, 0x1f00, 0x7f30, 0x7f00,
+        0x7708, 0x7700, 0x0778, 0x0700, 0x7149, 0x4700, 0x007f, 0x4100,
+        0x031c, 0x6000, 0x417f, 0x0000, 0x0201, 0x0200, 0x8080, 0x8000,
+        0x0001, 0x0200, 0x2454, 0x7800, 0x7f44, 0x3800, 0x3844, 0x2800,
+        0x3844, 0x7f00, 0x3854, 0x5800, 0x087e, 0x0900, 0x4854, 0x3c00,
+        0x7f04, 0x7800, 0x047d, 0x0000, 0x2040, 0x3d00, 0x7f10, 0x6c00,
+        0x017f, 0x0000, 0x7c18, 0x7c00, 0x7c04, 0x7800, 0x3844, 0x3800,
+        0x7c14, 0x0800, 0x0814, 0x7c00, 0x7c04, 0x0800, 0x4854, 0x2400,
+        0x043e, 0x4400, 0x3c40, 0x7c00, 0x1c60, 0x1c00, 0x7c30, 0x7c00,
+        0x6c10, 0x6c00, 0x4c50, 0x3c00, 0x6454, 0x4c00, 0x0836, 0x4100,
+        0x0077, 0x0000, 0x4136, 0x0800, 0x0201, 0x0201, 0x0205, 0x0200
+};
+
+static const uint16_t default_palette[LEM1802_PALETTE_WORDS] = {
+        0x0000, 0x000a, 0x00a0, 0x00aa, 0x0a00, 0x0a0a, 0x0a50, 0x0aaa,
+        0x0555, 0x055f, 0x05f5, 0x05ff, 0x0f55, 0x0f5f, 0x0ff5, 0x0fff
+};
+
+static void dump_words(struct dcpu *d, uint16_t addr,
+                       const uint16_t *src, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        dcpu_write(d, (uint16_t) (addr + i), src[i]);
+    }
+}
+
+// Watch the mapped regions so writes into them mark the frame dirty
+static void lem1802_remap(struct dcpu *d, struct lem1802 *l) {
+    dcpu_unwatch(d, &l->hw);
+    if (l->screen) {
+        dcpu_watch(d, &l->hw, l->screen, LEM1802_SCREEN_WORDS);
+    }
+    if (l->font) {
+        dcpu_watch(d, &l->hw, l->font, LEM1802_FONT_WORDS);
+    }
+    if (l->palette) {
+        dcpu_watch(d, &l->hw, l->palette, LEM1802_PALETTE_WORDS);
+    }
+    l->dirty_all = 1;
+}
+
+static int lem1802_interrupt(struct dcpu *d, struct hw_device *hw) {
+    struct lem1802 *l = (struct lem1802 *) hw;
+    uint16_t b = d->reg[DR_B];
+    switch (d->reg[DR_A]) {
+        case 0: // MEM_MAP_SCREEN
+            if (!l->screen && b) {
+                // going from disconnected to connected takes a second
+                l->started = 0;
+                sched_cancel(&d->sched, hw, le_started);
+                dcpu_schedule(d, hw, DCPU_CLOCK_HZ, le_started);
+            }
+            l->screen = b;
+            lem1802_remap(d, l);
+            return 0;
+        case 1: // MEM_MAP_FONT
+            l->font = b;
+            lem1802_remap(d, l);
+            return 0;
+        case 2: // MEM_MAP_PALETTE
+            l->palette = b;
+            lem1802_remap(d, l);
+            return 0;
+        case 3: // SET_BORDER_COLOR
+            l->border = (uint16_t) (b & 0xf);
+            l->dirty_all = 1;
+            return 0;
+        case 4: // MEM_DUMP_FONT
+            dump_words(d, b, default_font, LEM1802_FONT_WORDS);
+            return 256;
+        case 5: // MEM_DUMP_PALETTE
+            dump_words(d, b, default_palette, LEM1802_PALETTE_WORDS);
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+static void lem1802_event(struct dcpu *d, struct hw_device *hw, int kind) {
+    struct lem1802 *l = (struct lem1802 *) hw;
+    (void) d;
+    if (kind != le_started) {
+        LOGERROR("Unknown LEM1802 event: %d", kind);
+        return;
+    }
+    l->started = 1;
+}
+
+static void lem1802_free(struct hw_device *hw) {
+    free(hw);
+}
+
+static void lem1802_write(struct dcpu *d, struct hw_device *hw, uint16_t addr) {
+    struct lem1802 *l = (struct lem1802 *) hw;
+    uint16_t off;
+    (void) d;
+    if (l->screen) {
+        off = (uint16_t) (addr - l->screen);
+        if (off < LEM1802_SCREEN_WORDS) {
+            l->dirty_cells[off / 64] |= 1ULL << (off % 64);
+        }
+    }
+    if (l->font) {
+        off = (uint16_t) (addr - l->font);
+        if (off < LEM1802_FONT_WORDS) {
+            off /= 2;
+            l->dirty_glyphs[off / 64] |= 1ULL << (off % 64);
+        }
+    }
+    if (l->palette && (uint16_t) (addr - l->palette) < LEM1802_PALETTE_WORDS) {
+        // a colour may be used anywhere, border included
+        l->dirty_all = 1;
+    }
+}
+
+// The renderer state is not saved, a restored screen is drawn afresh
+static size_t lem1802_save(struct hw_device *hw, void *buf) {
+    return hw_state_save(hw, offsetof(struct lem1802, dirty_cells), buf);
+}
+
+static void lem1802_restore(struct dcpu *d, struct hw_device *hw,
+                            const void *buf) {
+    struct lem1802 *l = (struct lem1802 *) hw;
+    (void) d;
+    hw_state_restore(hw, offsetof(struct lem1802, dirty_cells), buf);
+    l->dirty_all = 1;
+}
+
+static const struct hw_ops lem1802_ops = {
+        lem1802_interrupt,
+        lem1802_event,
+        lem1802_free,
+        lem1802_write,
+        lem1802_save,
+        lem1802_restore
+};
+
+static inline uint16_t lem1802_color(struct dcpu *d, struct lem1802 *l,
+                                     uint16_t index) {
+    return l->palette ? d->ram[(uint16_t) (l->palette + index)]
+                      : default_palette[index];
+}
+
+static inline void to_rgb(uint16_t color, uint8_t rgb[3]) {
+    rgb[0] = (uint8_t) ((color >> 8 & 0xf) * 17);
+    rgb[1] = (uint8_t) ((color >> 4 & 0xf) * 17);
+    rgb[2] = (uint8_t) ((color & 0xf) * 17);
+}
+
+static void fill_rect(struct lem1802 *l, int x, int y, int w, int h,
+                      uint16_t color) {
+    uint8_t rgb[3];
+    int i, j;
+    to_rgb(color, rgb);
+    for (j = y; j < y + h; ++j) {
+        for (i = x; i < x + w; ++i) {
+            memcpy(l->frame[j][i], rgb, 3);
+        }
+    }
+}
+
+// Rasterize one 4x8 cell. Each glyph is two words, one byte per column,
+// with bit 0 of a column being its top pixel.
+static void draw_cell(struct dcpu *d, struct lem1802 *l, int cell) {
+    uint16_t w = d->ram[(uint16_t) (l->screen + cell)];
+    uint16_t c = (uint16_t) (w & 0x7f);
+    uint16_t fg = lem1802_color(d, l, (uint16_t) (w >> 12));
+    uint16_t bg = lem1802_color(d, l, (uint16_t) (w >> 8 & 0xf));
+    uint16_t glyph[2];
+    uint8_t rgb[2][3];
+    int x0 = LEM1802_BORDER + (cell % LEM1802_COLS) * 4;
+    int y0 = LEM1802_BORDER + (cell / LEM1802_COLS) * 8;
+    int col, row, bits;
+    if (l->font) {
+        glyph[0] = d->ram[(uint16_t) (l->font + c * 2)];
+        glyph[1] = d->ram[(uint16_t) (l->font + c * 2 + 1)];
+    } else {
+        glyph[0] = default_font[c * 2];
+        glyph[1] = default_font[c * 2 + 1];
+    }
+    if ((w & 0x80) && !l->blink) {
+        fg = bg;
+    }
+    to_rgb(bg, rgb[0]);
+    to_rgb(fg, rgb[1]);
+    for (col = 0; col < 4; ++col) {
+        bits = glyph[col / 2] >> (col % 2 ? 0 : 8) & 0xff;
+        for (row = 0; row < 8; ++row) {
+            memcpy(l->frame[y0 + row][x0 + col], rgb[(bits >> row) & 1], 3);
+        }
+    }
+}
+
+// Bring the frame up to date. Only cells whose video word, glyph or blink
+// state changed since the last call are rasterized again.
+// Returns the number of cells drawn.
+int lem1802_render(struct dcpu *d, struct hw_device *hw) {
+    struct lem1802 *l = (struct lem1802 *) hw;
+    uint8_t shown = (uint8_t) (l->screen && l->started);
+    uint8_t blink = (uint8_t) (d->cycles / LEM1802_BLINK_CYCLES % 2 == 0);
+    int cell, drawn = 0, glyphs = l->dirty_glyphs[0] || l->dirty_glyphs[1];
+    uint16_t w;
+
+    if (shown != l->shown) {
+        l->shown = shown;
+        l->dirty_all = 1;
+    }
+    if (!shown) {
+        // disconnected or still starting up: a dark screen
+        if (l->dirty_all) {
+            memset(l->frame, 0, sizeof(l->frame));
+            l->dirty_all = 0;
+        }
+        memset(l->dirty_cells, 0, sizeof(l->dirty_cells));
+        memset(l->dirty_glyphs, 0, sizeof(l->dirty_glyphs));
+        return 0;
+    }
+    if (l->dirty_all) {
+        fill_rect(l, 0, 0, LEM1802_FRAME_W, LEM1802_FRAME_H,
+                  lem1802_color(d, l, l->border));
+    }
+    // glyph and blink changes dirty the cells showing them
+    if (glyphs || blink != l->blink) {
+        for (cell = 0; cell < LEM1802_SCREEN_WORDS; ++cell) {
+            w = d->ram[(uint16_t) (l->screen + cell)];
+            if ((blink != l->blink && (w & 0x80)) ||
+                (l->dirty_glyphs[(w & 0x7f) / 64] >> (w & 0x3f) & 1)) {
+                l->dirty_cells[cell / 64] |= 1ULL << (cell % 64);
+            }
+        }
+        l->blink = blink;
+    }
+    for (cell = 0; cell < LEM1802_SCREEN_WORDS; ++cell) {
+        if (l->dirty_all || (l->dirty_cells[cell / 64] >> (cell % 64) & 1)) {
+            draw_cell(d, l, cell);
+            ++drawn;
+        }
+    }
+    memset(l->dirty_cells, 0, sizeof(l->dirty_cells));
+    memset(l->dirty_glyphs, 0, sizeof(l->dirty_glyphs));
+    l->dirty_all = 0;
+    return drawn;
+}
+
+// The frame as of the last lem1802_render(), LEM1802_FRAME_W x _H RGB
+uint8_t *lem1802_frame(struct hw_device *hw) {
+    return &((struct lem1802 *) hw)->frame[0][0][0];
+}
+
+struct hw_device *lem1802_new(void) {
+    struct lem1802 *l = calloc(1, sizeof(struct lem1802));
+    if (!l) {
+        LOGERROR("Cannot allocate memory for the LEM1802");
+        return NULL;
+    }
+    l->hw.hw_id = LEM1802_ID;
+    l->hw.hw_version = LEM1802_VERSION;
+    l->hw.hw_manufacturer = MANUFACTURER_NYA_ELEKTRISKA;
+    l->hw.hw_ops = &lem1802_ops;
+    l->dirty_all = 1;
+    return &l->hw;
+}
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware.h"
+
+// Mackapar 3.5" floppy drive, see docs/floppy-drive.txt
+
+#define M35FD_ID       0x4fd524c5
+#define M35FD_VERSION  0x000b
+
+/* 2.4 ms per track, 30.7k words per second */
+#define M35FD_SEEK_CYCLES     (DCPU_CLOCK_HZ * 24 / 10000)
+#define M35FD_SECTOR_CYCLES   ((DCPU_CLOCK_HZ * M35FD_SECTOR_WORDS + 15350) / 30700)
+
+enum m35fd_state {
+    ms_no_media,
+    ms_ready,
+    ms_ready_wp,
+    ms_busy,
+};
+
+enum m35fd_error {
+    me_none,
+    me_busy,
+    me_no_media,
+    me_protected,
+    me_eject,
+    me_bad_sector,
+    me_broken = 0xffff,
+};
+
+enum m35fd_event {
+    mv_done,            /* The pending read or write has finished */
+};
+
+struct m35fd {
+    struct hw_device hw;
+    uint16_t state;
+    uint16_t error;
+    uint16_t message;       /* Interrupt message, 0 when disabled */
+    uint16_t track;         /* Track the head is currently on */
+    uint8_t  write_protect;
+    uint8_t  writing;       /* Pending operation is a write */
+    uint16_t sector;        /* Sector of the pending operation */
+    uint16_t addr;          /* DCPU address of the pending operation */
+    uint16_t buffer[M35FD_SECTOR_WORDS];
+    char    *file;          /* Backing disk image, written through */
+    uint16_t *disk;
+};
+
+// state or error changes raise an interrupt when enabled
+static void m35fd_set(struct dcpu *d, struct m35fd *m,
+                      uint16_t state, uint16_t error) {
+    int changed = m->state != state || (error != me_none && m->error != error);
+    m->state = state;
+    if (error != me_none) {
+        m->error = error;
+    }
+    if (changed && m->message) {
+        dcpu_interrupt(d, m->message);
+    }
+}
+
+static int m35fd_start(struct dcpu *d, struct m35fd *m, int writing) {
+    uint16_t sector = d->reg[DR_X], track, dist;
+    if (m->state == ms_no_media) {
+        m35fd_set(d, m, m->state, me_no_media);
+        return 0;
+    } else if (m->state == ms_busy) {
+        m35fd_set(d, m, m->state, me_busy);
+        return 0;
+    } else if (writing && m->state == ms_ready_wp) {
+        m35fd_set(d, m, m->state, me_protected);
+        return 0;
+    } else if (sector >= M35FD_SECTORS) {
+        m35fd_set(d, m, m->state, me_bad_sector);
+        return 0;
+    }
+    m->writing = (uint8_t) writing;
+    m->sector = sector;
+    m->addr = d->reg[DR_Y];
+    if (writing) {
+        // take the data now, so the write is never partial
+        uint16_t i;
+        for (i = 0; i < M35FD_SECTOR_WORDS; ++i) {
+            m->buffer[i] = d->ram[(uint16_t) (m->addr + i)];
+        }
+    }
+    track = (uint16_t) (sector / M35FD_SECTORS_PER_TRACK);
+    dist = (uint16_t) (track > m->track ? track - m->track : m->track - track);
+    m->track = track;
+    dcpu_schedule(d, &m->hw,
+                  dist * M35FD_SEEK_CYCLES + M35FD_SECTOR_CYCLES, mv_done);
+    m35fd_set(d, m, ms_busy, me_none);
+    return 1;
+}
+
+static void m35fd_flush(struct m35fd *m, uint16_t sector) {
+    uint8_t buf[M35FD_SECTOR_WORDS * 2];
+    uint16_t *src = m->disk + (uint64_t) sector * M35FD_SECTOR_WORDS;
+    FILE *fp;
+    int i;
+    if (!m->file) {
+        return;
+    }
+    for (i = 0; i < M35FD_SECTOR_WORDS; ++i) {
+        buf[2 * i] = (uint8_t) (src[i] >> 8);
+        buf[2 * i + 1] = (uint8_t) src[i];
+    }
+    fp = fopen(m->file, "r+b");
+    if (!fp ||
+        fseek(fp, (long) sector * M35FD_SECTOR_WORDS * 2, SEEK_SET) != 0 ||
+        fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+        LOGERROR("Could not write sector %u back to %s", sector, m->file);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+static int m35fd_interrupt(struct dcpu *d, struct hw_device *hw) {
+    struct m35fd *m = (struct m35fd *) hw;
+    switch (d->reg[DR_A]) {
+        case 0: // Poll device
+            d->reg[DR_B] = m->state;
+            d->reg[DR_C] = m->error;
+            m->error = me_none;
+            break;
+        case 1: // Set interrupt
+            m->message = d->reg[DR_X];
+            break;
+        case 2: // Read sector
+            d->reg[DR_B] = (uint16_t) m35fd_start(d, m, 0);
+            break;
+        case 3: // Write sector
+            d->reg[DR_B] = (uint16_t) m35fd_start(d, m, 1);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void m35fd_event(struct dcpu *d, struct hw_device *hw, int kind) {
+    struct m35fd *m = (struct m35fd *) hw;
+    uint16_t *sec;
+    uint16_t i;
+    if (kind != mv_done) {
+        LOGERROR("Unknown M35FD event: %d", kind);
+        return;
+    }
+    sec = m->disk + (uint64_t) m->sector * M35FD_SECTOR_WORDS;
+    if (m->writing) {
+        memcpy(sec, m->buffer, sizeof(m->buffer));
+        m35fd_flush(m, m->sector);
+    } else {
+        for (i = 0; i < M35FD_SECTOR_WORDS; ++i) {
+            dcpu_write(d, (uint16_t) (m->addr + i), sec[i]);
+        }
+    }
+    m35fd_set(d, m, m->write_protect ? ms_ready_wp : ms_ready, me_none);
+}
+
+static void m35fd_free(struct hw_device *hw) {
+    struct m35fd *m = (struct m35fd *) hw;
+    if (m->disk) {
+        free(m->disk);
+    }
+    free(m);
+}
+
+// The controller state, followed by the whole disk when there is one
+static size_t m35fd_save(struct hw_device *hw, void *buf) {
+    struct m35fd *m = (struct m35fd *) hw;
+    size_t n = hw_state_save(hw, offsetof(struct m35fd, file), buf);
+    if (m->disk && buf) {
+        memcpy((uint8_t *) buf + n, m->disk, M35FD_DISK_WORDS * sizeof(uint16_t));
+    }
+    return n + (m->disk ? M35FD_DISK_WORDS * sizeof(uint16_t) : 0);
+}
+
+// Only the sectors that differ are copied back, and written through
+static void m35fd_restore(struct dcpu *d, struct hw_device *hw,
+                          const void *buf) {
+    struct m35fd *m = (struct m35fd *) hw;
+    size_t n = hw_state_restore(hw, offsetof(struct m35fd, file), buf);
+    const uint16_t *disk = (const uint16_t *) ((const uint8_t *) buf + n);
+    uint16_t s;
+    (void) d;
+    if (!m->disk) {
+        return;
+    }
+    for (s = 0; s < M35FD_SECTORS; ++s) {
+        uint64_t off = (uint64_t) s * M35FD_SECTOR_WORDS;
+        if (memcmp(m->disk + off, disk + off,
+                   M35FD_SECTOR_WORDS * sizeof(uint16_t)) != 0) {
+            memcpy(m->disk + off, disk + off,
+                   M35FD_SECTOR_WORDS * sizeof(uint16_t));
+            m35fd_flush(m, s);
+        }
+    }
+}
+
+static const struct hw_ops m35fd_ops = {
+        m35fd_interrupt,
+        m35fd_event,
+        m35fd_free,
+        NULL,
+        m35fd_save,
+        m35fd_restore
+};
+
+// Load a disk image of big endian words, short images are zero padded
+static int m35fd_load(struct m35fd *m, char *file) {
+    uint8_t buf[2];
+    uint64_t i = 0;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open disk image: %s", file);
+        return -1;
+    }
+    while (i < M35FD_DISK_WORDS && fread(buf, 1, 2, fp) == 2) {
+        m->disk[i++] = (uint16_t) (buf[0] << 8 | buf[1]);
+    }
+    fclose(fp);
+    return 0;
+}
+
+// 'disk' may be NULL for a drive without media
+struct hw_device *m35fd_new(char *disk, int write_protect) {
+    struct m35fd *m = calloc(1, sizeof(struct m35fd));
+    if (!m) {
+        LOGERROR("Cannot allocate memory for the M35FD");
+        return NULL;
+    }
+    m->hw.hw_id = M35FD_ID;
+    m->hw.hw_version = M35FD_VERSION;
+    m->hw.hw_manufacturer = MANUFACTURER_MACKAPAR;
+    m->hw.hw_ops = &m35fd_ops;
+    m->state = ms_no_media;
+    if (disk) {
+        m->disk = calloc(M35FD_DISK_WORDS, sizeof(uint16_t));
+        if (!m->disk) {
+            LOGERROR("Cannot allocate memory for the floppy");
+            free(m);
+            return NULL;
+        }
+        if (m35fd_load(m, disk) < 0) {
+            m35fd_free(&m->hw);
+            return NULL;
+        }
+        m->file = write_protect ? NULL : disk;
+        m->write_protect = (uint8_t) (write_protect != 0);
+        m->state = write_protect ? ms_ready_wp : ms_ready;
+    }
+    return &m->hw;
+}
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+
+#include "hardware.h"
+
+// SPC2000 suspension chamber, see docs/sleep-chamber.txt
+// The emulated vessel is always in a vacuum, fuelled and at rest, so the
+// chamber is ready to trigger. Triggering only records the skipped time:
+// from inside the field no time passes.
+
+#define SPC2000_ID       0x40e41d9d
+#define SPC2000_VERSION  0x005e
+
+enum spc2000_unit {
+    su_milliseconds,
+    su_minutes,
+    su_days,
+    su_years,
+};
+
+struct spc2000 {
+    struct hw_device hw;
+    uint64_t skip;          /* Number of units to skip */
+    uint16_t unit;          /* One of spc2000_unit */
+    uint64_t triggered;     /* Number of times the chamber was triggered */
+};
+
+static void spc2000_status(struct dcpu *d) {
+    d->reg[DR_C] = 1;
+}
+
+static int spc2000_interrupt(struct dcpu *d, struct hw_device *hw) {
+    struct spc2000 *s = (struct spc2000 *) hw;
+    uint16_t b = d->reg[DR_B];
+    int i;
+    switch (d->reg[DR_A]) {
+        case 0: // GET_STATUS
+            spc2000_status(d);
+            break;
+        case 1: // SET_UNIT_TO_SKIP, 64 bit big endian number at [B]
+            s->skip = 0;
+            for (i = 0; i < 4; ++i) {
+                s->skip = (s->skip << 16) | d->ram[(uint16_t) (b + i)];
+            }
+            break;
+        case 2: // TRIGGER_DEVICE
+            spc2000_status(d);
+            if (d->reg[DR_C] == 1) {
+                s->triggered++;
+            }
+            break;
+        case 3: // SET_SKIP_UNIT
+            if (b <= su_years) {
+                s->unit = b;
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void spc2000_event(struct dcpu *d, struct hw_device *hw, int kind) {
+    (void) d;
+    (void) hw;
+    LOGERROR("Unknown SPC2000 event: %d", kind);
+}
+
+static void spc2000_free(struct hw_device *hw) {
+    free(hw);
+}
+
+static size_t spc2000_save(struct hw_device *hw, void *buf) {
+    return hw_state_save(hw, sizeof(struct spc2000), buf);
+}
+
+static void spc2000_restore(struct dcpu *d, struct hw_device *hw, const void *buf) {
+    (void) d;
+    hw_state_restore(hw, sizeof(struct spc2000), buf);
+}
+
+static const struct hw_ops spc2000_ops = {
+        spc2000_interrupt,
+        spc2000_event,
+        spc2000_free,
+        NULL,
+        spc2000_save,
+        spc2000_restore
+};
+
+struct hw_device *spc2000_new(void) {
+    struct spc2000 *s = calloc(1, sizeof(struct spc2000));
+    if (!s) {
+        LOGERROR("Cannot allocate memory for the SPC2000");
+        return NULL;
+    }
+    s->hw.hw_id = SPC2000_ID;
+    s->hw.hw_version = SPC2000_VERSION;
+    s->hw.hw_manufacturer = MANUFACTURER_NYA_ELEKTRISKA;
+    s->hw.hw_ops = &spc2000_ops;
+    return &s->hw;
+}
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+
+#include "hardware.h"
+
+// SPED-3 vector display, see docs/3d-vector-display.txt
+
+#define SPED3_ID       0x42babf3c
+#define SPED3_VERSION  0x0003
+
+/* The emitters turn at 50 degrees per second */
+#define SPED3_DEGREE_CYCLES (DCPU_CLOCK_HZ / 50)
+
+enum sped3_state {
+    ss_no_data,
+    ss_running,
+    ss_turning,
+};
+
+enum sped3_event {
+    sv_turned,          /* The emitters reached the target rotation */
+};
+
+struct sped3 {
+    struct hw_device hw;
+    uint16_t state;
+    uint16_t error;
+    uint16_t region;        /* Vertex memory map offset */
+    uint16_t vertices;      /* Number of vertices to render */
+    uint16_t rotation;      /* Current rotation in degrees */
+    uint16_t target;        /* Target rotation in degrees */
+};
+
+static inline uint16_t sped3_idle_state(struct sped3 *s) {
+    return (uint16_t) (s->vertices ? ss_running : ss_no_data);
+}
+
+static int sped3_interrupt(struct dcpu *d, struct hw_device *hw) {
+    struct sped3 *s = (struct sped3 *) hw;
+    uint16_t dist;
+    switch (d->reg[DR_A]) {
+        case 0: // Poll device
+            d->reg[DR_B] = s->state;
+            d->reg[DR_C] = s->error;
+            s->error = 0;
+            break;
+        case 1: // Map region
+            s->region = d->reg[DR_X];
+            s->vertices = d->reg[DR_Y];
+            if (s->state != ss_turning) {
+                s->state = sped3_idle_state(s);
+            }
+            break;
+        case 2: // Rotate device, along the shorter way round
+            s->target = (uint16_t) (d->reg[DR_X] % 360);
+            dist = (uint16_t) ((s->target + 360 - s->rotation) % 360);
+            if (dist > 180) {
+                dist = (uint16_t) (360 - dist);
+            }
+            sched_cancel(&d->sched, hw, sv_turned);
+            if (dist) {
+                s->state = ss_turning;
+                dcpu_schedule(d, hw, (uint64_t) dist * SPED3_DEGREE_CYCLES,
+                              sv_turned);
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void sped3_event(struct dcpu *d, struct hw_device *hw, int kind) {
+    struct sped3 *s = (struct sped3 *) hw;
+    (void) d;
+    if (kind != sv_turned) {
+        LOGERROR("Unknown SPED-3 event: %d", kind);
+        return;
+    }
+    s->rotation = s->target;
+    s->state = sped3_idle_state(s);
+}
+
+static void sped3_free(struct hw_device *hw) {
+    free(hw);
+}
+
+static size_t sped3_save(struct hw_device *hw, void *buf) {
+    return hw_state_save(hw, sizeof(struct sped3), buf);
+}
+
+static void sped3_restore(struct dcpu *d, struct hw_device *hw, const void *buf) {
+    (void) d;
+    hw_state_restore(hw, sizeof(struct sped3), buf);
+}
+
+static const struct hw_ops sped3_ops = {
+        sped3_interrupt,
+        sped3_event,
+        sped3_free,
+        NULL,
+        sped3_save,
+        sped3_restore
+};
+
+struct hw_device *sped3_new(void) {
+    struct sped3 *s = calloc(1, sizeof(struct sped3));
+    if (!s) {
+        LOGERROR("Cannot allocate memory for the SPED-3");
+        return NULL;
+    }
+    s->hw.hw_id = SPED3_ID;
+    s->hw.hw_version = SPED3_VERSION;
+    s->hw.hw_manufacturer = MANUFACTURER_MACKAPAR;
+    s->hw.hw_ops = &sped3_ops;
+    return &s->hw;
+}
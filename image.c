@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+/* Largest payload of a stored deflate block */
+#define DEFLATE_STORED_MAX 0xffff
+
+int image_write_ppm(char *file, uint8_t *rgb, int w, int h) {
+    size_t size = (size_t) w * h * 3;
+    FILE *fp = fopen(file, "wb");
+    if (!fp) {
+        LOGERROR("Unable to open file: %s", file);
+        return -1;
+    }
+    fprintf(fp, "P6\n%d %d\n255\n", w, h);
+    if (fwrite(rgb, 1, size, fp) != size) {
+        fclose(fp);
+        LOGERROR("Could not write %s", file);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    uint32_t c, n, k;
+    if (crc_table[1]) {
+        return;
+    }
+    for (n = 0; n < 256; ++n) {
+        c = n;
+        for (k = 0; k < 8; ++k) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, uint8_t *buf, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static inline uint8_t *put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+    return p + 4;
+}
+
+// Write a PNG chunk, 'data' points at the 4 byte type followed by the body
+static int png_chunk(FILE *fp, uint8_t *data, uint32_t len) {
+    uint8_t hdr[4], crc[4];
+    put_be32(hdr, len);
+    put_be32(crc, ~crc_update(0xffffffff, data, len + 4));
+    return fwrite(hdr, 1, 4, fp) == 4 &&
+           fwrite(data, 1, len + 4, fp) == len + 4 &&
+           fwrite(crc, 1, 4, fp) == 4 ? 0 : -1;
+}
+
+// PNG with the image data in stored (uncompressed) deflate blocks. Frames
+// are small and this keeps zlib out of the build.
+int image_write_png(char *file, uint8_t *rgb, int w, int h) {
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    uint8_t ihdr[4 + 13], iend[4] = {'I', 'E', 'N', 'D'};
+    size_t stride = (size_t) w * 3 + 1, raw_len = stride * h;
+    size_t blocks = (raw_len + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX;
+    size_t idat_len = 2 + raw_len + blocks * 5 + 4, i, n;
+    uint8_t *raw, *idat, *p;
+    uint32_t s1 = 1, s2 = 0;
+    FILE *fp;
+    int y, rc;
+
+    crc_init();
+    raw = malloc(raw_len);
+    idat = malloc(4 + idat_len);
+    if (!raw || !idat) {
+        free(raw);
+        free(idat);
+        LOGERROR("Cannot allocate memory for the PNG encoder");
+        return -1;
+    }
+    // every row starts with filter type 0 (none)
+    for (y = 0; y < h; ++y) {
+        raw[y * stride] = 0;
+        memcpy(raw + y * stride + 1, rgb + (size_t) y * w * 3, stride - 1);
+    }
+    // zlib stream: header, stored blocks, adler32 of the raw data
+    p = idat;
+    memcpy(p, "IDAT", 4);
+    p += 4;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    for (i = 0; i < raw_len; i += n) {
+        n = raw_len - i < DEFLATE_STORED_MAX ? raw_len - i : DEFLATE_STORED_MAX;
+        *p++ = (uint8_t) (i + n == raw_len);
+        *p++ = (uint8_t) n;
+        *p++ = (uint8_t) (n >> 8);
+        *p++ = (uint8_t) ~n;
+        *p++ = (uint8_t) (~n >> 8);
+        memcpy(p, raw + i, n);
+        p += n;
+    }
+    for (i = 0; i < raw_len; ++i) {
+        s1 = (s1 + raw[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    put_be32(p, s2 << 16 | s1);
+
+    p = ihdr;
+    memcpy(p, "IHDR", 4);
+    p = put_be32(p + 4, (uint32_t) w);
+    p = put_be32(p, (uint32_t) h);
+    *p++ = 8;   // bit depth
+    *p++ = 2;   // colour type: RGB
+    *p++ = 0;   // deflate
+    *p++ = 0;   // adaptive filtering
+    *p = 0;     // no interlace
+
+    fp = fopen(file, "wb");
+    if (!fp) {
+        free(raw);
+        free(idat);
+        LOGERROR("Unable to open file: %s", file);
+        return -1;
+    }
+    rc = fwrite(signature, 1, sizeof(signature), fp) == sizeof(signature) &&
+         png_chunk(fp, ihdr, 13) == 0 &&
+         png_chunk(fp, idat, (uint32_t) idat_len) == 0 &&
+         png_chunk(fp, iend, 0) == 0 ? 0 : -1;
+    fclose(fp);
+    free(raw);
+    free(idat);
+    if (rc < 0) {
+        LOGERROR("Could not write %s", file);
+    }
+    return rc;
+}
+
+// Pick the format from the file extension, PPM unless it ends in .png
+int image_write(char *file, uint8_t *rgb, int w, int h) {
+    size_t len = strlen(file);
+    if (len > 4 && !strcmp(file + len - 4, ".png")) {
+        return image_write_png(file, rgb, w, h);
+    }
+    return image_write_ppm(file, rgb, w, h);
+}
+
+// FNV-1a over the pixels, lets tests compare screens without files
+uint64_t image_hash(uint8_t *rgb, int w, int h) {
+    uint64_t hash = FNV_OFFSET;
+    size_t i, size = (size_t) w * h * 3;
+    for (i = 0; i < size; ++i) {
+        hash = (hash ^ rgb[i]) * FNV_PRIME;
+    }
+    return hash;
+}
@@ -0,0 +1,12 @@
+#ifndef ASSEMBLER_IMAGE_H
+#define ASSEMBLER_IMAGE_H
+
+#include "common.h"
+
+/* Pixels are packed 8 bit RGB, row after row */
+int      image_write_ppm(char *file, uint8_t *rgb, int w, int h);
+int      image_write_png(char *file, uint8_t *rgb, int w, int h);
+int      image_write(char *file, uint8_t *rgb, int w, int h);
+uint64_t image_hash(uint8_t *rgb, int w, int h);
+
+#endif //ASSEMBLER_IMAGE_H
@@ -0,0 +1,477 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "json.h"
+
+// Just enough JSON for the language server and the diagnostics: a
+// validating parser that records where every value is, and an output
+// buffer. Strings are only unescaped when asked for.
+
+#define JSON_MAX_DEPTH 64
+
+struct json_parser {
+    struct json_doc *jp_doc;
+    const char      *jp_text;
+    size_t           jp_len;
+    size_t           jp_pos;
+};
+
+static inline void skip_ws(struct json_parser *p) {
+    while (p->jp_pos < p->jp_len &&
+           (p->jp_text[p->jp_pos] == ' ' || p->jp_text[p->jp_pos] == '\t' ||
+            p->jp_text[p->jp_pos] == '\n' || p->jp_text[p->jp_pos] == '\r')) {
+        p->jp_pos++;
+    }
+}
+
+static int new_node(struct json_parser *p, enum json_type type) {
+    struct json_doc *d = p->jp_doc;
+    struct json_node *grown;
+    uint32_t cap;
+    if (d->jd_count == d->jd_cap) {
+        cap = d->jd_cap ? d->jd_cap * 2 : 64;
+        grown = realloc(d->jd_node, sizeof(struct json_node) * cap);
+        if (!grown) {
+            LOGERROR("No memory for a JSON node");
+            return -1;
+        }
+        d->jd_node = grown;
+        d->jd_cap = cap;
+    }
+    memset(&d->jd_node[d->jd_count], 0, sizeof(struct json_node));
+    d->jd_node[d->jd_count].jn_type = type;
+    d->jd_node[d->jd_count].jn_start = (uint32_t) p->jp_pos;
+    return (int) d->jd_count++;
+}
+
+static int parse_value(struct json_parser *p, int depth);
+
+static int parse_string(struct json_parser *p) {
+    int n = new_node(p, jt_string);
+    char c;
+    if (n < 0) {
+        return -1;
+    }
+    p->jp_doc->jd_node[n].jn_start = (uint32_t) ++p->jp_pos;
+    while (p->jp_pos < p->jp_len && (c = p->jp_text[p->jp_pos]) != '"') {
+        if ((unsigned char) c < 0x20) {
+            return -1;
+        }
+        p->jp_pos += c == '\\' ? 2 : 1;
+    }
+    if (p->jp_pos >= p->jp_len) {
+        return -1;
+    }
+    p->jp_doc->jd_node[n].jn_end = (uint32_t) p->jp_pos++;
+    p->jp_doc->jd_node[n].jn_skip = 1;
+    return n;
+}
+
+static int parse_primitive(struct json_parser *p) {
+    int n = new_node(p, jt_primitive);
+    char c;
+    if (n < 0) {
+        return -1;
+    }
+    while (p->jp_pos < p->jp_len) {
+        c = p->jp_text[p->jp_pos];
+        if (!(c == '-' || c == '+' || c == '.' ||
+              (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+              (c >= 'A' && c <= 'Z'))) {
+            break;
+        }
+        p->jp_pos++;
+    }
+    if (p->jp_pos == p->jp_doc->jd_node[n].jn_start) {
+        return -1;
+    }
+    p->jp_doc->jd_node[n].jn_end = (uint32_t) p->jp_pos;
+    p->jp_doc->jd_node[n].jn_skip = 1;
+    return n;
+}
+
+// An object or an array, p->jp_pos on its opening bracket
+static int parse_container(struct json_parser *p, int depth) {
+    int is_obj = p->jp_text[p->jp_pos] == '{';
+    char close = is_obj ? '}' : ']';
+    int n = new_node(p, is_obj ? jt_object : jt_array);
+    uint32_t size = 0;
+    if (n < 0 || depth > JSON_MAX_DEPTH) {
+        return -1;
+    }
+    p->jp_pos++;
+    skip_ws(p);
+    if (p->jp_pos < p->jp_len && p->jp_text[p->jp_pos] == close) {
+        p->jp_pos++;
+    } else {
+        for (;;) {
+            if (is_obj) {
+                skip_ws(p);
+                if (p->jp_pos >= p->jp_len || p->jp_text[p->jp_pos] != '"' ||
+                    parse_string(p) < 0) {
+                    return -1;
+                }
+                skip_ws(p);
+                if (p->jp_pos >= p->jp_len || p->jp_text[p->jp_pos] != ':') {
+                    return -1;
+                }
+                p->jp_pos++;
+                size++;
+            }
+            if (parse_value(p, depth + 1) < 0) {
+                return -1;
+            }
+            size++;
+            skip_ws(p);
+            if (p->jp_pos >= p->jp_len) {
+                return -1;
+            }
+            if (p->jp_text[p->jp_pos] == ',') {
+                p->jp_pos++;
+                continue;
+            }
+            if (p->jp_text[p->jp_pos] != close) {
+                return -1;
+            }
+            p->jp_pos++;
+            break;
+        }
+    }
+    p->jp_doc->jd_node[n].jn_end = (uint32_t) p->jp_pos;
+    p->jp_doc->jd_node[n].jn_size = size;
+    p->jp_doc->jd_node[n].jn_skip = p->jp_doc->jd_count - (uint32_t) n;
+    return n;
+}
+
+static int parse_value(struct json_parser *p, int depth) {
+    skip_ws(p);
+    if (p->jp_pos >= p->jp_len) {
+        return -1;
+    }
+    switch (p->jp_text[p->jp_pos]) {
+        case '{':
+        case '[':
+            return parse_container(p, depth);
+        case '"':
+            return parse_string(p);
+        default:
+            return parse_primitive(p);
+    }
+}
+
+int json_parse(struct json_doc *d, const char *text, size_t len) {
+    struct json_parser p;
+    if (len > UINT32_MAX) {
+        return -1;
+    }
+    d->jd_text = text;
+    d->jd_count = 0;
+    p.jp_doc = d;
+    p.jp_text = text;
+    p.jp_len = len;
+    p.jp_pos = 0;
+    if (parse_value(&p, 0) < 0) {
+        return -1;
+    }
+    skip_ws(&p);
+    return p.jp_pos == len ? 0 : -1;
+}
+
+void json_free(struct json_doc *d) {
+    free(d->jd_node);
+    memset(d, 0, sizeof(*d));
+}
+
+int json_is(const struct json_doc *d, int n, const char *s) {
+    const struct json_node *jn;
+    size_t len = strlen(s);
+    if (n < 0 || d->jd_node[n].jn_type != jt_string) {
+        return 0;
+    }
+    jn = &d->jd_node[n];
+    return jn->jn_end - jn->jn_start == len &&
+           !memcmp(d->jd_text + jn->jn_start, s, len);
+}
+
+int json_get(const struct json_doc *d, int obj, const char *key) {
+    uint32_t i, k;
+    if (obj < 0 || d->jd_node[obj].jn_type != jt_object) {
+        return -1;
+    }
+    k = (uint32_t) obj + 1;
+    for (i = 0; i < d->jd_node[obj].jn_size; i += 2) {
+        if (json_is(d, (int) k, key)) {
+            return (int) k + 1;
+        }
+        k += 1 + d->jd_node[k + 1].jn_skip;
+    }
+    return -1;
+}
+
+int json_path(const struct json_doc *d, int obj, const char *path) {
+    char key[64];
+    const char *dot;
+    size_t n;
+    while (obj >= 0 && *path) {
+        dot = strchr(path, '.');
+        n = dot ? (size_t) (dot - path) : strlen(path);
+        if (n >= sizeof(key)) {
+            return -1;
+        }
+        memcpy(key, path, n);
+        key[n] = '\0';
+        obj = json_get(d, obj, key);
+        path += dot ? n + 1 : n;
+    }
+    return obj;
+}
+
+int json_elem(const struct json_doc *d, int arr, uint32_t i) {
+    uint32_t k, j;
+    if (arr < 0 || d->jd_node[arr].jn_type != jt_array ||
+        i >= d->jd_node[arr].jn_size) {
+        return -1;
+    }
+    k = (uint32_t) arr + 1;
+    for (j = 0; j < i; ++j) {
+        k += d->jd_node[k].jn_skip;
+    }
+    return (int) k;
+}
+
+int64_t json_int(const struct json_doc *d, int n, int64_t dflt) {
+    const struct json_node *jn;
+    int64_t v = 0;
+    uint32_t i;
+    int neg = 0;
+    if (n < 0 || d->jd_node[n].jn_type != jt_primitive) {
+        return dflt;
+    }
+    jn = &d->jd_node[n];
+    i = jn->jn_start;
+    if (d->jd_text[i] == '-') {
+        neg = 1;
+        ++i;
+    }
+    if (i == jn->jn_end) {
+        return dflt;
+    }
+    for (; i < jn->jn_end; ++i) {
+        if (d->jd_text[i] < '0' || d->jd_text[i] > '9') {
+            return dflt;
+        }
+        v = v * 10 + (d->jd_text[i] - '0');
+    }
+    return neg ? -v : v;
+}
+
+int json_bool(const struct json_doc *d, int n, int dflt) {
+    const struct json_node *jn;
+    if (n < 0 || d->jd_node[n].jn_type != jt_primitive) {
+        return dflt;
+    }
+    jn = &d->jd_node[n];
+    if (jn->jn_end - jn->jn_start == 4 &&
+        !memcmp(d->jd_text + jn->jn_start, "true", 4)) {
+        return 1;
+    }
+    if (jn->jn_end - jn->jn_start == 5 &&
+        !memcmp(d->jd_text + jn->jn_start, "false", 5)) {
+        return 0;
+    }
+    return dflt;
+}
+
+static inline int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Code unit of a \uXXXX escape at s, -1 if it is not one
+static inline int32_t utf16_unit(const char *s, const char *end) {
+    int32_t v = 0;
+    int i, h;
+    if (end - s < 6 || s[0] != '\\' || s[1] != 'u') {
+        return -1;
+    }
+    for (i = 2; i < 6; ++i) {
+        if ((h = hex_digit(s[i])) < 0) {
+            return -1;
+        }
+        v = v * 16 + h;
+    }
+    return v;
+}
+
+static inline char *put_utf8(char *o, uint32_t cp) {
+    if (cp < 0x80) {
+        *o++ = (char) cp;
+    } else if (cp < 0x800) {
+        *o++ = (char) (0xc0 | (cp >> 6));
+        *o++ = (char) (0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *o++ = (char) (0xe0 | (cp >> 12));
+        *o++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *o++ = (char) (0x80 | (cp & 0x3f));
+    } else {
+        *o++ = (char) (0xf0 | (cp >> 18));
+        *o++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+        *o++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *o++ = (char) (0x80 | (cp & 0x3f));
+    }
+    return o;
+}
+
+char *json_string(const struct json_doc *d, int n, size_t *len) {
+    const char *s, *end;
+    char *out, *o;
+    int32_t u, lo;
+    if (n < 0 || d->jd_node[n].jn_type != jt_string) {
+        return NULL;
+    }
+    s = d->jd_text + d->jd_node[n].jn_start;
+    end = d->jd_text + d->jd_node[n].jn_end;
+    // escapes never get longer once undone
+    out = o = malloc((size_t) (end - s) + 1);
+    if (!out) {
+        LOGERROR("No memory for a JSON string");
+        return NULL;
+    }
+    while (s < end) {
+        if (*s != '\\') {
+            *o++ = *s++;
+            continue;
+        }
+        switch (s[1]) {
+            case 'n': *o++ = '\n'; break;
+            case 't': *o++ = '\t'; break;
+            case 'r': *o++ = '\r'; break;
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'u':
+                if ((u = utf16_unit(s, end)) < 0) {
+                    free(out);
+                    return NULL;
+                }
+                s += 6;
+                // a surrogate pair is one code point
+                if (u >= 0xd800 && u < 0xdc00 &&
+                    (lo = utf16_unit(s, end)) >= 0xdc00 && lo < 0xe000) {
+                    u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+                    s += 6;
+                }
+                o = put_utf8(o, (uint32_t) u);
+                continue;
+            default:
+                *o++ = s[1];
+                break;
+        }
+        s += 2;
+    }
+    *o = '\0';
+    *len = (size_t) (o - out);
+    return out;
+}
+
+static int reserve(struct json_out *o, size_t n) {
+    size_t cap;
+    char *grown;
+    if (o->jo_err) {
+        return -1;
+    }
+    if (o->jo_len + n + 1 <= o->jo_cap) {
+        return 0;
+    }
+    cap = o->jo_cap ? o->jo_cap : 256;
+    while (cap < o->jo_len + n + 1) {
+        cap *= 2;
+    }
+    grown = realloc(o->jo_buf, cap);
+    if (!grown) {
+        LOGERROR("No memory for the JSON output");
+        o->jo_err = 1;
+        return -1;
+    }
+    o->jo_buf = grown;
+    o->jo_cap = cap;
+    return 0;
+}
+
+void json_raw(struct json_out *o, const char *s, size_t n) {
+    if (reserve(o, n) < 0) {
+        return;
+    }
+    memcpy(o->jo_buf + o->jo_len, s, n);
+    o->jo_len += n;
+    o->jo_buf[o->jo_len] = '\0';
+}
+
+void json_printf(struct json_out *o, const char *fmt, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || reserve(o, (size_t) n) < 0) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(o->jo_buf + o->jo_len, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    o->jo_len += (size_t) n;
+}
+
+void json_quote(struct json_out *o, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i, run = 0;
+    char esc[6];
+    json_raw(o, "\"", 1);
+    for (i = 0; i < n; ++i) {
+        unsigned char c = (unsigned char) s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        json_raw(o, s + run, i - run);
+        run = i + 1;
+        esc[0] = '\\';
+        switch (c) {
+            case '"': json_raw(o, "\\\"", 2); break;
+            case '\\': json_raw(o, "\\\\", 2); break;
+            case '\n': json_raw(o, "\\n", 2); break;
+            case '\t': json_raw(o, "\\t", 2); break;
+            case '\r': json_raw(o, "\\r", 2); break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                json_raw(o, esc, 6);
+                break;
+        }
+    }
+    json_raw(o, s + run, n - run);
+    json_raw(o, "\"", 1);
+}
+
+void json_copy(struct json_out *o, const struct json_doc *d, int n) {
+    const struct json_node *jn = &d->jd_node[n];
+    if (jn->jn_type == jt_string) {
+        // the quotes are outside the node
+        json_raw(o, d->jd_text + jn->jn_start - 1,
+                 jn->jn_end - jn->jn_start + 2);
+    } else {
+        json_raw(o, d->jd_text + jn->jn_start, jn->jn_end - jn->jn_start);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef ASSEMBLER_JSON_H
+#define ASSEMBLER_JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum json_type {
+    jt_invalid,
+    jt_object,
+    jt_array,
+    jt_string,      /* Without its quotes, escapes still in */
+    jt_primitive,   /* Number, true, false or null */
+};
+
+// A parsed document is a flat array of nodes in document order. The
+// children of a node follow it, and jn_skip tells where its subtree ends.
+// Object members are a key node then a value node.
+struct json_node {
+    enum json_type jn_type;
+    uint32_t       jn_start;     /* Offsets into the text */
+    uint32_t       jn_end;
+    uint32_t       jn_size;      /* Children, key and value counted apart */
+    uint32_t       jn_skip;      /* Nodes in the subtree, itself included */
+};
+
+struct json_doc {
+    const char       *jd_text;
+    struct json_node *jd_node;
+    uint32_t          jd_count;
+    uint32_t          jd_cap;
+};
+
+/* Parse text[0, len) into d, reusing its node array. 0 or -1. */
+int         json_parse(struct json_doc *d, const char *text, size_t len);
+void        json_free(struct json_doc *d);
+/* Node of the value of key in object obj, -1 if there is none */
+int         json_get(const struct json_doc *d, int obj, const char *key);
+/* json_get() down a path of keys separated by '.' */
+int         json_path(const struct json_doc *d, int obj, const char *path);
+/* Node of the i-th element of array arr, -1 past the end */
+int         json_elem(const struct json_doc *d, int arr, uint32_t i);
+/* The number at node n, dflt if n is not one */
+int64_t     json_int(const struct json_doc *d, int n, int64_t dflt);
+/* true or false at node n, dflt if it is neither */
+int         json_bool(const struct json_doc *d, int n, int dflt);
+/* Is node n the string s */
+int         json_is(const struct json_doc *d, int n, const char *s);
+/* The string at node n with its escapes undone, malloc()ed and NUL
+ * terminated, its length in len. NULL if n is not a string. */
+char       *json_string(const struct json_doc *d, int n, size_t *len);
+
+/* Output, grown as needed */
+struct json_out {
+    char   *jo_buf;
+    size_t  jo_len;
+    size_t  jo_cap;
+    int     jo_err;       /* Ran out of memory, jo_buf is incomplete */
+};
+
+void json_raw(struct json_out *o, const char *s, size_t n);
+void json_printf(struct json_out *o, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+/* s[0, n) as a quoted JSON string */
+void json_quote(struct json_out *o, const char *s, size_t n);
+/* The JSON text of node n, as it was */
+void json_copy(struct json_out *o, const struct json_doc *d, int n);
+
+#endif //ASSEMBLER_JSON_H
@@ -0,0 +1,533 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_code.h"
+#include "expr.h"
+#include "layout.h"
+#include "stats.h"
+
+// Layout pass, between tokenizing and pass 1. A label in operand a fits in
+// the opcode word when pass 1 has already placed it at 0x1e or below, and
+// costs a word of its own, and a cycle every time it runs, otherwise. So
+// does an expression of a label in operand a, when it comes to -1 to 30.
+//
+// The program is cut into blocks control never falls out of: a block
+// starts at a label after an unconditional jump (SET PC not under an IF,
+// or RFI) and runs up to the next such label. The blocks whose labels are
+// referenced most are moved right behind the entry block, into those first
+// 31 words, and every other block keeps its source order. The entry block,
+// a block after .pin and a last block that runs off the end stay put, and
+// a source with .org or .reserve, or an operand that takes one label from
+// another, is left alone.
+//
+// References are counted in the source, or taken from a profile of
+// "<label> <count>" lines, the count being how often each reference to the
+// label runs.
+
+#define SHORT_MAX   0x1e     /* Highest address an inline literal holds */
+#define OP_SET      0x01
+#define OP_IFB      0x10
+#define OP_IFU      0x17
+#define OP_RFI      0x0b
+#define OPD_PC      0x1c
+
+struct lay_ref {
+    struct label *lr_def;        /* The label pointer referred to */
+    uint64_t      lr_weight;
+    uint64_t      lr_blk;        /* The block it is in */
+    uint64_t      lr_off;        /* Its word in that block */
+};
+
+struct lay_block {
+    struct token *lb_head;       /* First and last top level token */
+    struct token *lb_tail;
+    uint64_t      lb_ref0;       /* Its labels in operand a, bare or not */
+    uint64_t      lb_nrefs;
+    uint64_t      lb_words;      /* In the source order */
+    uint64_t      lb_weight;     /* Of references it could make short */
+    uint64_t      lb_addr;       /* From the last simulate() */
+    int           lb_fixed;
+};
+
+struct lay_count {
+    char     *lc_name;
+    uint64_t  lc_len;
+    uint64_t  lc_count;
+};
+
+struct layout {
+    struct lay_block  *ly_blk;
+    uint64_t           ly_nblk;
+    struct lay_ref    *ly_ref;
+    uint64_t           ly_nref;
+    uint64_t           ly_moved;     /* Blocks put behind the entry block */
+    struct lay_count  *ly_prof;
+    uint64_t           ly_nprof;
+    char              *ly_prof_text;
+};
+
+int layout_is_jump(struct token *t) {
+    struct token *b = t->right;
+    if (t->type == tt_special_opcode) {
+        return t->ttu_opc == OP_RFI;
+    }
+    return t->type == tt_basic_opcode && t->ttu_opc == OP_SET &&
+           b->type == tt_operand && b->ttu_opd.opd_type == ot_reg &&
+           b->ttu_opd.opd_opcode_val == OPD_PC;
+}
+
+int layout_is_if(struct token *t) {
+    return t->type == tt_basic_opcode && t->ttu_opc >= OP_IFB &&
+           t->ttu_opc <= OP_IFU;
+}
+
+// An expression in operand a, which pass 1 may fold inline. In a source
+// that is laid out it names a single label, see expr_spans().
+static inline int is_short_expr(struct token *op) {
+    return op->type == tt_operand && !op->right &&
+           op->ttu_opd.opd_type == ot_literal && op->ttu_opd.opd_expr;
+}
+
+// The label of such an expression
+static struct expr_item *expr_label(struct expr *e) {
+    struct expr_item *it = e->ex_item;
+    while (it->ei_op != eo_label) {
+        ++it;
+    }
+    return it;
+}
+
+static int label_at(void *arg, const struct expr_item *it, int64_t *value) {
+    struct label *def = arg;
+    (void) it;
+    *value = (int64_t) def->lbl_off - 1;
+    return 0;
+}
+
+// Does the label operand op, or the expression, fit in the opcode word
+// with def placed as simulate() has it
+static int fits_inline(struct token *op, struct label *def) {
+    int64_t value;
+    if (!def->lbl_off) {
+        return 0;
+    }
+    if (op->type == tt_label) {
+        return def->lbl_off - 1 <= SHORT_MAX;
+    }
+    return expr_value(op->ttu_opd.opd_expr, label_at, def, &value) == 0 &&
+           value >= -1 && value <= SHORT_MAX;
+}
+
+static int count_cmp(const void *x, const void *y) {
+    const struct lay_count *p = x, *q = y;
+    uint64_t n = p->lc_len < q->lc_len ? p->lc_len : q->lc_len;
+    int c = strncmp(p->lc_name, q->lc_name, n);
+    if (c) {
+        return c;
+    }
+    return p->lc_len < q->lc_len ? -1 : p->lc_len > q->lc_len;
+}
+
+static int read_profile(struct assembler *a, struct layout *ly) {
+    FILE *fp = fopen(a->layout_profile, "rb");
+    struct lay_count *grown;
+    uint64_t cap = 0, size, len;
+    char *s, *end, *name;
+
+    if (!fp) {
+        LOGERROR("Unable to open the layout profile %s", a->layout_profile);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = (uint64_t) ftell(fp);
+    rewind(fp);
+    ly->ly_prof_text = malloc(size + 1);
+    if (!ly->ly_prof_text ||
+        fread(ly->ly_prof_text, 1, size, fp) != size) {
+        LOGERROR("Could not read the layout profile %s", a->layout_profile);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    ly->ly_prof_text[size] = '\0';
+    ASM_STAT(a, ac_bytes, size + 1);
+    for (s = ly->ly_prof_text; *s; ) {
+        while (isspace((unsigned char) *s)) {
+            ++s;
+        }
+        if (*s == ';' || *s == '#') {
+            while (*s && *s != '\n') {
+                ++s;
+            }
+            continue;
+        }
+        if (!*s) {
+            break;
+        }
+        name = s;
+        while (*s && !isspace((unsigned char) *s)) {
+            ++s;
+        }
+        len = (uint64_t) (s - name);
+        if (ly->ly_nprof == cap) {
+            cap = cap ? cap * 2 : 64;
+            grown = realloc(ly->ly_prof, sizeof(struct lay_count) * cap);
+            if (!grown) {
+                LOGERROR("No more memory for the layout profile");
+                return -1;
+            }
+            ASM_STAT(a, ac_bytes,
+                     sizeof(struct lay_count) * (cap - ly->ly_nprof));
+            ly->ly_prof = grown;
+        }
+        ly->ly_prof[ly->ly_nprof].lc_name = name;
+        ly->ly_prof[ly->ly_nprof].lc_len = len;
+        ly->ly_prof[ly->ly_nprof].lc_count = strtoull(s, &end, 0);
+        if (end == s) {
+            fprintf(stderr, "%s: no count for '%.*s'\n", a->layout_profile,
+                    (int) (len < 64 ? len : 64), name);
+            return -1;
+        }
+        ++ly->ly_nprof;
+        s = end;
+    }
+    qsort(ly->ly_prof, ly->ly_nprof, sizeof(struct lay_count), count_cmp);
+    return 0;
+}
+
+static uint64_t label_weight(struct layout *ly, struct label *l) {
+    struct lay_count key, *hit;
+    if (!ly->ly_prof_text) {
+        return 1;
+    }
+    key.lc_name = l->lbl_name;
+    key.lc_len = l->lbl_len;
+    hit = bsearch(&key, ly->ly_prof, ly->ly_nprof, sizeof(struct lay_count),
+                  count_cmp);
+    return hit ? hit->lc_count : 0;
+}
+
+// Cut the token list into blocks and find what every label operand in
+// operand a refers to. 1 on success, 0 if the source must keep its order,
+// as it must with a label missing, -1 on error.
+static int cut_blocks(struct assembler *a, struct layout *ly) {
+    struct lay_block *blk = NULL, *gb;
+    struct lay_ref *gr;
+    struct token *t, *op;
+    struct expr_item *it;
+    struct label *def;
+    uint64_t capb = 0, capr = 0, i;
+    int ended = 1, prev_if = 0, pin = 0;
+
+    for (t = a->tok_list.head; t; t = t->next) {
+        if (t->type == tt_org || t->type == tt_reserve ||
+            ((t->type == tt_basic_opcode || t->type == tt_special_opcode) &&
+             expr_spans(t))) {
+            for (def = a->label_pts.head; def; def = def->next) {
+                def->lbl_off = 0;
+            }
+            return 0;
+        }
+        if (!blk || (t->type == tt_label && ended)) {
+            if (ly->ly_nblk == capb) {
+                capb = capb ? capb * 2 : 64;
+                gb = realloc(ly->ly_blk, sizeof(struct lay_block) * capb);
+                if (!gb) {
+                    LOGERROR("No more memory for the layout blocks");
+                    return -1;
+                }
+                ASM_STAT(a, ac_bytes,
+                         sizeof(struct lay_block) * (capb - ly->ly_nblk));
+                ly->ly_blk = gb;
+            }
+            blk = &ly->ly_blk[ly->ly_nblk];
+            memset(blk, 0, sizeof(*blk));
+            blk->lb_head = t;
+            blk->lb_ref0 = ly->ly_nref;
+            blk->lb_fixed = !ly->ly_nblk || pin;
+            ++ly->ly_nblk;
+            pin = 0;
+            ended = 0;
+        }
+        blk->lb_tail = t;
+        if (t->type == tt_label) {
+            // which block it is in, until the references know
+            t->ttu_lab.lbl_off = ly->ly_nblk;
+        } else if (t->type == tt_pin) {
+            pin = 1;
+        } else if (t->type == tt_basic_opcode ||
+                   t->type == tt_special_opcode) {
+            ended = layout_is_jump(t) && !prev_if;
+            prev_if = layout_is_if(t);
+            for (op = t->right; op; op = op->right) {
+                if (op->type == tt_label && !op->right) {
+                    def = get_label_pointer(a, op->ttu_lab.lbl_name,
+                                            op->ttu_lab.lbl_len);
+                } else if (is_short_expr(op)) {
+                    it = expr_label(op->ttu_opd.opd_expr);
+                    def = get_label_pointer(a, it->ei_name, it->ei_len);
+                } else {
+                    continue;
+                }
+                if (!def) {
+                    // pass 1 reports it, along with any others
+                    for (def = a->label_pts.head; def; def = def->next) {
+                        def->lbl_off = 0;
+                    }
+                    return 0;
+                }
+                if (ly->ly_nref == capr) {
+                    capr = capr ? capr * 2 : 256;
+                    gr = realloc(ly->ly_ref, sizeof(struct lay_ref) * capr);
+                    if (!gr) {
+                        LOGERROR("No more memory for the layout references");
+                        return -1;
+                    }
+                    ASM_STAT(a, ac_bytes,
+                             sizeof(struct lay_ref) * (capr - ly->ly_nref));
+                    ly->ly_ref = gr;
+                }
+                ly->ly_ref[ly->ly_nref].lr_def = def;
+                ly->ly_ref[ly->ly_nref].lr_weight = label_weight(ly, def);
+                ++ly->ly_nref;
+                ++blk->lb_nrefs;
+            }
+        }
+    }
+    // the last block may run off the end of the program
+    if (blk && !ended) {
+        blk->lb_fixed = 1;
+    }
+    for (i = 0; i < ly->ly_nref; ++i) {
+        ly->ly_ref[i].lr_blk = ly->ly_ref[i].lr_def->lbl_off - 1;
+    }
+    for (def = a->label_pts.head; def; def = def->next) {
+        def->lbl_off = 0;
+    }
+    return ly->ly_nblk > 2;
+}
+
+// Lay the blocks out in this order as pass 1 would. Returns the words they
+// take; cycles gets the weighted count of label words left.
+// Label pointers hold their address plus one in lbl_off meanwhile, 0 while
+// they are not placed, and are all 0 again after.
+static uint64_t simulate(struct assembler *a, struct layout *ly,
+                         struct lay_block **order, uint64_t *cycles) {
+    struct lay_block *b;
+    struct lay_ref *r;
+    struct token *t, *op;
+    struct label *l;
+    uint64_t i, addr = 0;
+
+    *cycles = 0;
+    for (i = 0; i < ly->ly_nblk; ++i) {
+        b = order[i];
+        b->lb_addr = addr;
+        r = &ly->ly_ref[b->lb_ref0];
+        for (t = b->lb_head; ; t = t->next) {
+            switch (t->type) {
+                case tt_label:
+                    t->ttu_lab.lbl_off = addr + 1;
+                    break;
+                case tt_basic_opcode:
+                case tt_special_opcode:
+                    ++addr;
+                    for (op = t->right; op; op = op->right) {
+                        if (op->type != tt_label && !is_short_expr(op)) {
+                            addr += operand_words(op, !op->right);
+                        } else if (op->right) {
+                            ++addr;
+                        } else if (fits_inline(op, r->lr_def)) {
+                            ++r;
+                        } else {
+                            ++addr;
+                            *cycles += r->lr_weight;
+                            ++r;
+                        }
+                    }
+                    break;
+                case tt_words:
+                    addr += t->tok_len;
+                    break;
+                default:
+                    break;
+            }
+            if (t == b->lb_tail) {
+                break;
+            }
+        }
+    }
+    for (r = ly->ly_ref; r < ly->ly_ref + ly->ly_nref; ++r) {
+        r->lr_off = r->lr_def->lbl_off - 1 - ly->ly_blk[r->lr_blk].lb_addr;
+    }
+    for (l = a->label_pts.head; l; l = l->next) {
+        l->lbl_off = 0;
+    }
+    return addr;
+}
+
+static int by_weight(const void *x, const void *y) {
+    const struct lay_block *p = *(struct lay_block * const *) x;
+    const struct lay_block *q = *(struct lay_block * const *) y;
+    if (p->lb_weight != q->lb_weight) {
+        return p->lb_weight > q->lb_weight ? -1 : 1;
+    }
+    if (p->lb_words != q->lb_words) {
+        return p->lb_words < q->lb_words ? -1 : 1;
+    }
+    return p->lb_head->tok_pos < q->lb_head->tok_pos ? -1 : 1;
+}
+
+static int by_density(const void *x, const void *y) {
+    const struct lay_block *p = *(struct lay_block * const *) x;
+    const struct lay_block *q = *(struct lay_block * const *) y;
+    // weight per word, cross multiplied
+    uint64_t lp = p->lb_weight * (q->lb_words ? q->lb_words : 1);
+    uint64_t lq = q->lb_weight * (p->lb_words ? p->lb_words : 1);
+    if (lp != lq) {
+        return lp > lq ? -1 : 1;
+    }
+    return by_weight(x, y);
+}
+
+// The entry block, as many of the sorted candidates as start at or below
+// SHORT_MAX, then everything else in source order. Returns how many
+// candidates went in front.
+static uint64_t arrange(struct layout *ly, struct lay_block **cand,
+                        uint64_t n, struct lay_block **order) {
+    struct lay_block *b;
+    uint64_t i, taken, k = 0, addr = ly->ly_blk[0].lb_words;
+    order[k++] = &ly->ly_blk[0];
+    for (taken = 0; taken < n && addr <= SHORT_MAX; ++taken) {
+        order[k++] = cand[taken];
+        cand[taken]->lb_fixed = 2;          /* Taken, for now */
+        addr += cand[taken]->lb_words;
+    }
+    for (i = 1; i < ly->ly_nblk; ++i) {
+        b = &ly->ly_blk[i];
+        if (b->lb_fixed != 2) {
+            order[k++] = b;
+        }
+    }
+    for (i = 0; i < taken; ++i) {
+        cand[i]->lb_fixed = 0;
+    }
+    return taken;
+}
+
+static void relink(struct assembler *a, struct layout *ly,
+                   struct lay_block **order) {
+    uint64_t i;
+    for (i = 0; i + 1 < ly->ly_nblk; ++i) {
+        order[i]->lb_tail->next = order[i + 1]->lb_head;
+    }
+    order[ly->ly_nblk - 1]->lb_tail->next = NULL;
+    a->tok_list.head = order[0]->lb_head;
+    a->tok_list.tail = order[ly->ly_nblk - 1]->lb_tail;
+}
+
+static void report(struct layout *ly, struct lay_block **order,
+                   uint64_t words0, uint64_t words, uint64_t cycles0,
+                   uint64_t cycles) {
+    struct token *t;
+    uint64_t i;
+    fprintf(stderr, "layout: %llu of %llu blocks moved, %llu words and "
+                    "%llu cycles saved (%llu -> %llu words, %llu -> %llu "
+                    "cycles on label words)\n",
+            (unsigned long long) ly->ly_moved,
+            (unsigned long long) ly->ly_nblk,
+            (unsigned long long) (words0 - words),
+            (unsigned long long) (cycles0 - cycles),
+            (unsigned long long) words0, (unsigned long long) words,
+            (unsigned long long) cycles0, (unsigned long long) cycles);
+    for (i = 1; i <= ly->ly_moved; ++i) {
+        t = order[i]->lb_head;
+        fprintf(stderr, "layout:   %04llx %.*s (%llu references)\n",
+                (unsigned long long) order[i]->lb_addr,
+                (int) (t->ttu_lab.lbl_len < 64 ? t->ttu_lab.lbl_len : 64),
+                t->ttu_lab.lbl_name,
+                (unsigned long long) order[i]->lb_weight);
+    }
+}
+
+static int optimize(struct assembler *a, struct layout *ly) {
+    struct lay_block **cand, **order, **best, *b;
+    uint64_t i, k, n = 0, moved, words0, cycles0, words, cycles;
+    uint64_t best_words, best_cycles;
+    int (*keys[2])(const void *, const void *) = {by_weight, by_density};
+    int rc;
+
+    if ((rc = cut_blocks(a, ly)) <= 0) {
+        if (rc == 0) {
+            fprintf(stderr, "layout: keeping the source order\n");
+        }
+        return rc;
+    }
+    cand = malloc(sizeof(struct lay_block *) * ly->ly_nblk * 3);
+    if (!cand) {
+        LOGERROR("No more memory to order the blocks");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct lay_block *) * ly->ly_nblk * 3);
+    order = cand + ly->ly_nblk;
+    best = order + ly->ly_nblk;
+
+    // the source order, for the sizes of the blocks and to beat
+    for (i = 0; i < ly->ly_nblk; ++i) {
+        best[i] = &ly->ly_blk[i];
+    }
+    words0 = best_words = simulate(a, ly, best, &cycles0);
+    best_cycles = cycles0;
+    for (i = 0; i < ly->ly_nblk; ++i) {
+        b = &ly->ly_blk[i];
+        b->lb_words = (i + 1 < ly->ly_nblk ? ly->ly_blk[i + 1].lb_addr
+                                           : words0) - b->lb_addr;
+    }
+    // only labels that would still land at or below SHORT_MAX right
+    // behind the entry block count
+    for (i = 0; i < ly->ly_nref; ++i) {
+        if (ly->ly_blk[0].lb_words + ly->ly_ref[i].lr_off <= SHORT_MAX) {
+            ly->ly_blk[ly->ly_ref[i].lr_blk].lb_weight +=
+                    ly->ly_ref[i].lr_weight;
+        }
+    }
+    for (i = 1; i < ly->ly_nblk; ++i) {
+        if (!ly->ly_blk[i].lb_fixed && ly->ly_blk[i].lb_weight) {
+            cand[n++] = &ly->ly_blk[i];
+        }
+    }
+    // try a couple of orders of the candidates, keep the cheapest
+    for (k = 0; n && k < 2; ++k) {
+        qsort(cand, n, sizeof(struct lay_block *), keys[k]);
+        moved = arrange(ly, cand, n, order);
+        words = simulate(a, ly, order, &cycles);
+        if (cycles < best_cycles ||
+            (cycles == best_cycles && words < best_words)) {
+            memcpy(best, order, sizeof(struct lay_block *) * ly->ly_nblk);
+            best_words = words;
+            best_cycles = cycles;
+            ly->ly_moved = moved;
+        }
+    }
+    // for the addresses in the report
+    simulate(a, ly, best, &cycles);
+    relink(a, ly, best);
+    report(ly, best, words0, best_words, cycles0, best_cycles);
+    free(cand);
+    return 0;
+}
+
+int layout_optimize(struct assembler *a) {
+    struct layout ly;
+    int rc = -1;
+    memset(&ly, 0, sizeof(ly));
+    if (!a->layout_profile || read_profile(a, &ly) == 0) {
+        rc = optimize(a, &ly);
+    }
+    free(ly.ly_blk);
+    free(ly.ly_ref);
+    free(ly.ly_prof);
+    free(ly.ly_prof_text);
+    return rc;
+}
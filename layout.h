@@ -0,0 +1,16 @@
+#ifndef ASSEMBLER_LAYOUT_H
+#define ASSEMBLER_LAYOUT_H
+
+#include "common.h"
+
+/* Reorder the token list so the most referenced labels land where an
+ * inline literal can hold them, and report what it saves on stderr.
+ * 0 on success, -1 on error. */
+int layout_optimize(struct assembler *a);
+/* SET PC or RFI: unless under an IF, control never reaches the statement
+ * after it */
+int layout_is_jump(struct token *t);
+/* One of the IF opcodes, which may skip the statement after it */
+int layout_is_if(struct token *t);
+
+#endif //ASSEMBLER_LAYOUT_H
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+#include "prelude.h"
+
+// Widest line number, address and words in front of a line of source
+#define PREFIX_MAX (20 + 2 + 16 + 2 + LISTING_WORDS * 5 + 1)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+struct listing {
+    char  *li_buf;
+    size_t li_len;
+    size_t li_cap;
+    int    li_width;    /* Digits of the last line number */
+};
+
+// Room for n more bytes. The buffer is sized for the whole listing up
+// front, so this grows it only if that estimate was off.
+static int ensure(struct listing *l, size_t n) {
+    char *grown;
+    size_t cap = l->li_cap;
+    if (l->li_len + n <= l->li_cap) {
+        return 0;
+    }
+    while (cap < l->li_len + n) {
+        cap *= 2;
+    }
+    grown = realloc(l->li_buf, cap);
+    if (!grown) {
+        LOGERROR("No memory for the listing");
+        return -1;
+    }
+    l->li_buf = grown;
+    l->li_cap = cap;
+    return 0;
+}
+
+// At least four hex digits
+static inline char *put_addr(char *p, uint64_t v) {
+    int digits = 4, i;
+    while (digits < 16 && v >> (4 * digits)) {
+        ++digits;
+    }
+    for (i = digits - 1; i >= 0; --i) {
+        *p++ = hex_digits[(v >> (4 * i)) & 0xf];
+    }
+    return p;
+}
+
+static inline char *put_word(char *p, uint16_t w) {
+    p[0] = hex_digits[w >> 12];
+    p[1] = hex_digits[(w >> 8) & 0xf];
+    p[2] = hex_digits[(w >> 4) & 0xf];
+    p[3] = hex_digits[w & 0xf];
+    return p + 4;
+}
+
+// "  row  addr  w0 w1 w2 w3  text", the row left out when it is 0, the
+// address when there are no words or label at it
+static int put_line(struct listing *l, uint64_t row, int has_addr,
+                    uint64_t addr, const uint16_t *w, uint64_t n,
+                    const char *text, size_t len) {
+    char digits[20], *p;
+    int i, k = 0;
+    if (ensure(l, PREFIX_MAX + len + 1) < 0) {
+        return -1;
+    }
+    p = l->li_buf + l->li_len;
+    for (; row; row /= 10) {
+        digits[k++] = (char) ('0' + row % 10);
+    }
+    for (i = k; i < l->li_width; ++i) {
+        *p++ = ' ';
+    }
+    while (k) {
+        *p++ = digits[--k];
+    }
+    memcpy(p, "  ", 2);
+    p += 2;
+    if (has_addr) {
+        p = put_addr(p, addr);
+    } else {
+        memcpy(p, "    ", 4);
+        p += 4;
+    }
+    *p++ = ' ';
+    for (i = 0; i < LISTING_WORDS; ++i) {
+        *p++ = ' ';
+        if ((uint64_t) i < n) {
+            p = put_word(p, w[i]);
+        } else {
+            memcpy(p, "    ", 4);
+            p += 4;
+        }
+    }
+    if (len) {
+        memcpy(p, "  ", 2);
+        memcpy(p + 2, text, len);
+        p += len + 2;
+    } else {
+        // no blanks at the end of the line
+        while (p > l->li_buf + l->li_len && p[-1] == ' ') {
+            --p;
+        }
+    }
+    *p++ = '\n';
+    l->li_len = (size_t) (p - l->li_buf);
+    return 0;
+}
+
+// The line that starts at *pos, *pos moved on to the next one
+static size_t next_line(const char **pos, const char *end,
+                        const char **text) {
+    const char *nl = memchr(*pos, '\n', (size_t) (end - *pos));
+    const char *stop = nl ? nl : end;
+    *text = *pos;
+    *pos = nl ? nl + 1 : end;
+    if (stop > *text && stop[-1] == '\r') {
+        --stop;
+    }
+    return (size_t) (stop - *text);
+}
+
+// A row with its words, continued on lines of their own when there are
+// more than fit next to the source
+static int put_row(struct listing *l, uint64_t row, int has_addr,
+                   uint64_t addr, const uint16_t *w, uint64_t n,
+                   const char *text, size_t len) {
+    uint64_t k = n < LISTING_WORDS ? n : LISTING_WORDS;
+    if (put_line(l, row, has_addr, addr, w, k, text, len) < 0) {
+        return -1;
+    }
+    for (; k < n; k += LISTING_WORDS) {
+        if (put_line(l, 0, 1, addr + k, w + k,
+                     n - k < LISTING_WORDS ? n - k : LISTING_WORDS,
+                     NULL, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_label(const void *x, const void *y) {
+    const struct label *p = *(struct label * const *) x;
+    const struct label *q = *(struct label * const *) y;
+    uint64_t n = p->lbl_len < q->lbl_len ? p->lbl_len : q->lbl_len;
+    int c = memcmp(p->lbl_name, q->lbl_name, n);
+    return c ? c : (p->lbl_len > q->lbl_len) - (p->lbl_len < q->lbl_len);
+}
+
+// The labels by name
+static int put_symbols(struct listing *l, struct assembler *a) {
+    struct label *lbl, **sorted;
+    uint64_t n = 0, i;
+    for (lbl = a->label_pts.head; lbl; lbl = lbl->next) {
+        ++n;
+    }
+    sorted = malloc(sizeof(*sorted) * (n ? n : 1));
+    if (!sorted) {
+        LOGERROR("No memory to sort the labels");
+        return -1;
+    }
+    for (lbl = a->label_pts.head, i = 0; lbl; lbl = lbl->next) {
+        sorted[i++] = lbl;
+    }
+    qsort(sorted, n, sizeof(*sorted), cmp_label);
+    if (ensure(l, 10) < 0) {
+        free(sorted);
+        return -1;
+    }
+    memcpy(l->li_buf + l->li_len, "\nSymbols\n", 9);
+    l->li_len += 9;
+    for (i = 0; i < n; ++i) {
+        if (put_line(l, 0, 1, sorted[i]->lbl_off / 2, NULL, 0,
+                     sorted[i]->lbl_name, sorted[i]->lbl_len) < 0) {
+            free(sorted);
+            return -1;
+        }
+    }
+    free(sorted);
+    return 0;
+}
+
+// Bytes the listing takes at most, but for lines longer than the source
+static size_t listing_size(struct assembler *a, uint64_t lines) {
+    struct bcode_node *node;
+    struct label *lbl;
+    size_t size = a->inp_size + (lines + 2) * PREFIX_MAX + 16;
+    for (node = a->bcd_list.head; node; node = node->next) {
+        size += (node->size / 2 / LISTING_WORDS) * PREFIX_MAX;
+    }
+    for (lbl = a->label_pts.head; lbl; lbl = lbl->next) {
+        size += PREFIX_MAX + lbl->lbl_len + 1;
+    }
+    return size;
+}
+
+static int write_out(struct listing *l, const char *path) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    int rc = 0;
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", path);
+        return -1;
+    }
+    if (fwrite(l->li_buf, 1, l->li_len, fp) != l->li_len) {
+        rc = -1;
+    }
+    if (fp == stdout ? fflush(fp) != 0 : fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        LOGERROR("Could not write the listing to %s", path);
+    }
+    return rc;
+}
+
+static int cmp_row(const void *x, const void *y) {
+    const struct list_row *p = x, *q = y;
+    return (p->lr_row > q->lr_row) - (p->lr_row < q->lr_row);
+}
+
+// The tokens and binary code nodes side by side
+int64_t listing_rows(struct assembler *a, struct list_row *rows) {
+    struct bcode_node *node = a->bcd_list.head;
+    struct token *t;
+    uint64_t offset = 0, row;
+    int64_t n = 0;
+    // the prelude's words come first, from no line of this source
+    if (a->prelude && a->prelude->pr_head->ph_words) {
+        offset = a->prelude->pr_head->ph_words;
+        node = node->next;
+    }
+    for (t = a->tok_list.head; t;) {
+        row = t->tok_row;
+        memset(&rows[n], 0, sizeof(rows[n]));
+        rows[n].lr_row = row;
+        // the statements of one line, at most one of them laid out in words
+        for (; t && t->tok_row == row; t = t->next) {
+            switch (t->type) {
+                case tt_org:
+                    offset = t->ttu_num;
+                case tt_label:
+                case tt_reserve:
+                    break;
+                case tt_basic_opcode:
+                case tt_special_opcode:
+                case tt_words:
+                    if (!node) {
+                        LOGERROR("Fewer binary code nodes than statements");
+                        return -1;
+                    }
+                    rows[n].lr_node = node;
+                    break;
+                default:
+                    continue;
+            }
+            if (!rows[n].lr_has_addr) {
+                rows[n].lr_has_addr = 1;
+                rows[n].lr_addr = offset;
+            }
+            if (t->type == tt_reserve) {
+                offset += t->ttu_num;
+            } else if (t->type != tt_org && t->type != tt_label) {
+                offset += node->size / 2;
+                node = node->next;
+            }
+        }
+        ++n;
+    }
+    return n;
+}
+
+int listing_write(struct assembler *a, const char *path) {
+    struct listing l;
+    struct list_row *rows;
+    struct bcode_node *node;
+    struct token *t;
+    const char *pos = a->input, *end = a->input + a->inp_size, *s;
+    const char *text = NULL;
+    const uint16_t *w;
+    uint16_t code[3];
+    uint64_t lines = 0, cursor = 0, tokens = 0, n;
+    int64_t count, i;
+    size_t len = 0;
+    int rc = -1;
+
+    for (s = a->input; (s = memchr(s, '\n', (size_t) (end - s))); ++s) {
+        ++lines;
+    }
+    for (t = a->tok_list.head; t; t = t->next) {
+        ++tokens;
+    }
+    memset(&l, 0, sizeof(l));
+    for (l.li_width = 1, n = lines + 1; n >= 10; n /= 10) {
+        ++l.li_width;
+    }
+    l.li_cap = listing_size(a, lines);
+    l.li_buf = malloc(l.li_cap);
+    rows = malloc(sizeof(*rows) * (tokens ? tokens : 1));
+    if (!l.li_buf || !rows) {
+        LOGERROR("No memory for the listing");
+        goto out;
+    }
+    count = listing_rows(a, rows);
+    if (count < 0) {
+        goto out;
+    }
+    // --layout moves blocks of rows, the listing follows the source
+    for (i = 1; i < count && rows[i - 1].lr_row < rows[i].lr_row; ++i);
+    if (i < count) {
+        qsort(rows, (size_t) count, sizeof(*rows), cmp_row);
+    }
+    for (i = 0; i < count; ++i) {
+        // lines in between have no tokens
+        for (; cursor <= rows[i].lr_row && pos < end; ++cursor) {
+            len = next_line(&pos, end, &text);
+            if (cursor < rows[i].lr_row &&
+                put_line(&l, cursor + 1, 0, 0, NULL, 0, text, len) < 0) {
+                goto out;
+            }
+        }
+        node = rows[i].lr_node;
+        w = NULL;
+        n = 0;
+        if (node && node->type == bt_words) {
+            w = node->btu_words;
+            n = node->size / 2;
+        } else if (node) {
+            code[n = 0] = node->btu_code[0];
+            if (node->btu_c_has_a) {
+                code[++n] = node->btu_code[1];
+            }
+            if (node->btu_c_has_b) {
+                code[++n] = node->btu_code[2];
+            }
+            w = code;
+            ++n;
+        }
+        if (put_row(&l, rows[i].lr_row + 1, rows[i].lr_has_addr,
+                    rows[i].lr_addr, w, n, text, len) < 0) {
+            goto out;
+        }
+    }
+    for (; pos < end; ++cursor) {
+        len = next_line(&pos, end, &text);
+        if (put_line(&l, cursor + 1, 0, 0, NULL, 0, text, len) < 0) {
+            goto out;
+        }
+    }
+    if (put_symbols(&l, a) < 0) {
+        goto out;
+    }
+    rc = write_out(&l, path);
+out:
+    free(rows);
+    free(l.li_buf);
+    return rc;
+}
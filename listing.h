@@ -0,0 +1,28 @@
+#ifndef ASSEMBLER_LISTING_H
+#define ASSEMBLER_LISTING_H
+
+#include "common.h"
+
+// Every line of the source next to its line number, address and the words
+// it was encoded into, then the labels by name with their addresses. Made
+// after pass 2 from the tokens and the binary code nodes side by side, in
+// a buffer sized for it up front, and written out in one go.
+
+/* Words shown on a line, a longer DAT carries on below its source */
+#define LISTING_WORDS 4
+
+/* A line of the source that made words or took an address */
+struct list_row {
+    uint64_t           lr_row;
+    uint64_t           lr_addr;
+    int                lr_has_addr;
+    struct bcode_node *lr_node;     /* Its words, or NULL */
+};
+
+/* One row per line with tokens into rows, which has room for one per
+ * token, in the order they were laid out. The count or -1. */
+int64_t listing_rows(struct assembler *a, struct list_row *rows);
+/* 0 or -1 */
+int listing_write(struct assembler *a, const char *path);
+
+#endif //ASSEMBLER_LISTING_H
@@ -0,0 +1,500 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lsp.h"
+
+// Language server requests on the symbol index: go to definition, find
+// references and hover for the address of a label. The files of the
+// workspace are indexed from disk when the editor connects, and the open
+// ones follow the editor's incremental changes. Without includes every
+// file is a program of its own, so a label resolves to its definition in
+// the same file, and only to one in another file when it has none.
+
+#define RPC_PARSE_ERROR      (-32700)
+#define RPC_INVALID_REQUEST  (-32600)
+#define RPC_METHOD_NOT_FOUND (-32601)
+
+#define LSP_MAX_PATH 4096
+
+void lsp_init(struct lsp_server *s) {
+    memset(s, 0, sizeof(*s));
+    sym_init(&s->ls_index);
+}
+
+void lsp_free(struct lsp_server *s) {
+    sym_free(&s->ls_index);
+    json_free(&s->ls_msg);
+    free(s->ls_out.jo_buf);
+    memset(s, 0, sizeof(*s));
+}
+
+static inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// The path of a file:// URI, percent escapes undone. 0 or -1.
+static int uri_to_path(const char *uri, char *path, size_t size) {
+    size_t n = 0;
+    int hi, lo;
+    if (strncmp(uri, "file://", 7)) {
+        return -1;
+    }
+    for (uri += 7; *uri; ++uri) {
+        if (n + 1 >= size) {
+            return -1;
+        }
+        if (*uri == '%' && (hi = hex_value(uri[1])) >= 0 &&
+            (lo = hex_value(uri[2])) >= 0) {
+            path[n++] = (char) (hi * 16 + lo);
+            uri += 2;
+        } else {
+            path[n++] = *uri;
+        }
+    }
+    path[n] = '\0';
+    return 0;
+}
+
+// The file:// URI of path, escaped the same way whoever sent it, so that
+// a document is found whatever the editor escaped. 0 or -1.
+static int path_to_uri(const char *path, char *uri, size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 7;
+    unsigned char c;
+    if (size < 8) {
+        return -1;
+    }
+    memcpy(uri, "file://", 7);
+    for (; *path; ++path) {
+        c = (unsigned char) *path;
+        if (n + 4 >= size) {
+            return -1;
+        }
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            (c >= '0' && c <= '9') || strchr("-._~/", c)) {
+            uri[n++] = (char) c;
+        } else {
+            uri[n++] = '%';
+            uri[n++] = hex[c >> 4];
+            uri[n++] = hex[c & 0xf];
+        }
+    }
+    uri[n] = '\0';
+    return 0;
+}
+
+// Read path into the index as the document at uri
+static int load_file(struct lsp_server *s, const char *uri,
+                     const char *path) {
+    FILE *fp = fopen(path, "rb");
+    char *text;
+    long size;
+    int rc = -1;
+    if (!fp) {
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0) {
+        rewind(fp);
+        text = malloc((size_t) size + 1);
+        if (text && fread(text, 1, (size_t) size, fp) == (size_t) size) {
+            rc = sym_doc_set(&s->ls_index, uri, path, text,
+                             (size_t) size) ? 0 : -1;
+        }
+        free(text);
+    }
+    fclose(fp);
+    return rc;
+}
+
+// Index every .dasm file under dir
+static void load_tree(struct lsp_server *s, const char *dir, int depth) {
+    char path[LSP_MAX_PATH], uri[3 * LSP_MAX_PATH];
+    struct dirent *de;
+    struct stat st;
+    size_t n;
+    DIR *dp;
+    if (depth > 32 || !(dp = opendir(dir))) {
+        return;
+    }
+    while ((de = readdir(dp))) {
+        if (de->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+            (int) sizeof(path) || lstat(path, &st) < 0) {
+            continue;
+        }
+        n = strlen(de->d_name);
+        if (S_ISDIR(st.st_mode)) {
+            load_tree(s, path, depth + 1);
+        } else if (S_ISREG(st.st_mode) && n > 5 &&
+                   !strcmp(de->d_name + n - 5, ".dasm") &&
+                   path_to_uri(path, uri, sizeof(uri)) == 0 &&
+                   !sym_doc_find(&s->ls_index, uri)) {
+            load_file(s, uri, path);
+        }
+    }
+    closedir(dp);
+}
+
+static void begin_response(struct lsp_server *s, int id) {
+    json_raw(&s->ls_out, "{\"jsonrpc\":\"2.0\",\"id\":", 22);
+    if (id < 0) {
+        json_raw(&s->ls_out, "null", 4);
+    } else {
+        json_copy(&s->ls_out, &s->ls_msg, id);
+    }
+}
+
+static void reply_error(struct lsp_server *s, int id, int code,
+                        const char *message) {
+    begin_response(s, id);
+    json_printf(&s->ls_out, ",\"error\":{\"code\":%d,\"message\":", code);
+    json_quote(&s->ls_out, message, strlen(message));
+    json_raw(&s->ls_out, "}}", 2);
+}
+
+static void put_position(struct json_out *o, const struct sym_line *l,
+                         uint64_t col) {
+    json_printf(o, "{\"line\":%llu,\"character\":%llu}",
+                (unsigned long long) l->sl_no,
+                (unsigned long long) sym_utf16_col(l, col));
+}
+
+static void put_range(struct json_out *o, const struct sym_occ *occ) {
+    json_raw(o, "{\"start\":", 9);
+    put_position(o, occ->so_line, occ->so_col);
+    json_raw(o, ",\"end\":", 7);
+    put_position(o, occ->so_line, occ->so_col + occ->so_len);
+    json_raw(o, "}", 1);
+}
+
+static void put_location(struct json_out *o, const struct sym_occ *occ) {
+    sym_refresh(occ->so_line->sl_doc);
+    json_raw(o, "{\"uri\":", 7);
+    json_quote(o, occ->so_line->sl_doc->sd_uri,
+               strlen(occ->so_line->sl_doc->sd_uri));
+    json_raw(o, ",\"range\":", 9);
+    put_range(o, occ);
+    json_raw(o, "}", 1);
+}
+
+// params.textDocument.uri with its path, the URI escaped as path_to_uri()
+// does. 0 or -1.
+static int param_uri(struct lsp_server *s, int params, char *uri,
+                     char *path) {
+    char *given;
+    size_t len;
+    int rc;
+    given = json_string(&s->ls_msg,
+                        json_path(&s->ls_msg, params, "textDocument.uri"),
+                        &len);
+    if (!given) {
+        return -1;
+    }
+    rc = uri_to_path(given, path, LSP_MAX_PATH);
+    free(given);
+    return rc < 0 ? -1 : path_to_uri(path, uri, 3 * LSP_MAX_PATH);
+}
+
+// The document of params.textDocument.uri, NULL if it is not indexed
+static struct sym_doc *param_doc(struct lsp_server *s, int params) {
+    char uri[3 * LSP_MAX_PATH], path[LSP_MAX_PATH];
+    if (param_uri(s, params, uri, path) < 0) {
+        return NULL;
+    }
+    return sym_doc_find(&s->ls_index, uri);
+}
+
+// Line and byte column of params.position, -1 if it is not in d
+static int param_position(struct lsp_server *s, int params,
+                          struct sym_doc *d, uint64_t *line, uint64_t *col) {
+    int pos = json_get(&s->ls_msg, params, "position");
+    int64_t l = json_int(&s->ls_msg, json_get(&s->ls_msg, pos, "line"), -1);
+    int64_t c = json_int(&s->ls_msg, json_get(&s->ls_msg, pos, "character"),
+                         -1);
+    if (l < 0 || c < 0 || (uint64_t) l >= d->sd_nline) {
+        return -1;
+    }
+    *line = (uint64_t) l;
+    *col = sym_byte_col(d->sd_line[l], (uint64_t) c);
+    return 0;
+}
+
+static void on_initialize(struct lsp_server *s, int id, int params) {
+    static const char capabilities[] =
+            ",\"result\":{\"capabilities\":{"
+            "\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+            "\"definitionProvider\":true,"
+            "\"referencesProvider\":true,"
+            "\"hoverProvider\":true},"
+            "\"serverInfo\":{\"name\":\"dlsp\"}}}";
+    char path[LSP_MAX_PATH], *root;
+    size_t len;
+    int folders = json_get(&s->ls_msg, params, "workspaceFolders");
+    int n = json_get(&s->ls_msg, params, "rootUri");
+    uint32_t i;
+
+    for (i = 0; folders >= 0 &&
+                (n = json_get(&s->ls_msg, json_elem(&s->ls_msg, folders, i),
+                              "uri")) >= 0; ++i) {
+        if ((root = json_string(&s->ls_msg, n, &len))) {
+            if (uri_to_path(root, path, sizeof(path)) == 0) {
+                load_tree(s, path, 0);
+            }
+            free(root);
+        }
+    }
+    if (i == 0 && (root = json_string(&s->ls_msg, n, &len))) {
+        if (uri_to_path(root, path, sizeof(path)) == 0) {
+            load_tree(s, path, 0);
+        }
+        free(root);
+    }
+    begin_response(s, id);
+    json_raw(&s->ls_out, capabilities, sizeof(capabilities) - 1);
+}
+
+static void on_did_open(struct lsp_server *s, int params) {
+    char uri[3 * LSP_MAX_PATH], path[LSP_MAX_PATH], *text;
+    struct sym_doc *d;
+    size_t len;
+    if (param_uri(s, params, uri, path) < 0) {
+        return;
+    }
+    text = json_string(&s->ls_msg,
+                       json_path(&s->ls_msg, params, "textDocument.text"),
+                       &len);
+    if (!text) {
+        return;
+    }
+    if ((d = sym_doc_set(&s->ls_index, uri, path, text, len))) {
+        d->sd_open = 1;
+    }
+    free(text);
+}
+
+static void on_did_change(struct lsp_server *s, int params) {
+    char *text;
+    struct sym_doc *d = param_doc(s, params);
+    int changes = json_get(&s->ls_msg, params, "contentChanges");
+    int change, range;
+    int64_t l0, c0, l1, c1;
+    size_t len;
+    uint32_t i;
+
+    for (i = 0; d && (change = json_elem(&s->ls_msg, changes, i)) >= 0; ++i) {
+        text = json_string(&s->ls_msg, json_get(&s->ls_msg, change, "text"),
+                           &len);
+        if (!text) {
+            continue;
+        }
+        range = json_get(&s->ls_msg, change, "range");
+        if (range < 0) {
+            sym_doc_set(&s->ls_index, d->sd_uri, d->sd_path, text, len);
+            free(text);
+            continue;
+        }
+        l0 = json_int(&s->ls_msg, json_path(&s->ls_msg, range, "start.line"),
+                      -1);
+        c0 = json_int(&s->ls_msg,
+                      json_path(&s->ls_msg, range, "start.character"), -1);
+        l1 = json_int(&s->ls_msg, json_path(&s->ls_msg, range, "end.line"),
+                      -1);
+        c1 = json_int(&s->ls_msg,
+                      json_path(&s->ls_msg, range, "end.character"), -1);
+        if (l0 >= 0 && c0 >= 0 && l1 >= 0 && c1 >= 0) {
+            // columns come in UTF-16 units of the text before the edit
+            if ((uint64_t) l0 < d->sd_nline) {
+                c0 = (int64_t) sym_byte_col(d->sd_line[l0], (uint64_t) c0);
+            }
+            if ((uint64_t) l1 < d->sd_nline) {
+                c1 = (int64_t) sym_byte_col(d->sd_line[l1], (uint64_t) c1);
+            }
+            sym_doc_edit(&s->ls_index, d, (uint64_t) l0, (uint64_t) c0,
+                         (uint64_t) l1, (uint64_t) c1, text, len);
+        }
+        free(text);
+    }
+}
+
+static void on_did_close(struct lsp_server *s, int params) {
+    struct sym_doc *d = param_doc(s, params);
+    if (!d) {
+        return;
+    }
+    // what is on disk is still part of the workspace
+    if (load_file(s, d->sd_uri, d->sd_path) == 0) {
+        d->sd_open = 0;
+    } else {
+        sym_doc_drop(&s->ls_index, d);
+    }
+}
+
+// Does o stand for the same label as the definition def
+static inline int same_label(struct sym_occ *o, struct sym_occ *def) {
+    return !def || sym_definition(o->so_sym, o->so_line->sl_doc) == def;
+}
+
+static void on_definition(struct lsp_server *s, int id, int params) {
+    struct sym_doc *d = param_doc(s, params);
+    struct sym_occ *occ = NULL, *def = NULL;
+    uint64_t line, col;
+
+    if (d && param_position(s, params, d, &line, &col) == 0 &&
+        (occ = sym_at(d, line, col))) {
+        def = sym_definition(occ->so_sym, d);
+    }
+    begin_response(s, id);
+    json_raw(&s->ls_out, ",\"result\":", 10);
+    if (def) {
+        put_location(&s->ls_out, def);
+    } else {
+        json_raw(&s->ls_out, "null", 4);
+    }
+    json_raw(&s->ls_out, "}", 1);
+}
+
+static void on_references(struct lsp_server *s, int id, int params) {
+    struct sym_doc *d = param_doc(s, params);
+    struct sym_occ *occ = NULL, *def = NULL, *o;
+    uint64_t line, col;
+    int decl = json_bool(&s->ls_msg, json_path(&s->ls_msg, params,
+                                               "context.includeDeclaration"),
+                         0);
+    int first = 1;
+
+    if (d && param_position(s, params, d, &line, &col) == 0 &&
+        (occ = sym_at(d, line, col))) {
+        def = sym_definition(occ->so_sym, d);
+    }
+    begin_response(s, id);
+    json_raw(&s->ls_out, ",\"result\":[", 11);
+    for (o = occ ? occ->so_sym->se_head : NULL; o; o = o->so_next) {
+        if ((o->so_def && !decl) || !same_label(o, def)) {
+            continue;
+        }
+        if (!first) {
+            json_raw(&s->ls_out, ",", 1);
+        }
+        put_location(&s->ls_out, o);
+        first = 0;
+    }
+    json_raw(&s->ls_out, "]}", 2);
+}
+
+static void on_hover(struct lsp_server *s, int id, int params) {
+    char text[512];
+    struct sym_doc *d = param_doc(s, params);
+    struct sym_occ *occ = NULL, *def, *o;
+    struct sym_line *l;
+    uint64_t line, col, refs = 0;
+    const char *file;
+    int n = 0;
+
+    if (d && param_position(s, params, d, &line, &col) == 0) {
+        l = d->sd_line[line];
+        if ((occ = sym_at(d, line, col))) {
+            def = sym_definition(occ->so_sym, d);
+            for (o = occ->so_sym->se_head; o; o = o->so_next) {
+                refs += !o->so_def && same_label(o, def);
+            }
+            if (!def) {
+                n = snprintf(text, sizeof(text), "%.*s: not defined",
+                             (int) occ->so_len, l->sl_text + occ->so_col);
+            } else {
+                sym_refresh(def->so_line->sl_doc);
+                file = strrchr(def->so_line->sl_doc->sd_path, '/');
+                file = file ? file + 1 : def->so_line->sl_doc->sd_path;
+                n = snprintf(text, sizeof(text),
+                             "%.*s: 0x%04llx%s%s, %llu reference%s",
+                             (int) occ->so_len, l->sl_text + occ->so_col,
+                             (unsigned long long) sym_addr(def),
+                             def->so_line->sl_doc == d ? "" : " in ",
+                             def->so_line->sl_doc == d ? "" : file,
+                             (unsigned long long) refs, refs == 1 ? "" : "s");
+            }
+        } else if (l->sl_nstmt) {
+            sym_refresh(d);
+            n = snprintf(text, sizeof(text), "0x%04llx, %llu word%s",
+                         (unsigned long long) l->sl_addr,
+                         (unsigned long long) (l->sl_end - l->sl_addr),
+                         l->sl_end - l->sl_addr == 1 ? "" : "s");
+        }
+    }
+    begin_response(s, id);
+    json_raw(&s->ls_out, ",\"result\":", 10);
+    if (n > 0) {
+        json_raw(&s->ls_out, "{\"contents\":{\"kind\":\"plaintext\","
+                             "\"value\":", 40);
+        json_quote(&s->ls_out, text, strlen(text));
+        json_raw(&s->ls_out, "}}", 2);
+    } else {
+        json_raw(&s->ls_out, "null", 4);
+    }
+    json_raw(&s->ls_out, "}", 1);
+}
+
+void lsp_handle(struct lsp_server *s, const char *msg, size_t len) {
+    struct json_doc *m = &s->ls_msg;
+    int id, method, params;
+
+    s->ls_out.jo_len = 0;
+    s->ls_out.jo_err = 0;
+    if (json_parse(m, msg, len) < 0) {
+        reply_error(s, -1, RPC_PARSE_ERROR, "Parse error");
+        return;
+    }
+    id = json_get(m, 0, "id");
+    method = json_get(m, 0, "method");
+    params = json_get(m, 0, "params");
+    if (method < 0 || m->jd_node[method].jn_type != jt_string) {
+        // a response to us, we send no requests
+        if (id < 0) {
+            return;
+        }
+        reply_error(s, id, RPC_INVALID_REQUEST, "Invalid request");
+        return;
+    }
+    if (s->ls_shutdown && !json_is(m, method, "exit")) {
+        if (id >= 0) {
+            reply_error(s, id, RPC_INVALID_REQUEST, "Shut down");
+        }
+        return;
+    }
+    if (json_is(m, method, "initialize") && id >= 0) {
+        on_initialize(s, id, params);
+    } else if (json_is(m, method, "textDocument/didOpen")) {
+        on_did_open(s, params);
+    } else if (json_is(m, method, "textDocument/didChange")) {
+        on_did_change(s, params);
+    } else if (json_is(m, method, "textDocument/didClose")) {
+        on_did_close(s, params);
+    } else if (json_is(m, method, "textDocument/definition") && id >= 0) {
+        on_definition(s, id, params);
+    } else if (json_is(m, method, "textDocument/references") && id >= 0) {
+        on_references(s, id, params);
+    } else if (json_is(m, method, "textDocument/hover") && id >= 0) {
+        on_hover(s, id, params);
+    } else if (json_is(m, method, "shutdown") && id >= 0) {
+        s->ls_shutdown = 1;
+        begin_response(s, id);
+        json_raw(&s->ls_out, ",\"result\":null}", 15);
+    } else if (json_is(m, method, "exit")) {
+        s->ls_exit = s->ls_shutdown ? 1 : 2;
+    } else if (id >= 0) {
+        reply_error(s, id, RPC_METHOD_NOT_FOUND, "Method not found");
+    }
+    if (s->ls_out.jo_err) {
+        s->ls_out.jo_len = 0;
+    }
+}
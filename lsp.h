@@ -0,0 +1,22 @@
+#ifndef ASSEMBLER_LSP_H
+#define ASSEMBLER_LSP_H
+
+#include "json.h"
+#include "symbols.h"
+
+/* A language server over one symbol index, one message at a time */
+struct lsp_server {
+    struct sym_index ls_index;
+    struct json_doc  ls_msg;        /* The message being handled */
+    struct json_out  ls_out;        /* Its response, empty if it has none */
+    int              ls_shutdown;   /* Asked to shut down */
+    int              ls_exit;       /* Asked to exit, exit code plus one */
+};
+
+void lsp_init(struct lsp_server *s);
+void lsp_free(struct lsp_server *s);
+/* Handle the JSON-RPC message msg[0, len). Its response, if any, is left
+ * in s->ls_out without framing. */
+void lsp_handle(struct lsp_server *s, const char *msg, size_t len);
+
+#endif //ASSEMBLER_LSP_H
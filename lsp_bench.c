@@ -0,0 +1,297 @@
+#include <getopt.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lsp.h"
+
+// Latency of the language server over a workspace of sources. All of them
+// are opened, then labels picked at random are asked for their definition,
+// references and hover, and lines picked at random are edited, each
+// edit followed by a hover at the end of its file, which has to lay out
+// the lines after the edit again. Every request goes through lsp_handle()
+// as a whole message, JSON in and out. One line per operation, as
+// key=value pairs:
+//   op=<name> n=.. p50_us=.. p99_us=.. max_us=..
+// and first one for opening the workspace:
+//   op=open files=.. lines=.. seconds=..
+
+enum lsp_op {
+    lo_definition,
+    lo_references,
+    lo_hover,
+    lo_edit,            /* A character typed into a line */
+    lo_newline,         /* A line split in two and joined again */
+    lo_hover_after,     /* Hover at the end of the file after an edit */
+    lo_max
+};
+
+static const char *op_names[] = {
+        "definition", "references", "hover", "edit", "newline",
+        "hover_after_edit"
+};
+
+struct lsp_bench {
+    struct lsp_server lb_srv;
+    char             *lb_msg;
+    size_t            lb_cap;
+    double           *lb_us[lo_max];
+    uint64_t          lb_n[lo_max];
+    uint64_t          lb_state;     /* xorshift64 */
+    uint64_t          lb_version;
+};
+
+static inline double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t rnd(struct lsp_bench *b, uint64_t n) {
+    b->lb_state ^= b->lb_state << 13;
+    b->lb_state ^= b->lb_state >> 7;
+    b->lb_state ^= b->lb_state << 17;
+    return b->lb_state % n;
+}
+
+// Send the message in b->lb_msg, timed as op unless op is lo_max
+static int send(struct lsp_bench *b, enum lsp_op op, size_t len) {
+    double t0 = now();
+    lsp_handle(&b->lb_srv, b->lb_msg, len);
+    if (op != lo_max) {
+        b->lb_us[op][b->lb_n[op]++] = (now() - t0) * 1e6;
+    }
+    if (b->lb_srv.ls_out.jo_len &&
+        strstr(b->lb_srv.ls_out.jo_buf, "\"error\"")) {
+        fprintf(stderr, "%.*s\n", (int) b->lb_srv.ls_out.jo_len,
+                b->lb_srv.ls_out.jo_buf);
+        return -1;
+    }
+    return 0;
+}
+
+static int format(struct lsp_bench *b, size_t *len, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+static int format(struct lsp_bench *b, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    char *grown;
+    int n;
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->lb_msg, b->lb_cap, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t) n < b->lb_cap) {
+            *len = (size_t) n;
+            return 0;
+        }
+        grown = realloc(b->lb_msg, (size_t) n + 1);
+        if (!grown) {
+            LOGERROR("No memory for a message");
+            return -1;
+        }
+        b->lb_msg = grown;
+        b->lb_cap = (size_t) n + 1;
+    }
+}
+
+static int query(struct lsp_bench *b, enum lsp_op op, const char *uri,
+                 uint64_t line, uint64_t col) {
+    static const char *methods[] = {
+            "definition", "references", "hover"
+    };
+    size_t len;
+    int k = op == lo_hover_after ? lo_hover : op;
+    if (format(b, &len, "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":"
+                        "\"textDocument/%s\",\"params\":{\"textDocument\":"
+                        "{\"uri\":\"%s\"},\"position\":{\"line\":%llu,"
+                        "\"character\":%llu},\"context\":"
+                        "{\"includeDeclaration\":true}}}",
+               methods[k], uri, (unsigned long long) line,
+               (unsigned long long) col) < 0) {
+        return -1;
+    }
+    return send(b, op, len);
+}
+
+static int edit(struct lsp_bench *b, enum lsp_op op, const char *uri,
+                uint64_t l0, uint64_t c0, uint64_t l1, uint64_t c1,
+                const char *text) {
+    size_t len;
+    if (format(b, &len, "{\"jsonrpc\":\"2.0\",\"method\":"
+                        "\"textDocument/didChange\",\"params\":"
+                        "{\"textDocument\":{\"uri\":\"%s\",\"version\":%llu},"
+                        "\"contentChanges\":[{\"range\":{\"start\":"
+                        "{\"line\":%llu,\"character\":%llu},\"end\":"
+                        "{\"line\":%llu,\"character\":%llu}},"
+                        "\"text\":\"%s\"}]}}",
+               uri, (unsigned long long) ++b->lb_version,
+               (unsigned long long) l0, (unsigned long long) c0,
+               (unsigned long long) l1, (unsigned long long) c1, text) < 0) {
+        return -1;
+    }
+    return send(b, op, len);
+}
+
+// didOpen of path, its text escaped into the message
+static int open_file(struct lsp_bench *b, const char *path) {
+    struct json_out o;
+    FILE *fp = fopen(path, "rb");
+    char buf[65536], uri[4200];
+    size_t n;
+    int rc;
+    if (!fp) {
+        LOGERROR("Unable to open file: %s", path);
+        return -1;
+    }
+    memset(&o, 0, sizeof(o));
+    snprintf(uri, sizeof(uri), "file://%s", path);
+    json_printf(&o, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\","
+                    "\"params\":{\"textDocument\":{\"uri\":\"%s\","
+                    "\"languageId\":\"dasm\",\"version\":0,\"text\":\"", uri);
+    // the quotes of each piece are dropped
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        size_t at = o.jo_len;
+        json_quote(&o, buf, n);
+        memmove(o.jo_buf + at, o.jo_buf + at + 1, o.jo_len - at - 2);
+        o.jo_len -= 2;
+    }
+    fclose(fp);
+    json_raw(&o, "\"}}}", 4);
+    if (o.jo_err) {
+        free(o.jo_buf);
+        return -1;
+    }
+    free(b->lb_msg);
+    b->lb_msg = o.jo_buf;
+    b->lb_cap = o.jo_cap;
+    rc = send(b, lo_max, o.jo_len);
+    return rc;
+}
+
+static int cmp_double(const void *x, const void *y) {
+    double p = *(const double *) x, q = *(const double *) y;
+    return p < q ? -1 : p > q;
+}
+
+static void report(struct lsp_bench *b) {
+    uint64_t n;
+    double *v;
+    int op;
+    for (op = 0; op < lo_max; ++op) {
+        n = b->lb_n[op];
+        v = b->lb_us[op];
+        if (!n) {
+            continue;
+        }
+        qsort(v, n, sizeof(double), cmp_double);
+        printf("op=%s n=%llu p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+               op_names[op], (unsigned long long) n, v[n / 2],
+               v[n * 99 / 100], v[n - 1]);
+    }
+}
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n queries] [-S seed] <source>...\n",
+            basename(prog));
+}
+
+int main(int argc, char *argv[]) {
+    struct lsp_bench b;
+    struct sym_doc *d, **docs = NULL;
+    struct sym_line *l;
+    struct sym_occ *o;
+    uint64_t queries = 2000, ndocs = 0, i, k, tries, last;
+    double t0;
+    int opt, rc = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.lb_state = 88172645463325252ull;
+    while ((opt = getopt(argc, argv, "n:S:")) != -1) {
+        switch (opt) {
+            case 'n':
+                queries = strtoull(optarg, NULL, 0);
+                break;
+            case 'S':
+                b.lb_state = strtoull(optarg, NULL, 0) | 1;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind >= argc || !queries) {
+        usage(argv[0]);
+        return -1;
+    }
+    lsp_init(&b.lb_srv);
+    for (k = 0; k < lo_max; ++k) {
+        b.lb_us[k] = malloc(sizeof(double) * queries);
+        if (!b.lb_us[k]) {
+            LOGERROR("No memory for the timings");
+            return -1;
+        }
+    }
+    t0 = now();
+    for (i = (uint64_t) optind; i < (uint64_t) argc; ++i) {
+        if (open_file(&b, argv[i]) < 0) {
+            return -1;
+        }
+    }
+    printf("op=open files=%d lines=%llu seconds=%.6f\n", argc - optind,
+           (unsigned long long) b.lb_srv.ls_index.sx_lines, now() - t0);
+    for (d = b.lb_srv.ls_index.sx_docs; d; d = d->sd_next) {
+        ++ndocs;
+    }
+    docs = malloc(sizeof(*docs) * ndocs);
+    if (!docs) {
+        LOGERROR("No memory for the documents");
+        return -1;
+    }
+    for (d = b.lb_srv.ls_index.sx_docs, k = 0; d; d = d->sd_next) {
+        docs[k++] = d;
+    }
+    for (i = 0; i < queries && rc == 0; ++i) {
+        // a line with a label on it, somewhere
+        d = docs[rnd(&b, ndocs)];
+        for (tries = 0, l = NULL; tries < 1000; ++tries) {
+            l = d->sd_line[rnd(&b, d->sd_nline)];
+            if (l->sl_nocc) {
+                break;
+            }
+        }
+        if (!l || !l->sl_nocc) {
+            continue;
+        }
+        sym_refresh(d);
+        o = &l->sl_occ[rnd(&b, l->sl_nocc)];
+        k = l->sl_no;
+        // the last line with words, its address depends on every edit
+        for (last = d->sd_nline - 1;
+             last > 0 && !d->sd_line[last]->sl_nstmt; --last);
+        if (query(&b, lo_definition, d->sd_uri, k, o->so_col) < 0 ||
+            query(&b, lo_references, d->sd_uri, k, o->so_col) < 0 ||
+            query(&b, lo_hover, d->sd_uri, k, o->so_col) < 0 ||
+            edit(&b, lo_edit, d->sd_uri, k, 0, k, 0, " ") < 0 ||
+            query(&b, lo_hover_after, d->sd_uri, last, 0) < 0 ||
+            edit(&b, lo_max, d->sd_uri, k, 0, k, 1, "") < 0 ||
+            edit(&b, lo_newline, d->sd_uri, k, 0, k, 0, "\\n") < 0 ||
+            edit(&b, lo_max, d->sd_uri, k, 0, k + 1, 0, "") < 0) {
+            rc = -1;
+        }
+    }
+    report(&b);
+    for (k = 0; k < lo_max; ++k) {
+        free(b.lb_us[k]);
+    }
+    free(docs);
+    free(b.lb_msg);
+    lsp_free(&b.lb_srv);
+    return rc < 0 ? -1 : 0;
+}
@@ -1,35 +1,365 @@
+#include <getopt.h>
 #include <libgen.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "assembler.h"
+#include "diag.h"
+#include "floppy.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
 
-// TODO: Support literal after a register in "register indirect literal mode"
-//       For example as of today we support "SET [A + 0x200]",
-//       20 but not "SET [0x200 + A], 20"
-// TODO: Support list of numbers and strings as data
-//       As of today we just support a single string enclosed in quotes.
-//       Future plan is to allow something like the regular expression below
-//       DAT (<num> | <str>) (, [<num> | <str>])+
+#define MAX_OUTPUTS 16
+#define MAX_PARTS   16
+
+static void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-o [format:]image]... [--sparse]\n"
+                    "           [--stream|--pipeline]\n"
+                    "           [--merge-data] [--layout[=profile]]\n"
+                    "           [--stats[=text|json]]\n"
+                    "           [--prelude file] [--listing file]\n"
+                    "           [--debug-info file]\n"
+                    "           [--max-errors n] [--diagnostics file]\n"
+                    "           [--floppy disk [--place sector:file]...]\n"
+                    "           [--trace file] [--watch]\n"
+                    "           <infile>\n"
+                    "  -o image   write the binary image (big endian words)\n"
+                    "             instead of the listing on stdout; repeat\n"
+                    "             it for more images, all from one layout.\n"
+                    "             format is bin, sparse, hex (Intel HEX) or\n"
+                    "             c (a const uint16_t array in a header)\n"
+                    "  --sparse   images without a format are sparse: only\n"
+                    "             the segments placed by .org and .reserve,\n"
+                    "             after a table of them\n"
+                    "  --stream   encode each line as it is read and keep no\n"
+                    "             tokens, for very large sources (needs -o)\n"
+                    "  --pipeline as --stream, tokenizing on a second thread\n"
+                    "  --merge-data\n"
+                    "             merge labeled DATs that are the same as, or\n"
+                    "             the end of, another one into it\n"
+                    "  --layout   move the most referenced blocks where their\n"
+                    "             labels fit in the opcode word; profile\n"
+                    "             lines are \"<label> <count>\"\n"
+                    "  --prelude  lay file out at 0 ahead of infile, which\n"
+                    "             can use its labels; it is assembled once\n"
+                    "             into file.dpch and mapped after that\n"
+                    "  --listing  write every source line with its address\n"
+                    "             and words, then the labels, to file\n"
+                    "             (- for stdout), in place of the listing\n"
+                    "  --debug-info\n"
+                    "             write the labels and the address of every\n"
+                    "             line to file, for debuggers to map\n"
+                    "  --max-errors\n"
+                    "             stop after n errors in the source, 0 for\n"
+                    "             no limit (20)\n"
+                    "  --diagnostics\n"
+                    "             write the errors in the source to file\n"
+                    "             (- for stdout) as JSON, none is []\n"
+                    "  --floppy   write an M35FD disk image with the program\n"
+                    "             at sector 0, empty sectors left as holes\n"
+                    "  --place    put file on the disk from sector on, a\n"
+                    "             .dasm assembled, anything else as it is\n"
+                    "  --stats    report time, allocations and counts per\n"
+                    "             phase on stderr, as a table or as JSON\n"
+                    "  --trace    write a Chrome trace / Perfetto timeline\n"
+                    "             of the run to file\n"
+                    "  --watch    stay up and assemble again whenever the\n"
+                    "             input, the profile or the prelude changes\n",
+            basename(prog));
+}
+
+// One run over the input, kept together for --watch to repeat
+struct run {
+    struct assembler *r_asm;
+    struct asm_stats *r_stats;
+    char             *r_listing;
+    char             *r_debuginfo;
+    char             *r_diagnostics;
+    char             *r_floppy;
+    struct disk_part *r_parts;
+    int               r_nparts;
+    struct out_sink  *r_outputs;
+    int               r_noutputs;
+    char             *r_prelude;
+    int               r_stream;
+    int               r_json;
+    int               r_count;     /* Runs so far */
+};
+
+static int assemble(void *arg) {
+    struct run *r = arg;
+    struct assembler *a = r->r_asm;
+    struct asm_stats *sp = r->r_stats;
+    int rc;
+    /* Read the input again, but the first time */
+    if (r->r_count++) {
+        if (sp) {
+            memset(sp, 0, sizeof(*sp));
+            stats_begin(sp, asp_read);
+        }
+        if (asm_reload(a) < 0) {
+            return -1;
+        }
+        if (sp) {
+            stats_end(sp, asp_read);
+        }
+    }
+    /* Map the prelude, or assemble it if it changed */
+    if (r->r_prelude && asm_prelude(a, r->r_prelude) < 0) {
+        return -1;
+    }
+    /* Process the input, then tell what was wrong with it */
+    rc = r->r_stream == 2 ? asm_pipeline(a) :
+         r->r_stream ? asm_stream(a) : asm_parse(a);
+    if (r->r_diagnostics && diag_write(a, r->r_diagnostics) < 0) {
+        return -1;
+    }
+    if (rc < 0) {
+        return -1;
+    }
+    /* Write the parsed output to file */
+    if (r->r_noutputs ?
+        asm_write_images(a, r->r_outputs, r->r_noutputs) < 0 :
+        !r->r_listing && !r->r_floppy && asm_write(a) < 0) {
+        return -1;
+    }
+    if (r->r_floppy &&
+        asm_write_floppy(a, r->r_floppy, r->r_parts, r->r_nparts) < 0) {
+        return -1;
+    }
+    if (r->r_listing && asm_write_listing(a, r->r_listing) < 0) {
+        return -1;
+    }
+    if (r->r_debuginfo && asm_write_debuginfo(a, r->r_debuginfo) < 0) {
+        return -1;
+    }
+    if (sp) {
+        fflush(stdout);
+        stats_report(sp, stderr, r->r_json);
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
+    static const struct option longopts[] = {
+            {"stats", optional_argument, NULL, 's'},
+            {"trace", required_argument, NULL, 't'},
+            {"stream", no_argument, NULL, 'S'},
+            {"pipeline", no_argument, NULL, 'P'},
+            {"sparse", no_argument, NULL, 'R'},
+            {"layout", optional_argument, NULL, 'L'},
+            {"merge-data", no_argument, NULL, 'M'},
+            {"watch", no_argument, NULL, 'W'},
+            {"prelude", required_argument, NULL, 'p'},
+            {"listing", required_argument, NULL, 'l'},
+            {"debug-info", required_argument, NULL, 'g'},
+            {"max-errors", required_argument, NULL, 'E'},
+            {"diagnostics", required_argument, NULL, 'D'},
+            {"floppy", required_argument, NULL, 'F'},
+            {"place", required_argument, NULL, 'A'},
+            {NULL, 0, NULL, 0}
+    };
     struct assembler a[1];
-    char *infile;
+    struct asm_stats stats, *sp = NULL;
+    struct run r;
+    struct out_sink outputs[MAX_OUTPUTS];
+    struct disk_part parts[MAX_PARTS];
+    char *infile, *profile = NULL, *prelude = NULL, *listing = NULL;
+    char *debuginfo = NULL, *floppy = NULL, *diagnostics = NULL, *end;
+    char *outargs[MAX_OUTPUTS];
+    char *watched[3];
+    enum image_format format = if_flat;
+    int opt, json = 0, stream = 0, layout = 0, watch = 0, n, noutputs = 0;
+    int nparts = 0, merge = 0;
+    unsigned long long max_errors = ASM_MAX_ERRORS;
+
+    while ((opt = getopt_long(argc, argv, "o:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                if (noutputs == MAX_OUTPUTS) {
+                    fprintf(stderr, "%s: at most %d images\n",
+                            basename(argv[0]), MAX_OUTPUTS);
+                    return -1;
+                }
+                outargs[noutputs++] = optarg;
+                break;
+            case 's':
+                if (optarg && !strcmp(optarg, "json")) {
+                    json = 1;
+                } else if (optarg && strcmp(optarg, "text")) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                memset(&stats, 0, sizeof(stats));
+                sp = &stats;
+                break;
+            case 'S':
+                stream = 1;
+                break;
+            case 'P':
+                stream = 2;
+                break;
+            case 'R':
+                format = if_sparse;
+                break;
+            case 'L':
+                layout = 1;
+                profile = optarg;
+                break;
+            case 'M':
+                merge = 1;
+                break;
+            case 'W':
+                watch = 1;
+                break;
+            case 'p':
+                prelude = optarg;
+                break;
+            case 'l':
+                listing = optarg;
+                break;
+            case 'g':
+                debuginfo = optarg;
+                break;
+            case 'E':
+                max_errors = strtoull(optarg, &end, 0);
+                if (end == optarg || *end) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'D':
+                diagnostics = optarg;
+                break;
+            case 'F':
+                floppy = optarg;
+                break;
+            case 'A':
+                if (nparts == MAX_PARTS) {
+                    fprintf(stderr, "%s: at most %d files on a floppy\n",
+                            basename(argv[0]), MAX_PARTS);
+                    return -1;
+                }
+                if (floppy_parse(optarg, &parts[nparts++]) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 't':
+#ifdef DASM_TRACE
+                if (trace_open(optarg) < 0) {
+                    return -1;
+                }
+                TRACE_THREAD("main");
+#else
+                fprintf(stderr, "%s: built without tracing, configure with "
+                                "-DDASM_TRACE=ON\n", basename(argv[0]));
+                return -1;
+#endif
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
     /* Sanity check */
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <infile>\n", basename(argv[0]));
+    if (optind != argc - 1) {
+        usage(argv[0]);
         return -1;
     } else {
-        infile = argv[1];
+        infile = argv[optind];
+    }
+    for (n = 0; n < noutputs; ++n) {
+        if (out_parse(outargs[n], format, &outputs[n]) < 0) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (nparts && !floppy) {
+        fprintf(stderr, "%s: --place needs --floppy\n", basename(argv[0]));
+        return -1;
+    }
+    if (stream && !noutputs && !floppy) {
+        fprintf(stderr, "%s: --stream and --pipeline keep no listing, "
+                        "they need -o or --floppy\n",
+                basename(argv[0]));
+        return -1;
+    }
+    if (stream && merge) {
+        fprintf(stderr, "%s: --merge-data moves DATs across the whole "
+                        "program, it does not stream\n", basename(argv[0]));
+        return -1;
+    }
+    if (stream && layout) {
+        fprintf(stderr, "%s: --layout reorders the whole program, it does "
+                        "not stream\n", basename(argv[0]));
+        return -1;
+    }
+    if (stream && (listing || debuginfo)) {
+        fprintf(stderr, "%s: --listing and --debug-info do not combine "
+                        "with --stream or --pipeline\n", basename(argv[0]));
+        return -1;
+    }
+    if (prelude && (stream || layout)) {
+        fprintf(stderr, "%s: --prelude is laid out ahead of the tokens, it "
+                        "does not stream or move blocks\n",
+                basename(argv[0]));
+        return -1;
+    }
+    if (format == if_sparse && !noutputs) {
+        fprintf(stderr, "%s: --sparse needs -o\n", basename(argv[0]));
+        return -1;
     }
     /* Initialize the assembler */
-    if (asm_init(a, infile) < 0) {
+    if (sp) {
+        stats_begin(sp, asp_read);
+    }
+    // a stream maps its input to let go of it as it goes, but a file
+    // --watch rebuilds may be cut short under a mapping
+    if ((stream && !watch ? asm_init_mapped(a, infile)
+                          : asm_init(a, infile)) < 0) {
         return -1;
     }
-    /* Process the input */
-    if (asm_parse(a) < 0) {
+    if (sp) {
+        asm_set_stats(a, sp);
+        stats_end(sp, asp_read);
+    }
+    a->max_errors = max_errors;
+    a->merge = merge;
+    a->layout = layout;
+    a->layout_profile = profile;
+    r.r_asm = a;
+    r.r_stats = sp;
+    r.r_listing = listing;
+    r.r_debuginfo = debuginfo;
+    r.r_diagnostics = diagnostics;
+    r.r_floppy = floppy;
+    r.r_parts = parts;
+    r.r_nparts = nparts;
+    r.r_outputs = outputs;
+    r.r_noutputs = noutputs;
+    r.r_prelude = prelude;
+    r.r_stream = stream;
+    r.r_json = json;
+    r.r_count = 0;
+    if (watch) {
+        /* Rebuild on every change, readers never see half an image */
+        a->output_atomic = 1;
+        n = 0;
+        watched[n++] = infile;
+        if (profile) {
+            watched[n++] = profile;
+        }
+        if (prelude) {
+            watched[n++] = prelude;
+        }
+        watch_files(watched, n, assemble, &r);
+        asm_free(a);
         return -1;
     }
-    /* Write the parsed output to file */
-    if (asm_write(a) < 0) {
+    if (assemble(&r) < 0) {
         return -1;
     }
     /* Done */
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+#include "layout.h"
+#include "merge.h"
+#include "stats.h"
+#include "tokenize.h"
+
+// Merge pass, between tokenizing and the layout pass. A blob is a DAT of
+// numbers and strings only, under labels of its own that control cannot
+// fall into: the statement before them is a DAT or a jump out that is not
+// under an IF, not .pin, and a label or the end of the source comes after
+// it. Code is taken to read a blob only through its labels and within its
+// words.
+//
+// Blobs with the same words are interned in a hash table: the first of
+// them stays and the labels of the others move in front of it. The rest
+// are sorted by their words read backwards, where a blob that ends another
+// one sorts right before it, or before one that ends it too. Each such
+// chain is spliced together at the place of its longest blob: every blob
+// in it is cut short by the words of the next, which follows with its
+// labels and its DAT holding the same words. No word is copied and the
+// labels are placed by pass 1 as before. A source with .org or .reserve,
+// or an operand that takes one label from another, is left alone.
+
+struct blob {
+    struct token *bl_first;      /* Its first label */
+    struct token *bl_dat;
+    struct token *bl_after;      /* What came after it in the token list */
+    uint64_t      bl_hash;
+    struct blob  *bl_into;       /* The blob it is merged into, or NULL */
+    struct blob  *bl_same;       /* The next one with its words */
+    struct blob  *bl_tail;       /* The blob that ends it */
+};
+
+struct merge {
+    struct blob   *mg_blob;      /* In the order of the token list */
+    uint64_t       mg_nblob;
+    struct blob  **mg_table;     /* The first of each, by hash */
+    uint64_t       mg_mask;
+    struct blob  **mg_sorted;    /* The first of each, by tail */
+    uint64_t       mg_nsorted;
+};
+
+static inline uint64_t hash_words(const uint16_t *w, uint64_t n) {
+    uint64_t h = 14695981039346656037ull, i;
+    for (i = 0; i < n; ++i) {
+        h = (h ^ (w[i] & 0xff)) * 1099511628211ull;
+        h = (h ^ (w[i] >> 8)) * 1099511628211ull;
+    }
+    return h;
+}
+
+static inline int same_words(const struct blob *p, const struct blob *q) {
+    return p->bl_hash == q->bl_hash &&
+           p->bl_dat->tok_len == q->bl_dat->tok_len &&
+           !memcmp(p->bl_dat->ttu_wrd, q->bl_dat->ttu_wrd,
+                   sizeof(uint16_t) * p->bl_dat->tok_len);
+}
+
+// q ends with all the words of p, and has more
+static inline int ends(const struct blob *q, const struct blob *p) {
+    uint64_t n = p->bl_dat->tok_len, m = q->bl_dat->tok_len;
+    return n < m && !memcmp(q->bl_dat->ttu_wrd + (m - n), p->bl_dat->ttu_wrd,
+                            sizeof(uint16_t) * n);
+}
+
+// By the words read from the last one back
+static int by_tail(const void *x, const void *y) {
+    const struct blob *p = *(struct blob * const *) x;
+    const struct blob *q = *(struct blob * const *) y;
+    uint64_t n = p->bl_dat->tok_len, m = q->bl_dat->tok_len, i;
+    const uint16_t *u = p->bl_dat->ttu_wrd + n, *v = q->bl_dat->ttu_wrd + m;
+    for (i = 1; i <= n && i <= m; ++i) {
+        if (u[-i] != v[-i]) {
+            return u[-i] < v[-i] ? -1 : 1;
+        }
+    }
+    return (n > m) - (n < m);
+}
+
+// Find the blobs in the token list. 1 on success, 0 if the source must
+// keep its data, -1 on error.
+static int collect(struct assembler *a, struct merge *mg) {
+    struct token *t, *first = NULL, *prev = NULL;
+    struct blob *grown, *b;
+    uint64_t cap = 0;
+    int falls = 1, prev_if = 0;
+
+    for (t = a->tok_list.head; t; t = t->next) {
+        if (t->type == tt_org || t->type == tt_reserve ||
+            ((t->type == tt_basic_opcode || t->type == tt_special_opcode) &&
+             expr_spans(t))) {
+            return 0;
+        }
+        if (t->type == tt_label) {
+            first = first ? first : t;
+            continue;
+        }
+        if (t->type == tt_words && first && !falls && !t->ttu_nrefs &&
+            t->tok_len && !(prev && prev->type == tt_pin) &&
+            (!t->next || t->next->type == tt_label ||
+             t->next->type == tt_pin)) {
+            if (mg->mg_nblob == cap) {
+                cap = cap ? cap * 2 : 64;
+                grown = realloc(mg->mg_blob, sizeof(struct blob) * cap);
+                if (!grown) {
+                    LOGERROR("No more memory for the data to merge");
+                    return -1;
+                }
+                ASM_STAT(a, ac_bytes,
+                         sizeof(struct blob) * (cap - mg->mg_nblob));
+                mg->mg_blob = grown;
+            }
+            b = &mg->mg_blob[mg->mg_nblob++];
+            memset(b, 0, sizeof(*b));
+            b->bl_first = first;
+            b->bl_dat = t;
+            b->bl_after = t->next;
+            b->bl_hash = hash_words(t->ttu_wrd, t->tok_len);
+        }
+        // a DAT control falls into is run, and so is what follows it
+        if (t->type == tt_basic_opcode || t->type == tt_special_opcode) {
+            falls = !layout_is_jump(t) || prev_if;
+            prev_if = layout_is_if(t);
+        } else {
+            prev_if = 0;
+        }
+        prev = t;
+        first = NULL;
+    }
+    return 1;
+}
+
+// Intern the blobs by their words, then chain each one that is left to
+// the next by tail when that one ends with it
+static int find_merges(struct assembler *a, struct merge *mg) {
+    struct blob *b, **slot, *p, *q;
+    uint64_t size, i;
+
+    for (size = 1; size < 2 * mg->mg_nblob; size *= 2);
+    mg->mg_table = calloc(size, sizeof(struct blob *));
+    mg->mg_sorted = malloc(sizeof(struct blob *) * mg->mg_nblob);
+    if (!mg->mg_table || !mg->mg_sorted) {
+        LOGERROR("No more memory for the data to merge");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct blob *) * (size + mg->mg_nblob));
+    mg->mg_mask = size - 1;
+    for (b = mg->mg_blob; b < mg->mg_blob + mg->mg_nblob; ++b) {
+        for (i = b->bl_hash & mg->mg_mask; mg->mg_table[i];
+             i = (i + 1) & mg->mg_mask) {
+            if (same_words(mg->mg_table[i], b)) {
+                break;
+            }
+        }
+        slot = &mg->mg_table[i];
+        if (*slot) {
+            b->bl_into = *slot;
+            b->bl_same = (*slot)->bl_same;
+            (*slot)->bl_same = b;
+        } else {
+            *slot = b;
+            mg->mg_sorted[mg->mg_nsorted++] = b;
+        }
+    }
+    qsort(mg->mg_sorted, mg->mg_nsorted, sizeof(struct blob *), by_tail);
+    for (i = mg->mg_nsorted ? mg->mg_nsorted - 1 : 0; i-- > 0;) {
+        p = mg->mg_sorted[i];
+        q = mg->mg_sorted[i + 1];
+        if (ends(q, p)) {
+            p->bl_into = q;
+            q->bl_tail = p;
+        }
+    }
+    return 0;
+}
+
+static inline void put(struct token_list *l, struct token *t) {
+    if (l->tail) {
+        l->tail->next = t;
+    } else {
+        l->head = t;
+    }
+    l->tail = t;
+}
+
+static void put_labels(struct token_list *l, struct blob *b) {
+    struct token *t, *next;
+    for (t = b->bl_first; t != b->bl_dat; t = next) {
+        next = t->next;
+        put(l, t);
+    }
+}
+
+// Link the token list again, each chain at the place of its longest blob.
+// Returns the words saved.
+static uint64_t splice(struct assembler *a, struct merge *mg) {
+    struct token_list l;
+    struct token *t = a->tok_list.head, *next;
+    struct blob *b = mg->mg_blob, *end = b + mg->mg_nblob, *c, *d;
+    uint64_t saved = 0;
+
+    memset(&l, 0, sizeof(l));
+    while (t) {
+        if (b == end || t != b->bl_first) {
+            next = t->next;
+            put(&l, t);
+            t = next;
+            continue;
+        }
+        for (c = b->bl_into ? NULL : b; c; c = c->bl_tail) {
+            // the same words: only the labels are left
+            for (d = c->bl_same; d; d = d->bl_same) {
+                put_labels(&l, d);
+                saved += d->bl_dat->tok_len;
+                tok_release(d->bl_dat);
+                d->bl_dat->type = tt_invalid;
+                d->bl_dat->next = a->tok_pool;
+                a->tok_pool = d->bl_dat;
+            }
+            put_labels(&l, c);
+            // the words the next one holds
+            if (c->bl_tail) {
+                c->bl_dat->tok_len -= c->bl_tail->bl_dat->tok_len;
+                saved += c->bl_tail->bl_dat->tok_len;
+            }
+            put(&l, c->bl_dat);
+        }
+        t = b->bl_after;
+        ++b;
+    }
+    if (l.tail) {
+        l.tail->next = NULL;
+    }
+    a->tok_list = l;
+    return saved;
+}
+
+int merge_data(struct assembler *a) {
+    struct merge mg;
+    struct blob *b;
+    uint64_t saved = 0, total = 0, merged = 0;
+    int rc;
+
+    memset(&mg, 0, sizeof(mg));
+    rc = collect(a, &mg);
+    if (rc == 0) {
+        fprintf(stderr, "merge: keeping the data, the source has .org, "
+                        ".reserve or an expression of two labels\n");
+    } else if (rc > 0) {
+        rc = find_merges(a, &mg);
+    }
+    if (rc == 0 && mg.mg_table) {
+        for (b = mg.mg_blob; b < mg.mg_blob + mg.mg_nblob; ++b) {
+            total += b->bl_dat->tok_len;
+            merged += b->bl_into != NULL;
+        }
+        saved = splice(a, &mg);
+        fprintf(stderr, "merge: %llu of %llu DATs merged into others, %llu "
+                        "words saved (%llu -> %llu words)\n",
+                (unsigned long long) merged,
+                (unsigned long long) mg.mg_nblob,
+                (unsigned long long) saved, (unsigned long long) total,
+                (unsigned long long) (total - saved));
+    }
+    free(mg.mg_blob);
+    free(mg.mg_table);
+    free(mg.mg_sorted);
+    return rc < 0 ? -1 : 0;
+}
@@ -0,0 +1,11 @@
+#ifndef ASSEMBLER_MERGE_H
+#define ASSEMBLER_MERGE_H
+
+#include "common.h"
+
+/* Merge DATs of constant words that are the same as, or end another one,
+ * into it, moving their labels along, and report what it saves on stderr.
+ * 0 on success, -1 on error. */
+int merge_data(struct assembler *a);
+
+#endif //ASSEMBLER_MERGE_H
@@ -0,0 +1,371 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+// Words handed to every sink at a time, so they all work on the same
+// part of the image while it is in cache
+#define OUT_BLOCK 4096
+
+// Data bytes in an Intel HEX record
+#define HEX_RECORD 16
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static const struct {
+    const char       *fn_name;
+    enum image_format fn_format;
+} format_names[] = {
+        {"bin",    if_flat},
+        {"sparse", if_sparse},
+        {"hex",    if_hex},
+        {"c",      if_carray},
+};
+
+/* One output being written */
+struct sink {
+    const struct out_sink *sk_out;
+    FILE                  *sk_fp;
+    char                   sk_path[4096];   /* Written to, renamed over */
+    uint8_t               *sk_buf;          /* SINK_BUF bytes */
+    size_t                 sk_len;
+    uint64_t               sk_upper;        /* HEX: address bits above 16 */
+    uint64_t               sk_col;          /* C: words on the line */
+    int                    sk_err;
+};
+
+int out_parse(char *arg, enum image_format dflt, struct out_sink *o) {
+    char *colon = strchr(arg, ':');
+    size_t i, len;
+    o->os_format = dflt;
+    o->os_path = arg;
+    if (colon) {
+        len = (size_t) (colon - arg);
+        for (i = 0; i < sizeof(format_names) / sizeof(format_names[0]); ++i) {
+            if (strlen(format_names[i].fn_name) == len &&
+                !strncmp(arg, format_names[i].fn_name, len)) {
+                o->os_format = format_names[i].fn_format;
+                o->os_path = colon + 1;
+                break;
+            }
+        }
+    }
+    return *o->os_path ? 0 : -1;
+}
+
+static void flush(struct sink *s) {
+    if (s->sk_len && !s->sk_err &&
+        fwrite(s->sk_buf, 1, s->sk_len, s->sk_fp) != s->sk_len) {
+        s->sk_err = 1;
+    }
+    s->sk_len = 0;
+}
+
+// Room for n more bytes at the end of the buffer
+static inline uint8_t *room(struct sink *s, size_t n) {
+    if (s->sk_len + n > SINK_BUF) {
+        flush(s);
+    }
+    return s->sk_buf + s->sk_len;
+}
+
+static void put_text(struct sink *s, const char *text) {
+    size_t n = strlen(text);
+    memcpy(room(s, n), text, n);
+    s->sk_len += n;
+}
+
+static inline uint8_t *put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+    return p + 4;
+}
+
+static inline char *put_hex8(char *p, uint8_t v) {
+    p[0] = hex_digits[v >> 4];
+    p[1] = hex_digits[v & 0xf];
+    return p + 2;
+}
+
+// ":LLAAAATT<data>CC", the checksum making all the bytes sum to 0
+static void hex_record(struct sink *s, uint8_t type, uint16_t addr,
+                       const uint8_t *data, uint8_t n) {
+    char *p = (char *) room(s, 12 + 2 * (size_t) n), *start = p;
+    uint8_t sum = (uint8_t) (n + (addr >> 8) + addr + type);
+    uint8_t i;
+    *p++ = ':';
+    p = put_hex8(p, n);
+    p = put_hex8(p, (uint8_t) (addr >> 8));
+    p = put_hex8(p, (uint8_t) addr);
+    p = put_hex8(p, type);
+    for (i = 0; i < n; ++i) {
+        sum = (uint8_t) (sum + data[i]);
+        p = put_hex8(p, data[i]);
+    }
+    p = put_hex8(p, (uint8_t) -sum);
+    *p++ = '\n';
+    s->sk_len += (size_t) (p - start);
+}
+
+// Data records for the words at word address addr, big endian like the
+// binary image, at byte addresses. A record never crosses 64 KiB, where
+// an extended linear address record moves the upper bits on.
+static void put_hex(struct sink *s, uint64_t addr, const uint16_t *w,
+                    uint64_t n) {
+    uint8_t data[HEX_RECORD], upper[2];
+    uint64_t byte, i, k;
+    while (n) {
+        byte = addr * 2;
+        if (byte >> 16 != s->sk_upper) {
+            s->sk_upper = byte >> 16;
+            upper[0] = (uint8_t) (s->sk_upper >> 8);
+            upper[1] = (uint8_t) s->sk_upper;
+            hex_record(s, 4, 0, upper, 2);
+        }
+        k = (0x10000 - (byte & 0xffff)) / 2;
+        k = k < HEX_RECORD / 2 ? k : HEX_RECORD / 2;
+        k = k < n ? k : n;
+        for (i = 0; i < k; ++i) {
+            data[2 * i] = (uint8_t) (w[i] >> 8);
+            data[2 * i + 1] = (uint8_t) w[i];
+        }
+        hex_record(s, 0, (uint16_t) byte, data, (uint8_t) (2 * k));
+        addr += k;
+        w += k;
+        n -= k;
+    }
+}
+
+// "0x1234," eight to a line
+static void put_c(struct sink *s, const uint16_t *w, uint64_t n) {
+    uint64_t i;
+    char *p;
+    for (i = 0; i < n; ++i) {
+        p = (char *) room(s, 12);
+        if (!s->sk_col) {
+            memcpy(p, "    ", 4);
+            p += 4;
+            s->sk_len += 4;
+        }
+        p[0] = '0';
+        p[1] = 'x';
+        p[2] = hex_digits[w[i] >> 12];
+        p[3] = hex_digits[(w[i] >> 8) & 0xf];
+        p[4] = hex_digits[(w[i] >> 4) & 0xf];
+        p[5] = hex_digits[w[i] & 0xf];
+        p[6] = ',';
+        s->sk_col = (s->sk_col + 1) % 8;
+        p[7] = s->sk_col ? ' ' : '\n';
+        s->sk_len += 8;
+    }
+}
+
+static void put_words(struct sink *s, uint64_t addr, const uint16_t *w,
+                      uint64_t n) {
+    uint64_t i, k;
+    uint8_t *p;
+    switch (s->sk_out->os_format) {
+        case if_flat:
+        case if_sparse:
+            for (; n; n -= k, w += k) {
+                k = n < SINK_BUF / 2 ? n : SINK_BUF / 2;
+                p = room(s, 2 * k);
+                for (i = 0; i < k; ++i) {
+                    p[2 * i] = (uint8_t) (w[i] >> 8);
+                    p[2 * i + 1] = (uint8_t) w[i];
+                }
+                s->sk_len += 2 * k;
+            }
+            break;
+        case if_hex:
+            put_hex(s, addr, w, n);
+            break;
+        case if_carray:
+            put_c(s, w, n);
+            break;
+    }
+}
+
+// The identifier of a C array, from the name of its file
+static void c_name(const char *path, char *name, size_t size) {
+    const char *base = strrchr(path, '/');
+    size_t i = 0;
+    base = base ? base + 1 : path;
+    if (isdigit((unsigned char) *base)) {
+        name[i++] = '_';
+    }
+    for (; *base && *base != '.' && i + 1 < size; ++base) {
+        name[i++] = isalnum((unsigned char) *base) ? *base : '_';
+    }
+    if (!i) {
+        name[i++] = '_';
+    }
+    name[i] = '\0';
+}
+
+// What comes before the words: the segment table, the C declaration
+static void begin(struct assembler *a, struct sink *s,
+                  struct segment **regions, uint64_t nregions) {
+    char name[256], guard[256], line[1024];
+    uint8_t *p;
+    uint64_t i;
+    switch (s->sk_out->os_format) {
+        case if_sparse:
+            p = room(s, 8);
+            memcpy(p, "DSEG", 4);
+            put_be32(p + 4, (uint32_t) nregions);
+            s->sk_len += 8;
+            for (i = 0; i < nregions; ++i) {
+                p = room(s, 8);
+                put_be32(put_be32(p, (uint32_t) regions[i]->sg_addr),
+                         (uint32_t) regions[i]->sg_words);
+                s->sk_len += 8;
+            }
+            break;
+        case if_carray:
+            c_name(s->sk_out->os_path, name, sizeof(name));
+            for (i = 0; name[i]; ++i) {
+                guard[i] = (char) toupper((unsigned char) name[i]);
+            }
+            guard[i] = '\0';
+            snprintf(line, sizeof(line),
+                     "/* Generated by dasm from %s */\n"
+                     "#ifndef DASM_%s_H\n#define DASM_%s_H\n\n"
+                     "#include <stdint.h>\n\n"
+                     "static const uint16_t %s[] = {\n",
+                     basename(a->input_file), guard, guard, name);
+            put_text(s, line);
+            break;
+        default:
+            break;
+    }
+}
+
+static void end(struct sink *s, uint64_t words) {
+    switch (s->sk_out->os_format) {
+        case if_hex:
+            hex_record(s, 1, 0, NULL, 0);
+            break;
+        case if_carray:
+            if (!words) {
+                // an empty initializer is not C
+                put_text(s, "    0\n");
+            } else if (s->sk_col) {
+                // the space after the last word on the line
+                s->sk_buf[s->sk_len - 1] = '\n';
+            }
+            put_text(s, "};\n\n#endif\n");
+            break;
+        default:
+            break;
+    }
+}
+
+// Open a sink, next to its name when readers should never see half of it
+static int open_sink(struct assembler *a, struct sink *s,
+                     const struct out_sink *o) {
+    memset(s, 0, sizeof(*s));
+    s->sk_out = o;
+    if (snprintf(s->sk_path, sizeof(s->sk_path),
+                 a->output_atomic ? "%s.tmp" : "%s", o->os_path) >=
+        (int) sizeof(s->sk_path)) {
+        LOGERROR("Output file name too long: %s", o->os_path);
+        return -1;
+    }
+    s->sk_buf = malloc(SINK_BUF);
+    if (!s->sk_buf) {
+        LOGERROR("No memory for the output buffer");
+        return -1;
+    }
+    s->sk_fp = fopen(s->sk_path, "wb");
+    if (!s->sk_fp) {
+        LOGERROR("Unable to open %s for writing", s->sk_path);
+        free(s->sk_buf);
+        s->sk_buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int close_sink(struct assembler *a, struct sink *s, int rc) {
+    if (!s->sk_fp) {
+        return -1;
+    }
+    flush(s);
+    if (fclose(s->sk_fp) != 0 || s->sk_err) {
+        LOGERROR("Could not write %s", s->sk_path);
+        rc = -1;
+    }
+    if (a->output_atomic) {
+        if (rc == 0 && rename(s->sk_path, s->sk_out->os_path) != 0) {
+            LOGERROR("Could not rename %s to %s", s->sk_path,
+                     s->sk_out->os_path);
+            rc = -1;
+        }
+        if (rc < 0) {
+            remove(s->sk_path);
+        }
+    }
+    free(s->sk_buf);
+    return rc;
+}
+
+int out_write(struct assembler *a, const uint16_t *image, uint64_t words,
+              const struct out_sink *o, int n) {
+    struct segment whole, *only = &whole, **regions = &only;
+    struct sink *sinks;
+    uint64_t nregions, r, pos = 0, lo, hi, addr, k;
+    int i, rc = 0;
+
+    // the segments by address, or the whole image as one
+    if (a->segs.st_count) {
+        regions = a->segs.st_sorted;
+        nregions = a->segs.st_count;
+    } else {
+        memset(&whole, 0, sizeof(whole));
+        whole.sg_words = words;
+        nregions = words ? 1 : 0;
+    }
+    sinks = calloc((size_t) n, sizeof(*sinks));
+    if (!sinks) {
+        LOGERROR("No memory for the outputs");
+        return -1;
+    }
+    for (i = 0; i < n && rc == 0; ++i) {
+        rc = open_sink(a, &sinks[i], &o[i]);
+    }
+    if (rc == 0) {
+        for (i = 0; i < n; ++i) {
+            begin(a, &sinks[i], regions, nregions);
+        }
+        for (r = 0; r < nregions; ++r) {
+            lo = regions[r]->sg_addr;
+            hi = lo + regions[r]->sg_words;
+            // the gap before it is zero in formats laid out from 0
+            for (addr = pos; addr < hi; addr += k) {
+                k = (addr < lo ? lo : hi) - addr;
+                k = k < OUT_BLOCK ? k : OUT_BLOCK;
+                for (i = 0; i < n; ++i) {
+                    if (addr >= lo || o[i].os_format == if_flat ||
+                        o[i].os_format == if_carray) {
+                        put_words(&sinks[i], addr, image + addr, k);
+                    }
+                }
+            }
+            pos = hi;
+        }
+        for (i = 0; i < n; ++i) {
+            end(&sinks[i], words);
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        if (close_sink(a, &sinks[i], rc) < 0) {
+            rc = -1;
+        }
+    }
+    free(sinks);
+    return rc;
+}
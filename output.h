@@ -0,0 +1,21 @@
+#ifndef ASSEMBLER_OUTPUT_H
+#define ASSEMBLER_OUTPUT_H
+
+#include "common.h"
+
+// The image goes out to every -o once it is laid out, in one walk over it
+// in address order. Each sink formats the words into a buffer of its own
+// and writes it out whenever it fills up.
+
+#define SINK_BUF (1 << 16)
+
+/* "[format:]path", the format being bin, sparse, hex or c. Without one,
+ * or with something else before a colon, all of it is the path and gets
+ * dflt. 0, or -1 if there is no path. */
+int out_parse(char *arg, enum image_format dflt, struct out_sink *o);
+/* Write the words of the image, laid out at their addresses, to each of
+ * the n sinks. 0 if all of them were written. */
+int out_write(struct assembler *a, const uint16_t *image, uint64_t words,
+              const struct out_sink *o, int n);
+
+#endif //ASSEMBLER_OUTPUT_H
@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "diag.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "stream.h"
+#include "tokenize.h"
+#include "trace.h"
+
+// Streaming assembly on two threads. The lexer thread runs tok_statement()
+// and publishes each statement as a record in a single producer, single
+// consumer ring; the calling thread encodes them with stream_statement().
+//
+// Each side works on a private cursor and publishes it only every
+// RING_BATCH records, or before it waits, so the shared head and tail
+// cache lines change hands rarely. Each side also keeps the last value it
+// saw of the other's cursor and reads the shared one only when that runs
+// out. A full ring stalls the lexer, an empty one the encoder.
+
+#define RING_RECORDS 1024        /* Power of two */
+#define RING_BATCH   64
+#define RING_SPINS   256         /* Before yielding the CPU */
+#define CACHE_LINE   64
+
+struct ring_record {
+    struct token rr_tok[3];
+    int          rr_n;           /* From tok_statement(): 0 EOF, -1 error */
+};
+
+struct ring {
+    struct ring_record *rg_rec;
+    /* Written by the lexer */
+    uint64_t rg_head __attribute__((aligned(CACHE_LINE)));
+    /* Written by the encoder */
+    uint64_t rg_tail __attribute__((aligned(CACHE_LINE)));
+    int      rg_stop;            /* The encoder gave up */
+};
+
+struct lexer {
+    struct ring      *lx_ring;
+    struct assembler  lx_asm;    /* Copy of the assembler, for its cursor */
+    struct asm_stats  lx_stats;
+};
+
+static inline void ring_wait(unsigned *spins) {
+    if (++*spins < RING_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        *spins = 0;
+        sched_yield();
+    }
+}
+
+static void *lexer_main(void *arg) {
+    struct lexer *lx = arg;
+    struct ring *rg = lx->lx_ring;
+    struct ring_record *rec;
+    uint64_t pos = 0, published = 0, tail = 0, seen;
+    unsigned spins = 0;
+    TRACE_START(t0);
+
+    TRACE_THREAD("lexer");
+    for (;;) {
+        if (pos - tail == RING_RECORDS) {
+            // full, show what we have and wait for room
+            __atomic_store_n(&rg->rg_head, pos, __ATOMIC_RELEASE);
+            published = pos;
+            while (pos - (tail = __atomic_load_n(&rg->rg_tail,
+                                                 __ATOMIC_ACQUIRE))
+                   == RING_RECORDS) {
+                if (__atomic_load_n(&rg->rg_stop, __ATOMIC_RELAXED)) {
+                    goto out;
+                }
+                ring_wait(&spins);
+            }
+        }
+        rec = &rg->rg_rec[pos & (RING_RECORDS - 1)];
+        seen = lx->lx_asm.nerrors;
+        rec->rr_n = tok_statement(&lx->lx_asm, rec->rr_tok);
+        // an error in the source is kept, the record is used again
+        if (rec->rr_n < 0 && tok_recover(&lx->lx_asm, seen)) {
+            continue;
+        }
+        ++pos;
+        if (rec->rr_n <= 0) {
+            break;
+        }
+        if (pos - published >= RING_BATCH) {
+            if (__atomic_load_n(&rg->rg_stop, __ATOMIC_RELAXED)) {
+                break;
+            }
+            __atomic_store_n(&rg->rg_head, pos, __ATOMIC_RELEASE);
+            published = pos;
+        }
+    }
+out:
+    __atomic_store_n(&rg->rg_head, pos, __ATOMIC_RELEASE);
+    TRACE_SPAN(t0, "lex", lx->lx_asm.input_file);
+    return NULL;
+}
+
+static void add_counters(struct asm_counters *to, struct asm_counters *from) {
+    to->ac_bytes += from->ac_bytes;
+    to->ac_tokens += from->ac_tokens;
+    to->ac_labels += from->ac_labels;
+    to->ac_label_refs += from->ac_label_refs;
+    to->ac_fixups += from->ac_fixups;
+    to->ac_bcode_nodes += from->ac_bcode_nodes;
+    to->ac_probes += from->ac_probes;
+}
+
+int pipeline_assemble(struct assembler *a) {
+    struct ring rg;
+    struct lexer lx;
+    struct ring_record *rec;
+    pthread_t thread;
+    uint64_t pos = 0, published = 0, head = 0, seen;
+    unsigned spins = 0;
+    int rc = 0;
+
+    if (stream_begin(a) < 0) {
+        return -1;
+    }
+    memset(&rg, 0, sizeof(rg));
+    rg.rg_rec = malloc(sizeof(struct ring_record) * RING_RECORDS);
+    if (!rg.rg_rec) {
+        LOGERROR("No memory for the token ring");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct ring_record) * RING_RECORDS);
+    lx.lx_ring = &rg;
+    // both threads find errors, printed once they are in source order
+    a->diag_quiet = 1;
+    lx.lx_asm = *a;
+    // the lexer counts on its own, merged once it is done
+    memset(&lx.lx_stats, 0, sizeof(lx.lx_stats));
+    lx.lx_asm.stats = a->stats ? &lx.lx_stats : NULL;
+    // and keeps its errors apart, taken over once it is done
+    lx.lx_asm.diags = NULL;
+    lx.lx_asm.ndiags = lx.lx_asm.diag_cap = lx.lx_asm.nerrors = 0;
+    if (pthread_create(&thread, NULL, lexer_main, &lx) != 0) {
+        LOGERROR("Cannot start the lexer thread");
+        a->diag_quiet = 0;
+        free(rg.rg_rec);
+        return -1;
+    }
+
+    TRACE_START(t0);
+    for (;;) {
+        if (pos == head) {
+            __atomic_store_n(&rg.rg_tail, pos, __ATOMIC_RELEASE);
+            published = pos;
+            while ((head = __atomic_load_n(&rg.rg_head, __ATOMIC_ACQUIRE))
+                   == pos) {
+                ring_wait(&spins);
+            }
+        }
+        rec = &rg.rg_rec[pos & (RING_RECORDS - 1)];
+        if (rec->rr_n <= 0) {
+            rc = rec->rr_n;
+            break;
+        }
+        // the input before it has been tokenized and encoded
+        asm_drop_input(a, rec->rr_tok[0].tok_pos);
+        seen = a->nerrors;
+        rc = stream_statement(a, rec->rr_tok, rec->rr_n);
+        ++pos;
+        if (rc < 0 && (a->nerrors == seen || !diag_more(a))) {
+            break;
+        }
+        rc = 0;
+        if (pos - published >= RING_BATCH) {
+            __atomic_store_n(&rg.rg_tail, pos, __ATOMIC_RELEASE);
+            published = pos;
+        }
+    }
+    TRACE_SPAN(t0, "encode", a->input_file);
+
+    __atomic_store_n(&rg.rg_stop, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&rg.rg_tail, pos, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    // whatever the lexer got ahead with is dropped
+    head = __atomic_load_n(&rg.rg_head, __ATOMIC_ACQUIRE);
+    for (; pos < head; ++pos) {
+        rec = &rg.rg_rec[pos & (RING_RECORDS - 1)];
+        if (rec->rr_n > 0) {
+            tok_release(&rec->rr_tok[0]);
+        }
+    }
+    free(rg.rg_rec);
+    if (a->stats) {
+        add_counters(&a->stats->as_cur, &lx.lx_stats.as_cur);
+    }
+    if (diag_merge(a, &lx.lx_asm) < 0) {
+        rc = -1;
+    }
+    a->diag_quiet = 0;
+    diag_print(a);
+    if (rc < 0) {
+        return -1;
+    }
+    return stream_end(a);
+}
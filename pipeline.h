@@ -0,0 +1,9 @@
+#ifndef ASSEMBLER_PIPELINE_H
+#define ASSEMBLER_PIPELINE_H
+
+#include "common.h"
+
+/* stream_assemble(), with the tokenizer on a thread of its own */
+int pipeline_assemble(struct assembler *a);
+
+#endif //ASSEMBLER_PIPELINE_H
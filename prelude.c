@@ -0,0 +1,314 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "binary_code.h"
+#include "prelude.h"
+
+static inline const struct pch_label *pch_labels(const struct pch_header *h) {
+    return (const struct pch_label *) (h + 1);
+}
+
+static inline const uint16_t *pch_words(const struct pch_header *h) {
+    return (const uint16_t *) (pch_labels(h) + h->ph_labels);
+}
+
+static inline const char *pch_names(const struct pch_header *h) {
+    return (const char *) (pch_words(h) + h->ph_words);
+}
+
+static inline size_t pch_size(uint64_t words, uint64_t labels,
+                              uint64_t names) {
+    return sizeof(struct pch_header) + sizeof(struct pch_label) * labels +
+           sizeof(uint16_t) * words + names;
+}
+
+static inline uint64_t fnv1a(uint64_t h, const unsigned char *p, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+#define FNV_BASIS 14695981039346656037ull
+
+// Hash and size of the prelude source as it is now, 0 or -1
+static int hash_source(const char *file, uint64_t *hash, uint64_t *size) {
+    unsigned char buf[65536];
+    uint64_t h = FNV_BASIS, total = 0;
+    size_t n;
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        LOGERROR("Unable to open file: %s", file);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        h = fnv1a(h, buf, n);
+        total += n;
+    }
+    if (ferror(fp)) {
+        fclose(fp);
+        LOGERROR("Could not read the file successfully");
+        return -1;
+    }
+    fclose(fp);
+    *hash = h;
+    *size = total;
+    return 0;
+}
+
+// A cache of size bytes is usable when it is whole and was made from the
+// source that has this hash and size
+static int pch_valid(const struct pch_header *h, size_t size, uint64_t hash,
+                     uint64_t source) {
+    const struct pch_label *pl;
+    uint32_t i;
+    if (size < sizeof(*h) || h->ph_magic != PRELUDE_MAGIC ||
+        h->ph_version != PRELUDE_VERSION || h->ph_hash != hash ||
+        h->ph_size != source ||
+        pch_size(h->ph_words, h->ph_labels, h->ph_names) != size) {
+        return 0;
+    }
+    pl = pch_labels(h);
+    for (i = 0; i < h->ph_labels; ++i) {
+        if (pl[i].pl_name > h->ph_names ||
+            pl[i].pl_len > h->ph_names - pl[i].pl_name) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Map the cache at path if it is usable: 1 if it was, 0 if not
+static int map_cache(struct prelude *p, const char *path, uint64_t hash,
+                     uint64_t source) {
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct pch_header)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (!pch_valid(map, (size_t) st.st_size, hash, source)) {
+        munmap(map, (size_t) st.st_size);
+        return 0;
+    }
+    p->pr_head = map;
+    p->pr_size = (size_t) st.st_size;
+    p->pr_mapped = 1;
+    return 1;
+}
+
+// Write the cache next to its name and rename it over, so that another
+// run never maps half of one
+static int write_cache(const struct prelude *p, const char *path) {
+    char tmp[4096];
+    FILE *fp;
+    int rc = 0;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        LOGERROR("Prelude cache name too long: %s", path);
+        return -1;
+    }
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", tmp);
+        return -1;
+    }
+    if (fwrite(p->pr_head, 1, p->pr_size, fp) != p->pr_size) {
+        rc = -1;
+    }
+    if (fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp, path) != 0) {
+        rc = -1;
+    }
+    if (rc < 0) {
+        LOGERROR("Could not write the prelude cache %s", path);
+        remove(tmp);
+    }
+    return rc;
+}
+
+// Assemble the prelude and lay the cache out in memory
+static int build(struct prelude *p, char *file) {
+    struct assembler pa[1];
+    struct bcode_node *cur;
+    struct pch_header *h;
+    struct pch_label *pl;
+    struct label *l;
+    struct token t;
+    uint64_t words = 0, labels = 0, names = 0;
+    char *name;
+    int rc = -1;
+
+    if (asm_init(pa, file) < 0) {
+        return -1;
+    }
+    if (asm_parse(pa) < 0) {
+        goto out;
+    }
+    // the input goes right after it, so it has to be one run from 0
+    if (pa->segs.st_count) {
+        t.tok_row = pa->segs.st_seg[0].sg_row;
+        t.tok_col = pa->segs.st_seg[0].sg_col;
+        ASMTOKERROR(pa, (&t), "A prelude is laid out from 0, it cannot "
+                              "use .org or .reserve");
+        goto out;
+    }
+    for (cur = pa->bcd_list.head; cur; cur = cur->next) {
+        words += cur->size / 2;
+    }
+    for (l = pa->label_pts.head; l; l = l->next) {
+        ++labels;
+        names += l->lbl_len;
+    }
+    if (words > 0x10000 || names > UINT32_MAX) {
+        LOGERROR("Prelude %s does not fit in memory", file);
+        goto out;
+    }
+    h = calloc(1, pch_size(words, labels, names));
+    if (!h) {
+        LOGERROR("No memory for the prelude");
+        goto out;
+    }
+    h->ph_magic = PRELUDE_MAGIC;
+    h->ph_version = PRELUDE_VERSION;
+    h->ph_hash = fnv1a(FNV_BASIS, (const unsigned char *) pa->input,
+                       pa->inp_size);
+    h->ph_size = pa->inp_size;
+    h->ph_words = (uint32_t) words;
+    h->ph_labels = (uint32_t) labels;
+    h->ph_names = (uint32_t) names;
+    pl = (struct pch_label *) pch_labels(h);
+    name = (char *) pch_names(h);
+    for (l = pa->label_pts.head; l; l = l->next, ++pl) {
+        pl->pl_name = (uint32_t) (name - pch_names(h));
+        pl->pl_len = (uint32_t) l->lbl_len;
+        pl->pl_addr = (uint32_t) (l->lbl_off / 2);
+        pl->pl_row = (uint32_t) label_to_token(l)->tok_row;
+        pl->pl_col = (uint32_t) label_to_token(l)->tok_col;
+        memcpy(name, l->lbl_name, l->lbl_len);
+        name += l->lbl_len;
+    }
+    if (bcode_image(pa, (uint16_t *) pch_words(h), words) < 0) {
+        free(h);
+        goto out;
+    }
+    p->pr_head = h;
+    p->pr_size = pch_size(words, labels, names);
+    p->pr_mapped = 0;
+    rc = 0;
+out:
+    asm_free(pa);
+    return rc;
+}
+
+// Label tokens for the labels of the cache, resolved to their addresses
+static int make_labels(struct prelude *p) {
+    const struct pch_header *h = p->pr_head;
+    const struct pch_label *pl = pch_labels(h);
+    struct token *t;
+    uint32_t i;
+    p->pr_labels = calloc(h->ph_labels ? h->ph_labels : 1, sizeof(*t));
+    if (!p->pr_labels) {
+        LOGERROR("No memory for the prelude labels");
+        return -1;
+    }
+    for (i = 0; i < h->ph_labels; ++i) {
+        t = &p->pr_labels[i];
+        t->type = tt_label;
+        t->tok_row = pl[i].pl_row;
+        t->tok_col = pl[i].pl_col;
+        t->tok_len = pl[i].pl_len;
+        t->ttu_lab.lbl_name = (char *) pch_names(h) + pl[i].pl_name;
+        t->ttu_lab.lbl_len = pl[i].pl_len;
+        t->ttu_lab.lbl_off = (uint64_t) pl[i].pl_addr * 2;
+    }
+    // the image is never written through, a private mapping is fine
+    p->pr_words = (uint16_t *) pch_words(h);
+    return 0;
+}
+
+static void release(struct prelude *p) {
+    if (p->pr_head) {
+        if (p->pr_mapped) {
+            munmap((void *) p->pr_head, p->pr_size);
+        } else {
+            free((void *) p->pr_head);
+        }
+    }
+    free(p->pr_labels);
+    p->pr_head = NULL;
+    p->pr_labels = NULL;
+    p->pr_words = NULL;
+    p->pr_size = 0;
+}
+
+int prelude_load(struct prelude *p) {
+    char path[4096], *file = p->pr_file;
+    uint64_t hash, size;
+
+    if (hash_source(file, &hash, &size) < 0) {
+        return -1;
+    }
+    if (p->pr_head && p->pr_head->ph_hash == hash &&
+        p->pr_head->ph_size == size) {
+        return 0;
+    }
+    release(p);
+    if (snprintf(path, sizeof(path), "%s" PRELUDE_SUFFIX, file) >=
+        (int) sizeof(path)) {
+        LOGERROR("Prelude file name too long: %s", file);
+        return -1;
+    }
+    if (!map_cache(p, path, hash, size)) {
+        if (build(p, file) < 0) {
+            return -1;
+        }
+        // a prelude that cannot be cached still assembles
+        write_cache(p, path);
+    }
+    return make_labels(p);
+}
+
+int prelude_apply(struct assembler *a, struct prelude *p) {
+    struct label *l;
+    uint32_t i;
+    for (i = 0; i < p->pr_head->ph_labels; ++i) {
+        l = &p->pr_labels[i].ttu_lab;
+        l->lbl_state = ls_pt_resolved;
+        l->next = NULL;
+        if (a->label_pts.tail) {
+            a->label_pts.tail->next = l;
+            a->label_pts.tail = l;
+        } else {
+            a->label_pts.head = a->label_pts.tail = l;
+        }
+    }
+    if (p->pr_head->ph_words &&
+        build_words(a, p->pr_words, p->pr_head->ph_words) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void prelude_free(struct prelude *p) {
+    if (!p) {
+        return;
+    }
+    release(p);
+}
@@ -0,0 +1,53 @@
+#ifndef ASSEMBLER_PRELUDE_H
+#define ASSEMBLER_PRELUDE_H
+
+#include "common.h"
+
+// A source assembled ahead of the input, at address 0, whose labels the
+// input can refer to: constants, drivers and data every program shares.
+// It is assembled once into <prelude>.dpch, its words and labels as they
+// sit in memory, and later runs map that file instead of tokenizing and
+// encoding the prelude again. The cache is used only while it was made
+// from the same bytes of the prelude, by the same cache version.
+
+#define PRELUDE_MAGIC   0x48435044u     /* "DPCH" in host byte order */
+#define PRELUDE_VERSION 1
+#define PRELUDE_SUFFIX  ".dpch"
+
+/* The cache file starts with this, then the labels, words and names */
+struct pch_header {
+    uint32_t ph_magic;
+    uint32_t ph_version;
+    uint64_t ph_hash;       /* FNV-1a of the prelude source */
+    uint64_t ph_size;       /* Bytes of the prelude source */
+    uint32_t ph_words;
+    uint32_t ph_labels;
+    uint32_t ph_names;      /* Bytes of label names */
+    uint32_t ph_pad;
+};
+
+struct pch_label {
+    uint32_t pl_name;       /* Into the names */
+    uint32_t pl_len;
+    uint32_t pl_addr;       /* In words */
+    uint32_t pl_row;        /* Of the definition, for duplicate errors */
+    uint32_t pl_col;
+};
+
+struct prelude {
+    char                    *pr_file;
+    const struct pch_header *pr_head;   /* The cache, mapped or built here */
+    size_t                   pr_size;
+    int                      pr_mapped;
+    struct token            *pr_labels; /* Label tokens for a->label_pts */
+    uint16_t                *pr_words;
+};
+
+/* Map the cache of p->pr_file, or assemble it and write the cache. Keeps
+ * what is loaded when the prelude did not change since. 0 or -1. */
+int  prelude_load(struct prelude *p);
+/* Define its labels and lay its words out before a->tok_list is built */
+int  prelude_apply(struct assembler *a, struct prelude *p);
+void prelude_free(struct prelude *p);
+
+#endif //ASSEMBLER_PRELUDE_H
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+#define SCHED_INITIAL_CAP 16
+
+static inline int event_before(struct sched_event *x, struct sched_event *y) {
+    if (x->se_when != y->se_when) {
+        return x->se_when < y->se_when;
+    }
+    return x->se_seq < y->se_seq;
+}
+
+static inline void event_swap(struct sched_event *x, struct sched_event *y) {
+    struct sched_event tmp = *x;
+    *x = *y;
+    *y = tmp;
+}
+
+static void sift_up(struct scheduler *s, uint64_t i) {
+    while (i > 0) {
+        uint64_t parent = (i - 1) / 2;
+        if (!event_before(&s->heap[i], &s->heap[parent])) {
+            break;
+        }
+        event_swap(&s->heap[i], &s->heap[parent]);
+        i = parent;
+    }
+}
+
+static void sift_down(struct scheduler *s, uint64_t i) {
+    for (;;) {
+        uint64_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < s->count && event_before(&s->heap[l], &s->heap[min])) {
+            min = l;
+        }
+        if (r < s->count && event_before(&s->heap[r], &s->heap[min])) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        event_swap(&s->heap[i], &s->heap[min]);
+        i = min;
+    }
+}
+
+// remove the i-th element of the heap and restore the heap property
+static void remove_at(struct scheduler *s, uint64_t i) {
+    --s->count;
+    if (i == s->count) {
+        return;
+    }
+    s->heap[i] = s->heap[s->count];
+    sift_down(s, i);
+    sift_up(s, i);
+}
+
+int sched_init(struct scheduler *s) {
+    memset(s, 0, sizeof(*s));
+    s->heap = malloc(sizeof(struct sched_event) * SCHED_INITIAL_CAP);
+    if (!s->heap) {
+        LOGERROR("Cannot allocate memory for the event heap");
+        return -1;
+    }
+    s->cap = SCHED_INITIAL_CAP;
+    return 0;
+}
+
+void sched_free(struct scheduler *s) {
+    if (s->heap) {
+        free(s->heap);
+    }
+    memset(s, 0, sizeof(*s));
+}
+
+int sched_add(struct scheduler *s, uint64_t when,
+              struct hw_device *dev, int kind) {
+    struct sched_event *ev;
+    if (s->count == s->cap) {
+        ev = realloc(s->heap, sizeof(struct sched_event) * s->cap * 2);
+        if (!ev) {
+            LOGERROR("Cannot grow the event heap");
+            return -1;
+        }
+        s->heap = ev;
+        s->cap *= 2;
+    }
+    ev = &s->heap[s->count];
+    ev->se_when = when;
+    ev->se_seq = s->seq++;
+    ev->se_dev = dev;
+    ev->se_kind = kind;
+    sift_up(s, s->count++);
+    return 0;
+}
+
+// Drop every pending event of the given kind for a device. Devices only
+// keep a handful of events in flight so a linear sweep is good enough.
+// Returns the number of events removed.
+int sched_cancel(struct scheduler *s, struct hw_device *dev, int kind) {
+    uint64_t i = 0;
+    int removed = 0;
+    while (i < s->count) {
+        if (s->heap[i].se_dev == dev && s->heap[i].se_kind == kind) {
+            remove_at(s, i);
+            ++removed;
+            // the element moved into slot i has to be checked as well,
+            // but it may have bubbled up, so restart the sweep
+            i = 0;
+        } else {
+            ++i;
+        }
+    }
+    return removed;
+}
+
+// 1 if an event was popped, 0 if the scheduler is empty
+int sched_pop(struct scheduler *s, struct sched_event *ev) {
+    if (!s->count) {
+        return 0;
+    }
+    *ev = s->heap[0];
+    remove_at(s, 0);
+    return 1;
+}
+
+// Replace the pending events with a heap saved earlier, in heap order.
+// 0 on success, -1 if the heap cannot be grown.
+int sched_load(struct scheduler *s, const struct sched_event *heap,
+               uint64_t count, uint64_t seq) {
+    struct sched_event *ev;
+    uint64_t cap = s->cap;
+    while (cap < count) {
+        cap *= 2;
+    }
+    if (cap != s->cap) {
+        ev = realloc(s->heap, sizeof(struct sched_event) * cap);
+        if (!ev) {
+            LOGERROR("Cannot grow the event heap");
+            return -1;
+        }
+        s->heap = ev;
+        s->cap = cap;
+    }
+    memcpy(s->heap, heap, sizeof(struct sched_event) * count);
+    s->count = count;
+    s->seq = seq;
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef ASSEMBLER_SCHEDULER_H
+#define ASSEMBLER_SCHEDULER_H
+
+#include "common.h"
+
+/* Returned by sched_next() when nothing is scheduled */
+#define SCHED_NEVER UINT64_MAX
+
+struct hw_device;
+
+/* A device event, due once the CPU cycle counter reaches se_when */
+struct sched_event {
+    uint64_t se_when;
+    uint64_t se_seq;           /* Insertion order, keeps ties FIFO */
+    struct hw_device *se_dev;
+    int se_kind;               /* Device specific event kind */
+};
+
+/* Binary min-heap of pending events ordered on (se_when, se_seq) */
+struct scheduler {
+    struct sched_event *heap;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t seq;
+};
+
+int  sched_init(struct scheduler *s);
+void sched_free(struct scheduler *s);
+int  sched_add(struct scheduler *s, uint64_t when,
+               struct hw_device *dev, int kind);
+int  sched_cancel(struct scheduler *s, struct hw_device *dev, int kind);
+int  sched_pop(struct scheduler *s, struct sched_event *ev);
+int  sched_load(struct scheduler *s, const struct sched_event *heap,
+                uint64_t count, uint64_t seq);
+
+// Cycle at which the earliest event is due
+static inline uint64_t sched_next(struct scheduler *s) {
+    return s->count ? s->heap[0].se_when : SCHED_NEVER;
+}
+
+#endif //ASSEMBLER_SCHEDULER_H
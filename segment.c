@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_code.h"
+#include "segment.h"
+#include "stats.h"
+
+// Segments are kept in source order while assembling. Once sized, they
+// go into an interval tree, a treap keyed by the first address where every
+// node also knows the highest end below it, so that an overlap is found
+// in a walk down the tree. An in-order walk then sorts them by address.
+
+struct seg_node {
+    struct segment  *sn_seg;
+    uint64_t         sn_lo;      /* [sn_lo, sn_hi) in words */
+    uint64_t         sn_hi;
+    uint64_t         sn_max;     /* Highest sn_hi in the subtree */
+    uint32_t         sn_prio;
+    struct seg_node *left;
+    struct seg_node *right;
+};
+
+int seg_org(struct assembler *a, struct token *t, uint64_t addr,
+            uint64_t index) {
+    struct segment_table *st = &a->segs;
+    struct segment *grown, *sg;
+    uint64_t cap;
+    if (addr > SEG_MEMORY_WORDS) {
+        // .org takes a word, only .reserve gets this far
+        ASMTOKERROR(a, t, ".reserve runs past the end of memory at 0x10000");
+        return -1;
+    }
+    // room for the segment before the first directive and this one
+    if (st->st_count + 2 > st->st_cap) {
+        cap = st->st_cap ? st->st_cap * 2 : 8;
+        grown = realloc(st->st_seg, sizeof(struct segment) * cap);
+        if (!grown) {
+            LOGERROR("No more memory for a segment");
+            return -1;
+        }
+        ASM_STAT(a, ac_bytes, sizeof(struct segment) * (cap - st->st_cap));
+        st->st_seg = grown;
+        st->st_cap = cap;
+    }
+    if (!st->st_count) {
+        sg = &st->st_seg[st->st_count++];
+        memset(sg, 0, sizeof(*sg));
+    }
+    sg = &st->st_seg[st->st_count++];
+    sg->sg_addr = addr;
+    sg->sg_index = index;
+    sg->sg_words = 0;
+    sg->sg_row = t->tok_row;
+    sg->sg_col = t->tok_col;
+    return 0;
+}
+
+uint64_t seg_here(struct assembler *a, uint64_t index) {
+    struct segment *sg;
+    if (!a->segs.st_count) {
+        return index;
+    }
+    sg = &a->segs.st_seg[a->segs.st_count - 1];
+    return sg->sg_addr + (index - sg->sg_index);
+}
+
+static inline void tree_update(struct seg_node *n) {
+    n->sn_max = n->sn_hi;
+    if (n->left && n->left->sn_max > n->sn_max) {
+        n->sn_max = n->left->sn_max;
+    }
+    if (n->right && n->right->sn_max > n->sn_max) {
+        n->sn_max = n->right->sn_max;
+    }
+}
+
+static struct seg_node *tree_insert(struct seg_node *root,
+                                    struct seg_node *n) {
+    struct seg_node *up;
+    if (!root) {
+        return n;
+    }
+    if (n->sn_lo < root->sn_lo) {
+        root->left = tree_insert(root->left, n);
+        if (root->left->sn_prio > root->sn_prio) {
+            // rotate right
+            up = root->left;
+            root->left = up->right;
+            up->right = root;
+            tree_update(root);
+            root = up;
+        }
+    } else {
+        root->right = tree_insert(root->right, n);
+        if (root->right->sn_prio > root->sn_prio) {
+            // rotate left
+            up = root->right;
+            root->right = up->left;
+            up->left = root;
+            tree_update(root);
+            root = up;
+        }
+    }
+    tree_update(root);
+    return root;
+}
+
+// Any segment overlapping [lo, hi), NULL if there is none
+static struct seg_node *tree_overlap(struct seg_node *n, uint64_t lo,
+                                     uint64_t hi) {
+    while (n) {
+        if (n->sn_lo < hi && lo < n->sn_hi) {
+            return n;
+        }
+        // if anything on the left ends past lo, the left holds the
+        // overlap or nothing to the right of it can
+        n = n->left && n->left->sn_max > lo ? n->left : n->right;
+    }
+    return NULL;
+}
+
+static void tree_sorted(struct seg_node *n, struct segment ***out) {
+    for (; n; n = n->right) {
+        tree_sorted(n->left, out);
+        *(*out)++ = n->sn_seg;
+    }
+}
+
+int seg_finish(struct assembler *a, uint64_t words) {
+    struct segment_table *st = &a->segs;
+    struct seg_node *nodes, *root = NULL, *hit;
+    struct segment **out;
+    struct token t;
+    uint64_t i, n;
+    uint32_t prio = 2463534242u;
+    char err_str[256];
+
+    if (!st->st_count) {
+        return 0;
+    }
+    // size them, then keep only those holding words
+    for (i = 0; i < st->st_count; ++i) {
+        st->st_seg[i].sg_words = (i + 1 < st->st_count ?
+                                  st->st_seg[i + 1].sg_index : words) -
+                                 st->st_seg[i].sg_index;
+    }
+    for (i = n = 0; i < st->st_count; ++i) {
+        if (st->st_seg[i].sg_words) {
+            st->st_seg[n++] = st->st_seg[i];
+        }
+    }
+    st->st_count = n;
+    for (i = 0; i < n; ++i) {
+        if (st->st_seg[i].sg_addr + st->st_seg[i].sg_words >
+            SEG_MEMORY_WORDS) {
+            snprintf(err_str, 256, "Segment 0x%04llx-0x%04llx runs past the "
+                                   "end of memory at 0x10000",
+                     (unsigned long long) st->st_seg[i].sg_addr,
+                     (unsigned long long) (st->st_seg[i].sg_addr +
+                                           st->st_seg[i].sg_words - 1));
+            t.tok_row = st->st_seg[i].sg_row;
+            t.tok_col = st->st_seg[i].sg_col;
+            ASMTOKERROR(a, (&t), err_str);
+            return -1;
+        }
+    }
+    nodes = malloc(sizeof(struct seg_node) * (n ? n : 1));
+    st->st_sorted = malloc(sizeof(struct segment *) * (n ? n : 1));
+    if (!nodes || !st->st_sorted) {
+        LOGERROR("No more memory to sort the segments");
+        free(nodes);
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, (sizeof(struct seg_node) +
+                           sizeof(struct segment *)) * n);
+    for (i = 0; i < n; ++i) {
+        nodes[i].sn_seg = &st->st_seg[i];
+        nodes[i].sn_lo = st->st_seg[i].sg_addr;
+        nodes[i].sn_hi = st->st_seg[i].sg_addr + st->st_seg[i].sg_words;
+        nodes[i].sn_max = nodes[i].sn_hi;
+        // xorshift, the same tree from run to run
+        prio ^= prio << 13;
+        prio ^= prio >> 17;
+        prio ^= prio << 5;
+        nodes[i].sn_prio = prio;
+        nodes[i].left = nodes[i].right = NULL;
+        if ((hit = tree_overlap(root, nodes[i].sn_lo, nodes[i].sn_hi))) {
+            snprintf(err_str, 256, "Segment 0x%04llx-0x%04llx overlaps "
+                                   "0x%04llx-0x%04llx from (%llu:%llu)",
+                     (unsigned long long) nodes[i].sn_lo,
+                     (unsigned long long) (nodes[i].sn_hi - 1),
+                     (unsigned long long) hit->sn_lo,
+                     (unsigned long long) (hit->sn_hi - 1),
+                     (unsigned long long) (hit->sn_seg->sg_row + 1),
+                     (unsigned long long) (hit->sn_seg->sg_col + 1));
+            t.tok_row = st->st_seg[i].sg_row;
+            t.tok_col = st->st_seg[i].sg_col;
+            ASMTOKERROR(a, (&t), err_str);
+            free(nodes);
+            return -1;
+        }
+        root = tree_insert(root, &nodes[i]);
+    }
+    out = st->st_sorted;
+    tree_sorted(root, &out);
+    free(nodes);
+    return 0;
+}
+
+uint64_t seg_end(struct assembler *a) {
+    struct segment *last;
+    if (!a->segs.st_count) {
+        return 0;
+    }
+    last = a->segs.st_sorted[a->segs.st_count - 1];
+    return last->sg_addr + last->sg_words;
+}
+
+void seg_place(struct assembler *a, uint16_t *image, const uint16_t *words) {
+    struct segment *sg;
+    uint64_t i, pos = 0;
+    // gaps read as zero, as memory does
+    for (i = 0; i < a->segs.st_count; ++i) {
+        sg = a->segs.st_sorted[i];
+        memset(image + pos, 0, sizeof(uint16_t) * (sg->sg_addr - pos));
+        pos = sg->sg_addr + sg->sg_words;
+    }
+    for (i = 0; i < a->segs.st_count; ++i) {
+        sg = &a->segs.st_seg[i];
+        memmove(image + sg->sg_addr, words + sg->sg_index,
+                sizeof(uint16_t) * sg->sg_words);
+    }
+}
+
+void seg_reset(struct assembler *a) {
+    free(a->segs.st_sorted);
+    a->segs.st_sorted = NULL;
+    a->segs.st_count = 0;
+}
+
+void seg_free(struct assembler *a) {
+    free(a->segs.st_seg);
+    free(a->segs.st_sorted);
+    memset(&a->segs, 0, sizeof(a->segs));
+}
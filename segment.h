@@ -0,0 +1,26 @@
+#ifndef ASSEMBLER_SEGMENT_H
+#define ASSEMBLER_SEGMENT_H
+
+#include "common.h"
+
+#define SEG_MEMORY_WORDS 0x10000    /* The DCPU-16 address space */
+
+/* Start a segment at addr with the index-th word emitted, for t. A
+ * .reserve that runs past the end of memory is an error in the source. */
+int      seg_org(struct assembler *a, struct token *t, uint64_t addr,
+                 uint64_t index);
+/* Address of the index-th word emitted */
+uint64_t seg_here(struct assembler *a, uint64_t index);
+/* Size the segments once all words are out, drop the empty ones and
+ * check that each fits in memory and that none overlap */
+int      seg_finish(struct assembler *a, uint64_t words);
+/* One past the highest address written */
+uint64_t seg_end(struct assembler *a);
+/* Move the words emitted, in order, to their addresses in image */
+void     seg_place(struct assembler *a, uint16_t *image,
+                   const uint16_t *words);
+/* Drop the segments, keeping the table for the next run */
+void     seg_reset(struct assembler *a);
+void     seg_free(struct assembler *a);
+
+#endif //ASSEMBLER_SEGMENT_H
@@ -0,0 +1,296 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hardware.h"
+#include "snapshot.h"
+
+#define SNAP_ALIGN(n)   (((n) + 7) & ~(uint64_t) 7)
+#define SNAP_CPU_OFFSET (SNAP_RAM_OFFSET + DCPU_RAM_WORDS * sizeof(uint16_t))
+
+static uint64_t snap_ids;
+
+static inline int page_dirty(struct dcpu *d, uint32_t p) {
+    return (int) (d->dirty[p / 64] >> (p % 64) & 1);
+}
+
+// Bytes of state past the RAM for the machine as it is now
+static uint64_t state_size(struct dcpu *d) {
+    uint64_t size = sizeof(struct snap_cpu) +
+                    d->sched.count * sizeof(struct snap_event);
+    uint16_t i;
+    for (i = 0; i < d->hw_count; ++i) {
+        size += sizeof(struct snap_device) +
+                SNAP_ALIGN(d->hw[i]->hw_ops->hwo_save(d->hw[i], NULL));
+    }
+    return size;
+}
+
+static int device_index(struct dcpu *d, struct hw_device *hw) {
+    uint16_t i;
+    for (i = 0; i < d->hw_count; ++i) {
+        if (d->hw[i] == hw) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Freeze the whole machine: CPU, RAM, pending events and device state.
+// RAM tracking restarts from here. 0 on success, -1 on error.
+int snapshot_take(struct dcpu *d, struct dcpu_snapshot *sn) {
+    struct snap_header *h;
+    struct snap_cpu *c;
+    struct snap_event *ev;
+    struct snap_device *dev;
+    uint8_t *p;
+    uint64_t i;
+
+    memset(sn, 0, sizeof(*sn));
+    sn->sn_size = SNAP_CPU_OFFSET + state_size(d);
+    sn->sn_base = calloc(1, sn->sn_size);
+    if (!sn->sn_base) {
+        LOGERROR("Cannot allocate memory for a snapshot");
+        return -1;
+    }
+    sn->sn_ram = (uint16_t *) (sn->sn_base + SNAP_RAM_OFFSET);
+    sn->sn_id = ++snap_ids;
+
+    h = (struct snap_header *) sn->sn_base;
+    memcpy(h->sh_magic, SNAP_MAGIC, sizeof(h->sh_magic));
+    h->sh_version = SNAP_VERSION;
+    h->sh_hw_count = d->hw_count;
+    h->sh_size = sn->sn_size;
+    memcpy(sn->sn_ram, d->ram, sizeof(d->ram));
+
+    c = (struct snap_cpu *) (sn->sn_base + SNAP_CPU_OFFSET);
+    memcpy(c->sc_reg, d->reg, sizeof(d->reg));
+    c->sc_cycles = d->cycles;
+    c->sc_instructions = d->instructions;
+    c->sc_int_queueing = d->int_queueing;
+    c->sc_halted = d->halted;
+    c->sc_on_fire = d->on_fire;
+    c->sc_watch_count = d->watch_count;
+    memcpy(c->sc_intq, d->intq, sizeof(d->intq));
+    c->sc_intq_head = d->intq_head;
+    c->sc_intq_count = d->intq_count;
+    for (i = 0; i < d->watch_count; ++i) {
+        c->sc_watches[i].sw_start = d->watches[i].dw_start;
+        c->sc_watches[i].sw_len = d->watches[i].dw_len;
+        c->sc_watches[i].sw_dev = (uint16_t) device_index(d, d->watches[i].dw_dev);
+    }
+    c->sc_events = d->sched.count;
+    c->sc_seq = d->sched.seq;
+
+    ev = (struct snap_event *) (c + 1);
+    for (i = 0; i < d->sched.count; ++i) {
+        ev[i].sv_when = d->sched.heap[i].se_when;
+        ev[i].sv_seq = d->sched.heap[i].se_seq;
+        ev[i].sv_dev = (uint32_t) device_index(d, d->sched.heap[i].se_dev);
+        ev[i].sv_kind = d->sched.heap[i].se_kind;
+    }
+
+    p = (uint8_t *) (ev + d->sched.count);
+    for (i = 0; i < d->hw_count; ++i) {
+        dev = (struct snap_device *) p;
+        dev->sd_id = d->hw[i]->hw_id;
+        dev->sd_size = (uint32_t) d->hw[i]->hw_ops->hwo_save(d->hw[i], dev + 1);
+        p = (uint8_t *) (dev + 1) + SNAP_ALIGN(dev->sd_size);
+    }
+
+    memset(d->dirty, 0, sizeof(d->dirty));
+    d->snap_id = sn->sn_id;
+    return 0;
+}
+
+// Check that the snapshot fits this machine before touching anything
+static int snapshot_check(struct dcpu *d, struct dcpu_snapshot *sn) {
+    struct snap_header *h = (struct snap_header *) sn->sn_base;
+    struct snap_cpu *c = (struct snap_cpu *) (sn->sn_base + SNAP_CPU_OFFSET);
+    struct snap_device *dev;
+    uint8_t *p, *end = sn->sn_base + sn->sn_size;
+    uint64_t i;
+
+    if (sn->sn_size < SNAP_CPU_OFFSET + sizeof(struct snap_cpu) ||
+        memcmp(h->sh_magic, SNAP_MAGIC, sizeof(h->sh_magic)) != 0 ||
+        h->sh_version != SNAP_VERSION || h->sh_size != sn->sn_size) {
+        LOGERROR("Not a snapshot, or one of another version");
+        return -1;
+    }
+    if (h->sh_hw_count != d->hw_count) {
+        LOGERROR("Snapshot has %u devices, the DCPU %u",
+                 h->sh_hw_count, d->hw_count);
+        return -1;
+    }
+    if (c->sc_watch_count > DCPU_WATCH_MAX ||
+        c->sc_events > (sn->sn_size - SNAP_CPU_OFFSET - sizeof(*c)) /
+                       sizeof(struct snap_event)) {
+        LOGERROR("Snapshot is corrupt");
+        return -1;
+    }
+    for (i = 0; i < c->sc_watch_count; ++i) {
+        if (c->sc_watches[i].sw_dev >= d->hw_count) {
+            LOGERROR("Snapshot is corrupt");
+            return -1;
+        }
+    }
+    p = (uint8_t *) ((struct snap_event *) (c + 1) + c->sc_events);
+    for (i = 0; i < c->sc_events; ++i) {
+        if (((struct snap_event *) (c + 1))[i].sv_dev >= d->hw_count) {
+            LOGERROR("Snapshot is corrupt");
+            return -1;
+        }
+    }
+    for (i = 0; i < d->hw_count; ++i) {
+        dev = (struct snap_device *) p;
+        if (p + sizeof(*dev) > end ||
+            dev->sd_id != d->hw[i]->hw_id ||
+            dev->sd_size != d->hw[i]->hw_ops->hwo_save(d->hw[i], NULL) ||
+            (uint8_t *) (dev + 1) + SNAP_ALIGN(dev->sd_size) > end) {
+            LOGERROR("Snapshot device %u does not match the DCPU", (unsigned) i);
+            return -1;
+        }
+        p = (uint8_t *) (dev + 1) + SNAP_ALIGN(dev->sd_size);
+    }
+    return 0;
+}
+
+// Put the machine back as it was in the snapshot. The devices must be
+// attached in the same order as when it was taken. When the RAM last came
+// from this very snapshot only the pages written since are copied.
+// Returns the number of RAM pages copied, or -1 on error.
+int snapshot_restore(struct dcpu *d, struct dcpu_snapshot *sn) {
+    struct snap_cpu *c = (struct snap_cpu *) (sn->sn_base + SNAP_CPU_OFFSET);
+    struct snap_event *ev = (struct snap_event *) (c + 1);
+    struct sched_event *heap;
+    struct snap_device *dev;
+    struct hw_device *hw;
+    uint8_t *p;
+    uint64_t i;
+    uint32_t page;
+    int copied = 0;
+
+    if (snapshot_check(d, sn) < 0) {
+        return -1;
+    }
+    heap = malloc(sizeof(struct sched_event) * (c->sc_events ? c->sc_events : 1));
+    if (!heap) {
+        LOGERROR("Cannot allocate memory for the event heap");
+        return -1;
+    }
+    for (i = 0; i < c->sc_events; ++i) {
+        heap[i].se_when = ev[i].sv_when;
+        heap[i].se_seq = ev[i].sv_seq;
+        heap[i].se_dev = d->hw[ev[i].sv_dev];
+        heap[i].se_kind = ev[i].sv_kind;
+    }
+    if (sched_load(&d->sched, heap, c->sc_events, c->sc_seq) < 0) {
+        free(heap);
+        return -1;
+    }
+    free(heap);
+
+    for (page = 0; page < DCPU_PAGES; ++page) {
+        if (d->snap_id != sn->sn_id || page_dirty(d, page)) {
+            memcpy(d->ram + (page << DCPU_PAGE_SHIFT),
+                   sn->sn_ram + (page << DCPU_PAGE_SHIFT),
+                   sizeof(uint16_t) << DCPU_PAGE_SHIFT);
+            ++copied;
+        }
+    }
+    memset(d->dirty, 0, sizeof(d->dirty));
+    d->snap_id = sn->sn_id;
+
+    memcpy(d->reg, c->sc_reg, sizeof(d->reg));
+    d->cycles = c->sc_cycles;
+    d->instructions = c->sc_instructions;
+    d->int_queueing = c->sc_int_queueing;
+    d->halted = c->sc_halted;
+    d->on_fire = c->sc_on_fire;
+    memcpy(d->intq, c->sc_intq, sizeof(d->intq));
+    d->intq_head = c->sc_intq_head;
+    d->intq_count = c->sc_intq_count;
+
+    // rebuild the granule counts through the usual path
+    memset(d->watched, 0, sizeof(d->watched));
+    d->watch_count = 0;
+    for (i = 0; i < c->sc_watch_count; ++i) {
+        dcpu_watch(d, d->hw[c->sc_watches[i].sw_dev],
+                   c->sc_watches[i].sw_start, c->sc_watches[i].sw_len);
+    }
+
+    p = (uint8_t *) (ev + c->sc_events);
+    for (i = 0; i < d->hw_count; ++i) {
+        dev = (struct snap_device *) p;
+        hw = d->hw[i];
+        hw->hw_ops->hwo_restore(d, hw, dev + 1);
+        p = (uint8_t *) (dev + 1) + SNAP_ALIGN(dev->sd_size);
+    }
+    return copied;
+}
+
+// Write the snapshot to a file that snapshot_map() can share
+int snapshot_save(struct dcpu_snapshot *sn, char *file) {
+    FILE *fp = fopen(file, "wb");
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", file);
+        return -1;
+    }
+    if (fwrite(sn->sn_base, 1, sn->sn_size, fp) != sn->sn_size) {
+        LOGERROR("Could not write the snapshot to %s", file);
+        fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0) {
+        LOGERROR("Could not write the snapshot to %s", file);
+        return -1;
+    }
+    return 0;
+}
+
+// Map a saved snapshot read-only. Processes mapping the same file share
+// its pages, and nothing is read from disk until it is restored.
+int snapshot_map(struct dcpu_snapshot *sn, char *file) {
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(sn, 0, sizeof(*sn));
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        LOGERROR("Unable to open snapshot: %s", file);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (uint64_t) st.st_size < SNAP_CPU_OFFSET) {
+        LOGERROR("Not a snapshot: %s", file);
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOGERROR("Unable to map snapshot: %s", file);
+        return -1;
+    }
+    sn->sn_base = base;
+    sn->sn_size = (uint64_t) st.st_size;
+    sn->sn_ram = (uint16_t *) (sn->sn_base + SNAP_RAM_OFFSET);
+    sn->sn_id = ++snap_ids;
+    sn->sn_mapped = 1;
+    return 0;
+}
+
+void snapshot_free(struct dcpu_snapshot *sn) {
+    if (!sn->sn_base) {
+        return;
+    }
+    if (sn->sn_mapped) {
+        munmap(sn->sn_base, sn->sn_size);
+    } else {
+        free(sn->sn_base);
+    }
+    memset(sn, 0, sizeof(*sn));
+}
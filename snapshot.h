@@ -0,0 +1,76 @@
+#ifndef ASSEMBLER_SNAPSHOT_H
+#define ASSEMBLER_SNAPSHOT_H
+
+#include "dcpu.h"
+
+#define SNAP_MAGIC      "DCPUSNAP"
+#define SNAP_VERSION    1
+/* RAM starts on a page of its own so a mapped file can be shared as is */
+#define SNAP_RAM_OFFSET 4096
+
+/* Snapshot layout, in memory and on disk alike (host byte order):
+ *   struct snap_header, padded to SNAP_RAM_OFFSET
+ *   RAM, DCPU_RAM_WORDS words
+ *   struct snap_cpu
+ *   struct snap_event * sc_events
+ *   per device: struct snap_device, then its state padded to 8 bytes */
+struct snap_header {
+    char     sh_magic[8];
+    uint32_t sh_version;
+    uint16_t sh_hw_count;
+    uint64_t sh_size;          /* Size of the whole snapshot in bytes */
+};
+
+struct snap_watch {
+    uint16_t sw_start;
+    uint16_t sw_len;
+    uint16_t sw_dev;           /* Index of the device */
+};
+
+struct snap_cpu {
+    uint16_t sc_reg[DR_MAX];
+    uint64_t sc_cycles;
+    uint64_t sc_instructions;
+    uint8_t  sc_int_queueing;
+    uint8_t  sc_halted;
+    uint8_t  sc_on_fire;
+    uint8_t  sc_watch_count;
+    uint16_t sc_intq[DCPU_INTQ_MAX];
+    uint16_t sc_intq_head;
+    uint16_t sc_intq_count;
+    struct snap_watch sc_watches[DCPU_WATCH_MAX];
+    uint64_t sc_events;        /* Pending events, in heap order */
+    uint64_t sc_seq;
+};
+
+struct snap_event {
+    uint64_t sv_when;
+    uint64_t sv_seq;
+    uint32_t sv_dev;           /* Index of the device */
+    int32_t  sv_kind;
+};
+
+struct snap_device {
+    uint32_t sd_id;
+    uint32_t sd_size;          /* Bytes of state that follow */
+};
+
+// A frozen machine. The live RAM is treated as a copy-on-write view of
+// the snapshot it was last taken from or restored to: dcpu_write() marks
+// the 512 word pages it touches, and restoring the same snapshot copies
+// back just those pages.
+struct dcpu_snapshot {
+    uint8_t  *sn_base;         /* The whole snapshot, see the layout above */
+    uint64_t  sn_size;
+    uint16_t *sn_ram;          /* Points into sn_base */
+    uint64_t  sn_id;           /* Unique in this process, never 0 */
+    int       sn_mapped;       /* sn_base is a read-only file mapping */
+};
+
+int  snapshot_take(struct dcpu *d, struct dcpu_snapshot *sn);
+int  snapshot_restore(struct dcpu *d, struct dcpu_snapshot *sn);
+int  snapshot_save(struct dcpu_snapshot *sn, char *file);
+int  snapshot_map(struct dcpu_snapshot *sn, char *file);
+void snapshot_free(struct dcpu_snapshot *sn);
+
+#endif //ASSEMBLER_SNAPSHOT_H
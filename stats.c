@@ -0,0 +1,113 @@
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char *phase_names[] = {
+        "read", "prelude", "tokenize", "merge", "layout", "pass1", "pass2",
+        "stream", "output", "listing", "debuginfo", "floppy"
+};
+
+static inline double clock_seconds(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void stats_begin(struct asm_stats *s, enum asm_phase p) {
+    (void) p;
+    s->as_wall0 = clock_seconds(CLOCK_MONOTONIC);
+    s->as_cpu0 = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    s->as_count0 = s->as_cur;
+}
+
+void stats_end(struct asm_stats *s, enum asm_phase p) {
+    struct asm_phase_stats *ps = &s->as_phase[p];
+    struct asm_counters *c = &ps->aps_count, *c0 = &s->as_count0;
+    ps->aps_wall += clock_seconds(CLOCK_MONOTONIC) - s->as_wall0;
+    ps->aps_cpu += clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - s->as_cpu0;
+    c->ac_bytes += s->as_cur.ac_bytes - c0->ac_bytes;
+    c->ac_tokens += s->as_cur.ac_tokens - c0->ac_tokens;
+    c->ac_labels += s->as_cur.ac_labels - c0->ac_labels;
+    c->ac_label_refs += s->as_cur.ac_label_refs - c0->ac_label_refs;
+    c->ac_fixups += s->as_cur.ac_fixups - c0->ac_fixups;
+    c->ac_bcode_nodes += s->as_cur.ac_bcode_nodes - c0->ac_bcode_nodes;
+    c->ac_probes += s->as_cur.ac_probes - c0->ac_probes;
+}
+
+static void report_text(struct asm_stats *s, FILE *out) {
+    struct asm_phase_stats total;
+    struct asm_phase_stats *ps;
+    int p;
+
+    memset(&total, 0, sizeof(total));
+    total.aps_count = s->as_cur;
+    fprintf(out, "%-9s %10s %10s %12s %9s %8s %9s %8s %8s %10s\n",
+            "phase", "wall ms", "cpu ms", "allocated", "tokens", "labels",
+            "label ops", "fixups", "nodes", "probes");
+    for (p = 0; p <= asp_max; ++p) {
+        ps = p < asp_max ? &s->as_phase[p] : &total;
+        fprintf(out, "%-9s %10.3f %10.3f %12llu %9llu %8llu %9llu %8llu "
+                     "%8llu %10llu\n",
+                p < asp_max ? phase_names[p] : "total",
+                ps->aps_wall * 1e3, ps->aps_cpu * 1e3,
+                (unsigned long long) ps->aps_count.ac_bytes,
+                (unsigned long long) ps->aps_count.ac_tokens,
+                (unsigned long long) ps->aps_count.ac_labels,
+                (unsigned long long) ps->aps_count.ac_label_refs,
+                (unsigned long long) ps->aps_count.ac_fixups,
+                (unsigned long long) ps->aps_count.ac_bcode_nodes,
+                (unsigned long long) ps->aps_count.ac_probes);
+        if (p < asp_max) {
+            total.aps_wall += ps->aps_wall;
+            total.aps_cpu += ps->aps_cpu;
+        }
+    }
+}
+
+static void report_json(struct asm_stats *s, FILE *out) {
+    struct asm_phase_stats *ps;
+    struct asm_counters *c = &s->as_cur;
+    double wall = 0, cpu = 0;
+    int p;
+
+    fprintf(out, "{\"phases\": [");
+    for (p = 0; p < asp_max; ++p) {
+        ps = &s->as_phase[p];
+        wall += ps->aps_wall;
+        cpu += ps->aps_cpu;
+        fprintf(out, "%s\n  {\"phase\": \"%s\", \"wall_s\": %.6f, "
+                     "\"cpu_s\": %.6f, \"bytes_allocated\": %llu, "
+                     "\"tokens\": %llu, \"labels\": %llu, "
+                     "\"label_refs\": %llu, \"fixups\": %llu, "
+                     "\"bcode_nodes\": %llu, \"symbol_probes\": %llu}",
+                p ? "," : "", phase_names[p], ps->aps_wall, ps->aps_cpu,
+                (unsigned long long) ps->aps_count.ac_bytes,
+                (unsigned long long) ps->aps_count.ac_tokens,
+                (unsigned long long) ps->aps_count.ac_labels,
+                (unsigned long long) ps->aps_count.ac_label_refs,
+                (unsigned long long) ps->aps_count.ac_fixups,
+                (unsigned long long) ps->aps_count.ac_bcode_nodes,
+                (unsigned long long) ps->aps_count.ac_probes);
+    }
+    fprintf(out, "],\n \"total\": {\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+                 "\"bytes_allocated\": %llu, \"tokens\": %llu, "
+                 "\"labels\": %llu, \"label_refs\": %llu, \"fixups\": %llu, "
+                 "\"bcode_nodes\": %llu, \"symbol_probes\": %llu}}\n",
+            wall, cpu, (unsigned long long) c->ac_bytes,
+            (unsigned long long) c->ac_tokens,
+            (unsigned long long) c->ac_labels,
+            (unsigned long long) c->ac_label_refs,
+            (unsigned long long) c->ac_fixups,
+            (unsigned long long) c->ac_bcode_nodes,
+            (unsigned long long) c->ac_probes);
+}
+
+// Human readable table, or a JSON object
+void stats_report(struct asm_stats *s, FILE *out, int json) {
+    if (json) {
+        report_json(s, out);
+    } else {
+        report_text(s, out);
+    }
+}
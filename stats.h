@@ -0,0 +1,62 @@
+#ifndef ASSEMBLER_STATS_H
+#define ASSEMBLER_STATS_H
+
+#include "common.h"
+
+/* Phases of an assembly, in the order they run */
+enum asm_phase {
+    asp_read,
+    asp_prelude,       /* Only with --prelude */
+    asp_tokenize,
+    asp_merge,         /* Only with --merge-data */
+    asp_layout,        /* Only with --layout */
+    asp_pass1,
+    asp_pass2,
+    asp_stream,        /* Tokenize and encode in one go, instead of the three */
+    asp_output,
+    asp_listing,       /* Only with --listing */
+    asp_debuginfo,     /* Only with --debug-info */
+    asp_floppy,        /* Only with --floppy */
+    asp_max
+};
+
+/* What the assembler did, summed up as it goes */
+struct asm_counters {
+    uint64_t ac_bytes;         /* Bytes allocated */
+    uint64_t ac_tokens;
+    uint64_t ac_labels;        /* Label definitions */
+    uint64_t ac_label_refs;    /* Labels used as operands */
+    uint64_t ac_fixups;        /* Label operands patched in pass 2 */
+    uint64_t ac_bcode_nodes;
+    uint64_t ac_probes;        /* Symbol table entries looked at */
+};
+
+struct asm_phase_stats {
+    double aps_wall;           /* Seconds */
+    double aps_cpu;            /* Seconds of CPU time of the process */
+    struct asm_counters aps_count;
+};
+
+struct asm_stats {
+    struct asm_counters as_cur;
+    struct asm_phase_stats as_phase[asp_max];
+    /* Where the running phase started */
+    double as_wall0;
+    double as_cpu0;
+    struct asm_counters as_count0;
+};
+
+// Count something while assembling. Statistics are off unless a->stats
+// is set, and then all it costs is the test.
+#define ASM_STAT(a, field, n) \
+    do { \
+        if ((a)->stats) { \
+            (a)->stats->as_cur.field += (n); \
+        } \
+    } while (0)
+
+void stats_begin(struct asm_stats *s, enum asm_phase p);
+void stats_end(struct asm_stats *s, enum asm_phase p);
+void stats_report(struct asm_stats *s, FILE *out, int json);
+
+#endif //ASSEMBLER_STATS_H
@@ -0,0 +1,430 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "binary_code.h"
+#include "diag.h"
+#include "expr.h"
+#include "segment.h"
+#include "stats.h"
+#include "stream.h"
+#include "tokenize.h"
+
+// Streaming assembly: every statement is tokenized into tokens on the
+// stack, encoded straight into a->image and forgotten. Only the symbol
+// table and the image stay. Symbols keep a copy of their names, so the
+// input they came from can be let go of, see asm_drop_input().
+//
+// A reference to a label that is not defined yet leaves a placeholder
+// symbol. The operand words waiting for it form a chain through the image
+// itself: each holds the distance back to the previous waiting word, 0
+// ends the chain. A distance that does not fit in a word starts a new
+// chain and the old head is spilled into the symbol. Defining the label
+// walks the chains and patches the words. The word of an expression that
+// names labels is filled in at the end, once they are all defined.
+
+struct stream_label {
+    struct label sl_lbl;        /* On a->label_pts, state ls_pt_* */
+    uint64_t     sl_row;        /* Definition, or the first reference */
+    uint64_t     sl_col;
+    uint64_t     sl_chain;      /* Last waiting word plus one, 0 if none */
+    uint64_t    *sl_spill;      /* Heads of older chains */
+    uint32_t     sl_nspill;
+    uint32_t     sl_capspill;
+    char         sl_name[];     /* sl_lbl.lbl_name */
+};
+
+static inline struct stream_label *to_stream_label(struct label *l) {
+    return (struct stream_label *) ((uint8_t *) l -
+                                    offsetof(struct stream_label, sl_lbl));
+}
+
+static inline void stream_error(struct assembler *a, uint64_t row,
+                                uint64_t col, const char *message) {
+    struct token t;
+    t.tok_row = row;
+    t.tok_col = col;
+    ASMTOKERROR(a, (&t), message);
+}
+
+static int grow_image(struct assembler *a, uint64_t words) {
+    uint16_t *grown;
+    uint64_t cap = a->img_cap ? a->img_cap : 4096;
+    if (a->img_words + words <= a->img_cap) {
+        return 0;
+    }
+    while (cap < a->img_words + words) {
+        cap *= 2;
+    }
+    grown = realloc(a->image, sizeof(uint16_t) * cap);
+    if (!grown) {
+        LOGERROR("No more memory for the image");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(uint16_t) * (cap - a->img_cap));
+    a->image = grown;
+    a->img_cap = cap;
+    return 0;
+}
+
+static struct stream_label *new_label(struct assembler *a, struct token *t,
+                                      enum label_state state) {
+    uint64_t len = t->ttu_lab.lbl_len;
+    struct stream_label *sl = calloc(1, sizeof(*sl) + len);
+    if (!sl) {
+        LOGERROR("No more memory for a label");
+        return NULL;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(*sl) + len);
+    memcpy(sl->sl_name, t->ttu_lab.lbl_name, len);
+    sl->sl_lbl.lbl_name = sl->sl_name;
+    sl->sl_lbl.lbl_len = len;
+    sl->sl_lbl.lbl_state = state;
+    sl->sl_row = t->tok_row;
+    sl->sl_col = t->tok_col;
+    if (a->label_pts.tail) {
+        a->label_pts.tail->next = &sl->sl_lbl;
+        a->label_pts.tail = &sl->sl_lbl;
+    } else {
+        a->label_pts.head = a->label_pts.tail = &sl->sl_lbl;
+    }
+    return sl;
+}
+
+// Thread the image word at index onto the label's chain
+static int chain_word(struct assembler *a, struct stream_label *sl,
+                      uint64_t index) {
+    uint64_t *grown;
+    uint32_t cap;
+    if (sl->sl_chain && index - (sl->sl_chain - 1) > 0xffff) {
+        if (sl->sl_nspill == sl->sl_capspill) {
+            cap = sl->sl_capspill ? sl->sl_capspill * 2 : 4;
+            grown = realloc(sl->sl_spill, sizeof(uint64_t) * cap);
+            if (!grown) {
+                LOGERROR("No more memory to chain a label");
+                return -1;
+            }
+            ASM_STAT(a, ac_bytes,
+                     sizeof(uint64_t) * (cap - sl->sl_capspill));
+            sl->sl_spill = grown;
+            sl->sl_capspill = cap;
+        }
+        sl->sl_spill[sl->sl_nspill++] = sl->sl_chain;
+        sl->sl_chain = 0;
+    }
+    a->image[index] = (uint16_t) (sl->sl_chain ? index - (sl->sl_chain - 1)
+                                               : 0);
+    sl->sl_chain = index + 1;
+    return 0;
+}
+
+static void patch_chain(struct assembler *a, uint64_t head, uint16_t value) {
+    uint64_t i = head - 1;
+    uint16_t link;
+    for (;;) {
+        link = a->image[i];
+        a->image[i] = value;
+        ASM_STAT(a, ac_fixups, 1);
+        if (!link) {
+            break;
+        }
+        i -= link;
+    }
+}
+
+static int define_label(struct assembler *a, struct token *t) {
+    struct label *l = get_label_pointer(a, t->ttu_lab.lbl_name,
+                                        t->ttu_lab.lbl_len);
+    struct stream_label *sl;
+    uint64_t here = seg_here(a, a->img_words);
+    uint32_t i;
+    char err_str[256];
+
+    if (l && l->lbl_state == ls_pt_resolved) {
+        sl = to_stream_label(l);
+        snprintf(err_str, 256, "Found duplicate label at (%llu:%llu)",
+                 (unsigned long long) sl->sl_row + 1,
+                 (unsigned long long) sl->sl_col + 1);
+        ASMTOKERROR(a, t, err_str);
+        return -1;
+    }
+    ASM_STAT(a, ac_labels, 1);
+    sl = l ? to_stream_label(l) : new_label(a, t, ls_pt_resolved);
+    if (!sl) {
+        return -1;
+    }
+    // labels hold byte offsets, as in pass 1
+    sl->sl_lbl.lbl_off = here * 2;
+    sl->sl_lbl.lbl_state = ls_pt_resolved;
+    sl->sl_row = t->tok_row;
+    sl->sl_col = t->tok_col;
+    if (sl->sl_chain) {
+        patch_chain(a, sl->sl_chain, (uint16_t) here);
+    }
+    for (i = 0; i < sl->sl_nspill; ++i) {
+        patch_chain(a, sl->sl_spill[i], (uint16_t) here);
+    }
+    sl->sl_chain = 0;
+    free(sl->sl_spill);
+    sl->sl_spill = NULL;
+    sl->sl_nspill = sl->sl_capspill = 0;
+    return 0;
+}
+
+// The symbol of a label operand, a new placeholder if there is none yet
+static struct stream_label *refer_label(struct assembler *a,
+                                        struct token *t) {
+    struct label *l;
+    ASM_STAT(a, ac_label_refs, 1);
+    l = get_label_pointer(a, t->ttu_lab.lbl_name, t->ttu_lab.lbl_len);
+    return l ? to_stream_label(l) : new_label(a, t, ls_pt_unresolved);
+}
+
+// Symbols for the labels of an expression, so that they are reported
+// like any other when they are never defined. The expression waits for
+// the end, its names are taken from them rather than from the input.
+static int refer_expr(struct assembler *a, struct expr *e) {
+    struct stream_label *sl;
+    struct token t;
+    uint32_t i;
+    memset(&t, 0, sizeof(t));
+    for (i = 0; i < e->ex_count; ++i) {
+        if (e->ex_item[i].ei_op != eo_label) {
+            continue;
+        }
+        t.tok_row = e->ex_item[i].ei_row;
+        t.tok_col = e->ex_item[i].ei_col;
+        t.ttu_lab.lbl_name = e->ex_item[i].ei_name;
+        t.ttu_lab.lbl_len = e->ex_item[i].ei_len;
+        if (!(sl = refer_label(a, &t))) {
+            return -1;
+        }
+        e->ex_item[i].ei_name = sl->sl_name;
+    }
+    return 0;
+}
+
+static int emit_opcode(struct assembler *a, struct token *t) {
+    struct bcode_node node;
+    struct stream_label *sym[2] = {NULL, NULL};
+    struct token *op;
+    uint64_t base = a->img_words, index;
+    int i;
+
+    for (op = t->right, i = 0; op; op = op->right, ++i) {
+        if (op->type == tt_label && !(sym[i] = refer_label(a, op))) {
+            return -1;
+        }
+        if (op->type == tt_operand && op->ttu_opd.opd_expr &&
+            refer_expr(a, op->ttu_opd.opd_expr) < 0) {
+            return -1;
+        }
+    }
+    if (encode_opcode(a, t, &node) < 0 || grow_image(a, 3) < 0) {
+        return -1;
+    }
+    a->image[a->img_words++] = node.btu_code[0];
+    if (node.btu_c_has_a) {
+        a->image[a->img_words++] = node.btu_code[1];
+    }
+    if (node.btu_c_has_b) {
+        a->image[a->img_words++] = node.btu_code[2];
+    }
+    // operands still waiting for their label join its chain, expressions
+    // wait for the end
+    for (op = t->right, i = 0; op; op = op->right, ++i) {
+        if (op->type == tt_operand && op->ttu_opd.opd_expr) {
+            index = base + 1;
+            if (op->ttu_opd.opd_bcp == &node.btu_code[2]) {
+                index += node.btu_c_has_a;
+            }
+            if (expr_defer(a, NULL, index, op->ttu_opd.opd_expr) < 0) {
+                return -1;
+            }
+            op->ttu_opd.opd_expr = NULL;
+            continue;
+        }
+        if (op->type != tt_label || op->ttu_lab.lbl_state != ls_op_unresolved) {
+            continue;
+        }
+        index = base + 1;
+        if (op->ttu_lab.lbl_bcp == &node.btu_code[2]) {
+            index += node.btu_c_has_a;
+        }
+        if (chain_word(a, sym[i], index) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int emit_data(struct assembler *a, struct token *t) {
+    struct stream_label *sl;
+    struct token *r;
+    uint64_t base = a->img_words, i;
+    if (grow_image(a, t->tok_len) < 0) {
+        return -1;
+    }
+    if (t->tok_len) {
+        memcpy(a->image + base, t->ttu_wrd, sizeof(uint16_t) * t->tok_len);
+    }
+    a->img_words += t->tok_len;
+    // lbl_off of a reference is the index of its word
+    for (i = 0; i < t->ttu_nrefs; ++i) {
+        r = &t->ttu_refs[i];
+        if (!(sl = refer_label(a, r))) {
+            return -1;
+        }
+        if (sl->sl_lbl.lbl_state == ls_pt_resolved) {
+            a->image[base + r->ttu_lab.lbl_off] =
+                    (uint16_t) (sl->sl_lbl.lbl_off / 2);
+        } else if (chain_word(a, sl, base + r->ttu_lab.lbl_off) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int stream_begin(struct assembler *a) {
+    return grow_image(a, 1);
+}
+
+// Encode one statement from tok_statement(). 0 on success, -1 on error.
+int stream_statement(struct assembler *a, struct token st[3], int n) {
+    int rc;
+    ASM_STAT(a, ac_tokens, n);
+    switch (st[0].type) {
+        case tt_label:
+            rc = define_label(a, &st[0]);
+            break;
+        case tt_basic_opcode:
+        case tt_special_opcode:
+            rc = emit_opcode(a, &st[0]);
+            break;
+        case tt_words:
+            rc = emit_data(a, &st[0]);
+            break;
+        case tt_org:
+            rc = seg_org(a, &st[0], st[0].ttu_num, a->img_words);
+            break;
+        case tt_pin:
+            rc = 0;
+            break;
+        case tt_reserve:
+            rc = seg_org(a, &st[0], seg_here(a, a->img_words) +
+                                    st[0].ttu_num, a->img_words);
+            break;
+        default:
+            ASMTOKERROR(a, (&st[0]), "Unexpected token");
+            rc = -1;
+            break;
+    }
+    tok_release(&st[0]);
+    return rc;
+}
+
+// The words went out in source order, move each segment to its address
+static int place_segments(struct assembler *a) {
+    uint16_t *placed;
+    uint64_t end;
+    if (seg_finish(a, a->img_words) < 0) {
+        return -1;
+    }
+    if (!a->segs.st_count) {
+        return 0;
+    }
+    end = seg_end(a);
+    placed = malloc(sizeof(uint16_t) * (end ? end : 1));
+    if (!placed) {
+        LOGERROR("No more memory for the image");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(uint16_t) * end);
+    seg_place(a, placed, a->image);
+    free(a->image);
+    a->image = placed;
+    a->img_words = a->img_cap = end;
+    return 0;
+}
+
+// Every placeholder must have been defined by the end
+int stream_end(struct assembler *a) {
+    struct label *l;
+    struct stream_label *sl;
+    char err_str[256];
+    for (l = a->label_pts.head; l; l = l->next) {
+        if (l->lbl_state != ls_pt_resolved) {
+            sl = to_stream_label(l);
+            snprintf(err_str, 256, "Label '%.*s' is not associated with any "
+                                   "label pointer",
+                     (int) (l->lbl_len < 64 ? l->lbl_len : 64), l->lbl_name);
+            stream_error(a, sl->sl_row, sl->sl_col, err_str);
+            if (!diag_more(a)) {
+                return -1;
+            }
+        }
+    }
+    // the words went out in source order, expressions are filled in there
+    if (expr_fixups(a) < 0) {
+        return -1;
+    }
+    // the errors in the source are all in by now
+    if (a->nerrors) {
+        return -1;
+    }
+    return place_segments(a);
+}
+
+int stream_assemble(struct assembler *a) {
+    struct token st[3];
+    uint64_t seen;
+    int n;
+
+    if (stream_begin(a) < 0) {
+        return -1;
+    }
+    for (;;) {
+        // everything before the next statement has been encoded
+        asm_drop_input(a, a->inp_offset);
+        seen = a->nerrors;
+        if ((n = tok_statement(a, st)) == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (!tok_recover(a, seen)) {
+                return -1;
+            }
+        } else if (stream_statement(a, st, n) < 0 &&
+                   (a->nerrors == seen || !diag_more(a))) {
+            return -1;
+        }
+    }
+    return stream_end(a);
+}
+
+void stream_reset(struct assembler *a) {
+    struct label *l, *next;
+    struct stream_label *sl;
+    if (!a->image) {
+        return;
+    }
+    for (l = a->label_pts.head; l; l = next) {
+        next = l->next;
+        sl = to_stream_label(l);
+        free(sl->sl_spill);
+        free(sl);
+    }
+    a->label_pts.head = a->label_pts.tail = NULL;
+    a->img_words = 0;
+}
+
+void stream_free(struct assembler *a) {
+    if (!a->image) {
+        return;
+    }
+    stream_reset(a);
+    free(a->image);
+    a->image = NULL;
+    a->img_cap = 0;
+}
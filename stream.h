@@ -0,0 +1,16 @@
+#ifndef ASSEMBLER_STREAM_H
+#define ASSEMBLER_STREAM_H
+
+#include "common.h"
+
+/* Tokenize and encode one statement at a time into a->image */
+int  stream_assemble(struct assembler *a);
+/* The pieces of stream_assemble(), for drivers of their own */
+int  stream_begin(struct assembler *a);
+int  stream_statement(struct assembler *a, struct token st[3], int n);
+int  stream_end(struct assembler *a);
+/* Forget the symbols and the words, keep the image buffer */
+void stream_reset(struct assembler *a);
+void stream_free(struct assembler *a);
+
+#endif //ASSEMBLER_STREAM_H
@@ -0,0 +1,740 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_code.h"
+#include "expr.h"
+#include "symbols.h"
+#include "tokenize.h"
+
+#define SHORT_MAX 0x1e     /* Highest address an inline literal holds */
+
+void sym_init(struct sym_index *sx) {
+    memset(sx, 0, sizeof(*sx));
+}
+
+static inline uint32_t hash_name(const char *s, uint32_t n) {
+    uint32_t h = 2166136261u, i;
+    for (i = 0; i < n; ++i) {
+        h = (h ^ (uint8_t) s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int grow_table(struct sym_index *sx) {
+    struct sym_entry **slot, *e;
+    uint32_t cap = sx->sx_cap ? sx->sx_cap * 2 : 1024, i, j;
+    slot = calloc(cap, sizeof(struct sym_entry *));
+    if (!slot) {
+        LOGERROR("No memory for the symbol index");
+        return -1;
+    }
+    for (i = 0; i < sx->sx_cap; ++i) {
+        if ((e = sx->sx_slot[i])) {
+            for (j = e->se_hash & (cap - 1); slot[j]; j = (j + 1) & (cap - 1));
+            slot[j] = e;
+        }
+    }
+    free(sx->sx_slot);
+    sx->sx_slot = slot;
+    sx->sx_cap = cap;
+    return 0;
+}
+
+// The slot of name, or the empty one it would go in
+static inline uint32_t probe(struct sym_index *sx, const char *name,
+                             uint32_t len, uint32_t h) {
+    struct sym_entry *e;
+    uint32_t j;
+    for (j = h & (sx->sx_cap - 1); (e = sx->sx_slot[j]);
+         j = (j + 1) & (sx->sx_cap - 1)) {
+        if (e->se_hash == h && e->se_len == len &&
+            !memcmp(e->se_name, name, len)) {
+            break;
+        }
+    }
+    return j;
+}
+
+struct sym_entry *sym_lookup(struct sym_index *sx, const char *name,
+                             uint32_t len) {
+    if (!sx->sx_cap) {
+        return NULL;
+    }
+    return sx->sx_slot[probe(sx, name, len, hash_name(name, len))];
+}
+
+static struct sym_entry *intern(struct sym_index *sx, const char *name,
+                                uint32_t len) {
+    struct sym_entry *e;
+    uint32_t h = hash_name(name, len), j;
+    if (2 * (sx->sx_count + 1) > sx->sx_cap && grow_table(sx) < 0) {
+        return NULL;
+    }
+    j = probe(sx, name, len, h);
+    if (sx->sx_slot[j]) {
+        return sx->sx_slot[j];
+    }
+    e = calloc(1, sizeof(*e) + len + 1);
+    if (!e) {
+        LOGERROR("No memory for a symbol");
+        return NULL;
+    }
+    e->se_name = (char *) (e + 1);
+    memcpy(e->se_name, name, len);
+    e->se_len = len;
+    e->se_hash = h;
+    sx->sx_slot[j] = e;
+    sx->sx_count++;
+    return e;
+}
+
+static void link_occ(struct sym_occ *o) {
+    struct sym_entry *e = o->so_sym;
+    if (o->so_def) {
+        o->so_prev = NULL;
+        o->so_next = e->se_head;
+        if (e->se_head) {
+            e->se_head->so_prev = o;
+        } else {
+            e->se_tail = o;
+        }
+        e->se_head = o;
+        e->se_ndef++;
+    } else {
+        o->so_next = NULL;
+        o->so_prev = e->se_tail;
+        if (e->se_tail) {
+            e->se_tail->so_next = o;
+        } else {
+            e->se_head = o;
+        }
+        e->se_tail = o;
+        e->se_nref++;
+    }
+}
+
+static void unlink_occ(struct sym_occ *o) {
+    struct sym_entry *e = o->so_sym;
+    if (o->so_prev) {
+        o->so_prev->so_next = o->so_next;
+    } else {
+        e->se_head = o->so_next;
+    }
+    if (o->so_next) {
+        o->so_next->so_prev = o->so_prev;
+    } else {
+        e->se_tail = o->so_prev;
+    }
+    if (o->so_def) {
+        e->se_ndef--;
+    } else {
+        e->se_nref--;
+    }
+}
+
+static int add_occ(struct sym_index *sx, struct sym_line *l, char *name,
+                   uint64_t len, int def) {
+    struct sym_occ *o = &l->sl_occ[l->sl_nocc++];
+    o->so_sym = intern(sx, name, (uint32_t) len);
+    if (!o->so_sym) {
+        l->sl_nocc--;
+        return -1;
+    }
+    o->so_line = l;
+    o->so_col = (uint32_t) (name - l->sl_text);
+    o->so_len = (uint32_t) len;
+    o->so_def = (uint8_t) def;
+    link_occ(o);
+    return 0;
+}
+
+// Labels named in the expression of an operand, if it has one
+static inline uint64_t expr_labels(struct token *op) {
+    return op->type == tt_operand && op->ttu_opd.opd_expr ?
+           op->ttu_opd.opd_expr->ex_labels : 0;
+}
+
+// An expression of labels in operand a, which pass 1 may fold inline
+static inline int short_expr(struct token *op) {
+    return !op->right && expr_labels(op) &&
+           op->ttu_opd.opd_type == ot_literal;
+}
+
+// Labels of a statement, in the order sym_refresh() meets them
+static uint64_t count_labels(struct token *st) {
+    struct token *t;
+    uint64_t n = 0;
+    if (st->type == tt_words) {
+        return st->ttu_nrefs;
+    }
+    for (t = st; t; t = t->right) {
+        n += t->type == tt_label ? 1 : expr_labels(t);
+    }
+    return n;
+}
+
+// Words of the line with a word for every label, where each definition
+// is among them and what sym_refresh() has to look at
+static void summarize(struct sym_line *l) {
+    struct sym_occ *o = l->sl_occ;
+    struct token *t, *op;
+    uint64_t s, words = 0;
+    for (s = 0; s < l->sl_nstmt; ++s) {
+        t = l->sl_stmt[s];
+        switch (t->type) {
+            case tt_label:
+                o->so_off = (int32_t) words;
+                l->sl_flags |= SL_DEF;
+                if (l->sl_flags & SL_SHORT) {
+                    l->sl_flags |= SL_SLOW;
+                }
+                ++o;
+                break;
+            case tt_basic_opcode:
+            case tt_special_opcode:
+                ++words;
+                for (op = t->right; op; op = op->right) {
+                    if (op->type != tt_label) {
+                        words += operand_words(op, !op->right);
+                        o += expr_labels(op);
+                        if (short_expr(op)) {
+                            l->sl_flags |= SL_SLOW;
+                        }
+                        continue;
+                    }
+                    if (!op->right) {
+                        o->so_a = 1;
+                        l->sl_flags |= SL_SHORT;
+                    }
+                    ++words;
+                    ++o;
+                }
+                break;
+            case tt_words:
+                words += t->tok_len;
+                o += t->ttu_nrefs;
+                break;
+            case tt_org:
+            case tt_reserve:
+                l->sl_flags |= SL_SLOW;
+                break;
+            default:
+                break;
+        }
+    }
+    l->sl_fixed = (uint32_t) words;
+}
+
+static int add_expr_occ(struct sym_index *sx, struct sym_line *l,
+                        struct expr *e) {
+    uint32_t i;
+    for (i = 0; i < e->ex_count; ++i) {
+        if (e->ex_item[i].ei_op == eo_label &&
+            add_occ(sx, l, e->ex_item[i].ei_name, e->ex_item[i].ei_len,
+                    0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Tokenize the text of l, as much of it as is valid, and file its labels
+static int lex_line(struct sym_index *sx, struct sym_line *l) {
+    struct assembler a;
+    struct token st[3], (*grown)[3];
+    struct token *t;
+    uint64_t i, r, nocc = 0;
+    int n, rc = 0;
+
+    memset(&a, 0, sizeof(a));
+    a.input = l->sl_text;
+    a.inp_size = l->sl_len;
+    a.input_file = l->sl_doc->sd_path;
+    while ((n = tok_statement(&a, st)) > 0) {
+        grown = realloc(l->sl_stmt, sizeof(st) * (l->sl_nstmt + 1));
+        if (!grown) {
+            LOGERROR("No memory for a statement");
+            tok_release(&st[0]);
+            rc = -1;
+            break;
+        }
+        l->sl_stmt = grown;
+        memcpy(l->sl_stmt[l->sl_nstmt++], st, sizeof(st));
+    }
+    l->sl_error = n < 0;
+    // the tokens moved, so link them again
+    for (i = 0; i < l->sl_nstmt; ++i) {
+        t = l->sl_stmt[i];
+        t[0].right = t[0].right ? &t[1] : NULL;
+        t[1].right = t[1].right ? &t[2] : NULL;
+        nocc += count_labels(t);
+    }
+    if (!nocc) {
+        summarize(l);
+        return rc;
+    }
+    l->sl_occ = calloc(nocc, sizeof(struct sym_occ));
+    if (!l->sl_occ) {
+        LOGERROR("No memory for the labels of a line");
+        return -1;
+    }
+    for (i = 0; i < l->sl_nstmt; ++i) {
+        t = l->sl_stmt[i];
+        if (t->type == tt_words) {
+            for (r = 0; r < t->ttu_nrefs; ++r) {
+                if (add_occ(sx, l, t->ttu_refs[r].ttu_lab.lbl_name,
+                            t->ttu_refs[r].ttu_lab.lbl_len, 0) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+        for (; t; t = t->right) {
+            if (t->type == tt_label &&
+                add_occ(sx, l, t->ttu_lab.lbl_name, t->ttu_lab.lbl_len,
+                        t == l->sl_stmt[i]) < 0) {
+                return -1;
+            }
+            if (expr_labels(t) &&
+                add_expr_occ(sx, l, t->ttu_opd.opd_expr) < 0) {
+                return -1;
+            }
+        }
+    }
+    summarize(l);
+    return rc;
+}
+
+static void unlex_line(struct sym_line *l) {
+    uint64_t i;
+    for (i = 0; i < l->sl_nocc; ++i) {
+        unlink_occ(&l->sl_occ[i]);
+    }
+    for (i = 0; i < l->sl_nstmt; ++i) {
+        tok_release(&l->sl_stmt[i][0]);
+    }
+    free(l->sl_occ);
+    free(l->sl_stmt);
+    l->sl_occ = NULL;
+    l->sl_stmt = NULL;
+    l->sl_nocc = l->sl_nstmt = 0;
+    l->sl_fixed = 0;
+    l->sl_flags = 0;
+}
+
+static void free_line(struct sym_line *l) {
+    unlex_line(l);
+    free(l);
+}
+
+static struct sym_line *new_line(struct sym_index *sx, struct sym_doc *d,
+                                 const char *text, size_t len) {
+    struct sym_line *l = calloc(1, sizeof(*l) + len + 1);
+    if (!l) {
+        LOGERROR("No memory for a line");
+        return NULL;
+    }
+    l->sl_doc = d;
+    l->sl_text = (char *) (l + 1);
+    memcpy(l->sl_text, text, len);
+    l->sl_text[len] = '\0';
+    l->sl_len = (uint32_t) len;
+    // out of memory half way, the line is kept as if it did not tokenize
+    if (lex_line(sx, l) < 0) {
+        unlex_line(l);
+        l->sl_error = 1;
+    }
+    return l;
+}
+
+// Replace the lines [at, at + drop) by the lines of text
+static int splice_lines(struct sym_index *sx, struct sym_doc *d, uint64_t at,
+                        uint64_t drop, const char *text, size_t len) {
+    struct sym_line **grown;
+    const char *s = text, *end = text + len, *nl;
+    uint64_t add = 1, i, cap;
+
+    for (nl = text; (nl = memchr(nl, '\n', (size_t) (end - nl))); ++nl) {
+        ++add;
+    }
+    if (d->sd_nline - drop + add > d->sd_cap) {
+        cap = d->sd_cap ? d->sd_cap : 64;
+        while (cap < d->sd_nline - drop + add) {
+            cap *= 2;
+        }
+        grown = realloc(d->sd_line, sizeof(struct sym_line *) * cap);
+        if (!grown) {
+            LOGERROR("No memory for the lines of %s", d->sd_uri);
+            return -1;
+        }
+        d->sd_line = grown;
+        d->sd_cap = cap;
+    }
+    for (i = at; i < at + drop; ++i) {
+        free_line(d->sd_line[i]);
+    }
+    memmove(d->sd_line + at + add, d->sd_line + at + drop,
+            sizeof(struct sym_line *) * (d->sd_nline - at - drop));
+    d->sd_nline = d->sd_nline - drop + add;
+    sx->sx_lines = sx->sx_lines - drop + add;
+    for (i = at; i < at + add; ++i) {
+        nl = memchr(s, '\n', (size_t) (end - s));
+        if (!nl) {
+            nl = end;
+        }
+        d->sd_line[i] = new_line(sx, d, s, (size_t) (nl - s));
+        if (!d->sd_line[i]) {
+            // close the gap of the lines not made
+            memmove(d->sd_line + i, d->sd_line + at + add,
+                    sizeof(struct sym_line *) * (d->sd_nline - at - add));
+            d->sd_nline -= at + add - i;
+            sx->sx_lines -= at + add - i;
+            break;
+        }
+        s = nl + 1;
+    }
+    if (at < d->sd_stale) {
+        d->sd_stale = at;
+    }
+    return i == at + add ? 0 : -1;
+}
+
+struct sym_doc *sym_doc_find(struct sym_index *sx, const char *uri) {
+    struct sym_doc *d;
+    for (d = sx->sx_docs; d; d = d->sd_next) {
+        if (!strcmp(d->sd_uri, uri)) {
+            break;
+        }
+    }
+    return d;
+}
+
+struct sym_doc *sym_doc_set(struct sym_index *sx, const char *uri,
+                            const char *path, const char *text, size_t len) {
+    struct sym_doc *d = sym_doc_find(sx, uri);
+    size_t ulen = strlen(uri), plen = strlen(path);
+    if (!d) {
+        d = calloc(1, sizeof(*d) + ulen + plen + 2);
+        if (!d) {
+            LOGERROR("No memory for %s", uri);
+            return NULL;
+        }
+        d->sd_uri = (char *) (d + 1);
+        memcpy(d->sd_uri, uri, ulen + 1);
+        d->sd_path = d->sd_uri + ulen + 1;
+        memcpy(d->sd_path, path, plen + 1);
+        d->sd_next = sx->sx_docs;
+        sx->sx_docs = d;
+    }
+    if (splice_lines(sx, d, 0, d->sd_nline, text, len) < 0) {
+        return NULL;
+    }
+    return d;
+}
+
+int sym_doc_edit(struct sym_index *sx, struct sym_doc *d, uint64_t line0,
+                 uint64_t col0, uint64_t line1, uint64_t col1,
+                 const char *text, size_t len) {
+    struct sym_line *l0, *l1;
+    char *joined;
+    size_t n;
+    int rc;
+
+    // past the end is the end
+    if (line0 >= d->sd_nline) {
+        line0 = d->sd_nline - 1;
+        col0 = d->sd_line[line0]->sl_len;
+    }
+    if (line1 >= d->sd_nline) {
+        line1 = d->sd_nline - 1;
+        col1 = d->sd_line[line1]->sl_len;
+    }
+    l0 = d->sd_line[line0];
+    l1 = d->sd_line[line1];
+    if (col0 > l0->sl_len) {
+        col0 = l0->sl_len;
+    }
+    if (col1 > l1->sl_len) {
+        col1 = l1->sl_len;
+    }
+    if (line1 < line0 || (line1 == line0 && col1 < col0)) {
+        LOGERROR("Edit of %s ends before it starts", d->sd_uri);
+        return -1;
+    }
+    n = col0 + len + (l1->sl_len - col1);
+    joined = malloc(n + 1);
+    if (!joined) {
+        LOGERROR("No memory for an edit");
+        return -1;
+    }
+    memcpy(joined, l0->sl_text, col0);
+    memcpy(joined + col0, text, len);
+    memcpy(joined + col0 + len, l1->sl_text + col1, l1->sl_len - col1);
+    rc = splice_lines(sx, d, line0, line1 - line0 + 1, joined, n);
+    free(joined);
+    return rc;
+}
+
+void sym_doc_drop(struct sym_index *sx, struct sym_doc *d) {
+    struct sym_doc **p;
+    uint64_t i;
+    for (p = &sx->sx_docs; *p && *p != d; p = &(*p)->sd_next);
+    if (*p) {
+        *p = d->sd_next;
+    }
+    for (i = 0; i < d->sd_nline; ++i) {
+        free_line(d->sd_line[i]);
+    }
+    sx->sx_lines -= d->sd_nline;
+    free(d->sd_line);
+    free(d->sd_low);
+    free(d);
+}
+
+void sym_free(struct sym_index *sx) {
+    uint32_t i;
+    while (sx->sx_docs) {
+        sym_doc_drop(sx, sx->sx_docs);
+    }
+    for (i = 0; i < sx->sx_cap; ++i) {
+        free(sx->sx_slot[i]);
+    }
+    free(sx->sx_slot);
+    memset(sx, 0, sizeof(*sx));
+}
+
+static inline int is_low(struct sym_doc *d, struct sym_entry *e) {
+    uint64_t i;
+    for (i = 0; i < d->sd_nlow; ++i) {
+        if (d->sd_low[i].lo_sym == e) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void add_low(struct sym_doc *d, struct sym_entry *e, uint64_t line,
+                    uint64_t addr) {
+    struct sym_low *grown;
+    uint64_t cap;
+    if (d->sd_nlow == d->sd_caplow) {
+        cap = d->sd_caplow ? d->sd_caplow * 2 : 32;
+        grown = realloc(d->sd_low, sizeof(struct sym_low) * cap);
+        if (!grown) {
+            // it only costs the word of a short label in the addresses
+            return;
+        }
+        d->sd_low = grown;
+        d->sd_caplow = cap;
+    }
+    d->sd_low[d->sd_nlow].lo_sym = e;
+    d->sd_low[d->sd_nlow].lo_line = line;
+    d->sd_low[d->sd_nlow++].lo_addr = addr;
+}
+
+// walk_line() folding an expression, its labels from fo_occ on
+struct fold {
+    struct sym_doc  *fo_doc;
+    struct sym_line *fo_line;
+    struct sym_occ  *fo_occ;
+    uint64_t         fo_start;      /* Of the line, as walk_line() has it */
+};
+
+// The address of the next label of the expression, when it is defined
+// before it in the same document, where pass 1 has placed it by then
+static int placed_before(void *arg, const struct expr_item *it,
+                         int64_t *value) {
+    struct fold *f = arg;
+    struct sym_occ *o = f->fo_occ++;
+    struct sym_occ *def = sym_definition(o->so_sym, f->fo_doc);
+    struct sym_line *dl;
+    (void) it;
+    if (!def || (dl = def->so_line)->sl_doc != f->fo_doc) {
+        return -1;
+    }
+    if (dl == f->fo_line) {
+        if (def > o) {
+            return -1;
+        }
+        *value = (int64_t) (f->fo_start + (uint64_t) def->so_off);
+        return 0;
+    }
+    // the lines after this one may still have their old numbers
+    if (dl->sl_no >= f->fo_line->sl_no ||
+        f->fo_doc->sd_line[dl->sl_no] != dl) {
+        return -1;
+    }
+    *value = (int64_t) sym_addr(def);
+    return 0;
+}
+
+// Does the expression of op come to an inline literal, as pass 1 folds it
+static int folds_inline(struct sym_doc *d, struct sym_line *l,
+                        struct sym_occ *o, uint64_t start, struct token *op) {
+    struct fold f;
+    int64_t value;
+    f.fo_doc = d;
+    f.fo_line = l;
+    f.fo_occ = o;
+    f.fo_start = start;
+    return expr_value(op->ttu_opd.opd_expr, placed_before, &f, &value) == 0 &&
+           value >= -1 && value <= SHORT_MAX;
+}
+
+// Lay out a line token by token from addr, returns where it ends
+static uint64_t walk_line(struct sym_doc *d, struct sym_line *l, uint64_t i,
+                          uint64_t addr) {
+    struct sym_occ *o = l->sl_occ;
+    struct token *t, *op;
+    uint64_t s, start = addr;
+    for (s = 0; s < l->sl_nstmt; ++s) {
+        t = l->sl_stmt[s];
+        switch (t->type) {
+            case tt_label:
+                o->so_off = (int32_t) (addr - start);
+                if (addr <= SHORT_MAX) {
+                    add_low(d, o->so_sym, i, addr);
+                }
+                ++o;
+                break;
+            case tt_basic_opcode:
+            case tt_special_opcode:
+                ++addr;
+                for (op = t->right; op; op = op->right) {
+                    if (op->type != tt_label) {
+                        addr += operand_words(op, !op->right);
+                        if (short_expr(op) &&
+                            folds_inline(d, l, o, start, op)) {
+                            --addr;
+                        }
+                        o += expr_labels(op);
+                        continue;
+                    }
+                    if (op->right || !is_low(d, o->so_sym)) {
+                        ++addr;
+                    }
+                    ++o;
+                }
+                break;
+            case tt_words:
+                addr += t->tok_len;
+                o += t->ttu_nrefs;
+                break;
+            case tt_org:
+                addr = t->ttu_num;
+                break;
+            case tt_reserve:
+                addr += t->ttu_num;
+                break;
+            default:
+                break;
+        }
+    }
+    // the line starts where the words after a leading .org go
+    if (l->sl_stmt[0]->type == tt_org || l->sl_stmt[0]->type == tt_reserve) {
+        l->sl_addr = addr;
+        for (o = l->sl_occ; o < l->sl_occ + l->sl_nocc; ++o) {
+            o->so_off -= (int32_t) (l->sl_addr - start);
+        }
+    }
+    return addr;
+}
+
+// Lay the lines out from the first stale one, as pass 1 would: a label
+// in operand a takes no word when it was defined before, at 0x1e or lower,
+// nor does an expression of labels defined before that comes to -1 to 30.
+// Most lines only need their fixed size; the definitions are looked at
+// while the address is that low, and the labels in operand a while some
+// label is.
+void sym_refresh(struct sym_doc *d) {
+    struct sym_line *l;
+    struct sym_occ *o;
+    uint64_t i, addr, end;
+
+    if (d->sd_stale >= d->sd_nline) {
+        return;
+    }
+    while (d->sd_nlow && d->sd_low[d->sd_nlow - 1].lo_line >= d->sd_stale) {
+        d->sd_nlow--;
+    }
+    addr = d->sd_stale ? d->sd_line[d->sd_stale - 1]->sl_end : 0;
+    for (i = d->sd_stale; i < d->sd_nline; ++i) {
+        l = d->sd_line[i];
+        l->sl_no = i;
+        l->sl_addr = addr;
+        if (l->sl_flags & SL_SLOW) {
+            addr = walk_line(d, l, i, addr);
+            l->sl_end = addr;
+            continue;
+        }
+        end = addr + l->sl_fixed;
+        if ((l->sl_flags & SL_DEF) && addr <= SHORT_MAX) {
+            for (o = l->sl_occ; o < l->sl_occ + l->sl_nocc; ++o) {
+                if (o->so_def && addr + (uint64_t) o->so_off <= SHORT_MAX) {
+                    add_low(d, o->so_sym, i, addr + (uint64_t) o->so_off);
+                }
+            }
+        }
+        if ((l->sl_flags & SL_SHORT) && d->sd_nlow) {
+            for (o = l->sl_occ; o < l->sl_occ + l->sl_nocc; ++o) {
+                end -= o->so_a && is_low(d, o->so_sym);
+            }
+        }
+        l->sl_end = addr = end;
+    }
+    d->sd_stale = d->sd_nline;
+}
+
+struct sym_occ *sym_at(struct sym_doc *d, uint64_t line, uint64_t col) {
+    struct sym_line *l;
+    uint32_t i;
+    if (line >= d->sd_nline) {
+        return NULL;
+    }
+    l = d->sd_line[line];
+    for (i = 0; i < l->sl_nocc; ++i) {
+        // the cursor may sit right after the name
+        if (col >= l->sl_occ[i].so_col &&
+            col <= l->sl_occ[i].so_col + l->sl_occ[i].so_len) {
+            return &l->sl_occ[i];
+        }
+    }
+    return NULL;
+}
+
+struct sym_occ *sym_definition(struct sym_entry *e, struct sym_doc *near) {
+    struct sym_occ *o;
+    for (o = e->se_head; o && o->so_def; o = o->so_next) {
+        if (o->so_line->sl_doc == near) {
+            return o;
+        }
+    }
+    return e->se_head && e->se_head->so_def ? e->se_head : NULL;
+}
+
+uint64_t sym_utf16_col(const struct sym_line *l, uint64_t col) {
+    uint64_t i, units = 0;
+    uint8_t c;
+    for (i = 0; i < col && i < l->sl_len; ++i) {
+        c = (uint8_t) l->sl_text[i];
+        if ((c & 0xc0) != 0x80) {
+            units += c >= 0xf0 ? 2 : 1;
+        }
+    }
+    return units;
+}
+
+uint64_t sym_byte_col(const struct sym_line *l, uint64_t col16) {
+    uint64_t i, units = 0;
+    uint8_t c;
+    for (i = 0; i < l->sl_len; ++i) {
+        c = (uint8_t) l->sl_text[i];
+        if ((c & 0xc0) != 0x80) {
+            if (units >= col16) {
+                break;
+            }
+            units += c >= 0xf0 ? 2 : 1;
+        }
+    }
+    return i;
+}
@@ -0,0 +1,124 @@
+#ifndef ASSEMBLER_SYMBOLS_H
+#define ASSEMBLER_SYMBOLS_H
+
+#include "common.h"
+
+// Labels of a set of documents, kept up to date one edited line at a
+// time for the language server. Every line caches the statements the
+// tokenizer read from it and the labels among them. Those are filed by
+// name in an index shared by all the documents. Line numbers and
+// addresses are worked out again only when asked for, from the first
+// line edited since.
+
+struct sym_entry;
+struct sym_line;
+struct sym_doc;
+
+/* A label in a line, defined there or referred to */
+struct sym_occ {
+    struct sym_entry *so_sym;
+    struct sym_line  *so_line;
+    struct sym_occ   *so_prev;      /* Same name, in every document */
+    struct sym_occ   *so_next;
+    int32_t           so_off;       /* Definitions: words from sl_addr */
+    uint32_t          so_col;       /* Bytes into the line */
+    uint32_t          so_len;
+    uint8_t           so_def;
+    uint8_t           so_a;         /* In operand a, may be encoded inline */
+};
+
+/* Every occurrence of a name, its definitions first */
+struct sym_entry {
+    char           *se_name;
+    uint32_t        se_len;
+    uint32_t        se_hash;
+    struct sym_occ *se_head;
+    struct sym_occ *se_tail;
+    uint32_t        se_ndef;
+    uint32_t        se_nref;
+};
+
+/* sl_flags */
+#define SL_DEF   0x1    /* Defines a label */
+#define SL_SHORT 0x2    /* A label in operand a */
+#define SL_SLOW  0x4    /* Has .org or .reserve, an expression of labels in
+                         * operand a, or a definition after a label in
+                         * operand a: laid out token by token */
+
+struct sym_line {
+    /* Laid out by sym_refresh(), kept together as it walks every line */
+    uint64_t        sl_no;          /* Line number */
+    uint64_t        sl_addr;        /* Of its first word */
+    uint64_t        sl_end;         /* Where the next line goes */
+    uint32_t        sl_fixed;       /* Words, a word for every label */
+    uint8_t         sl_flags;
+    uint8_t         sl_error;       /* The rest did not tokenize */
+    uint32_t        sl_len;
+    char           *sl_text;        /* Without its newline, NUL ended */
+    struct sym_doc *sl_doc;
+    struct token  (*sl_stmt)[3];    /* Statements, as tok_statement() */
+    uint32_t        sl_nstmt;
+    uint32_t        sl_nocc;
+    struct sym_occ *sl_occ;         /* Labels in the order of the tokens */
+};
+
+/* A label defined low enough to be encoded inline */
+struct sym_low {
+    struct sym_entry *lo_sym;
+    uint64_t          lo_line;
+    uint64_t          lo_addr;
+};
+
+struct sym_doc {
+    char             *sd_uri;
+    char             *sd_path;
+    struct sym_line **sd_line;
+    uint64_t          sd_nline;
+    uint64_t          sd_cap;
+    uint64_t          sd_stale;     /* First line whose sl_no/sl_addr are old */
+    struct sym_low   *sd_low;       /* In line order, up to sd_stale */
+    uint64_t          sd_nlow;
+    uint64_t          sd_caplow;
+    int               sd_open;      /* Opened by the editor, not only on disk */
+    struct sym_doc   *sd_next;
+};
+
+struct sym_index {
+    struct sym_entry **sx_slot;     /* Open addressing by name */
+    uint32_t           sx_cap;
+    uint32_t           sx_count;
+    struct sym_doc    *sx_docs;
+    uint64_t           sx_lines;
+};
+
+void              sym_init(struct sym_index *sx);
+void              sym_free(struct sym_index *sx);
+struct sym_doc   *sym_doc_find(struct sym_index *sx, const char *uri);
+/* A new document, or new contents for the one at uri */
+struct sym_doc   *sym_doc_set(struct sym_index *sx, const char *uri,
+                              const char *path, const char *text,
+                              size_t len);
+/* Replace from (line0, col0) up to (line1, col1), columns in bytes, by
+ * text. Only the lines touched are tokenized again. 0 or -1. */
+int               sym_doc_edit(struct sym_index *sx, struct sym_doc *d,
+                               uint64_t line0, uint64_t col0,
+                               uint64_t line1, uint64_t col1,
+                               const char *text, size_t len);
+void              sym_doc_drop(struct sym_index *sx, struct sym_doc *d);
+/* Bring line numbers and addresses of d up to date */
+void              sym_refresh(struct sym_doc *d);
+/* Address of a definition, its document refreshed */
+static inline uint64_t sym_addr(const struct sym_occ *o) {
+    return o->so_line->sl_addr + (int64_t) o->so_off;
+}
+struct sym_entry *sym_lookup(struct sym_index *sx, const char *name,
+                             uint32_t len);
+/* The label at byte col of line, NULL if there is none */
+struct sym_occ   *sym_at(struct sym_doc *d, uint64_t line, uint64_t col);
+/* Where the label is defined, in the document near if it is there */
+struct sym_occ   *sym_definition(struct sym_entry *e, struct sym_doc *near);
+/* Columns counted in UTF-16 units, as the protocol does, and back */
+uint64_t          sym_utf16_col(const struct sym_line *l, uint64_t col);
+uint64_t          sym_byte_col(const struct sym_line *l, uint64_t col16);
+
+#endif //ASSEMBLER_SYMBOLS_H
@@ -0,0 +1,16 @@
+# Assemble INPUTS, split it over LANES lanes at 0x1000 and run SOURCE on
+# them in lockstep in DEMU, which checks every lane against a run of its
+# own through the plain interpreter. Run as:
+#   cmake -DDASM=.. -DDEMU=.. -DSOURCE=.. -DINPUTS=.. -DLANES=.. -DWORKDIR=..
+#         -P batch.cmake
+file(MAKE_DIRECTORY ${WORKDIR})
+set(image ${WORKDIR}/inputs.bin)
+execute_process(COMMAND ${DASM} -o ${image} ${INPUTS} RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${INPUTS} does not assemble")
+endif()
+execute_process(COMMAND ${DEMU} -N ${LANES} -i ${image}@0x1000 -V ${SOURCE}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE err)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "The lanes differ from runs of their own:\n${err}")
+endif()
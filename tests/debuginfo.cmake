@@ -0,0 +1,23 @@
+# Assemble SOURCE with FLAGS and --debug-info, run the image in DEMU with
+# it and check that PC is reported at the label and source line in WHERE,
+# a regular expression. Run as:
+#   cmake -DDASM=.. -DDEMU=.. -DSOURCE=.. -DWHERE=.. -DWORKDIR=..
+#         [-DFLAGS=..] -P debuginfo.cmake
+separate_arguments(FLAGS)
+file(MAKE_DIRECTORY ${WORKDIR})
+get_filename_component(name ${SOURCE} NAME_WE)
+set(image ${WORKDIR}/${name}.bin)
+set(symbols ${WORKDIR}/${name}.dsym)
+execute_process(COMMAND ${DASM} ${FLAGS} --debug-info=${symbols} -o ${image}
+        ${SOURCE} RESULT_VARIABLE rc ERROR_QUIET)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} does not assemble")
+endif()
+execute_process(COMMAND ${DEMU} -b -g ${symbols} ${image}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${image} does not run")
+endif()
+if(NOT out MATCHES "at=${WHERE}\n")
+    message(FATAL_ERROR "Expected at=${WHERE}, got:\n${out}")
+endif()
@@ -0,0 +1,19 @@
+# Assemble SOURCE, which has errors, with DASM and compare the diagnostics
+# it writes with EXPECTED. The run has to fail, and to report them all.
+# Run as: cmake -DDASM=.. -DSOURCE=.. -DEXPECTED=.. -DOUTPUT=..
+#               [-DFLAGS=..] -P diagnostics.cmake
+separate_arguments(FLAGS)
+get_filename_component(dir ${SOURCE} DIRECTORY)
+get_filename_component(name ${SOURCE} NAME)
+# from its directory, so the file named in them is the same everywhere
+execute_process(COMMAND ${DASM} ${FLAGS} -o ${OUTPUT}.bin
+            --diagnostics=${OUTPUT} ${name}
+        WORKING_DIRECTORY ${dir} RESULT_VARIABLE rc ERROR_QUIET)
+if(rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} assembles in spite of its errors")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
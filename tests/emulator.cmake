@@ -0,0 +1,13 @@
+# Run SOURCE in DEMU for CYCLES and compare the registers it prints at the
+# end, and anything FLAGS add, with EXPECTED.
+# Run as: cmake -DDEMU=.. -DSOURCE=.. -DEXPECTED=.. -DCYCLES=.. [-DFLAGS=..]
+#               -P emulator.cmake
+execute_process(COMMAND ${DEMU} -c ${CYCLES} ${FLAGS} ${SOURCE}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} does not run")
+endif()
+file(READ ${EXPECTED} want)
+if(NOT out STREQUAL want)
+    message(FATAL_ERROR "Expected:\n${want}got:\n${out}")
+endif()
@@ -0,0 +1,29 @@
+# Write a floppy with SOURCE at sector 0, the image RAW at sector 5 as it
+# is and the source PLACED assembled at sector 9, then check the size of
+# the disk and that each image is where it was put, compared with EXPECTED
+# and PLACED_EXPECTED. Run as:
+#   cmake -DDASM=.. -DSOURCE=.. -DEXPECTED=.. -DRAW=.. -DPLACED=..
+#         -DPLACED_EXPECTED=.. -DDISK=.. -P floppy.cmake
+execute_process(COMMAND ${DASM} --floppy ${DISK} --place 5:${RAW}
+        --place 9:${PLACED} ${SOURCE} RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${DISK} was not written")
+endif()
+file(SIZE ${DISK} size)
+if(NOT size EQUAL 1474560)
+    message(FATAL_ERROR "${DISK} has ${size} bytes, not 1440 sectors")
+endif()
+
+function(check sector image)
+    file(READ ${image} want HEX)
+    file(SIZE ${image} n)
+    math(EXPR offset "${sector} * 1024")
+    file(READ ${DISK} got OFFSET ${offset} LIMIT ${n} HEX)
+    if(NOT got STREQUAL want)
+        message(FATAL_ERROR "${image} is not at sector ${sector}")
+    endif()
+endfunction()
+
+check(0 ${EXPECTED})
+check(5 ${RAW})
+check(9 ${PLACED_EXPECTED})
@@ -0,0 +1,22 @@
+# Assemble SOURCE with DASM and compare the image byte for byte with
+# EXPECTED, or the listing with FORMAT=listing.
+# Run as: cmake -DDASM=.. -DSOURCE=.. -DEXPECTED=.. -DOUTPUT=..
+#               [-DFLAGS=..] [-DFORMAT=..] -P golden.cmake
+separate_arguments(FLAGS)
+if(FORMAT STREQUAL "listing")
+    set(sink --listing=${OUTPUT})
+elseif(FORMAT)
+    set(sink -o ${FORMAT}:${OUTPUT})
+else()
+    set(sink -o ${OUTPUT})
+endif()
+execute_process(COMMAND ${DASM} ${FLAGS} ${sink} ${SOURCE}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} does not assemble")
+endif()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
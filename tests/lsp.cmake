@@ -0,0 +1,39 @@
+# Run the messages of SESSION, one per line, through DLSP on stdin and
+# compare its responses, one per line without their headers, with EXPECTED.
+# Run as: cmake -DDLSP=.. -DSESSION=.. -DEXPECTED=.. -DOUTPUT=.. -P lsp.cmake
+file(READ ${SESSION} session)
+set(framed "")
+# not a list: the messages are full of brackets and may hold semicolons
+while(NOT session STREQUAL "")
+    string(FIND "${session}" "\n" end)
+    if(end EQUAL -1)
+        string(LENGTH "${session}" end)
+    endif()
+    string(SUBSTRING "${session}" 0 ${end} msg)
+    math(EXPR end "${end} + 1")
+    string(LENGTH "${session}" len)
+    if(end GREATER len)
+        set(end ${len})
+    endif()
+    string(SUBSTRING "${session}" ${end} -1 session)
+    string(LENGTH "${msg}" len)
+    if(len GREATER 0)
+        string(APPEND framed "Content-Length: ${len}\r\n\r\n${msg}")
+    endif()
+endwhile()
+file(WRITE ${OUTPUT}.in "${framed}")
+execute_process(COMMAND ${DLSP} --stdio INPUT_FILE ${OUTPUT}.in
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${DLSP} exited with ${rc}")
+endif()
+# strings in the responses are escaped, so a newline ends one of them, and
+# the headers may have lost their carriage returns on the way
+string(REGEX REPLACE "Content-Length: [0-9]+\r?\n\r?\n" "\n" out "${out}")
+string(REGEX REPLACE "^\n" "" out "${out}")
+file(WRITE ${OUTPUT} "${out}\n")
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
@@ -0,0 +1,19 @@
+/* Generated by dasm from org.dasm */
+#ifndef DASM_ORG_H
+#define DASM_ORG_H
+
+#include <stdint.h>
+
+static const uint16_t org[] = {
+    0x7D40, 0x0040, 0x7F81, 0x0020, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0001, 0x0002, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x7C21, 0x0040, 0x0023, 0x7F81, 0x0023, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+    0xA401, 0x8560,
+};
+
+#endif
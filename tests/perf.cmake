@@ -0,0 +1,76 @@
+# Throughput gate for one corpus shape. Generates the corpus, times it with
+# dasm_bench (a warm-up, then RUNS runs, median, pinned to CPU) and compares the total
+# MB/s with the baseline of the shape. Fails when it is more than
+# THRESHOLD percent slower. With RECORD=1 the baseline is written instead.
+#
+# Run as: cmake -DCORPUS=.. -DBENCH=.. -DSHAPE=.. -DSIZE=.. -DRUNS=..
+#               -DCPU=.. -DBASELINE=.. -DTHRESHOLD=.. -DWORKDIR=..
+#               [-DRECORD=1] -P perf.cmake
+set(baseline)
+if(EXISTS ${BASELINE})
+    file(STRINGS ${BASELINE} lines REGEX "^${SHAPE} ")
+    if(lines MATCHES "^${SHAPE} ([0-9.]+)")
+        set(baseline ${CMAKE_MATCH_1})
+    endif()
+endif()
+if(NOT baseline AND NOT RECORD)
+    message("PERF SKIPPED: no baseline for ${SHAPE} in ${BASELINE}, "
+            "record one with 'make perf_baseline'")
+    return()
+endif()
+
+set(source ${WORKDIR}/${SHAPE}.dasm)
+if(NOT EXISTS ${source})
+    execute_process(COMMAND ${CORPUS} -k ${SHAPE} -s ${SIZE} -o ${source}
+            RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "Cannot generate the ${SHAPE} corpus")
+    endif()
+endif()
+execute_process(COMMAND ${BENCH} -w 1 -r ${RUNS} -m -c ${CPU} ${source}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE out)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "dasm_bench failed on ${source}")
+endif()
+if(NOT out MATCHES "phase=total [^\n]* mb_per_s=([0-9.]+)")
+    message(FATAL_ERROR "Unexpected dasm_bench output:\n${out}")
+endif()
+set(current ${CMAKE_MATCH_1})
+
+if(RECORD)
+    set(lines)
+    if(EXISTS ${BASELINE})
+        file(STRINGS ${BASELINE} old)
+        foreach(line ${old})
+            if(NOT line MATCHES "^${SHAPE} ")
+                list(APPEND lines "${line}")
+            endif()
+        endforeach()
+    endif()
+    list(APPEND lines "${SHAPE} ${current}")
+    list(SORT lines)
+    string(REPLACE ";" "\n" lines "${lines}")
+    file(WRITE ${BASELINE} "${lines}\n")
+    message(STATUS "${SHAPE}: baseline ${current} MB/s")
+    return()
+endif()
+
+# CMake has integer math only, compare in thousandths of MB/s
+macro(to_milli value var)
+    string(REGEX MATCH "^[0-9]+" int_part "${value}")
+    string(REGEX MATCH "\\.[0-9]+" frac_part "${value}")
+    if(NOT frac_part)
+        set(frac_part ".")
+    endif()
+    string(SUBSTRING "${frac_part}000" 1 3 frac_part)
+    math(EXPR ${var} "${int_part} * 1000 + ${frac_part}")
+endmacro()
+to_milli(${current} cur_milli)
+to_milli(${baseline} base_milli)
+math(EXPR floor_milli "${base_milli} * (100 - ${THRESHOLD}) / 100")
+message("${SHAPE}: ${current} MB/s, baseline ${baseline} MB/s, "
+        "allowed down to ${THRESHOLD}% slower")
+if(cur_milli LESS floor_milli)
+    message(FATAL_ERROR "${SHAPE} regressed: ${current} MB/s against a "
+            "baseline of ${baseline} MB/s")
+endif()
@@ -0,0 +1,39 @@
+# Assemble SOURCE after PRELUDE and compare the image with EXPECTED: once
+# building the prelude cache, once mapping it, and once more after the
+# prelude changed, which has to build it again. The prelude is copied to
+# WORKDIR so that its cache is written there.
+# Run as: cmake -DDASM=.. -DPRELUDE=.. -DSOURCE=.. -DEXPECTED=.. -DWORKDIR=..
+#               -P prelude.cmake
+set(copy ${WORKDIR}/prelude.dasm)
+file(MAKE_DIRECTORY ${WORKDIR})
+file(REMOVE ${copy}.dpch)
+file(READ ${PRELUDE} text)
+file(WRITE ${copy} "${text}")
+
+function(check run)
+    execute_process(COMMAND ${DASM} --prelude ${copy}
+            -o ${WORKDIR}/${run}.bin ${SOURCE} RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${SOURCE} does not assemble (${run})")
+    endif()
+    if(NOT EXISTS ${copy}.dpch)
+        message(FATAL_ERROR "No prelude cache after the ${run} run")
+    endif()
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files
+            ${WORKDIR}/${run}.bin ${EXPECTED} RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${WORKDIR}/${run}.bin differs from ${EXPECTED}")
+    endif()
+endfunction()
+
+check(cold)
+file(READ ${copy}.dpch built HEX)
+check(warm)
+# a comment changes the bytes of the prelude but not its words, the cache
+# has to be made again all the same
+file(APPEND ${copy} "; edited\n")
+check(edited)
+file(READ ${copy}.dpch rebuilt HEX)
+if(built STREQUAL rebuilt)
+    message(FATAL_ERROR "The prelude cache was not made again after an edit")
+endif()
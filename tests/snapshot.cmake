@@ -0,0 +1,55 @@
+# Run SOURCE in DEMU for 2 * CYCLES straight, and for CYCLES saving a
+# snapshot then CYCLES more from it, and check both end with the same
+# registers and byte for byte the same machine. Then run on from the
+# snapshot with -V, which restores it again page by page and must end the
+# same, and check that a truncated snapshot is turned down.
+# Run as: cmake -DDEMU=.. -DSOURCE=.. -DCYCLES=.. -DDIR=.. -P snapshot.cmake
+math(EXPR twice "${CYCLES} * 2")
+execute_process(COMMAND ${DEMU} -c ${twice} -w ${DIR}/straight.snap ${SOURCE}
+        RESULT_VARIABLE rc OUTPUT_VARIABLE straight)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} does not run")
+endif()
+execute_process(COMMAND ${DEMU} -c ${CYCLES} -w ${DIR}/half.snap ${SOURCE}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "No snapshot of ${SOURCE}")
+endif()
+
+execute_process(COMMAND ${DEMU} -c ${CYCLES} -w ${DIR}/resumed.snap
+            -l ${DIR}/half.snap
+        RESULT_VARIABLE rc OUTPUT_VARIABLE resumed)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${DIR}/half.snap does not resume")
+endif()
+if(NOT resumed STREQUAL straight)
+    message(FATAL_ERROR "Straight:\n${straight}resumed:\n${resumed}")
+endif()
+file(READ ${DIR}/straight.snap want HEX)
+file(READ ${DIR}/resumed.snap got HEX)
+if(NOT got STREQUAL want)
+    message(FATAL_ERROR "The resumed machine is not the one run straight")
+endif()
+
+execute_process(COMMAND ${DEMU} -c ${CYCLES} -V -l ${DIR}/half.snap
+        RESULT_VARIABLE rc OUTPUT_VARIABLE rerun ERROR_VARIABLE err)
+if(NOT rc EQUAL 0 OR NOT rerun STREQUAL straight)
+    message(FATAL_ERROR "The rerun from ${DIR}/half.snap differs:\n${err}")
+endif()
+if(NOT err MATCHES "rerun: ([0-9]+) of ([0-9]+) pages" OR
+   NOT CMAKE_MATCH_1 LESS CMAKE_MATCH_2)
+    message(FATAL_ERROR "The rerun did not restore page by page:\n${err}")
+endif()
+
+file(SIZE ${DIR}/half.snap size)
+math(EXPR size "${size} - 8")
+execute_process(COMMAND head -c ${size} ${DIR}/half.snap
+        OUTPUT_FILE ${DIR}/truncated.snap RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "Could not truncate ${DIR}/half.snap")
+endif()
+execute_process(COMMAND ${DEMU} -c ${CYCLES} -l ${DIR}/truncated.snap
+        RESULT_VARIABLE rc OUTPUT_QUIET ERROR_VARIABLE err)
+if(rc EQUAL 0 OR NOT err MATCHES "Not a snapshot")
+    message(FATAL_ERROR "A truncated snapshot was taken:\n${err}")
+endif()
@@ -0,0 +1,35 @@
+# Assemble SOURCE with --trace and check the trace is a Trace Event Format
+# JSON object with a complete span for each of tokenize, pass1 and pass2.
+# Needs cmake 3.19 for string(JSON).
+# Run as: cmake -DDASM=.. -DSOURCE=.. -DOUTPUT=.. -P trace.cmake
+cmake_minimum_required(VERSION 3.19)
+file(REMOVE ${OUTPUT})
+execute_process(COMMAND ${DASM} --trace ${OUTPUT} -o ${OUTPUT}.bin ${SOURCE}
+        RESULT_VARIABLE rc)
+if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} does not assemble with --trace")
+endif()
+file(READ ${OUTPUT} trace)
+string(JSON n ERROR_VARIABLE err LENGTH "${trace}" traceEvents)
+if(err)
+    message(FATAL_ERROR "${OUTPUT} is not a trace: ${err}")
+endif()
+
+set(spans "")
+math(EXPR last "${n} - 1")
+foreach(i RANGE ${last})
+    string(JSON ph GET "${trace}" traceEvents ${i} ph)
+    if(ph STREQUAL "X")
+        string(JSON name GET "${trace}" traceEvents ${i} name)
+        # ts and dur must be there, a missing member is an error
+        string(JSON ts GET "${trace}" traceEvents ${i} ts)
+        string(JSON dur GET "${trace}" traceEvents ${i} dur)
+        list(APPEND spans ${name})
+    endif()
+endforeach()
+foreach(name tokenize pass1 pass2)
+    list(FIND spans ${name} found)
+    if(found LESS 0)
+        message(FATAL_ERROR "No ${name} span in ${OUTPUT}: ${spans}")
+    endif()
+endforeach()
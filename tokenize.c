@@ -3,19 +3,21 @@
 //
 
 #include <ctype.h>
-#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "diag.h"
+#include "expr.h"
+#include "stats.h"
 #include "tokenize.h"
 
 #define DELIM_INLINE_WS         " \t"
 #define DELIM_ALL_WS            " \t\n"
 #define DELIM_OPERAND_END       " \t\n,"
-#define DELIM_INDIRECT_MID      " \t\n+"
+#define DELIM_INDIRECT_MID      " \t\n+-"
 #define DELIM_INDIRECT_END      " \t\n]"
 
-static struct opcode_tokens basic_opcodes[] = {
+struct opcode_tokens basic_opcodes[] = {
         //  {RESRV, resrv, 0x00},
         {"SET", "set", 0x01},
         {"ADD", "add", 0x02},
@@ -50,7 +52,7 @@ static struct opcode_tokens basic_opcodes[] = {
         {"STD", "std", 0x1f}
 };
 
-static struct opcode_tokens special_opcodes[] = {
+struct opcode_tokens special_opcodes[] = {
         //  {RESRV, resrv, 0x00},
         {"JSR", "jsr", 0x01},
         //  {RESRV, resrv, 0x02},
@@ -85,7 +87,7 @@ static struct opcode_tokens special_opcodes[] = {
         //  {RESRV, resrv, 0x1f}
 };
 
-static struct operand_tokens operands[] = {
+struct operand_tokens operands[] = {
         // Register
         {"A", "a", 0x00, ot_reg},
         {"B", "b", 0x01, ot_reg},
@@ -130,6 +132,12 @@ static struct operand_tokens operands[] = {
         {"", "", 0x1f, ot_literal}
 };
 
+const int basic_opcodes_count =
+        sizeof(basic_opcodes) / sizeof(struct opcode_tokens);
+const int special_opcodes_count =
+        sizeof(special_opcodes) / sizeof(struct opcode_tokens);
+const int operands_count = sizeof(operands) / sizeof(struct operand_tokens);
+
 // fetches the address of the token enclosing the label
 // Should only be used on labels which are part of a token.
 inline struct token *label_to_token(struct label *l) {
@@ -356,17 +364,76 @@ static inline int getif_label(struct assembler *a, struct token *tok,
     return 1;
 }
 
-// get a string if found
+/* A DAT list while it is being parsed */
+struct dat_list {
+    uint16_t     *dl_words;
+    uint64_t      dl_count;
+    uint64_t      dl_cap;
+    struct token *dl_refs;      /* lbl_off is the index of the word */
+    uint64_t      dl_nrefs;
+    uint64_t      dl_caprefs;
+};
+
+// Room for n more words. 0 on success, -1 on failure.
+static int dat_reserve(struct assembler *a, struct dat_list *dl, uint64_t n) {
+    uint16_t *grown;
+    uint64_t cap = dl->dl_cap ? dl->dl_cap : 8;
+    if (dl->dl_count + n <= dl->dl_cap) {
+        return 0;
+    }
+    while (cap < dl->dl_count + n) {
+        cap *= 2;
+    }
+    grown = realloc(dl->dl_words, sizeof(uint16_t) * cap);
+    if (!grown) {
+        LOGERROR("No more memory to store data words");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(uint16_t) * (cap - dl->dl_cap));
+    dl->dl_words = grown;
+    dl->dl_cap = cap;
+    return 0;
+}
+
+// Room for one more label reference. 0 on success, -1 on failure.
+static int dat_reserve_ref(struct assembler *a, struct dat_list *dl) {
+    struct token *grown;
+    uint64_t cap;
+    if (dl->dl_nrefs < dl->dl_caprefs) {
+        return 0;
+    }
+    cap = dl->dl_caprefs ? dl->dl_caprefs * 2 : 4;
+    grown = realloc(dl->dl_refs, sizeof(struct token) * cap);
+    if (!grown) {
+        LOGERROR("No more memory to store data labels");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct token) * (cap - dl->dl_caprefs));
+    dl->dl_refs = grown;
+    dl->dl_caprefs = cap;
+    return 0;
+}
+
+// get a string if found, a word per character, or two per word with
+// the first in the high byte when it is packed (p"...")
 // 1 on success, 0 on not found, -1 on error
-static inline int getif_string(struct assembler *a, struct token *t) {
-    uint64_t counter = 0;
-    char c, *s , *start;
+static inline int getif_dat_string(struct assembler *a, struct dat_list *dl) {
+    struct token t;
+    uint64_t counter = 0, i;
+    uint16_t *w;
+    char c, *s, *start;
+    int packed;
 
+    s = cur_ptr(a);
+    packed = (s[0] == 'p' || s[0] == 'P') && s[1] == '"';
     // check for valid string start delimiter
-    if (cur_char(a) != '"') {
+    if (!packed && s[0] != '"') {
         return 0;
     }
-    save_global_pos_tok(a, t);
+    save_global_pos_tok(a, &t);
+    if (packed) {
+        inc_char(a);
+    }
     inc_char(a);
     start = cur_ptr(a);
     // Now find a closing quote
@@ -381,17 +448,176 @@ static inline int getif_string(struct assembler *a, struct token *t) {
 
     // Check for end of file loop exit
     if (!cur_char(a)) {
-        ASMTOKERROR(a, t, "Unexpected end of file after string start");
+        ASMTOKERROR(a, (&t), "Unexpected end of file after string start");
         return -1;
     } else {
         // Go past closing " quote
         inc_char(a);
     }
 
-    // Finally fill up the token structure
-    t->type = tt_data;
-    t->ttu_dat = start;
-    t->tok_len = counter;
+    // Finally lay the characters out as words
+    if (dat_reserve(a, dl, packed ? (counter + 1) / 2 : counter) < 0) {
+        return -1;
+    }
+    w = dl->dl_words + dl->dl_count;
+    if (packed) {
+        for (i = 0; i + 1 < counter; i += 2) {
+            *w++ = (uint16_t) ((uint8_t) start[i] << 8 |
+                               (uint8_t) start[i + 1]);
+        }
+        if (i < counter) {
+            *w++ = (uint16_t) ((uint8_t) start[i] << 8);
+        }
+    } else {
+        for (i = 0; i < counter; ++i) {
+            *w++ = (uint8_t) start[i];
+        }
+    }
+    dl->dl_count = (uint64_t) (w - dl->dl_words);
+    return 1;
+}
+
+// get a label reference if found, a word that is filled in once the
+// label has an address
+// 1 on success, 0 on not found, -1 on error
+static inline int getif_dat_label(struct assembler *a, struct dat_list *dl) {
+    struct token *r;
+    char *s = cur_ptr(a);
+    uint64_t len;
+
+    if (!isalpha((unsigned char) s[0]) && s[0] != '_') {
+        return 0;
+    }
+    for (len = 1; isalnum((unsigned char) s[len]) || s[len] == '_'; ++len) {
+    }
+    if (dat_reserve(a, dl, 1) < 0 || dat_reserve_ref(a, dl) < 0) {
+        return -1;
+    }
+    r = &dl->dl_refs[dl->dl_nrefs++];
+    memset(r, 0, sizeof(*r));
+    save_global_pos_tok(a, r);
+    r->type = tt_label;
+    r->tok_len = len;
+    r->ttu_lab.lbl_name = s;
+    r->ttu_lab.lbl_len = len;
+    r->ttu_lab.lbl_state = ls_op_unresolved;
+    r->ttu_lab.lbl_off = dl->dl_count;
+    dl->dl_words[dl->dl_count++] = 0;
+    // labels hold no newline either
+    a->inp_offset += len;
+    a->inp_col += len;
+    return 1;
+}
+
+static inline int getif_number(struct assembler *a, long *num);
+
+// get a number if found
+// 1 on success, 0 on not found, -1 on error
+static inline int getif_dat_number(struct assembler *a, struct dat_list *dl) {
+    long num;
+    int rc = getif_number(a, &num);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (dat_reserve(a, dl, 1) < 0) {
+        return -1;
+    }
+    dl->dl_words[dl->dl_count++] = (uint16_t) num;
+    return 1;
+}
+
+// "x <count>" after an item lays its words out count times in all
+// 1 on success, 0 on not found, -1 on error
+static inline int getif_dat_repeat(struct assembler *a, struct dat_list *dl,
+                                   uint64_t word0, uint64_t ref0) {
+    uint64_t n, total, done, i, k, nrefs;
+    long count;
+    char *s = cur_ptr(a);
+    int rc;
+
+    // the x stands apart, 0x10 is a number
+    if (s[0] != ' ' && s[0] != '\t') {
+        return 0;
+    }
+    skip_inline_whitespaces(a);
+    s = cur_ptr(a);
+    if ((s[0] != 'x' && s[0] != 'X') || (s[1] != ' ' && s[1] != '\t')) {
+        return 0;
+    }
+    inc_char(a);
+    skip_inline_whitespaces(a);
+    if ((rc = getif_number(a, &count)) <= 0) {
+        if (rc == 0) {
+            ASMERROR(a, "Expected a repeat count after x");
+        }
+        return -1;
+    }
+    if (count < 1) {
+        ASMERROR(a, "Repeat count must be at least 1");
+        return -1;
+    }
+    n = dl->dl_count - word0;
+    total = n * (uint64_t) count;
+    if (dat_reserve(a, dl, total - n) < 0) {
+        return -1;
+    }
+    // double what is there until it is all there
+    for (done = n; done < total; done += i) {
+        i = total - done < done ? total - done : done;
+        memcpy(dl->dl_words + word0 + done, dl->dl_words + word0,
+               sizeof(uint16_t) * i);
+    }
+    dl->dl_count = word0 + total;
+    nrefs = dl->dl_nrefs - ref0;
+    for (k = 1; nrefs && k < (uint64_t) count; ++k) {
+        for (i = 0; i < nrefs; ++i) {
+            if (dat_reserve_ref(a, dl) < 0) {
+                return -1;
+            }
+            dl->dl_refs[dl->dl_nrefs] = dl->dl_refs[ref0 + i];
+            dl->dl_refs[dl->dl_nrefs++].ttu_lab.lbl_off += n * k;
+        }
+    }
+    return 1;
+}
+
+// get the items of a DAT, separated by commas: numbers, labels, strings
+// and packed strings, each optionally repeated. They all become the words
+// of one token.
+// 1 on success, -1 on error
+static inline int getif_dat_list(struct assembler *a, struct token *t) {
+    struct dat_list dl;
+    uint64_t word0, ref0;
+    int rc;
+
+    memset(&dl, 0, sizeof(dl));
+    save_global_pos_tok(a, t);
+    for (;;) {
+        word0 = dl.dl_count;
+        ref0 = dl.dl_nrefs;
+        if ((rc = getif_dat_string(a, &dl)) == 0 &&
+            (rc = getif_dat_number(a, &dl)) == 0 &&
+            (rc = getif_dat_label(a, &dl)) == 0) {
+            ASMERROR(a, "Expected a number, string or label in DAT");
+        }
+        if (rc <= 0 || getif_dat_repeat(a, &dl, word0, ref0) < 0) {
+            free(dl.dl_words);
+            free(dl.dl_refs);
+            return -1;
+        }
+        skip_inline_whitespaces(a);
+        if (cur_char(a) != ',') {
+            break;
+        }
+        inc_char(a);
+        skip_inline_whitespaces(a);
+    }
+
+    t->type = tt_words;
+    t->ttu_wrd = dl.dl_words;
+    t->ttu_refs = dl.dl_refs;
+    t->ttu_nrefs = dl.dl_nrefs;
+    t->tok_len = dl.dl_count;
     return 1;
 }
 
@@ -411,46 +637,518 @@ static inline int getif_data(struct assembler *a, struct token *t) {
             ASMTOKERROR(a, t, "Unexpected newline while searching for data");
             return -1;
         }
-        // See if it is a string?
-        return  getif_string(a, t);
+        return getif_dat_list(a, t);
     } else {
         // No DAT token, so not data...
         return 0;
     }
 }
 
-// extract a number from the current position if found
-// 0 if not a number, 1 on success, < 0 on error
+// get an .org <address>, .reserve <words> or .pin directive if found
+// 1 on success, 0 if not a directive, -1 on error
+static inline int getif_directive(struct assembler *a, struct token *t) {
+    long num;
+    int rc;
+    if (cur_char(a) != '.') {
+        return 0;
+    }
+    save_global_pos_tok(a, t);
+    if (strcmp_token(a, ".pin", DELIM_ALL_WS) >= 0 ||
+        strcmp_token(a, ".PIN", DELIM_ALL_WS) >= 0) {
+        t->type = tt_pin;
+        t->tok_len = go_past_cur_token(a);
+        return 1;
+    } else if (strcmp_token(a, ".org", DELIM_ALL_WS) >= 0 ||
+        strcmp_token(a, ".ORG", DELIM_ALL_WS) >= 0) {
+        t->type = tt_org;
+    } else if (strcmp_token(a, ".reserve", DELIM_ALL_WS) >= 0 ||
+               strcmp_token(a, ".RESERVE", DELIM_ALL_WS) >= 0) {
+        t->type = tt_reserve;
+    } else {
+        ASMTOKERROR(a, t, "Unknown directive");
+        return -1;
+    }
+    go_past_cur_token_delim(a, DELIM_INLINE_WS);
+    skip_inline_whitespaces(a);
+    if ((rc = getif_number(a, &num)) <= 0) {
+        if (rc == 0) {
+            ASMERROR(a, t->type == tt_org ? "Expected an address after .org" :
+                        "Expected a number of words after .reserve");
+        }
+        return -1;
+    }
+    t->ttu_num = (uint64_t) num;
+    t->tok_len = a->inp_offset - t->tok_pos;
+    return 1;
+}
+
+// Value plus one of every character as a digit, 0 if it is none
+static const uint8_t digit_value[256] = {
+        ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+        ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+        ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+        ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#define NUM_MAX 0xffff
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NUM_SWAR 1
+// Bytes of x (all below 0x80) strictly between m and n get their top bit
+#define SWAR_BETWEEN(x, m, n) \
+    ((0x01010101u * (127 + (n)) - ((x) & 0x7f7f7f7fu)) & ~(x) & \
+     (((x) & 0x7f7f7f7fu) + 0x01010101u * (127 - (m))) & 0x80808080u)
+
+// Four decimal digits at s in one go. 1 and their value, or 0.
+static inline int swar_dec4(const char *s, uint32_t *value) {
+    uint32_t x;
+    memcpy(&x, s, 4);
+    if ((x & 0xf0f0f0f0u) != 0x30303030u ||
+            ((x + 0x06060606u) & 0xf0f0f0f0u) != 0x30303030u) {
+        return 0;
+    }
+    x -= 0x30303030u;
+    // the first character is the lowest byte
+    x = (x * 10 + (x >> 8)) & 0x00ff00ffu;
+    *value = (x & 0xff) * 100 + (x >> 16);
+    return 1;
+}
+
+// Four hexadecimal digits at s in one go. 1 and their value, or 0.
+static inline int swar_hex4(const char *s, uint32_t *value) {
+    uint32_t x, digits, letters;
+    memcpy(&x, s, 4);
+    if (x & 0x80808080u) {
+        return 0;
+    }
+    digits = SWAR_BETWEEN(x, 0x2f, 0x3a);
+    letters = SWAR_BETWEEN(x | 0x20202020u, 0x60, 0x67);
+    if ((digits | letters) != 0x80808080u) {
+        return 0;
+    }
+    // a letter's low nibble is 1..6, add 9
+    x = (x & 0x0f0f0f0fu) + (letters >> 7) * 9;
+    x = ((x & 0x000f000fu) << 4) | ((x & 0x0f000f00u) >> 8);
+    *value = ((x & 0xff) << 8) | ((x >> 16) & 0xff);
+    return 1;
+}
+#endif
+
+// Digits of the given base from s on, stopping at the first character
+// that is not one. Returns how many were used; *overflow is set once the
+// value passes NUM_MAX.
+static inline uint64_t parse_digits(const char *s, const char *end,
+                                    uint32_t base, uint32_t *value,
+                                    int *overflow) {
+    const char *p = s;
+    uint32_t v = 0, d, chunk;
+#ifdef NUM_SWAR
+    if (end - p >= 4 && (base == 10 || base == 16) &&
+            (base == 10 ? swar_dec4(p, &chunk) : swar_hex4(p, &chunk))) {
+        v = chunk;
+        p += 4;
+    }
+#else
+    (void) end;
+    (void) chunk;
+#endif
+    while ((d = digit_value[(uint8_t) *p] - 1u) < base) {
+        if (v <= NUM_MAX) {
+            v = v * base + d;
+        }
+        ++p;
+    }
+    if (v > NUM_MAX) {
+        *overflow = 1;
+    }
+    *value = v;
+    return (uint64_t) (p - s);
+}
+
+// A character literal at s, 'c' or one of '\n' '\t' '\r' '\0' '\\' '\''.
+// Returns its length, or 0 if it is not well formed.
+static inline uint64_t parse_char(const char *s, uint32_t *value) {
+    if (s[1] == '\\') {
+        switch (s[2]) {
+            case 'n':  *value = '\n'; break;
+            case 't':  *value = '\t'; break;
+            case 'r':  *value = '\r'; break;
+            case '0':  *value = 0;    break;
+            case '\\': *value = '\\'; break;
+            case '\'': *value = '\''; break;
+            default:
+                return 0;
+        }
+        return s[3] == '\'' ? 4 : 0;
+    }
+    if (s[1] < ' ' || s[1] > '~' || s[1] == '\'' || s[2] != '\'') {
+        return 0;
+    }
+    *value = (uint8_t) s[1];
+    return 3;
+}
+
+// extract a number from the current position if found, and go past it.
+// Decimal, 0x hexadecimal, 0b binary, 0 octal or a 'c' character, up to
+// 16 bits. 0 if not a number, 1 on success, < 0 on error
 static inline int getif_number(struct assembler *a, long *num) {
-    long number;
-    char *s;
-    if (cur_char(a) < '0' || cur_char(a) > '9') {
+    const char *s = cur_ptr(a), *end = a->input + a->inp_size;
+    uint32_t value = 0, base = 10;
+    uint64_t len, prefix = 0;
+    int overflow = 0;
+
+    if (*s == '\'') {
+        len = parse_char(s, &value);
+        if (!len) {
+            ASMERROR(a, "Invalid character literal");
+            return -1;
+        }
+    } else if (*s >= '0' && *s <= '9') {
+        if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+            base = 16;
+            prefix = 2;
+        } else if (s[0] == '0' && (s[1] == 'b' || s[1] == 'B')) {
+            base = 2;
+            prefix = 2;
+        } else if (s[0] == '0' && s[1] >= '0' && s[1] <= '9') {
+            base = 8;
+            prefix = 1;
+        }
+        len = parse_digits(s + prefix, end, base, &value, &overflow);
+        if (prefix == 2 && !len) {
+            ASMERROR(a, base == 16 ? "Invalid hexadecimal number" :
+                        "Invalid binary number");
+            return -1;
+        }
+        len += prefix;
+    } else {
         /* Not a number */
         return 0;
     }
-    // we have a number
-    s = cur_ptr(a);
-    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
-        number = strtol(s, NULL, 16);
-        if (number == LONG_MAX && errno != 0) {
-            ASMERROR(a, "Invalid hexadecimal number");
+    // whatever follows must end the number
+    if (isalnum((unsigned char) s[len]) || s[len] == '_' || s[len] == '\'') {
+        ASMERROR(a, base == 16 ? "Invalid hexadecimal number" :
+                    base == 8 ? "Invalid octal number" :
+                    base == 2 ? "Invalid binary number" :
+                    "Invalid decimal number");
+        return -1;
+    }
+    if (overflow) {
+        ASMERROR(a, "Number does not fit in 16 bits");
+        return -1;
+    }
+    // numbers hold no newline, so the column moves along with them
+    a->inp_offset += len;
+    a->inp_col += len;
+    *num = (long) value;
+    return 1;
+}
+
+/* An operand expression while it is being read, see expr.h */
+struct expr_parse {
+    struct expr_item ep_item[EXPR_MAX_ITEMS];
+    uint32_t         ep_count;
+    uint32_t         ep_labels;
+    uint32_t         ep_depth;
+    int              ep_reg_ok;  /* May end in + register, see get_expr() */
+    struct operand_tokens *ep_reg;
+};
+
+// The binary operator at s, past inline whitespace, and its length in
+// *len. eo_num if there is none.
+static inline enum expr_op peek_operator(const char *s, uint64_t *len) {
+    while (*s == ' ' || *s == '\t') {
+        ++s;
+    }
+    *len = 1;
+    switch (*s) {
+        case '*': return eo_mul;
+        case '/': return eo_div;
+        case '%': return eo_mod;
+        case '+': return eo_add;
+        case '-': return eo_sub;
+        case '&': return eo_and;
+        case '^': return eo_xor;
+        case '|': return eo_or;
+        case '<':
+        case '>':
+            if (s[1] != s[0]) {
+                return eo_num;
+            }
+            *len = 2;
+            return s[0] == '<' ? eo_shl : eo_shr;
+        default:
+            return eo_num;
+    }
+}
+
+// Binding of a binary operator, higher binds tighter
+static inline int precedence(enum expr_op op) {
+    switch (op) {
+        case eo_mul: case eo_div: case eo_mod: return 5;
+        case eo_add: case eo_sub:              return 4;
+        case eo_shl: case eo_shr:              return 3;
+        case eo_and:                           return 2;
+        case eo_xor:                           return 1;
+        default:                               return 0;
+    }
+}
+
+// Register names are no labels
+static inline int is_register(const char *s, uint64_t len) {
+    int i;
+    for (i = 0; i < operands_count; ++i) {
+        if ((operands[i].type == ot_reg ||
+             operands[i].type == ot_reg_literal) &&
+            strlen(operands[i].caps) == len &&
+            (!strncmp(s, operands[i].caps, len) ||
+             !strncmp(s, operands[i].nocaps, len))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The [register + literal] entry of the register at s, when ']' is all
+// that comes after it. NULL if there is none.
+static struct operand_tokens *register_last(const char *s) {
+    uint64_t len;
+    int i;
+    for (len = 0; isalnum((unsigned char) s[len]); ++len) {
+    }
+    for (i = 0; i < operands_count; ++i) {
+        if (operands[i].type == ot_ind_reg_literal &&
+            strlen(operands[i].caps) == len &&
+            (!strncmp(s, operands[i].caps, len) ||
+             !strncmp(s, operands[i].nocaps, len))) {
+            break;
+        }
+    }
+    if (i == operands_count) {
+        return NULL;
+    }
+    for (s += len; *s == ' ' || *s == '\t'; ++s) {
+    }
+    return *s == ']' ? &operands[i] : NULL;
+}
+
+static inline struct expr_item *expr_put(struct assembler *a,
+                                         struct expr_parse *ep,
+                                         enum expr_op op,
+                                         uint64_t row, uint64_t col) {
+    struct expr_item *it;
+    if (ep->ep_count == EXPR_MAX_ITEMS) {
+        asm_error(a, row, col, "Expression is too long");
+        return NULL;
+    }
+    it = &ep->ep_item[ep->ep_count++];
+    it->ei_op = op;
+    it->ei_len = 0;
+    it->ei_row = row;
+    it->ei_col = col;
+    return it;
+}
+
+// Append an operator, or apply it right away to the numbers it takes.
+// 0 on success, -1 on error.
+static int expr_operator(struct assembler *a, struct expr_parse *ep,
+                         enum expr_op op, uint64_t row, uint64_t col) {
+    struct expr_item *y = &ep->ep_item[ep->ep_count - 1], *x;
+    const char *err = NULL;
+    int rc = 1;
+    // a number last is all of its operand, it takes one item then
+    if (expr_unary(op)) {
+        if (y->ei_op == eo_num) {
+            rc = expr_apply(op, y->ei_num, 0, &y->ei_num, &err);
+        }
+    } else if (y->ei_op == eo_num && (x = y - 1)->ei_op == eo_num) {
+        rc = expr_apply(op, x->ei_num, y->ei_num, &x->ei_num, &err);
+        ep->ep_count--;
+    }
+    if (rc < 0) {
+        asm_error(a, row, col, err);
+        return -1;
+    }
+    return rc == 0 || expr_put(a, ep, op, row, col) ? 0 : -1;
+}
+
+static int expr_binary(struct assembler *a, struct expr_parse *ep, int min);
+
+// A number, a label, or an expression in parentheses, after any unary
+// operators. 1 on success, 0 at a register before anything else, -1 on
+// error.
+static int expr_unary_term(struct assembler *a, struct expr_parse *ep) {
+    struct expr_item *it;
+    char *s = cur_ptr(a);
+    uint64_t row = a->inp_row, col = a->inp_col, len;
+    long num;
+    int rc;
+
+    if (*s == '-' || *s == '~' || *s == '+' || *s == '(') {
+        if (++ep->ep_depth > EXPR_MAX_DEPTH) {
+            ASMERROR(a, "Expression is nested too deeply");
             return -1;
         }
-    } else if (s[0] == '0' && isdigit(s[1])) {
-        number = strtol(s, NULL, 8);
-        if (number == LONG_MAX && errno != 0) {
-            ASMERROR(a, "Invalid octal number");
+        inc_char(a);
+        skip_inline_whitespaces(a);
+        rc = *s == '(' ? expr_binary(a, ep, 0) : expr_unary_term(a, ep);
+        if (rc <= 0) {
+            return rc;
+        }
+        ep->ep_depth--;
+        if (*s == '(') {
+            skip_inline_whitespaces(a);
+            if (cur_char(a) != ')') {
+                ASMERROR(a, "Expected ')' in an expression");
+                return -1;
+            }
+            inc_char(a);
+        } else if (*s != '+' &&
+                   expr_operator(a, ep, *s == '-' ? eo_neg : eo_not,
+                                 row, col) < 0) {
             return -1;
         }
-    } else {
-        number = strtol(s, NULL, 10);
-        if (number == LONG_MAX && errno != 0) {
-            ASMERROR(a, "Invalid decimal number");
+        return 1;
+    }
+    if ((rc = getif_number(a, &num)) != 0) {
+        if (rc < 0 || !(it = expr_put(a, ep, eo_num, row, col))) {
             return -1;
         }
+        it->ei_num = num;
+        return 1;
+    }
+    if (!isalpha((unsigned char) *s) && *s != '_') {
+        ASMERROR(a, "Expected a number, label or '(' in an expression");
+        return -1;
+    }
+    for (len = 1; isalnum((unsigned char) s[len]) || s[len] == '_'; ++len) {
+    }
+    // [A + 1], [--SP] and the like are for the operand table
+    if (is_register(s, len)) {
+        if (!ep->ep_count) {
+            return 0;
+        }
+        ASMERROR(a, "Register in an expression, only [register + "
+                    "expression] or [expression + register] takes one");
+        return -1;
+    }
+    if (!(it = expr_put(a, ep, eo_label, row, col))) {
+        return -1;
     }
-    // We have a number, and we know what it is..
-    *num = number;
+    it->ei_name = s;
+    it->ei_len = (uint32_t) len;
+    ep->ep_labels++;
+    // labels hold no newline
+    a->inp_offset += len;
+    a->inp_col += len;
+    return 1;
+}
+
+// Operands joined by binary operators that bind at least as tight as min.
+// 1 on success, 0 at a register before anything else, -1 on error.
+static int expr_binary(struct assembler *a, struct expr_parse *ep, int min) {
+    enum expr_op op;
+    uint64_t len, row, col;
+    int rc;
+
+    if ((rc = expr_unary_term(a, ep)) <= 0) {
+        return rc;
+    }
+    while ((op = peek_operator(cur_ptr(a), &len)) != eo_num &&
+           precedence(op) >= min) {
+        skip_inline_whitespaces(a);
+        row = a->inp_row;
+        col = a->inp_col;
+        a->inp_offset += len;
+        a->inp_col += len;
+        skip_inline_whitespaces(a);
+        // [expression + register] is [register + expression]
+        if (op == eo_add && !min && !ep->ep_depth && ep->ep_reg_ok &&
+            (ep->ep_reg = register_last(cur_ptr(a)))) {
+            len = strlen(ep->ep_reg->caps);
+            a->inp_offset += len;
+            a->inp_col += len;
+            return 1;
+        }
+        // the right operand takes only what binds tighter
+        if ((rc = expr_binary(a, ep, precedence(op) + 1)) <= 0) {
+            return rc;
+        }
+        if (expr_operator(a, ep, op, row, col) < 0) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// Read an expression into opd: its value when it folds to a number, the
+// expression otherwise. neg negates it, for [reg - expr]. With reg it may
+// end in + register before the ']', whose [register + literal] entry goes
+// to *reg, NULL when it does not.
+// 1 on success, 0 if it names a register, -1 on error
+static int get_expr(struct assembler *a, struct operand *opd, int neg,
+                    struct operand_tokens **reg) {
+    struct expr_parse ep;
+    struct expr *e;
+    struct token start;
+    uint64_t len;
+    int64_t value;
+    long num;
+    int rc;
+
+    save_global_pos_tok(a, &start);
+    if (reg) {
+        *reg = NULL;
+    }
+    // a number alone is the common case, and needs nothing more
+    if (!neg && (rc = getif_number(a, &num)) != 0) {
+        if (rc < 0) {
+            return -1;
+        }
+        if (peek_operator(cur_ptr(a), &len) == eo_num) {
+            opd->opd_literal_val = num;
+            opd->opd_expr = NULL;
+            return 1;
+        }
+        restore_global_pos_tok(a, &start);
+    }
+    ep.ep_count = ep.ep_labels = ep.ep_depth = 0;
+    ep.ep_reg_ok = reg != NULL;
+    ep.ep_reg = NULL;
+    if ((rc = expr_binary(a, &ep, 0)) <= 0) {
+        return rc;
+    }
+    if (ep.ep_reg) {
+        *reg = ep.ep_reg;
+    }
+    if (neg && expr_operator(a, &ep, eo_neg, start.tok_row,
+                             start.tok_col) < 0) {
+        return -1;
+    }
+    if (ep.ep_count == 1 && ep.ep_item[0].ei_op == eo_num) {
+        value = ep.ep_item[0].ei_num;
+        if (value < -0x8000 || value > 0xffff) {
+            ASMTOKERROR(a, (&start), "Expression does not fit in 16 bits");
+            return -1;
+        }
+        opd->opd_literal_val = (long) value;
+        opd->opd_expr = NULL;
+        return 1;
+    }
+    e = malloc(sizeof(struct expr) + sizeof(struct expr_item) * ep.ep_count);
+    if (!e) {
+        LOGERROR("No more memory for an expression");
+        return -1;
+    }
+    ASM_STAT(a, ac_bytes,
+             sizeof(struct expr) + sizeof(struct expr_item) * ep.ep_count);
+    e->ex_row = start.tok_row;
+    e->ex_col = start.tok_col;
+    e->ex_count = ep.ep_count;
+    e->ex_labels = ep.ep_labels;
+    memcpy(e->ex_item, ep.ep_item, sizeof(struct expr_item) * ep.ep_count);
+    opd->opd_literal_val = 0;
+    opd->opd_expr = e;
     return 1;
 }
 
@@ -530,8 +1228,7 @@ static inline int getif_ind_reg_literal(struct assembler *a,
                                         struct operand_tokens *ot,
                                         struct token *t) {
     char *start, *end;
-    int rc;
-    long num;
+    int rc, minus;
 
     // check for indirection start parenthesis
     if (cur_char(a) != '[') {
@@ -565,12 +1262,19 @@ static inline int getif_ind_reg_literal(struct assembler *a,
     } else if (cur_char(a) == '\n') {
         ASMERROR(a, "Unexpected new line while searching for a '+'");
         return -1;
-    } else if (cur_char(a) != '+') {
+    } else if (cur_char(a) != '+' && cur_char(a) != '-') {
         ASMERROR(a, "Unexpected character while searching for a '+'");
+        return -1;
     }
+    minus = cur_char(a) == '-';
     inc_char(a);
+    // [SP++] is an indirect register
+    if (!minus && cur_char(a) == '+') {
+        restore_global_pos_tok(a, t);
+        return 0;
+    }
 
-    // see if we can get a number..
+    // see if we can get a number, or an expression..
     skip_inline_whitespaces(a);
     if (!cur_char(a)) {
         ASMERROR(a, "Unexpected end of file while searching for a number");
@@ -579,13 +1283,14 @@ static inline int getif_ind_reg_literal(struct assembler *a,
         ASMERROR(a, "Unexpected new line while searching for a number");
         return -1;
     }
-    rc = getif_number(a, &num);
+    rc = get_expr(a, &t->ttu_opd, minus, NULL);
     if (rc <= 0) {
         // not a number..
         restore_global_pos_tok(a, t);
         return rc;
     }
-    go_past_cur_token_delim(a, DELIM_INDIRECT_END);
+    // from here on the statement releases the expression on an error
+    t->type = tt_operand;
 
     // find indirection close paren...
     skip_inline_whitespaces(a);
@@ -597,15 +1302,14 @@ static inline int getif_ind_reg_literal(struct assembler *a,
         return -1;
     } else if (cur_char(a) != ']') {
         ASMERROR(a, "Unexpected character while searching for ']'");
+        return -1;
     }
     inc_char(a);
     end = cur_ptr(a);
 
     // ok we encountered a indirect register, fill up the token
-    t->type = tt_operand;
     t->ttu_opd.opd_type = ot->type;
     t->ttu_opd.opd_opcode_val = ot->value;
-    t->ttu_opd.opd_literal_val = num;
     t->tok_len = end - start;
     // done
     return 1;
@@ -616,7 +1320,6 @@ static inline int getif_reg_literal(struct assembler *a,
                                     struct token *t) {
     char *start, *end;
     int rc;
-    long num;
 
     start = cur_ptr(a);
     save_global_pos_tok(a, t);
@@ -637,7 +1340,7 @@ static inline int getif_reg_literal(struct assembler *a,
     }
     go_past_cur_token(a);
 
-    // see if we can get a number..
+    // see if we can get a number, or an expression..
     skip_inline_whitespaces(a);
     if (!cur_char(a)) {
         ASMERROR(a, "Unexpected end of file while searching for number");
@@ -646,13 +1349,12 @@ static inline int getif_reg_literal(struct assembler *a,
         ASMERROR(a, "Unexpected new line while searching for a number");
         return -1;
     }
-    rc = getif_number(a, &num);
+    rc = get_expr(a, &t->ttu_opd, 0, NULL);
     if (rc <= 0) {
         // not a number..
         restore_global_pos_tok(a, t);
         return rc;
     }
-    go_past_cur_token_delim(a, DELIM_OPERAND_END);
 
     end = cur_ptr(a);
 
@@ -660,7 +1362,6 @@ static inline int getif_reg_literal(struct assembler *a,
     t->type = tt_operand;
     t->ttu_opd.opd_type = ot->type;
     t->ttu_opd.opd_opcode_val = ot->value;
-    t->ttu_opd.opd_literal_val = num;
     t->tok_len = end - start;
     // done
     return 1;
@@ -669,7 +1370,7 @@ static inline int getif_reg_literal(struct assembler *a,
 static inline int getif_ind_literal(struct assembler *a,
                                     struct operand_tokens *ot,
                                     struct token *t) {
-    long num;
+    struct operand_tokens *reg;
     int rc;
     char *start, *end;
 
@@ -690,13 +1391,14 @@ static inline int getif_ind_literal(struct assembler *a,
         ASMERROR(a, "Unexpected new line while searching for a number");
         return -1;
     }
-    rc = getif_number(a, &num);
+    // a number, a label or an expression, [A] and the like are not
+    rc = get_expr(a, &t->ttu_opd, 0, &reg);
     if (rc <= 0) {
-        // not a number..
         restore_global_pos_tok(a, t);
         return rc;
     }
-    go_past_cur_token_delim(a, DELIM_INDIRECT_END);
+    // from here on the statement releases the expression on an error
+    t->type = tt_operand;
 
     // skip whitespaces.. check for correct closing of parenthesis
     skip_inline_whitespaces(a);
@@ -708,15 +1410,16 @@ static inline int getif_ind_literal(struct assembler *a,
         return -1;
     } else if (cur_char(a) != ']') {
         ASMERROR(a, "Unexpected character while searching for ']'");
+        return -1;
     }
     inc_char(a);
     end = cur_ptr(a);
 
-    // ok we encountered a indirect literal, fill up the token
-    t->type = tt_operand;
+    // ok we encountered a indirect literal, fill up the token, or
+    // [literal + register] it turned out to be
+    ot = reg ? reg : ot;
     t->ttu_opd.opd_type = ot->type;
     t->ttu_opd.opd_opcode_val = ot->value;
-    t->ttu_opd.opd_literal_val = num;
     t->tok_len = end - start;
     // done
     return 1;
@@ -725,17 +1428,32 @@ static inline int getif_ind_literal(struct assembler *a,
 static inline int getif_literal(struct assembler *a,
                                 struct operand_tokens *ot,
                                 struct token *t) {
-    long num;
-    int rc = getif_number(a, &num);
+    char *s = cur_ptr(a);
+    uint64_t len;
+    int rc;
+    if (isalpha((unsigned char) *s) || *s == '_') {
+        // a label alone is a label operand, with an operator after it
+        // it starts an expression
+        for (len = 1; isalnum((unsigned char) s[len]) || s[len] == '_';
+             ++len) {
+        }
+        if (peek_operator(s + len, &len) == eo_num) {
+            return 0;
+        }
+    } else if (!isdigit((unsigned char) *s) && *s != '\'' && *s != '(' &&
+               *s != '-' && *s != '~' && *s != '+') {
+        return 0;
+    }
+    save_global_pos_tok(a, t);
+    rc = get_expr(a, &t->ttu_opd, 0, NULL);
     if (rc <= 0) {
+        restore_global_pos_tok(a, t);
         return rc;
     } else {
-        save_global_pos_tok(a, t);
         t->type = tt_operand;
         t->ttu_opd.opd_type = ot->type;
         t->ttu_opd.opd_opcode_val = ot->value;
-        t->ttu_opd.opd_literal_val = num;
-        t->tok_len = go_past_cur_token_delim(a, DELIM_OPERAND_END);
+        t->tok_len = a->inp_offset - t->tok_pos;
         return 1;
     }
 }
@@ -749,6 +1467,7 @@ static inline int append_to_unresolved_labels(struct assembler *a,
     switch (l->lbl_state) {
         case ls_op_unresolved:
         case ls_op_resolved:
+            ASM_STAT(a, ac_label_refs, 1);
             if (a->label_ops.tail) {
                 a->label_ops.tail->next = l;
                 a->label_ops.tail = l;
@@ -761,6 +1480,7 @@ static inline int append_to_unresolved_labels(struct assembler *a,
             // First check for duplicate labels
             found = 0;
             for (cur = a->label_pts.head; cur; cur = cur->next) {
+                ASM_STAT(a, ac_probes, 1);
                 // easy check on label lengths
                 if (l->lbl_len != cur->lbl_len) {
                     continue;
@@ -779,11 +1499,13 @@ static inline int append_to_unresolved_labels(struct assembler *a,
                 char err_str[256];
                 struct token *t2 = label_to_token(cur);
                 snprintf(err_str, 256, "Found duplicate label at (%llu:%llu)",
-                         t2->tok_row, t2->tok_col);
+                         (unsigned long long) t2->tok_row + 1,
+                         (unsigned long long) t2->tok_col + 1);
                 ASMTOKERROR(a, tok, err_str);
                 return -1;
             }
             // No duplicates, append this
+            ASM_STAT(a, ac_labels, 1);
             if (a->label_pts.tail) {
                 a->label_pts.tail->next = l;
                 a->label_pts.tail = l;
@@ -854,9 +1576,8 @@ static inline int getif_operand(struct assembler *a, struct token *t) {
     if (rc < 0) {
         return rc;
     } else if (rc > 0) {
-        // if able to append correctly return 1 as everything succeeded
-        // if not return -1 to halt assembling the code.
-        return !append_to_unresolved_labels(a, t) ? 1 : -1;
+        // the caller files the label once the statement is complete
+        return 1;
     }
     // not an operand
     return 0;
@@ -910,7 +1631,15 @@ static inline int getif_special_opcode(struct assembler *a, struct token *t) {
     return 1;
 }
 
-static inline struct token *get_token() {
+static inline struct token *get_token(struct assembler *a) {
+    struct token *t = a->tok_pool;
+    ASM_STAT(a, ac_tokens, 1);
+    if (t) {
+        a->tok_pool = t->next;
+        memset(t, 0, sizeof(*t));
+        return t;
+    }
+    ASM_STAT(a, ac_bytes, sizeof(struct token));
     return calloc(1, sizeof(struct token));
 }
 
@@ -923,187 +1652,194 @@ static inline void append_to_token_list(struct assembler *a, struct token *t) {
     }
 }
 
-int construct_tokens(struct assembler *a) {
+// Read the operand of an opcode into t, with the checks on what precedes
+// it. 1 on success, -1 on error.
+static inline int get_opcode_operand(struct assembler *a, struct token *t,
+                                     const char *missing) {
     int rc;
-    struct token *t, *t1, *t2;
-    /* Start parsing */
-    while (!is_end_of_file(a)) {
-        /* Skip all whitespaces and comments */
-        skip_whitespaces_and_comments(a);
-        if (is_end_of_file(a)) {
-            break;
-        }
+    // skip inline whitespace, check for end of file/newline
+    skip_inline_whitespaces(a);
+    if (!cur_char(a)) {
+        ASMERROR(a, "Unexpected end of file while searching "
+                "for an operand");
+        return -1;
+    } else if (cur_char(a) == '\n') {
+        ASMERROR(a, "Unexpected new line while searching "
+                "for an operand");
+        return -1;
+    }
+    rc = getif_operand(a, t);
+    if (rc == 0) {
+        ASMERROR(a, missing);
+        return -1;
+    }
+    return rc < 0 ? -1 : 1;
+}
 
-        t = get_token();
-        if (!t) {
-            LOGERROR("No more memory to allocate basic token");
+// tok_statement(), leaving what it read to it on an error
+static int read_statement(struct assembler *a, struct token st[3]) {
+    int rc;
+    /* Skip all whitespaces and comments */
+    skip_whitespaces_and_comments(a);
+    if (is_end_of_file(a)) {
+        return 0;
+    }
+    // search for labels with ':' prefixed only...
+    if ((rc = getif_label(a, &st[0], 1)) != 0) {
+        return rc < 0 ? -1 : 1;
+    } else if ((rc = getif_data(a, &st[0])) != 0) {
+        return rc < 0 ? -1 : 1;
+    } else if ((rc = getif_directive(a, &st[0])) != 0) {
+        return rc < 0 ? -1 : 1;
+    } else if ((rc = getif_basic_opcode(a, &st[0])) != 0) {
+        if (rc < 0) {
+            return -1;
+        }
+        // First operand
+        if (get_opcode_operand(a, &st[1],
+                               "No operand/label found after basic "
+                               "opcode") < 0) {
             return -1;
         }
-        // search for labels with ':' prefixed only...
-        if ((rc = getif_label(a, t, 1)) != 0) {
-            if (rc < 0) {
-                free(t);
-                return rc;
-            }
-            // valid label with : prefix..
-            // add it to global unresolved label pointers
-            append_to_unresolved_labels(a, t);
-        } else if ((rc = getif_data(a, t)) != 0) {
-            if (rc < 0) {
-                free(t);
-                return rc;
-            }
-        } else if ((rc = getif_basic_opcode(a, t)) != 0) {
-            if (rc < 0) {
-                free(t);
-                return rc;
-            }
 
-            // skip inline whitespace, check for end of file/newline
-            skip_inline_whitespaces(a);
-            if (!cur_char(a)) {
-                ASMERROR(a, "Unexpected end of file while searching "
-                        "for an operand");
-                free(t);
-                return -1;
-            } else if (cur_char(a) == '\n') {
-                ASMERROR(a, "Unexpected new line while searching "
-                        "for an operand");
-                free(t);
-                return -1;
-            }
+        // skip inline whitespace, check for end of file/newline
+        skip_inline_whitespaces(a);
+        if (!cur_char(a)) {
+            ASMERROR(a, "Unexpected end of file while searching "
+                    "for a comma delimiter");
+            return -1;
+        } else if (cur_char(a) == '\n') {
+            ASMERROR(a, "Unexpected new line while searching "
+                    "for a comma delimiter");
+            return -1;
+        }
 
-            // First operand
-            t1 = get_token();
-            if (!t1) {
-                LOGERROR("No more memory to allocate op1 token");
-                free(t);
-                return -1;
-            }
-            rc = getif_operand(a, t1);
-            if (rc < 0) {
-                free(t1);
-                free(t);
-                return -1;
-            } else if (rc == 0) {
-                ASMERROR(a, "No operand/label found after basic opcode");
-                free(t1);
-                free(t);
-                return -1;
-            }
+        // check for comma..
+        if (cur_char(a) != ',') {
+            ASMERROR(a, "No comma after first operand");
+            return -1;
+        }
+        inc_char(a);
 
-            // skip inline whitespace, check for end of file/newline
-            skip_inline_whitespaces(a);
-            if (!cur_char(a)) {
-                ASMERROR(a, "Unexpected end of file while searching "
-                        "for a comma delimiter");
-                free(t1);
-                free(t);
-                return -1;
-            } else if (cur_char(a) == '\n') {
-                ASMERROR(a, "Unexpected new line while searching "
-                        "for a comma delimiter");
-                free(t1);
-                free(t);
-                return -1;
-            }
+        // Second operand
+        if (get_opcode_operand(a, &st[2],
+                               "No second operand/label found for basic "
+                               "opcode") < 0) {
+            return -1;
+        }
 
-            // check for comma..
-            if (cur_char(a) != ',') {
-                ASMERROR(a, "No comma after first operand");
-                free(t1);
-                free(t);
-                return -1;
-            }
-            inc_char(a);
+        // Make a group out of these 3 tokens
+        st[0].right = &st[1];
+        st[1].right = &st[2];
+        return 3;
+    } else if ((rc = getif_special_opcode(a, &st[0])) != 0) {
+        if (rc < 0) {
+            return -1;
+        }
+        // First operand
+        if (get_opcode_operand(a, &st[1],
+                               "No operand found after basic opcode") < 0) {
+            return -1;
+        }
+        // Link the operand to main token and form a group
+        st[0].right = &st[1];
+        return 2;
+    }
+    ASMERROR(a, "Unknown token");
+    return -1;
+}
 
-            // skip inline whitespace, check for end of file/newline
-            skip_inline_whitespaces(a);
-            if (!cur_char(a)) {
-                ASMERROR(a, "Unexpected end of file while searching "
-                        "for an operand");
-                free(t1);
-                free(t);
-                return -1;
-            } else if (cur_char(a) == '\n') {
-                ASMERROR(a, "Unexpected new line while searching "
-                        "for an operand");
-                free(t1);
-                free(t);
-                return -1;
-            }
+// Read one statement (a label, data or an opcode with its operands) into
+// st[0], operands into st[1] and st[2] linked through right. Nothing is
+// filed anywhere, the caller owns the tokens.
+// Returns the number of tokens used, 0 at end of file, -1 on error.
+int tok_statement(struct assembler *a, struct token st[3]) {
+    int n;
+    memset(st, 0, sizeof(struct token) * 3);
+    n = read_statement(a, st);
+    if (n < 0) {
+        // an operand read before the error may hold an expression
+        tok_release(&st[1]);
+        tok_release(&st[2]);
+    }
+    return n;
+}
 
-            // Second operand
-            t2 = get_token();
-            if (!t2) {
-                LOGERROR("No more memory to allocate op2 token");
-                free(t1);
-                free(t);
-                return -1;
-            }
-            rc = getif_operand(a, t2);
-            if (rc < 0) {
-                free(t2);
-                free(t1);
-                free(t);
-                return rc;
-            } else if (rc == 0) {
-                ASMERROR(a, "No second operand/label found for basic opcode");
-                free(t2);
-                free(t1);
-                free(t);
-                return -1;
-            }
+// Release what a statement owns: the words of a DAT, or the expressions
+// of its operands
+void tok_release(struct token *t) {
+    if (t->type == tt_words) {
+        free(t->ttu_wrd);
+        free(t->ttu_refs);
+        return;
+    }
+    for (; t; t = t->right) {
+        if (t->type == tt_operand && t->ttu_opd.opd_expr) {
+            free(t->ttu_opd.opd_expr);
+            t->ttu_opd.opd_expr = NULL;
+        }
+    }
+}
 
-            // Make a group out of these 3 tokens
-            t->right = t1;
-            t1->right = t2;
-        } else if ((rc = getif_special_opcode(a, t)) != 0) {
-            if (rc < 0) {
-                free(t);
-                return rc;
-            }
+// Panic mode: drop what is left of the line an error was found on, the
+// next statement starts on the line after it
+int tok_recover(struct assembler *a, uint64_t seen) {
+    // running out of memory is no error in the source, and ends it
+    if (a->nerrors == seen || !diag_more(a)) {
+        return 0;
+    }
+    while (cur_char(a) != '\0' && cur_char(a) != '\n') {
+        inc_char(a);
+    }
+    inc_char(a);
+    return 1;
+}
 
-            // skip inline whitespace, check for end of file/newline
-            skip_inline_whitespaces(a);
-            if (!cur_char(a)) {
-                ASMERROR(a, "Unexpected end of file while searching "
-                        "for an operand");
-                free(t);
-                return -1;
-            } else if (cur_char(a) == '\n') {
-                ASMERROR(a, "Unexpected new line while searching "
-                        "for an operand");
-                free(t);
+int construct_tokens(struct assembler *a) {
+    struct token st[3], *t[3];
+    uint64_t r, seen;
+    int n, i;
+    /* Start parsing */
+    for (seen = a->nerrors; (n = tok_statement(a, st)) != 0;
+         seen = a->nerrors) {
+        if (n < 0) {
+            // tok_statement() released what it had read
+            if (!tok_recover(a, seen)) {
                 return -1;
             }
-
-            // First operand
-            t1 = get_token();
-            if (!t1) {
-                LOGERROR("No more memory to allocate op1 token");
-                free(t);
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            t[i] = get_token(a);
+            if (!t[i]) {
+                LOGERROR("No more memory to allocate a token");
+                while (i > 0) {
+                    free(t[--i]);
+                }
+                tok_release(&st[0]);
                 return -1;
             }
-            rc = getif_operand(a, t1);
-            if (rc < 0) {
-                free(t1);
-                free(t);
+            *t[i] = st[i];
+        }
+        for (i = 0; i + 1 < n; ++i) {
+            t[i]->right = t[i + 1];
+        }
+        append_to_token_list(a, t[0]);
+        // labels point into the tokens, so file them only now. A label
+        // defined twice stays in the list, pass 1 places it all the same.
+        for (i = 0; i < n; ++i) {
+            if (t[i]->type == tt_label &&
+                    append_to_unresolved_labels(a, t[i]) < 0 &&
+                    !diag_more(a)) {
                 return -1;
-            } else if (rc == 0) {
-                ASMERROR(a, "No operand found after basic opcode");
-                free(t1);
-                free(t);
+            }
+        }
+        for (r = 0; t[0]->type == tt_words && r < t[0]->ttu_nrefs; ++r) {
+            if (append_to_unresolved_labels(a, &t[0]->ttu_refs[r]) < 0 &&
+                !diag_more(a)) {
                 return -1;
             }
-            // Link the operand to main token and form a group
-            t->right = t1;
-        } else {
-            ASMERROR(a, "Unknown token");
-            free(t);
-            return -1;
         }
-        append_to_token_list(a, t);
     }
     return 0;
-}
\ No newline at end of file
+}
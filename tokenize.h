@@ -7,6 +7,22 @@
 
 #include "common.h"
 
+/* Mnemonic tables, shared with the disassembler */
+extern struct opcode_tokens basic_opcodes[];
+extern struct opcode_tokens special_opcodes[];
+extern struct operand_tokens operands[];
+extern const int basic_opcodes_count;
+extern const int special_opcodes_count;
+extern const int operands_count;
+
 int construct_tokens(struct assembler *a);
+int tok_statement(struct assembler *a, struct token st[3]);
+/* After tok_statement() failed with seen errors before it: 1 when that
+ * was an error in the source and there may be more, the input moved on
+ * to the next line; 0 when the run has to stop. */
+int tok_recover(struct assembler *a, uint64_t seen);
+/* Free what a statement owns, the words of a DAT or the expressions of
+ * its operands. The tokens themselves stay. */
+void tok_release(struct token *t);
 
 #endif //ASSEMBLER_TOKENIZE_H
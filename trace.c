@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_CHUNK 1024
+
+struct trace_event {
+    const char *te_name;
+    const char *te_file;
+    uint64_t    te_ts;      /* Nanoseconds since trace_open() */
+    uint64_t    te_dur;
+};
+
+struct trace_chunk {
+    struct trace_event  tc_ev[TRACE_CHUNK];
+    uint32_t            tc_count;
+    struct trace_chunk *next;
+};
+
+/* Events of one thread, only ever written by that thread */
+struct trace_buffer {
+    uint32_t             tb_tid;
+    const char          *tb_name;
+    struct trace_chunk  *tb_head;
+    struct trace_chunk  *tb_tail;
+    struct trace_buffer *next;
+};
+
+static struct trace_buffer *trace_buffers;  /* Pushed with a CAS */
+static uint32_t trace_tids;
+static int      trace_on;
+static int      trace_opened;
+static char    *trace_path;
+static uint64_t trace_t0;
+static __thread struct trace_buffer *trace_mine;
+
+static inline uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void trace_at_exit(void) {
+    trace_close();
+}
+
+// 0 on success, -1 on failure. A process traces at most once.
+int trace_open(const char *path) {
+    if (trace_opened) {
+        LOGERROR("Tracing has already been started once");
+        return -1;
+    }
+    trace_path = strdup(path);
+    if (!trace_path) {
+        LOGERROR("No memory to store the trace file name");
+        return -1;
+    }
+    trace_opened = 1;
+    trace_t0 = clock_ns();
+    atexit(trace_at_exit);
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int trace_enabled(void) {
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_now(void) {
+    return trace_enabled() ? clock_ns() : 0;
+}
+
+static struct trace_buffer *my_buffer(void) {
+    struct trace_buffer *b = trace_mine;
+    if (b) {
+        return b;
+    }
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        return NULL;
+    }
+    b->tb_tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+    b->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_buffers, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // b->next now holds the new head, try again
+    }
+    trace_mine = b;
+    return b;
+}
+
+void trace_thread_name(const char *name) {
+    struct trace_buffer *b;
+    if (!trace_enabled() || !(b = my_buffer())) {
+        return;
+    }
+    b->tb_name = name;
+}
+
+void trace_span(const char *name, const char *file, uint64_t start) {
+    struct trace_buffer *b;
+    struct trace_chunk *c;
+    struct trace_event *e;
+    uint64_t end;
+
+    if (!trace_enabled() || !(b = my_buffer())) {
+        return;
+    }
+    end = clock_ns();
+    c = b->tb_tail;
+    if (!c || c->tc_count == TRACE_CHUNK) {
+        c = malloc(sizeof(*c));
+        if (!c) {
+            // drop the span rather than the build
+            return;
+        }
+        c->tc_count = 0;
+        c->next = NULL;
+        if (b->tb_tail) {
+            b->tb_tail->next = c;
+        } else {
+            b->tb_head = c;
+        }
+        b->tb_tail = c;
+    }
+    e = &c->tc_ev[c->tc_count++];
+    e->te_name = name;
+    e->te_file = file;
+    e->te_ts = start - trace_t0;
+    e->te_dur = end - start;
+}
+
+static void json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(fp, "\\%c", *s);
+        } else if ((unsigned char) *s < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char) *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Merge every thread's events into the trace file. Threads that record
+// must be done by now. 0 on success, -1 on failure.
+int trace_close(void) {
+    struct trace_buffer *b, *bn;
+    struct trace_chunk *c, *cn;
+    struct trace_event *e;
+    const char *sep = "";
+    FILE *fp;
+    uint32_t i;
+    int rc = 0;
+
+    if (!__atomic_exchange_n(&trace_on, 0, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    fp = fopen(trace_path, "w");
+    if (!fp) {
+        LOGERROR("Unable to open %s for writing", trace_path);
+        rc = -1;
+    }
+    if (fp) {
+        fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    }
+    b = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for (; b; b = bn) {
+        bn = b->next;
+        if (fp) {
+            fprintf(fp, "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", "
+                        "\"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",
+                    sep, b->tb_tid);
+            if (b->tb_name) {
+                json_string(fp, b->tb_name);
+            } else {
+                fprintf(fp, "\"thread %u\"", b->tb_tid);
+            }
+            fprintf(fp, "}}");
+            sep = ",";
+        }
+        for (c = b->tb_head; c; c = cn) {
+            cn = c->next;
+            for (i = 0; fp && i < c->tc_count; ++i) {
+                e = &c->tc_ev[i];
+                fprintf(fp, ",\n{\"ph\": \"X\", \"cat\": \"dasm\", \"name\": ");
+                json_string(fp, e->te_name);
+                fprintf(fp, ", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+                            "\"dur\": %.3f",
+                        b->tb_tid, (double) e->te_ts / 1e3,
+                        (double) e->te_dur / 1e3);
+                if (e->te_file) {
+                    fprintf(fp, ", \"args\": {\"file\": ");
+                    json_string(fp, e->te_file);
+                    fprintf(fp, "}");
+                }
+                fprintf(fp, "}");
+            }
+            free(c);
+        }
+        free(b);
+    }
+    trace_buffers = NULL;
+    trace_mine = NULL;
+    if (fp) {
+        fprintf(fp, "\n]}\n");
+        if (fclose(fp) != 0) {
+            LOGERROR("Could not write %s", trace_path);
+            rc = -1;
+        }
+    }
+    free(trace_path);
+    trace_path = NULL;
+    return rc;
+}
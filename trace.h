@@ -0,0 +1,33 @@
+#ifndef ASSEMBLER_TRACE_H
+#define ASSEMBLER_TRACE_H
+
+#include <stdint.h>
+
+// Timeline of an assembler run in the Trace Event Format, which
+// chrome://tracing and Perfetto load. Every thread records into buffers of
+// its own, without locks; the buffers are merged into one file when
+// tracing is closed, or at exit.
+//
+// The TRACE_* hooks are compiled in only when DASM_TRACE is defined
+// (cmake -DDASM_TRACE=ON, or a Debug build), otherwise they are nothing.
+
+int  trace_open(const char *path);
+int  trace_close(void);
+int  trace_enabled(void);
+uint64_t trace_now(void);
+// A span from start to now. name and file must live until trace_close().
+void trace_span(const char *name, const char *file, uint64_t start);
+// How this thread shows up in the timeline
+void trace_thread_name(const char *name);
+
+#ifdef DASM_TRACE
+#define TRACE_START(v)              uint64_t v = trace_now()
+#define TRACE_SPAN(v, name, file)   trace_span(name, file, v)
+#define TRACE_THREAD(name)          trace_thread_name(name)
+#else
+#define TRACE_START(v)              do { } while (0)
+#define TRACE_SPAN(v, name, file)   do { } while (0)
+#define TRACE_THREAD(name)          do { } while (0)
+#endif
+
+#endif //ASSEMBLER_TRACE_H
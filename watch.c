@@ -0,0 +1,190 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "watch.h"
+
+// The directory of each file is watched rather than the file itself, so
+// that an editor replacing it by a rename is seen as well. Events for the
+// other names there are dropped. Once the files have been quiet for
+// WATCH_QUIET_MS the ones written are hashed, and only if a hash changed
+// is anything built: saving without an edit, or touching a file, costs
+// nothing.
+
+struct watched {
+    char    *wf_path;
+    char    *wf_name;      /* Last component of wf_path */
+    int      wf_wd;        /* Watch on its directory */
+    int      wf_dirty;     /* Written since it was last hashed */
+    uint64_t wf_hash;
+};
+
+static inline double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+// FNV-1a of the contents, 0 when the file cannot be read (yet)
+static uint64_t hash_file(const char *path) {
+    unsigned char buf[65536];
+    uint64_t h = 14695981039346656037ull;
+    size_t n, i;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return 0;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (i = 0; i < n; ++i) {
+            h = (h ^ buf[i]) * 1099511628211ull;
+        }
+    }
+    fclose(fp);
+    return h;
+}
+
+static int add_watch(int fd, struct watched *wf, char *path) {
+    char dir[4096];
+    char *slash = strrchr(path, '/');
+    wf->wf_path = path;
+    wf->wf_name = slash ? slash + 1 : path;
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if ((size_t) (slash - path) < sizeof(dir)) {
+        memcpy(dir, path, (size_t) (slash - path));
+        dir[slash - path] = '\0';
+    } else {
+        LOGERROR("Path too long to watch: %s", path);
+        return -1;
+    }
+    wf->wf_wd = inotify_add_watch(fd, dir, IN_MODIFY | IN_CLOSE_WRITE |
+                                           IN_MOVED_TO | IN_CREATE);
+    if (wf->wf_wd < 0) {
+        LOGERROR("Cannot watch %s", dir);
+        return -1;
+    }
+    wf->wf_dirty = 0;
+    wf->wf_hash = hash_file(path);
+    return 0;
+}
+
+// Mark the files the events in buf[0, len) are about. 1 if any was.
+static int mark_events(struct watched *wf, int nfiles, const char *buf,
+                       ssize_t len) {
+    const struct inotify_event *ev;
+    ssize_t off;
+    int i, hit = 0;
+    for (off = 0; off < len;
+         off += (ssize_t) sizeof(*ev) + (ssize_t) ev->len) {
+        ev = (const struct inotify_event *) (buf + off);
+        for (i = 0; ev->len && i < nfiles; ++i) {
+            if (ev->wd == wf[i].wf_wd && !strcmp(ev->name, wf[i].wf_name)) {
+                wf[i].wf_dirty = 1;
+                hit = 1;
+            }
+        }
+    }
+    return hit;
+}
+
+static void report(const char *path, int rc, double edit, double start,
+                   double end) {
+    if (rc < 0) {
+        fprintf(stderr, "%s: build failed, waiting for the next edit\n",
+                path);
+        return;
+    }
+    if (edit == 0) {
+        fprintf(stderr, "%s: image built in %.1f ms\n", path, end - start);
+        return;
+    }
+    fprintf(stderr, "%s: image %.1f ms after the edit (%.1f ms to build)\n",
+            path, end - edit, end - start);
+}
+
+int watch_files(char **files, int nfiles, int (*build)(void *arg),
+                void *arg) {
+    struct watched *wf;
+    struct pollfd pfd;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    double edit = 0, start;
+    ssize_t len;
+    int fd, i, rc, changed;
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        LOGERROR("inotify_init1() failed");
+        return -1;
+    }
+    wf = calloc((size_t) nfiles, sizeof(*wf));
+    if (!wf) {
+        LOGERROR("No memory to watch the files");
+        close(fd);
+        return -1;
+    }
+    for (i = 0; i < nfiles; ++i) {
+        if (add_watch(fd, &wf[i], files[i]) < 0) {
+            free(wf);
+            close(fd);
+            return -1;
+        }
+    }
+    start = now_ms();
+    report(files[0], build(arg), 0, start, now_ms());
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        // a burst ends when nothing is written for WATCH_QUIET_MS
+        rc = poll(&pfd, 1, edit > 0 ? WATCH_QUIET_MS : -1);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGERROR("poll() failed");
+            break;
+        }
+        if (rc > 0) {
+            len = read(fd, buf, sizeof(buf));
+            if (len < 0) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                LOGERROR("Could not read the file events");
+                break;
+            }
+            if (mark_events(wf, nfiles, buf, len) && edit == 0) {
+                edit = now_ms();
+            }
+            continue;
+        }
+        for (i = changed = 0; i < nfiles; ++i) {
+            uint64_t h;
+            if (!wf[i].wf_dirty) {
+                continue;
+            }
+            wf[i].wf_dirty = 0;
+            h = hash_file(wf[i].wf_path);
+            // gone for now, as during a save through a rename
+            if (h == 0) {
+                continue;
+            }
+            changed |= h != wf[i].wf_hash;
+            wf[i].wf_hash = h;
+        }
+        if (changed) {
+            start = now_ms();
+            rc = build(arg);
+            report(files[0], rc, edit, start, now_ms());
+        }
+        edit = 0;
+    }
+    free(wf);
+    close(fd);
+    return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef ASSEMBLER_WATCH_H
+#define ASSEMBLER_WATCH_H
+
+#include <stdint.h>
+
+/* A burst of writes is over once the files stay quiet this long */
+#define WATCH_QUIET_MS 30
+
+/* Run build(arg) once, then again each time the contents of one of the
+ * files change, as long as the process lives. build returns 0 once the
+ * image is out and -1 on errors, which were reported and are waited out.
+ * Returns -1 if the files cannot be watched. */
+int watch_files(char **files, int nfiles, int (*build)(void *arg),
+                void *arg);
+
+#endif //ASSEMBLER_WATCH_H